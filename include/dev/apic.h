@@ -237,6 +237,8 @@ struct apic_dev {
     uint64_t cycles_per_tick;
     uint8_t  timer_set;
     uint32_t current_ticks; // timeout currently being computed
+    uint8_t  timer_tsc_deadline; // timer is in TSC-deadline mode
+    uint64_t current_deadline;   // TSC at which it fires in that mode
     uint64_t timer_count;
     int      in_timer_interrupt;
     int      in_kick_interrupt;
@@ -366,6 +368,10 @@ uint64_t apic_realtime_to_cycles(struct apic_dev *apic, uint64_t ns);
 // ns
 uint64_t apic_cycles_to_realtime(struct apic_dev *apic, uint64_t cycles);
 
+// With NAUT_CONFIG_TICKLESS, APIC_TIMER_INFINITE stops the timer instead
+// of setting it to its longest timeout
+#define APIC_TIMER_INFINITE 0xffffffffU
+
 void     apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks);
 
 // updating the timer 
@@ -0,0 +1,120 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <nautilus/naut_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Arenas for runtimes that allocate big arrays
+ *
+ * An arena hands out memory by bumping a pointer through chunks,
+ * which are 2 MB or 1 GB aligned extents obtained from the kmem
+ * zones (see kmem_malloc_extent()) and so are backed by large pages.
+ * Allocations too big to share a chunk get an extent of their own,
+ * of exactly their size rounded up to a page, and aligned to the
+ * largest page size that fits in them.   Small allocations are
+ * released only in bulk, by resetting or destroying the arena, while
+ * large ones can also be freed individually.
+ *
+ * Memory for an arena comes from the zones closest to a particular
+ * CPU, to a CPU in a particular NUMA domain, or to whichever CPU
+ * needs a new chunk or large allocation.
+ */
+
+#define NK_ARENA_CHUNK_2MB   (1ULL << 21)
+#define NK_ARENA_CHUNK_1GB   (1ULL << 30)
+
+// allocations bigger than chunk_size/NK_ARENA_LARGE_FRAC get their own extent
+#define NK_ARENA_LARGE_FRAC  4
+
+typedef enum {
+    NK_ARENA_LOCAL,    // CPU that triggers the allocation
+    NK_ARENA_CPU,      // a given CPU
+    NK_ARENA_DOMAIN,   // a given NUMA domain
+} nk_arena_place_t;
+
+struct nk_arena;
+
+struct nk_arena_stats {
+    uint64_t num_chunks;
+    uint64_t chunk_bytes;    // memory held in chunks
+    uint64_t used_bytes;     // of which has been handed out
+    uint64_t num_large;
+    uint64_t large_bytes;    // memory held in large allocations
+};
+
+// chunk_size is rounded up to a multiple of 2 MB; 0 means 2 MB
+// where is the CPU or domain for NK_ARENA_CPU and NK_ARENA_DOMAIN
+struct nk_arena *nk_arena_create(char *name, size_t chunk_size, nk_arena_place_t place, int where);
+void             nk_arena_destroy(struct nk_arena *arena);
+
+// align is a power of two, 0 means 16 bytes
+void *nk_arena_alloc(struct nk_arena *arena, size_t size, size_t align);
+// frees a large allocation now; for others this does nothing
+void  nk_arena_free(struct nk_arena *arena, void *ptr);
+// frees all allocations, keeping one chunk for reuse
+void  nk_arena_reset(struct nk_arena *arena);
+
+void  nk_arena_get_stats(struct nk_arena *arena, struct nk_arena_stats *stats);
+
+#ifdef __cplusplus
+}
+
+/*
+ * Standard allocator over an arena, e.g.
+ *
+ *   std::vector<double, nk_arena_allocator<double>> v(n, 0.0, nk_arena_allocator<double>(arena));
+ *
+ * The operator new/delete overloads taking an arena are in cxxglue.cc.
+ */
+template <typename T>
+struct nk_arena_allocator {
+    typedef T      value_type;
+    typedef T *    pointer;
+    typedef size_t size_type;
+
+    template <typename U> struct rebind { typedef nk_arena_allocator<U> other; };
+
+    struct nk_arena *arena;
+
+    nk_arena_allocator(struct nk_arena *a) : arena(a) { }
+    template <typename U> nk_arena_allocator(const nk_arena_allocator<U> &o) : arena(o.arena) { }
+
+    T *allocate(size_t n) { return (T *)nk_arena_alloc(arena, n * sizeof(T), __alignof__(T)); }
+    void deallocate(T *p, size_t n) { nk_arena_free(arena, p); }
+
+    template <typename U> bool operator==(const nk_arena_allocator<U> &o) const { return arena == o.arena; }
+    template <typename U> bool operator!=(const nk_arena_allocator<U> &o) const { return arena != o.arena; }
+};
+
+void *operator new(size_t size, struct nk_arena *arena);
+void *operator new[](size_t size, struct nk_arena *arena);
+void  operator delete(void *p, struct nk_arena *arena);
+void  operator delete[](void *p, struct nk_arena *arena);
+
+#endif
+
+#endif
@@ -31,8 +31,41 @@ extern "C" {
 
 #define NK_BARRIER_LAST 1
 
+/*
+ * Barrier algorithms, chosen per barrier at init time
+ *
+ * CENTRAL counts arrivals on one lock-protected counter and releases
+ * everyone through one flag, so its latency grows linearly with the
+ * number of participants.  DISSEMINATION takes ceil(log2(n)) rounds,
+ * in each of which a participant sets one flag of another and waits
+ * on one of its own.  TREE counts arrivals up a combining tree with
+ * a fan-in of a few participants, laid out so that participants on
+ * cpus sharing a core or socket share a leaf, and releases them back
+ * down the tree.
+ *
+ * For the latter two, nk_barrier_wait numbers participants in their
+ * order of arrival, which costs one atomic increment of a shared
+ * word.  Participants that know their own number in [0,count) should
+ * use nk_barrier_wait_id instead.  The tree is laid out at init time
+ * assuming participant i runs on cpu i modulo the number of cpus, so
+ * it only follows the topology for nk_barrier_wait_id callers placed
+ * that way.  Under nk_barrier_wait, leaves are shared by participants
+ * that arrive together, wherever they run.  A barrier must be waited
+ * on only one way.
+ */
+typedef enum {
+    NK_BARRIER_CENTRAL = 0,
+    NK_BARRIER_DISSEMINATION,
+    NK_BARRIER_TREE,
+} nk_barrier_type_t;
+
+// waiters spin for a while, then sleep until released
+#define NK_BARRIER_BLOCKING 0x1
+
 typedef struct nk_barrier nk_barrier_t;
 
+struct nk_barrier_state;
+
 struct nk_barrier {
     spinlock_t lock; /* SLOW */
     
@@ -41,15 +74,21 @@ struct nk_barrier {
 
     uint8_t  active; /* used for core barriers */
 
-    uint8_t pad[52];
+    uint8_t  type;
+    uint8_t  flags;
+    struct nk_barrier_state *state; /* all but spinning central barriers */
+
+    uint8_t pad[41];
 
     /* this is on another cache line (Assuming 64b) */
     volatile unsigned notify;
 } __attribute__ ((packed)) __attribute((aligned(64)));
 
 int nk_barrier_init (nk_barrier_t * barrier, uint32_t count);
+int nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type, int flags);
 int nk_barrier_destroy (nk_barrier_t * barrier);
 int nk_barrier_wait (nk_barrier_t * barrier);
+int nk_barrier_wait_id (nk_barrier_t * barrier, uint32_t id);
 void nk_barrier_test(void);
 
 /* CORE barriers */
@@ -25,31 +25,63 @@
 
 #include <nautilus/naut_types.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/list.h>
+
+/*
+ * Each block order has its own free list, tag bitmap, and lock, so 
+ * allocations and frees of different sizes do not serialize against
+ * each other.   An operation holds at most one order lock at a time,
+ * and runs with interrupts off throughout.
+ *
+ * A split or coalesce briefly holds a free block off every list.
+ * Such operations are counted in in_flight while they do, and bump
+ * seq when they are done, so that an allocation that finds every
+ * list empty can tell whether that is really so.
+ */
+struct buddy_order {
+    spinlock_t        lock;      /** protects avail and tag_bits */
+    struct list_head  avail;     /** free list of 2^order blocks */
+    ulong_t          *tag_bits;  /** one bit for each 2^order block
+                                  *   0 = block is not free at this order
+                                  *   1 = block is on avail
+                                  */
+} __attribute__((aligned(64)));
 
 struct buddy_mempool {
     ulong_t    base_addr;    /** base address of the memory pool */
     ulong_t    pool_order;   /** size of memory pool = 2^pool_order */
     ulong_t    min_order;    /** minimum allocatable block size */
 
-    ulong_t    num_blocks;   /** number of bits in tag_bits */
-    ulong_t    *tag_bits;    /** one bit for each 2^min_order block
-                                    *   0 = block is allocated
-                                    *   1 = block is available
+    ulong_t    num_blocks;   /** number of 2^min_order blocks in the pool */
+
+    volatile ulong_t avail_mask;   /** summary of orders[]: bit i is set
+                                    * iff orders[i].avail is nonempty,
+                                    * so the smallest order that can
+                                    * satisfy a request is found with
+                                    * one bit scan 
                                     */
 
-    struct list_head *avail;       /** one free list for each block size,
-                                    * indexed by block order:
-                                    *   avail[i] = free list of 2^i blocks
+    struct buddy_order *orders;    /** one per block size, indexed by
+                                    * block order
                                     */
 
-    spinlock_t lock;
+    volatile ulong_t in_flight;    /** operations holding a free block
+                                    * off every list
+                                    */
+    volatile ulong_t seq;          /** bumped as each of them finishes */
 };
 
 struct buddy_mempool * buddy_init(ulong_t base_addr, ulong_t pool_order, ulong_t min_order);
 
+// These do their own locking
 void buddy_free(struct buddy_mempool * mp, void * addr, ulong_t order);
 void * buddy_alloc(struct buddy_mempool * mp, ulong_t order);
 
+// Resize an allocated block in place; growing fails (nonzero) unless
+// the blocks above it are free
+int  buddy_grow(struct buddy_mempool * mp, void * addr, ulong_t order, ulong_t new_order);
+void buddy_shrink(struct buddy_mempool * mp, void * addr, ulong_t order, ulong_t new_order);
+
 int  buddy_sanity_check(struct buddy_mempool *mp);
 
 struct buddy_pool_stats {
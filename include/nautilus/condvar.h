@@ -29,6 +29,7 @@ extern "C" {
 
 #include <nautilus/thread.h>
 #include <nautilus/waitqueue.h>
+#include <nautilus/mutex.h>
 
 typedef struct nk_condvar {
     NK_LOCK_T lock;
@@ -43,6 +44,8 @@ typedef struct nk_condvar {
 int nk_condvar_init(nk_condvar_t * c);
 int nk_condvar_destroy(nk_condvar_t * c);
 uint8_t nk_condvar_wait(nk_condvar_t * c, NK_LOCK_T * l);
+// same, but for a condition protected by a blocking mutex
+uint8_t nk_condvar_wait_mutex(nk_condvar_t * c, nk_mutex_t * m);
 int nk_condvar_signal(nk_condvar_t * c);
 int nk_condvar_bcast(nk_condvar_t * c);
 void nk_condvar_test(void);
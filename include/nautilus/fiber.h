@@ -43,12 +43,12 @@ extern "C" {
 typedef uint64_t nk_stack_size_t;
 typedef struct nk_thread nk_thread_t;
 
-#define F_RAND_CPU -2
+#define F_RAND_CPU -2 // any cpu: queued locally, idle cpus steal it
 #define F_CURR_CPU -1
 #define YIELD_TO_EARLY_RET 1
 
 /* common fiber stack sizes */
-#define FSTACK_DEFAULT 0 // will be 4K
+#define FSTACK_DEFAULT 0 // will be 16K (or the configured small stack size)
 #define FSTACK_4KB 0x001000
 #define FSTACK_16KB 0x004000
 #define FSTACK_1MB 0x100000
@@ -99,8 +99,10 @@ typedef struct nk_fiber {
   struct list_head child_node;
   int num_children;
   
-  struct list_head sched_node; // sched queue node
+  struct list_head sched_node; // inbox node
   int curr_cpu;  // current cpu the fiber is on
+  volatile int queued; // whether and where the fiber is queued to run
+  volatile int refs;   // run queue slots naming this fiber, plus one until it exits
 
   nk_fiber_fun_t fun; // routine the fiber will execute
   void *input;  // input for the fiber's routine
@@ -50,6 +50,14 @@ extern "C" {
 #define NK_FREE_PROF_EXIT() 
 #endif
 
+#ifdef NAUT_CONFIG_HEAP_PROFILE
+#define NK_HEAP_PROF_ALLOC(p,s) nk_heap_profile_alloc(p,s)
+#define NK_HEAP_PROF_FREE(p) nk_heap_profile_free(p)
+#else
+#define NK_HEAP_PROF_ALLOC(p,s)
+#define NK_HEAP_PROF_FREE(p)
+#endif
+
 struct nk_hashtable;
 
 struct malloc_data {
@@ -111,6 +119,11 @@ void nk_instrument_query(void);
 void nk_instrument_clear(void);
 void nk_instrument_calibrate(unsigned loops);
 
+// sampling heap profiler, called by kmem
+void nk_heap_profile_init(void);
+void nk_heap_profile_alloc(void *ptr, size_t size);
+void nk_heap_profile_free(void *ptr);
+
 
 #ifdef __cplusplus
 }
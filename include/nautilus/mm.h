@@ -66,6 +66,9 @@ ulong_t mm_boot_last_pfn(void);
 int mm_boot_init (ulong_t mbd);
 void mm_boot_kmem_init(void);
 void mm_boot_kmem_cleanup(void);
+// adds the rest of large zones in the background, once the APs are up
+void mm_boot_kmem_init_deferred(void);
+int  mm_boot_kmem_deferred_pending(void);
 
 void mm_dump_page_map(void);
 
@@ -81,18 +84,65 @@ void mm_boot_free(void *addr, ulong_t size);
 
 /* KMEM FUNCTIONS */
 
+struct slab_cpu_cache;
+
+// realloc activity, counted per cpu
+struct kmem_realloc_stats {
+    uint64_t calls;
+    uint64_t in_place;           // resized without moving
+    uint64_t bytes_copied;       // by reallocs that moved
+    uint64_t bytes_not_copied;   // that in-place reallocs would have had to copy
+};
+
 struct kmem_data {
     struct list_head ordered_regions;
+    struct slab_cpu_cache *slab;   // NULL if slabs are not in use
+    struct kmem_realloc_stats realloc;
 };
 
 int nk_kmem_init(void);
 
 struct mem_region;
 
+/*
+ * Each zone has an array of page descriptors, one per KMEM_PAGE_SIZE
+ * page of the zone, indexed by the page's offset from the zone base.
+ * Only the descriptor of the first page of an allocated buddy block
+ * or slab is meaningful, which makes finding the size and flags of
+ * an allocation O(1) from its address.
+ */
+#define KMEM_PAGE_ORDER     12
+#define KMEM_PAGE_SIZE      (1ULL << KMEM_PAGE_ORDER)
+#define KMEM_NUM_PAGES(len) (((len) + KMEM_PAGE_SIZE - 1) >> KMEM_PAGE_ORDER)
+
+#define KMEM_PAGE_FREE      0   // not the head of an allocation
+#define KMEM_PAGE_BLOCK     1   // head of a buddy block handed out by kmem
+#define KMEM_PAGE_SLAB      2   // head of a 2^SLAB_ORDER slab
+
+// block attributes, which unlike flags belong to kmem
+#define KMEM_PAGE_EXTENT    0x1 // block is a piece of an extent
+
+// block flags (see the GC support functions below) are 31 bits wide
+#define KMEM_FLAGS_MASK     0x7fffffffULL
+
+struct kmem_page {
+    uint8_t  type;
+    uint8_t  order;     // of the block, if type is KMEM_PAGE_BLOCK
+    uint8_t  attrs;     // of the block, if type is KMEM_PAGE_BLOCK
+    uint8_t  rsvd;
+    uint32_t flags;     // of the block, if type is KMEM_PAGE_BLOCK
+};
+
 struct mem_region * kmem_get_base_zone(void);
 struct mem_region * kmem_get_region_by_addr(ulong_t addr);
 void kmem_add_memory(struct mem_region * mem, ulong_t base_addr, size_t size);
 
+// Only the first kmem_zone_boot_len() bytes of a zone are added during
+// boot; the page descriptors of the rest must be cleared before it is
+// added (KMEM_PARALLEL_INIT)
+ulong_t kmem_zone_boot_len(struct mem_region * mem);
+void    kmem_zone_clear_pages(struct mem_region * mem, ulong_t offset, ulong_t len);
+
 // this the range of heap addresses used by the boot allocator [low,high)
 void kmem_inform_boot_allocation(void *low, void *high);
 
@@ -105,6 +155,35 @@ void * kmem_mallocz(size_t size);
 void * kmem_realloc(void * ptr, size_t size);
 void   kmem_free(void * addr);
 
+// NUMA placement policies.  Small allocations come from slabs in the
+// zones the policy selects, through the current CPU's slab cache when
+// those are its nearest zones.
+//
+// Each thread has a policy, inherited from its parent, which is used
+// by kmem_malloc(), kmem_mallocz() and kmem_malloc_specific() with 
+// cpu == -1.   kmem_malloc_policy() overrides it for one allocation.
+// Interleaving is per allocation: successive allocations come from
+// successive domains, but a single block is not split across them.
+typedef enum {
+    NK_KMEM_POLICY_LOCAL = 0,    // domains nearest the current cpu first
+    NK_KMEM_POLICY_INTERLEAVE,   // round-robin over all domains
+    NK_KMEM_POLICY_BIND,         // the given domain only
+    NK_KMEM_POLICY_PREFERRED,    // the given domain first, then those nearest it
+} nk_kmem_policy_t;
+
+void * kmem_malloc_policy(size_t size, nk_kmem_policy_t policy, int domain, int zero);
+int    kmem_set_thread_policy(nk_kmem_policy_t policy, int domain);
+void   kmem_get_thread_policy(nk_kmem_policy_t *policy, int *domain);
+const char *kmem_policy_name(nk_kmem_policy_t policy);
+
+// Extents are exact-size (rounded to KMEM_PAGE_SIZE) runs of pages with
+// the given power-of-two alignment, which avoids the power-of-two
+// rounding of kmem_malloc() for large allocations.   An extent must
+// be freed with kmem_free_extent() and the size it was allocated with;
+// kmem_free() and kmem_realloc() reject extents.
+void * kmem_malloc_extent(size_t size, size_t align, int cpu, int zero);
+void   kmem_free_extent(void * addr, size_t size);
+
 // Support functions for garbage collection
 // We currently assume these are done with the world stopped,
 // hence no locking
@@ -112,7 +191,7 @@ void   kmem_free(void * addr);
 // find the matching block that contains addr and its flags
 // returns nonzero if the addr is invalid or within no allocated block
 // user flags are allocate from low bit up, while kmem's flags are allocated
-// high bit down
+// high bit down; only the low 31 bits (KMEM_FLAGS_MASK) are stored
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags);
 // set the flags of an allocated block
 int  kmem_set_block_flags(void *block_addr, uint64_t flags);
@@ -182,6 +261,18 @@ struct kmem_stats {
 uint64_t kmem_num_pools();
 void     kmem_stats(struct kmem_stats *stats);
 
+// allocations of a page or more (not slabs) served from a NUMA domain
+struct kmem_domain_stats {
+    uint64_t bytes_managed;
+    uint64_t bytes_allocated;
+    uint64_t num_allocs;
+    uint64_t num_frees;
+    uint64_t num_remote_allocs;   // by a cpu in a different domain
+};
+
+void     kmem_domain_stats(unsigned domain, struct kmem_domain_stats *stats);
+void     kmem_realloc_stats(struct kmem_realloc_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
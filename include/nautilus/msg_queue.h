@@ -28,11 +28,18 @@
 // And you probably do not want to use message queues at all
 // in interrupt context unless you know what you are doing
 
-typedef enum { NK_MSG_QUEUE_DEFAULT=0 } nk_msg_queue_type_t;
+// The type is a hint about who will use the queue.  A queue with
+// a single producer (or consumer) skips the atomic operations that
+// producers (or consumers) otherwise need to claim slots, so the
+// hint must be honored
+typedef enum { NK_MSG_QUEUE_DEFAULT=0,
+	       NK_MSG_QUEUE_SINGLE_PRODUCER=1,
+	       NK_MSG_QUEUE_SINGLE_CONSUMER=2,
+	       NK_MSG_QUEUE_SPSC=3 } nk_msg_queue_type_t;
 
 #define NK_MSG_QUEUE_NAME_LEN 32
 
-// name is optional, currently there is only one mq type and no characteristics
+// name is optional, there are currently no type characteristics
 struct nk_msg_queue *nk_msg_queue_create(char *name,
 					 uint64_t size,
 					 nk_msg_queue_type_t type,
@@ -59,6 +66,16 @@ void  nk_msg_queue_pull(struct nk_msg_queue *queue, void **msg);
 int  nk_msg_queue_try_push(struct nk_msg_queue *queue, void *msg);
 int  nk_msg_queue_try_pull(struct nk_msg_queue *queue, void **msg);
 
+// batches - these wake waiters once per batch instead of once per message
+// push_batch blocks until all n are pushed
+// pull_batch blocks until at least one is available, and returns the number pulled
+void     nk_msg_queue_push_batch(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+uint64_t nk_msg_queue_pull_batch(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+
+// return the number pushed or pulled - do not block
+uint64_t nk_msg_queue_try_push_batch(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+uint64_t nk_msg_queue_try_pull_batch(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+
 // returns 0 on success, >0 on timeout
 // blocks for up to timeout_ns
 int  nk_msg_queue_push_timeout(struct nk_msg_queue *queue, void *msg, uint64_t timeout_ns);
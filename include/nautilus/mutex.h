@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/spinlock.h>
+#include <nautilus/list.h>
+
+struct nk_thread;
+
+/*
+ * Blocking mutex with adaptive spinning
+ *
+ * An uncontended lock or unlock is a single atomic operation on the
+ * owner field.  A thread that finds the mutex held spins only while
+ * the owner is running on another cpu and nobody is queued, and
+ * otherwise parks itself on the mutex's FIFO of waiters and sleeps.
+ * Unlock hands the mutex directly to the first parked waiter, so that
+ * a woken thread never has to compete for it again.
+ *
+ * Mutexes are for threads.  They must not be taken in interrupt
+ * context, and must be unlocked by the thread that locked them.
+ */
+typedef struct nk_mutex {
+    struct nk_thread * volatile owner;   // null when unlocked
+    volatile uint32_t           num_waiters;
+    spinlock_t                  lock;    // guards waiters
+    struct list_head            waiters;
+} nk_mutex_t;
+
+#define NK_MUTEX_INITIALIZER(name) { .waiters = LIST_HEAD_INIT((name).waiters) }
+
+int  nk_mutex_init(nk_mutex_t *m);
+int  nk_mutex_deinit(nk_mutex_t *m);
+
+int  nk_mutex_lock(nk_mutex_t *m);
+// 0 return indicates the mutex was acquired
+int  nk_mutex_try_lock(nk_mutex_t *m);
+int  nk_mutex_unlock(nk_mutex_t *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -198,6 +198,38 @@ double strtod(const char *s, char **se);
 char * strtok(char *s, const char *delim);
 
 
+// Implementations of memcpy/memset/memmove/memcmp for sizes beyond
+// the small scalar fast path.  detect_cpu() selects one via CPUID
+#define NK_STRING_IMPL_BASIC  0   // rep movsq/stosq, integer code only
+#define NK_STRING_IMPL_SSE    1   // 16 byte SSE2 loops
+#define NK_STRING_IMPL_ERMS   2   // rep movsb/stosb for large sizes, SSE2 otherwise
+#define NK_STRING_IMPL_FSRM   3   // rep movsb for all copies, as ERMS otherwise
+#define NK_STRING_NUM_IMPLS   4
+
+int          nk_string_get_impl(void);
+void         nk_string_set_impl(int impl);
+const char * nk_string_impl_name(int impl);
+
+// Streaming (cache-bypassing) zero and copy for large buffers that
+// will not be read again soon
+void * nk_memzero_nt(void * dst, size_t n);
+void * nk_memcpy_nt(void * dst, const void * src, size_t n);
+
+// At or above this size, nk_memzero/nk_memcpy_bulk use the streaming
+// versions, since the buffer would not stay in cache anyway
+#define NK_NT_THRESHOLD  (256UL * 1024)
+
+static inline void * nk_memzero(void * dst, size_t n)
+{
+    return n >= NK_NT_THRESHOLD ? nk_memzero_nt(dst, n) : memset(dst, 0, n);
+}
+
+static inline void * nk_memcpy_bulk(void * dst, const void * src, size_t n)
+{
+    return n >= NK_NT_THRESHOLD ? nk_memcpy_nt(dst, src, n) : memcpy(dst, src, n);
+}
+
+
 // low level assembly versions for use early in the boot process
 // or elsewhere where we want to guarantee that only generic 64 bit
 // integer code is used regardless of the compiler's feelings
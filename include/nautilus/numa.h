@@ -43,6 +43,7 @@ struct numa_domain {
 };
 
 struct buddy_mempool;
+struct slab_zone;
 
 struct mem_reg_entry {
     struct mem_region * mem;
@@ -66,6 +67,8 @@ struct mem_region {
 
     /* used by the kernel memory allocator */
     struct buddy_mempool * mm_state;
+    struct slab_zone     * slab_state;
+    struct kmem_page     * page_desc;   // one per KMEM_PAGE_SIZE page of the zone
 
     struct list_head entry;
 
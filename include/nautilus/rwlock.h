@@ -29,14 +29,41 @@ extern "C" {
 
 #include <nautilus/spinlock.h>
 
+struct nk_wait_queue;
+
+//
+// Phase-fair ticket reader-writer lock (Brandenburg and Anderson)
+//
+// Readers and writers alternate in phases: a reader that arrives
+// while a writer is present or waiting waits for at most that one
+// writer, and a writer waits for at most the readers already in
+// plus the writers ahead of it.  Neither side can be starved.
+//
+// With NAUT_CONFIG_RWLOCK_READER_BIAS, readers of a lock that has not
+// seen a writer for a while bypass these counters entirely and only
+// write a slot of a global visible readers table (BRAVO).
+//
+// A blocking lock (nk_rwlock_init_blocking) spins briefly and then
+// sleeps on a wait queue.  Its irq_save variants always spin.
+//
 struct nk_rwlock {
-    spinlock_t lock;
-    unsigned readers;
+    volatile uint32_t rin;    // readers in (upper bits) + writer phase bits
+    volatile uint32_t rout;   // readers out
+    volatile uint32_t win;    // writer tickets handed out
+    volatile uint32_t wout;   // writer tickets served
+    volatile uint32_t rbias;  // readers may use the visible readers table
+    uint32_t          flags;
+#define NK_RWLOCK_BLOCKING 0x1
+    uint64_t          inhibit_until; // cycle count before which rbias stays off
+    volatile uint32_t waiters;       // sleeping on waitq (blocking only)
+    struct nk_wait_queue * volatile waitq;
 };
 
 typedef struct nk_rwlock nk_rwlock_t;
 
 int nk_rwlock_init(nk_rwlock_t * l);
+int nk_rwlock_init_blocking(nk_rwlock_t * l);
+int nk_rwlock_deinit(nk_rwlock_t * l);
 int nk_rwlock_rd_lock(nk_rwlock_t * l);
 int nk_rwlock_wr_lock(nk_rwlock_t * l);
 int nk_rwlock_rd_unlock(nk_rwlock_t * l);
@@ -166,6 +166,8 @@ void    nk_sched_exit(spinlock_t *lock_to_release);
 // clean up after detached threads
 // normally will only execute if we have too many threads active
 void    nk_sched_reap(int unconditional);
+// reap a batch of the threads that have exited on this cpu
+void    nk_sched_reap_local();
 
 // find a dead thread that matches the criteria, if possible
 // the caller can then avoid the cost of allocating a new
@@ -192,6 +194,12 @@ void nk_sched_dump_time(int cpu);
 // cpu==-means all cpus
 void nk_sched_map_threads(int cpu, void (func)(struct nk_thread *t, void *state), void *state);
 
+// visit the other cpus nearest first (same core, socket, domain, then
+// the rest), as the scheduler does when stealing work, until func
+// returns nonzero. level is the distance (0=same core).
+// returns the cpu func stopped at, or -1
+int nk_sched_map_victims(int (*func)(int cpu, int level, void *state), void *state);
+
 
 // Provide ability to stop and start the world from the caller
 // This forces all cores, except the caller out into an interrupt
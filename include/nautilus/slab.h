@@ -0,0 +1,125 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/list.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/buddy.h>
+
+/*
+ * Slab caches for small kernel allocations
+ *
+ * Small requests are rounded up to one of SLAB_NUM_CLASSES size
+ * classes (16 bytes to SLAB_MAX_SIZE) instead of to a power of two.
+ * Objects are carved out of slabs, which are 2^SLAB_ORDER byte blocks
+ * obtained from the zone's buddy allocator and tracked by per-zone,
+ * per-class depots.  With NAUT_CONFIG_KMEM_SLAB, each CPU also keeps
+ * a magazine of free objects per class that it can allocate from and
+ * free to with interrupts off and no locks held, going to the depots
+ * only to refill or flush the magazine.
+ *
+ * The first page descriptor (struct kmem_page) of each slab is marked
+ * KMEM_PAGE_SLAB, which is how a free finds out that an address
+ * belongs to a slab.
+ */
+
+#define SLAB_ORDER        16                  /* 64 KB slabs */
+#define SLAB_SIZE         (1UL << SLAB_ORDER)
+#define SLAB_MIN_SIZE     16
+#define SLAB_MAX_SIZE     4096
+#define SLAB_NUM_CLASSES  16
+
+#define SLAB_MAG_SIZE     32                  /* objects cached per cpu per class */
+#define SLAB_MAG_BATCH    (SLAB_MAG_SIZE/2)   /* objects moved per refill/flush */
+#define SLAB_EMPTY_KEEP   2                   /* empty slabs a depot holds before returning them */
+
+struct slab_depot {
+    spinlock_t       lock;
+    struct list_head partial;    // slabs that have at least one free object
+    uint64_t         num_slabs;  // slabs currently owned by this depot
+    uint64_t         num_empty;  // of which have no objects in use
+};
+
+struct mem_region;
+
+// slab state of a single kmem zone
+struct slab_zone {
+    struct mem_region    *region;
+    struct buddy_mempool *mp;
+    struct slab_depot     depot[SLAB_NUM_CLASSES];
+};
+
+struct slab_class_stats {
+    uint64_t hits;      // allocations served from the cpu's magazine
+    uint64_t misses;    // allocations that had to go to a depot
+    uint64_t frees;     // frees absorbed by the cpu's magazine
+    uint64_t flushes;   // times the magazine overflowed into the depots
+};
+
+struct slab_magazine {
+    uint64_t  count;
+    void     *objs[SLAB_MAG_SIZE];
+};
+
+// slab state of a single cpu
+struct slab_cpu_cache {
+    struct slab_magazine    mag[SLAB_NUM_CLASSES];
+    struct slab_class_stats stats[SLAB_NUM_CLASSES];
+};
+
+void slab_init(void);
+
+// the region's mm_state and page_desc must already be set up
+struct slab_zone      * slab_zone_init(struct mem_region *region);
+struct slab_cpu_cache * slab_cpu_init(int cpu);
+
+// cpu<0 => calling cpu, which allocates from its magazine
+// returns NULL if size > SLAB_MAX_SIZE or if no zone in the
+// cpu's affinity list can supply a slab
+void * slab_alloc(size_t size, int cpu);
+
+// from the given zones (a list of struct mem_reg_entry), in order,
+// and only from those of domain bind unless it is -1
+void * slab_alloc_placed(size_t size, struct list_head *regions, int bind);
+
+// returns 0 if addr was a slab object and was freed, -1 otherwise
+int    slab_free(void *addr);
+
+// size of the slab object at addr, or 0 if addr is not a slab object
+size_t slab_size_of(void *addr);
+
+uint64_t slab_class_size(int cls);
+// per-class stats for one cpu, and number of slabs backing each class
+void     slab_cpu_stats(int cpu, struct slab_class_stats *stats);
+void     slab_num_slabs(uint64_t *num_slabs);
+
+// Garbage collection support, following the conventions of the
+// kmem_*_block* functions in mm.h.  Objects carry flags only when
+// NAUT_CONFIG_GARBAGE_COLLECTION is enabled; otherwise these find
+// nothing and do nothing.
+int  slab_find_object(void *any_addr, void **obj_addr, uint64_t *obj_size, uint64_t *flags);
+int  slab_set_object_flags(void *obj_addr, uint64_t flags);
+void slab_mask_all_object_flags(uint64_t mask, int or);
+int  slab_apply_to_matching_objects(uint64_t mask, uint64_t flags, int (*func)(void *obj, void *state), void *state);
+
+#endif
@@ -88,6 +88,9 @@ struct cpu {
     // this field is only used if aspace are enabled
     struct nk_aspace    *cur_aspace;            /* +32 PAD: DO NOT MOVE */
 
+    // lazy FPU restores done by the #NM handler
+    uint64_t fpu_restore_count;                 /* +40 PAD: DO NOT MOVE */
+
     #if NAUT_CONFIG_FIBER_ENABLE
     struct nk_fiber_percpu_state *f_state; /* Fiber state for each CPU */
     #endif
@@ -113,6 +116,12 @@ struct cpu {
 
     struct nk_sched_percpu_state *sched_state;
 
+    struct nk_timer_percpu_state *timer_state;
+
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    struct nk_thread_stack_pool *stack_pool;
+#endif
+
     nk_queue_t * xcall_q;
     struct nk_xcall xcall_nowait_info;
 
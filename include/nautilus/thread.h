@@ -183,6 +183,9 @@ struct nk_thread {
                                  /* Always included to reserve this "slot" for asm code */
 
     nk_stack_size_t stack_size;
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    uint8_t stack_guard;         // the stack has a guard, checked as the thread is switched out
+#endif
     unsigned long tid;
 
     int lock;
@@ -207,6 +210,10 @@ struct nk_thread {
     int placement_cpu;
     int current_cpu;
 
+    // NUMA allocation policy (nk_kmem_policy_t), inherited by children
+    uint8_t mem_policy;
+    int     mem_policy_domain;
+
     uint8_t is_idle;
 
     void **output_loc;  // where the thread should write output
@@ -242,6 +249,24 @@ _nk_thread_init (nk_thread_t * t,
 		 int placement_cpu, // must be >=0 - where thread will go initially
 		 nk_thread_t * parent);
 
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+// per-CPU pools of stacks for nk_thread_create(), filled at boot
+// and topped up by each CPU's idle thread
+int  nk_thread_stack_pool_init(void);
+void nk_thread_stack_pool_refill(void);
+#endif
+
+// a pattern in the lowest bytes of a thread or fiber stack, which an
+// overflow overwrites first
+#define NK_STACK_GUARD_SIZE 64
+void nk_stack_guard_set(void *stack);
+int  nk_stack_guard_intact(void *stack);
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+// panics if the thread has overrun the guard at the bottom of its stack
+void nk_thread_stack_guard_check(nk_thread_t *t);
+#endif
+
 
 struct nk_tls {
     unsigned seq_num;
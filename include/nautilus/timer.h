@@ -47,7 +47,9 @@ typedef struct nk_timer {
     void              (*callback)(void *priv);
     void              *priv;
     struct list_head  node;            // global list of all timers
-    struct list_head  active_node;     // global list of active timers
+    struct list_head  active_node;     // slot in its cpu's timer wheel
+    uint32_t          wheel_cpu;       // cpu whose wheel holds it when active
+    uint32_t          wheel_slot;      // level and slot within that wheel
 } nk_timer_t;
 
 nk_timer_t *nk_timer_create(char *name);
@@ -100,10 +102,18 @@ void nk_timer_deinit();
 
 void nk_timer_dump_timers();
 
+// A timer is kept by the cpu that started it, and fires on that cpu
+// (a callback may still be sent to another cpu)
+
 // The cpu time driver (e.g., apic) will invoke the following handler
 // function on every timer interrupt, regardless of how much time has passed
-// The handler returns the time (in ns) from now whereupon it must be
-// called again at the latest.
+// It fires the expired timers of the calling cpu, and returns the time
+// (in ns) from now whereupon it must be called again at the latest,
+// or -1 if there is nothing to wait for
 uint64_t nk_timer_handler(void);
 
+// absolute time (ns) by which the calling cpu must next run the handler
+// to fire its earliest active timer within the timer slack, or -1
+uint64_t nk_timer_next_expiry(void);
+
 #endif
@@ -3,19 +3,24 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/semaphore.h>
+#include <nautilus/mutex.h>
 #include <nautilus/msg_queue.h>
 #include <nautilus/thread.h>
 #include "arch/cc.h"
 
 
 typedef struct nk_semaphore sys_sem;
-typedef sys_sem sys_mutex;
+typedef struct nk_mutex sys_mutex;
 typedef nk_thread_id_t sys_thread_t;
 typedef struct nk_msg_queue sys_mbox;
 
 typedef struct{
 	sys_sem* sem;
-} sys_sem_t, sys_mutex_t;
+} sys_sem_t;
+
+typedef struct{
+	sys_mutex* mutex;
+} sys_mutex_t;
 
 
 typedef struct {
@@ -23,6 +23,8 @@
 #ifndef _NK_GOMP_
 #define _NK_GOMP_
 
+#include <nautilus/mm.h>
+
 // Run-time startup and shutdown - invoke in init
 // after scheduling is active
 int nk_openmp_init();
@@ -38,6 +40,10 @@ void nk_openmp_deinit();
 int nk_openmp_thread_init();
 int nk_openmp_thread_deinit();
 
+// Set the NUMA allocation policy (see mm.h) of the current thread.
+// Threads of teams it subsequently creates inherit the policy.
+int nk_openmp_set_mem_policy(nk_kmem_policy_t policy, int domain);
+
 
 //
 // publicly visible functions in compliance with OMP standard
@@ -104,4 +110,56 @@ void omp_destroy_nest_lock(omp_nest_lock_t *lock);
 double omp_get_wtick(void);
 double omp_get_wtime(void);
 
+
+// Memory allocators (OpenMP 5.0).   The only trait that has an effect
+// is omp_atk_partition, which selects the NUMA policy of the allocator
+
+typedef uint64_t omp_memspace_handle_t;
+
+#define omp_default_mem_space   0
+#define omp_large_cap_mem_space 1
+#define omp_const_mem_space     2
+#define omp_high_bw_mem_space   3
+#define omp_low_lat_mem_space   4
+
+typedef uint64_t omp_allocator_handle_t;
+
+#define omp_null_allocator      0
+#define omp_default_mem_alloc   1
+#define omp_large_cap_mem_alloc 2
+#define omp_const_mem_alloc     3
+#define omp_high_bw_mem_alloc   4
+#define omp_low_lat_mem_alloc   5
+#define omp_cgroup_mem_alloc    6
+#define omp_pteam_mem_alloc     7
+#define omp_thread_mem_alloc    8
+
+typedef enum {
+    omp_atk_sync_hint = 1,
+    omp_atk_alignment = 2,
+    omp_atk_access = 3,
+    omp_atk_pool_size = 4,
+    omp_atk_fallback = 5,
+    omp_atk_fb_data = 6,
+    omp_atk_pinned = 7,
+    omp_atk_partition = 8
+} omp_alloctrait_key_t;
+
+#define omp_atv_environment 15
+#define omp_atv_nearest     16
+#define omp_atv_blocked     17
+#define omp_atv_interleaved 18
+
+typedef struct {
+    omp_alloctrait_key_t key;
+    uint64_t             value;
+} omp_alloctrait_t;
+
+omp_allocator_handle_t omp_init_allocator(omp_memspace_handle_t memspace, int ntraits, const omp_alloctrait_t traits[]);
+void omp_destroy_allocator(omp_allocator_handle_t allocator);
+void omp_set_default_allocator(omp_allocator_handle_t allocator);
+omp_allocator_handle_t omp_get_default_allocator(void);
+void *omp_alloc(size_t size, omp_allocator_handle_t allocator);
+void omp_free(void *ptr, omp_allocator_handle_t allocator);
+
 #endif
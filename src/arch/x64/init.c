@@ -292,6 +292,48 @@ static int launch_vmm_environment()
 
 extern struct naut_info * smp_ap_stack_switch(uint64_t, uint64_t, struct naut_info*);
 
+/*
+ * Boot phase timing.  Each call marks the end of a phase, and the
+ * report gives the time since the previous mark.   Times are only
+ * in cycles until the boot processor's frequency is known.
+ */
+#define MAX_BOOT_PHASES 32
+
+static struct {
+    const char *name;
+    uint64_t    tsc;
+} boot_phases[MAX_BOOT_PHASES];
+
+static int      num_boot_phases = 0;
+static uint64_t boot_start_tsc;
+
+static inline void
+boot_phase (const char *name)
+{
+    if (num_boot_phases < MAX_BOOT_PHASES) {
+	boot_phases[num_boot_phases].name = name;
+	boot_phases[num_boot_phases].tsc = rdtsc();
+	num_boot_phases++;
+    }
+}
+
+static void
+boot_phase_report (struct naut_info *naut)
+{
+    uint64_t khz = naut->sys.cpus[0]->cpu_khz;
+    uint64_t last = boot_start_tsc;
+    int i;
+
+    printk("Boot phase timing:\n");
+    for (i = 0; i < num_boot_phases; i++) {
+	uint64_t cycles = boot_phases[i].tsc - last;
+	printk("    %-24s %12lu cycles %8lu us\n", boot_phases[i].name, cycles, khz ? cycles * 1000 / khz : 0);
+	last = boot_phases[i].tsc;
+    }
+    printk("    %-24s %12lu cycles %8lu us\n", "[TOTAL]", last - boot_start_tsc, 
+	   khz ? (last - boot_start_tsc) * 1000 / khz : 0);
+}
+
 void
 init (unsigned long mbd,
       unsigned long magic)
@@ -303,6 +345,8 @@ init (unsigned long mbd,
     // sure that nothing we invoke could be using SSE or
     // similar due to compiler optimization
     
+    boot_start_tsc = rdtsc();
+
     nk_low_level_memset(naut, 0, sizeof(struct naut_info));
 
     vga_early_init();
@@ -341,6 +385,8 @@ init (unsigned long mbd,
     nk_net_dev_init();
 
     nk_vc_print(NAUT_WELCOME);
+
+    boot_phase("early devices");
     
     detect_cpu();
 
@@ -352,6 +398,8 @@ init (unsigned long mbd,
         ERROR_PRINT("Problem parsing multiboot header\n");
     }
 
+    boot_phase("boot allocator");
+
     nk_acpi_init();
 
     /* enumerate CPUs and initialize them */
@@ -361,12 +409,18 @@ init (unsigned long mbd,
      * also initialize the relevant ACPI tables if they exist */
     nk_numa_init();
 
+    boot_phase("acpi, cpus, numa");
+
     /* this will finish up the identity map */
     nk_paging_init(&(naut->sys.mem), mbd);
 
+    boot_phase("paging");
+
     /* setup the main kernel memory allocator */
     nk_kmem_init();
 
+    boot_phase("kmem zones");
+
     // setup per-core area for BSP
     msr_write(MSR_GS_BASE, (uint64_t)naut->sys.cpus[0]);
 
@@ -374,6 +428,8 @@ init (unsigned long mbd,
      * allocated in the boot mem allocator are kept reserved */
     mm_boot_kmem_init();
 
+    boot_phase("kmem boot memory");
+
 #ifdef NAUT_CONFIG_ASPACES
     nk_aspace_init();
 #endif
@@ -416,8 +472,14 @@ init (unsigned long mbd,
 
     pci_init(naut);
 
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    nk_thread_stack_pool_init();
+#endif
+
     nk_sched_init(&sched_cfg);
 
+    boot_phase("interrupts, timers, pci");
+
 #ifdef NAUT_CONFIG_CACHEPART
 #ifdef NAUT_CONFIG_CACHEPART_INTERRUPT
     nk_cache_part_init(NAUT_CONFIG_CACHEPART_THREAD_DEFAULT_PERCENT,
@@ -456,8 +518,12 @@ init (unsigned long mbd,
     // vesa_test();
 #endif
 
+    boot_phase("bsp setup");
+
     smp_bringup_aps(naut);
 
+    boot_phase("ap bringup");
+
 #ifdef NAUT_CONFIG_ENABLE_MONITOR
     nk_monitor_init();
 #endif
@@ -477,6 +543,11 @@ init (unsigned long mbd,
     serial_init();
 
     nk_sched_start();
+
+    // the rest of large memory zones is added in the background
+    mm_boot_kmem_init_deferred();
+
+    boot_phase("scheduler start");
     
 #ifdef NAUT_CONFIG_FIBER_ENABLE
     nk_fiber_init();
@@ -537,6 +608,8 @@ init (unsigned long mbd,
     nk_net_ethernet_collective_init();
 #endif
     
+    boot_phase("devices");
+
     nk_fs_init();
 
 #ifdef NAUT_CONFIG_EXT2_FILESYSTEM_DRIVER
@@ -575,6 +648,10 @@ init (unsigned long mbd,
     nk_watchdog_init(NAUT_CONFIG_WATCHDOG_DEFAULT_TIME_MS * 1000000UL);
 #endif
     
+    boot_phase("runtime environment");
+
+    boot_phase_report(naut);
+
     nk_launch_shell("root-shell",0,0,0);
 
     runtime_init();
@@ -37,6 +37,7 @@
 #include <nautilus/naut_types.h>
 #include <nautilus/cxxglue.h>
 #include <nautilus/mm.h>
+#include <nautilus/arena.h>
 
 void * __dso_handle;
 unsigned __atexit_func_count = 0;
@@ -214,6 +215,39 @@ delete[] (void *p)
 }
 
 
+// Placement in an arena, as in "new (arena) T(...)".  Objects
+// allocated this way are released when the arena is reset or
+// destroyed, or, if large, by nk_arena_free().
+void *operator 
+new (size_t size, struct nk_arena *arena)
+{
+  return nk_arena_alloc(arena, size, 0);
+}
+
+
+void *operator 
+new[] (size_t size, struct nk_arena *arena)
+{
+  return nk_arena_alloc(arena, size, 0);
+}
+
+
+// only called if a constructor fails, which cannot happen
+// without exceptions
+void operator 
+delete (void *p, struct nk_arena *arena)
+{
+  nk_arena_free(arena, p);
+}
+
+
+void operator 
+delete[] (void *p, struct nk_arena *arena)
+{
+  nk_arena_free(arena, p);
+}
+
+
 /*
 namespace std {
 
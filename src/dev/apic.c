@@ -486,6 +486,18 @@ apic_timer_setup (struct apic_dev * apic, uint32_t quantum_ms)
 
     calibrate_apic_timer(apic);
 
+#ifdef NAUT_CONFIG_TICKLESS
+    if (tscdeadline) {
+	APIC_PRINT("APIC 0x%x timer using TSC-deadline mode\n", apic->id);
+	apic->timer_tsc_deadline = 1;
+	apic_write(apic, APIC_REG_LVTT, APIC_TIMER_TSCDLINE | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
+	// the mode change must be visible before the first deadline write
+	__asm__ __volatile__ ("mfence" : : : "memory");
+    } else {
+	APIC_PRINT("APIC 0x%x timer using one-shot mode (no TSC-deadline)\n", apic->id);
+    }
+#endif
+
     apic_set_oneshot_timer(apic,apic_realtime_to_ticks(apic,quantum_ms*1000000ULL));
 }
 
@@ -959,8 +971,39 @@ apic_init (struct cpu * core)
 
 
 
+#ifdef NAUT_CONFIG_TICKLESS
+static void apic_stop_timer(struct apic_dev *apic)
+{
+    if (apic->timer_tsc_deadline) {
+	_apic_msr_write(IA32_MSR_TSC_DEADLINE, 0);
+    } else {
+	apic_write(apic, APIC_REG_TMICT, 0);
+    }
+    apic->timer_set = 0;
+    apic->current_ticks = 0;
+    apic->current_deadline = 0;
+}
+#endif
+
 void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks) 
 {
+#ifdef NAUT_CONFIG_TICKLESS
+    if (ticks == APIC_TIMER_INFINITE) {
+	apic_stop_timer(apic);
+	return;
+    }
+    if (apic->timer_tsc_deadline) {
+	if (!ticks) {
+	    ticks=1;
+	}
+	apic->current_deadline = rdtsc() + (uint64_t)ticks * apic->cycles_per_tick;
+	_apic_msr_write(IA32_MSR_TSC_DEADLINE, apic->current_deadline);
+	apic->timer_set = 1;
+	apic->current_ticks = ticks;
+	return;
+    }
+#endif
+
     apic_write(apic, APIC_REG_LVTT, APIC_TIMER_ONESHOT | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
     apic_write(apic, APIC_REG_TMDCR, APIC_TIMER_DIVCODE);
 
@@ -972,6 +1015,22 @@ void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks)
     apic->current_ticks = ticks;
 }
 
+// compare a timeout of ticks from now with the one that is set
+static inline int timer_compare(struct apic_dev *apic, uint32_t ticks)
+{
+#ifdef NAUT_CONFIG_TICKLESS
+    if (apic->timer_tsc_deadline) {
+	// deadlines are absolute, so we can compare them exactly
+	uint64_t deadline = rdtsc() + (uint64_t)ticks * apic->cycles_per_tick;
+	if (ticks == APIC_TIMER_INFINITE) {
+	    return 1;
+	}
+	return deadline < apic->current_deadline ? -1 : deadline > apic->current_deadline ? 1 : 0;
+    }
+#endif
+    return ticks < apic->current_ticks ? -1 : ticks > apic->current_ticks ? 1 : 0;
+}
+
 void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
 			       nk_timer_condition_t cond)
 {
@@ -983,10 +1042,10 @@ void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
 	    apic_set_oneshot_timer(apic,ticks);
 	    break;
 	case IF_EARLIER:
-	    if (ticks < apic->current_ticks) { apic_set_oneshot_timer(apic,ticks);}
+	    if (timer_compare(apic,ticks) < 0) { apic_set_oneshot_timer(apic,ticks);}
 	    break;
 	case IF_LATER:
-	    if (ticks > apic->current_ticks) { apic_set_oneshot_timer(apic,ticks);}
+	    if (timer_compare(apic,ticks) > 0) { apic_set_oneshot_timer(apic,ticks);}
 	    break;
 	}
     }
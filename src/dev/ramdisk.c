@@ -75,7 +75,7 @@ static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *
 	ERROR("Illegal access past end of disk\n");
 	return -1;
     } else {
-	memcpy(dest,s->data+blocknum*s->block_size,s->block_size*count);
+	nk_memcpy_bulk(dest,s->data+blocknum*s->block_size,s->block_size*count);
 	STATE_UNLOCK(s);
 	//nk_dump_mem(dest,s->block_size*count);
 	if (callback) {
@@ -99,7 +99,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 	ERROR("Illegal access past end of disk\n");
 	return -1;
     } else {
-	memcpy(s->data+blocknum*s->block_size,src,s->block_size*count);
+	nk_memcpy_bulk(s->data+blocknum*s->block_size,src,s->block_size*count);
 	STATE_UNLOCK(s);
 	if (callback) { 
 	    callback(NK_BLOCK_DEV_STATUS_SUCCESS,context);
@@ -28,6 +28,9 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/numa.h>
+#include <nautilus/cpu_state.h>
+#include <nautilus/waitqueue.h>
 
 
 #ifndef NAUT_CONFIG_DEBUG_BARRIER
@@ -60,6 +63,207 @@ barrier_xcall_handler (void * arg)
 }
 
 
+// pauses before a waiter at a blocking barrier goes to sleep
+#define BARRIER_SPIN_LIMIT 1024
+
+// children (participants or nodes) of each combining tree node
+#define BARRIER_TREE_FANIN 4
+
+// dissemination rounds for up to 2^16 participants
+#define BARRIER_MAX_ROUNDS 16
+
+/*
+ * Dissemination and tree barriers wait for a flag to reach the
+ * number of the current episode (the times the barrier has been
+ * passed) plus one, so that zeroed flags are never mistaken for a
+ * signal.  Each flag has one writer per episode, and writers cannot
+ * get ahead of those of earlier episodes, except that one dissemination
+ * participant can still be in the previous episode while the rest
+ * are in the next.  Dissemination flags are therefore kept per
+ * episode parity.
+ */
+struct barrier_participant {
+    volatile uint64_t flag[2][BARRIER_MAX_ROUNDS];
+    uint64_t          episode;   // used by nk_barrier_wait_id
+    uint32_t          leaf;      // tree node this participant arrives at
+} __attribute__((aligned(64)));
+
+struct barrier_node {
+    volatile uint32_t arrived;
+    uint32_t          count;     // children
+    int               parent;    // -1 at the root
+    volatile uint64_t release;
+} __attribute__((aligned(64)));
+
+struct nk_barrier_state {
+    uint32_t                   count;
+    uint32_t                   rounds;
+    struct barrier_node       *nodes;
+    struct nk_wait_queue      *waitq;
+    volatile uint32_t          waiters;
+
+    // numbers the participants calling nk_barrier_wait
+    volatile uint64_t          ticket __attribute__((aligned(64)));
+
+    struct barrier_participant parts[];
+};
+
+struct barrier_wait {
+    nk_barrier_t      *b;
+    volatile uint64_t *flag;
+    uint64_t           val;
+};
+
+static int flag_reached (void * state)
+{
+    struct barrier_wait * w = state;
+    return (sint64_t)(*w->flag - w->val) >= 0;
+}
+
+static int notify_changed (void * state)
+{
+    struct barrier_wait * w = state;
+    return w->b->notify != w->val;
+}
+
+static inline int can_block (nk_barrier_t * b)
+{
+    return (b->flags & NK_BARRIER_BLOCKING) && irqs_enabled() && !in_interrupt_context();
+}
+
+static void 
+barrier_await (nk_barrier_t * b, int (*cond)(void *), struct barrier_wait * w)
+{
+    struct nk_barrier_state * s = b->state;
+    int i;
+
+    for (i = 0; !cond(w); i++) {
+        if (i >= BARRIER_SPIN_LIMIT && can_block(b)) {
+            // the increment orders us against barrier_wake's check
+            __sync_fetch_and_add(&s->waiters, 1);
+            while (!cond(w)) {
+                nk_wait_queue_sleep_extended(s->waitq, cond, w);
+            }
+            __sync_fetch_and_sub(&s->waiters, 1);
+            return;
+        }
+        asm volatile ("pause");
+    }
+}
+
+// call after setting a flag.  Sleepers share one queue, so those
+// waiting on other flags will go back to sleep
+static inline void barrier_wake (nk_barrier_t * b)
+{
+    if (b->flags & NK_BARRIER_BLOCKING) {
+        __sync_synchronize();
+        if (b->state->waiters) {
+            nk_wait_queue_wake_all(b->state->waitq);
+        }
+    }
+}
+
+// order cpus by domain, socket, core, and hyperthread, so that
+// neighbors in the order share as much as possible
+static int cpu_before (struct cpu * a, struct cpu * b)
+{
+    uint32_t da = a->domain ? a->domain->id : 0;
+    uint32_t db = b->domain ? b->domain->id : 0;
+
+    if (da != db) {
+        return da < db;
+    }
+
+    if (a->coord && b->coord) {
+        if (a->coord->pkg_id != b->coord->pkg_id) {
+            return a->coord->pkg_id < b->coord->pkg_id;
+        }
+        if (a->coord->core_id != b->coord->core_id) {
+            return a->coord->core_id < b->coord->core_id;
+        }
+        if (a->coord->smt_id != b->coord->smt_id) {
+            return a->coord->smt_id < b->coord->smt_id;
+        }
+    }
+
+    return a->id < b->id;
+}
+
+/*
+ * Participants, sorted by the topology of their cpus, arrive at the
+ * leaves in groups of BARRIER_TREE_FANIN, and the nodes of each level
+ * are grouped the same way under the next, up to a single root.
+ * Node numbers increase from the leaves to the root.
+ *
+ * Participant i is taken to run on cpu i modulo the number of cpus,
+ * which only holds for nk_barrier_wait_id callers that place their
+ * threads that way.  nk_barrier_wait numbers participants by arrival,
+ * so there the layout is correct but not topology-aware.
+ */
+static int
+build_tree (struct nk_barrier_state * s)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    uint32_t n = s->count;
+    uint32_t num, total, first, i, j, p;
+    uint32_t * order;
+
+    order = malloc(sizeof(uint32_t) * n);
+    if (!order) {
+        return -ENOMEM;
+    }
+
+    // insertion sort, since this is done once per barrier
+    for (i = 0; i < n; i++) {
+        p = i;
+        for (j = i; j > 0 && 
+                 cpu_before(sys->cpus[p % sys->num_cpus], sys->cpus[order[j-1] % sys->num_cpus]); j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = p;
+    }
+
+    total = 0;
+    num = n;
+    do {
+        num = (num + BARRIER_TREE_FANIN - 1) / BARRIER_TREE_FANIN;
+        total += num;
+    } while (num > 1);
+
+    s->nodes = malloc(sizeof(struct barrier_node) * total);
+    if (!s->nodes) {
+        free(order);
+        return -ENOMEM;
+    }
+    memset(s->nodes, 0, sizeof(struct barrier_node) * total);
+
+    for (i = 0; i < total; i++) {
+        s->nodes[i].parent = -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        s->parts[order[i]].leaf = i / BARRIER_TREE_FANIN;
+        s->nodes[i / BARRIER_TREE_FANIN].count++;
+    }
+
+    first = 0;
+    num = (n + BARRIER_TREE_FANIN - 1) / BARRIER_TREE_FANIN;
+    while (num > 1) {
+        for (i = 0; i < num; i++) {
+            s->nodes[first + i].parent = first + num + i / BARRIER_TREE_FANIN;
+            s->nodes[first + num + i / BARRIER_TREE_FANIN].count++;
+        }
+        first += num;
+        num = (num + BARRIER_TREE_FANIN - 1) / BARRIER_TREE_FANIN;
+    }
+
+    DEBUG_PRINT("Barrier tree for %u participants has %u nodes\n", n, total);
+
+    free(order);
+    return 0;
+}
+
+
 /*
  * nk_barrier_init
  *
@@ -75,7 +279,32 @@ barrier_xcall_handler (void * arg)
 int 
 nk_barrier_init (nk_barrier_t * barrier, uint32_t count) 
 {
-    int ret = 0;
+    return nk_barrier_init_type(barrier, count, NK_BARRIER_CENTRAL, 0);
+}
+
+
+/*
+ * nk_barrier_init_type
+ *
+ * initialize a thread barrier that uses the given
+ * algorithm 
+ *
+ * @barrier: the barrier to initialize
+ * @count: the number of participants
+ * @type: the algorithm
+ * @flags: NK_BARRIER_BLOCKING to have waiters
+ *         sleep after spinning for a while
+ *
+ * returns 0 on succes, -EINVAL or -ENOMEM on error
+ *
+ */
+int 
+nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type, int flags)
+{
+    struct nk_barrier_state * s;
+    char name[NK_WAIT_QUEUE_NAME_LEN];
+    uint32_t nparts;
+
     memset(barrier, 0, sizeof(nk_barrier_t));
     barrier->lock = 0;
 
@@ -84,10 +313,53 @@ nk_barrier_init (nk_barrier_t * barrier, uint32_t count)
         return -EINVAL;
     }
 
+    if (type > NK_BARRIER_TREE ||
+        (type == NK_BARRIER_DISSEMINATION && count > (1U << BARRIER_MAX_ROUNDS))) {
+        ERROR_PRINT("Unsupported barrier type %d for count %u\n", type, count);
+        return -EINVAL;
+    }
 
-    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u\n", (void*)barrier, count);
+    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u, type=%d, flags=%x\n", (void*)barrier, count, type, flags);
     barrier->init_count = count;
     barrier->remaining  = count;
+    barrier->type       = type;
+    barrier->flags      = flags;
+
+    if (type == NK_BARRIER_CENTRAL && !(flags & NK_BARRIER_BLOCKING)) {
+        return 0;
+    }
+
+    nparts = type == NK_BARRIER_CENTRAL ? 0 : count;
+
+    s = malloc(sizeof(*s) + sizeof(struct barrier_participant) * nparts);
+    if (!s) {
+        ERROR_PRINT("Cannot allocate barrier state\n");
+        return -ENOMEM;
+    }
+    memset(s, 0, sizeof(*s) + sizeof(struct barrier_participant) * nparts);
+
+    s->count = count;
+    while ((1U << s->rounds) < count) {
+        s->rounds++;
+    }
+
+    if (type == NK_BARRIER_TREE && build_tree(s)) {
+        ERROR_PRINT("Cannot build barrier tree\n");
+        free(s);
+        return -ENOMEM;
+    }
+
+    if (flags & NK_BARRIER_BLOCKING) {
+        snprintf(name, NK_WAIT_QUEUE_NAME_LEN, "barrier-%p", barrier);
+        if (!(s->waitq = nk_wait_queue_create(name))) {
+            ERROR_PRINT("Cannot allocate barrier wait queue\n");
+            free(s->nodes);
+            free(s);
+            return -ENOMEM;
+        }
+    }
+
+    barrier->state = s;
 
     return 0;
 }
@@ -106,6 +378,7 @@ nk_barrier_init (nk_barrier_t * barrier, uint32_t count)
 int 
 nk_barrier_destroy (nk_barrier_t * barrier)
 {
+    struct nk_barrier_state * s;
     int res;
 
     if (!barrier) {
@@ -114,9 +387,12 @@ nk_barrier_destroy (nk_barrier_t * barrier)
 
     DEBUG_PRINT("Destroying barrier (%p)\n", (void*)barrier);
 
+    s = barrier->state;
+
     bspin_lock(&barrier->lock);
     
-    if (likely(barrier->remaining == barrier->init_count)) {
+    if (likely(barrier->remaining == barrier->init_count &&
+               (!s || (s->ticket % s->count == 0 && !s->waiters)))) {
         res = 0;
     } else {
         /* someone is still waiting at the barrier? */
@@ -125,9 +401,98 @@ nk_barrier_destroy (nk_barrier_t * barrier)
     }
     bspin_unlock(&barrier->lock);
 
+    if (!res && s) {
+        if (s->waitq) {
+            nk_wait_queue_destroy(s->waitq);
+        }
+        free(s->nodes);
+        free(s);
+        barrier->state = NULL;
+    }
+
+    return res;
+}
+
+
+// the last arrival flips notify, which waiters sampled on arrival
+static int
+central_wait (nk_barrier_t * barrier)
+{
+    struct barrier_wait w = { .b = barrier };
+
+    bspin_lock(&barrier->lock);
+
+    w.val = barrier->notify;
+
+    if (--barrier->remaining == 0) {
+        barrier->remaining = barrier->init_count;
+        barrier->notify = !w.val;
+        bspin_unlock(&barrier->lock);
+        barrier_wake(barrier);
+        return NK_BARRIER_LAST;
+    }
+
+    bspin_unlock(&barrier->lock);
+
+    barrier_await(barrier, notify_changed, &w);
+
+    return 0;
+}
+
+// in round k, signal participant id+2^k and wait for id-2^k
+static int
+dissemination_wait (nk_barrier_t * barrier, uint32_t id, uint64_t episode)
+{
+    struct nk_barrier_state * s = barrier->state;
+    struct barrier_wait w = { .b = barrier, .val = episode + 1 };
+    int par = episode & 1;
+    uint32_t k;
+
+    for (k = 0; k < s->rounds; k++) {
+        s->parts[(id + (1U << k)) % s->count].flag[par][k] = episode + 1;
+        barrier_wake(barrier);
+        w.flag = &s->parts[id].flag[par][k];
+        barrier_await(barrier, flag_reached, &w);
+    }
+
+    return id == 0 ? NK_BARRIER_LAST : 0;
+}
+
+// the last arrival at a node goes on to its parent, and on the way
+// back releases the node
+static int
+tree_arrive (nk_barrier_t * barrier, uint32_t n, uint64_t episode)
+{
+    struct barrier_node * node = &barrier->state->nodes[n];
+    struct barrier_wait w = { .b = barrier, .flag = &node->release, .val = episode + 1 };
+    int res;
+
+    if (__sync_fetch_and_add(&node->arrived, 1) != node->count - 1) {
+        barrier_await(barrier, flag_reached, &w);
+        return 0;
+    }
+
+    // nobody arrives here again until we release the node
+    node->arrived = 0;
+
+    res = node->parent < 0 ? NK_BARRIER_LAST : tree_arrive(barrier, node->parent, episode);
+
+    node->release = episode + 1;
+    barrier_wake(barrier);
+
     return res;
 }
 
+static inline int
+typed_wait (nk_barrier_t * barrier, uint32_t id, uint64_t episode)
+{
+    if (barrier->type == NK_BARRIER_DISSEMINATION) {
+        return dissemination_wait(barrier, id, episode);
+    } else {
+        return tree_arrive(barrier, barrier->state->parts[id].leaf, episode);
+    }
+}
+
 
 /*
  * nk_barrier_wait
@@ -139,35 +504,56 @@ nk_barrier_destroy (nk_barrier_t * barrier)
  * returns 0 to all threads but the last. The last thread
  * out of the barrier will return NK_BARRIER_LAST. This
  * is useful for having one thread in charge of cleaning 
- * the barrier up. Again, similar to POSIX
+ * the barrier up. Again, similar to POSIX.  For dissemination
+ * and tree barriers, one thread, but not necessarily the last,
+ * gets NK_BARRIER_LAST
  *
  */
 int 
 nk_barrier_wait (nk_barrier_t * barrier) 
 {
-    int res = 0;
+    uint64_t ticket;
+    int res;
 
     DEBUG_PRINT("Thread (%p) entering barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
 
-    bspin_lock(&barrier->lock);
-
-    if (--barrier->remaining == 0) {
-        res = NK_BARRIER_LAST;
-        atomic_cmpswap(barrier->notify, 0, 1);
+    if (barrier->type == NK_BARRIER_CENTRAL) {
+        res = central_wait(barrier);
     } else {
-        bspin_unlock(&barrier->lock);
-        BARRIER_WHILE(barrier->notify != 1);
+        ticket = __sync_fetch_and_add(&barrier->state->ticket, 1);
+        res = typed_wait(barrier, ticket % barrier->init_count, ticket / barrier->init_count);
     }
 
     DEBUG_PRINT("Thread (%p) exiting barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
     
-    register unsigned init_count = barrier->init_count;
+    return res;
+}
 
-    if (atomic_inc_val(barrier->remaining) == init_count) {
-        bspin_unlock(&barrier->lock);
+
+/*
+ * nk_barrier_wait_id
+ *
+ * wait at a thread barrier as participant id
+ *
+ * @barrier: the barrier to wait at
+ * @id: the caller's participant number, in [0,count)
+ *
+ * returns as nk_barrier_wait, or -EINVAL for a bad id
+ *
+ */
+int 
+nk_barrier_wait_id (nk_barrier_t * barrier, uint32_t id) 
+{
+    if (barrier->type == NK_BARRIER_CENTRAL) {
+        return nk_barrier_wait(barrier);
     }
-    
-    return res;
+
+    if (id >= barrier->init_count) {
+        ERROR_PRINT("Participant %u out of range for barrier (%p)\n", id, (void*)barrier);
+        return -EINVAL;
+    }
+
+    return typed_wait(barrier, id, barrier->state->parts[id].episode++);
 }
 
 
@@ -369,6 +755,121 @@ barrier_func2 (void * in, void ** out)
 }
 
 
+
+#define BARRIER_CHECK_ROUNDS  50
+#define BARRIER_CHECK_MAX     11
+
+struct barrier_check;
+
+struct barrier_check_arg {
+    struct barrier_check * c;
+    uint32_t               id;
+};
+
+struct barrier_check {
+    nk_barrier_t             b;
+    uint32_t                 n;
+    int                      by_id;
+    struct barrier_check_arg args[BARRIER_CHECK_MAX];
+    volatile uint64_t        arrived[BARRIER_CHECK_ROUNDS];
+    volatile uint64_t        lasts[BARRIER_CHECK_ROUNDS];
+    volatile uint64_t        early;   // releases before everyone arrived
+};
+
+static void
+barrier_check_func (void * in, void ** out)
+{
+    struct barrier_check_arg * a = (struct barrier_check_arg *)in;
+    struct barrier_check * c = a->c;
+    uint64_t n;
+    int r, res;
+
+    for (r = 0; r < BARRIER_CHECK_ROUNDS; r++) {
+        // stagger arrivals so that early ones go to sleep
+        for (n = 100 * ((a->id + r) % 3); n; n--) {
+            io_delay();
+        }
+
+        __sync_fetch_and_add(&c->arrived[r], 1);
+
+        res = c->by_id ? nk_barrier_wait_id(&c->b, a->id) : nk_barrier_wait(&c->b);
+
+        if (c->arrived[r] != c->n) {
+            __sync_fetch_and_add(&c->early, 1);
+        }
+        if (res == NK_BARRIER_LAST) {
+            __sync_fetch_and_add(&c->lasts[r], 1);
+        }
+    }
+}
+
+// run n threads through a blocking barrier of the given type for a
+// number of episodes, and check that none is released before all
+// have arrived, and that exactly one gets NK_BARRIER_LAST each time
+static int
+barrier_check (nk_barrier_type_t type, uint32_t n, int by_id)
+{
+    struct barrier_check * c;
+    nk_thread_id_t tids[BARRIER_CHECK_MAX];
+    uint32_t i, started;
+    uint64_t lasts = 0;
+    int r, rc = 0;
+
+    c = malloc(sizeof(*c));
+    if (!c) {
+        ERROR_PRINT("could not allocate barrier\n");
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+
+    c->n = n;
+    c->by_id = by_id;
+
+    if (nk_barrier_init_type(&c->b, n, type, NK_BARRIER_BLOCKING)) {
+        ERROR_PRINT("could not initialize barrier\n");
+        free(c);
+        return -1;
+    }
+
+    for (started = 0; started < n; started++) {
+        c->args[started].c = c;
+        c->args[started].id = started;
+        if (nk_thread_start(barrier_check_func, &c->args[started], NULL, 0, TSTACK_DEFAULT, &tids[started], -1)) {
+            break;
+        }
+    }
+
+    if (started < n) {
+        // the others are stuck at the barrier, so leave them, and it, behind
+        ERROR_PRINT("could only start %u of %u barrier threads\n", started, n);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        nk_join(tids[i], NULL);
+    }
+
+    for (r = 0; r < BARRIER_CHECK_ROUNDS; r++) {
+        if (c->lasts[r] != 1) {
+            lasts++;
+        }
+    }
+
+    if (c->early || lasts) {
+        ERROR_PRINT("barrier type %d, %u threads%s: %lu early releases, %lu episodes without exactly one last\n",
+                    type, n, by_id ? " by id" : "", c->early, lasts);
+        rc = -1;
+    }
+
+    if (nk_barrier_destroy(&c->b)) {
+        rc = -1;
+    }
+
+    free(c);
+
+    return rc;
+}
+
 /* 
  *
  * NOTE: this test assumes that there are at least 3 CPUs on 
@@ -377,6 +878,13 @@ barrier_func2 (void * in, void ** out)
  */
 void nk_barrier_test(void)
 {
+    // counts that are not powers of two, which leave dissemination
+    // rounds wrapping around and tree nodes partly filled
+    uint32_t counts[] = { 3, 5, 7, BARRIER_CHECK_MAX };
+    nk_barrier_type_t type;
+    uint32_t i;
+    int by_id, rc = 0;
+
     nk_barrier_t * b;
     b = malloc(sizeof(nk_barrier_t));
     if (!b) {
@@ -393,5 +901,15 @@ void nk_barrier_test(void)
     printk("Barrier test successful\n");
     nk_barrier_destroy(b);
     free(b);
+
+    for (type = NK_BARRIER_DISSEMINATION; type <= NK_BARRIER_TREE; type++) {
+        for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+            for (by_id = 0; by_id < 2; by_id++) {
+                rc |= barrier_check(type, counts[i], by_id);
+            }
+        }
+    }
+
+    printk("Dissemination and tree barrier tests %s\n", rc ? "FAILED" : "successful");
 }
 
@@ -22,6 +22,7 @@
  */
 #include <nautilus/nautilus.h>
 #include <nautilus/condvar.h>
+#include <nautilus/mutex.h>
 #include <nautilus/queue.h>
 #include <nautilus/thread.h>
 #include <nautilus/errno.h>
@@ -78,8 +79,14 @@ nk_condvar_destroy (nk_condvar_t * c)
 }
 
 
-uint8_t
-nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
+// the caller's lock is either an NK_LOCK_T or an nk_mutex
+static void lock_release (void * l)  { NK_UNLOCK((NK_LOCK_T *)l); }
+static void lock_acquire (void * l)  { NK_LOCK((NK_LOCK_T *)l); }
+static void mutex_release (void * m) { nk_mutex_unlock((nk_mutex_t *)m); }
+static void mutex_acquire (void * m) { nk_mutex_lock((nk_mutex_t *)m); }
+
+static uint8_t
+condvar_wait (nk_condvar_t * c, void * l, void (*release)(void *), void (*acquire)(void *))
 {
     NK_PROFILE_ENTRY();
 
@@ -88,7 +95,7 @@ nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
     NK_LOCK(&c->lock);
 
     /* now we can unlock the mutex and go to sleep */
-    NK_UNLOCK(l);
+    release(l);
 
     ++c->nwaiters;
     ++c->main_seq;
@@ -121,7 +128,7 @@ bcout:
     NK_UNLOCK(&c->lock);
 
     /* reacquire lock */
-    NK_LOCK(l);
+    acquire(l);
 
     NK_PROFILE_EXIT();
 
@@ -129,6 +136,20 @@ bcout:
 }
 
 
+uint8_t
+nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
+{
+    return condvar_wait(c, l, lock_release, lock_acquire);
+}
+
+
+uint8_t
+nk_condvar_wait_mutex (nk_condvar_t * c, nk_mutex_t * m)
+{
+    return condvar_wait(c, m, mutex_release, mutex_acquire);
+}
+
+
 int 
 nk_condvar_signal (nk_condvar_t * c)
 {
@@ -84,6 +84,36 @@ cpuid_leaf_max (void)
 }
 
 
+/*
+ * Pick the memcpy/memset implementation for this processor. 
+ * SSE2 is architectural in long mode.  ERMS makes rep movsb/stosb
+ * the fastest option for large sizes, and FSRM (CPUID.7.0:EDX[4])
+ * makes rep movsb fast for short copies as well.
+ */
+static void
+select_string_impl (void)
+{
+    int impl = NK_STRING_IMPL_SSE;
+    struct cpuid_ext_feat_flags_ebx ebx;
+    cpuid_ret_t r;
+
+    if (cpuid_leaf_max() >= 7) {
+        cpuid_sub(7, 0, &r);
+        ebx.val = r.b;
+        if (ebx.erms) {
+            impl = NK_STRING_IMPL_ERMS;
+            if (r.d & (1 << 4)) {
+                impl = NK_STRING_IMPL_FSRM;
+            }
+        }
+    }
+
+    nk_string_set_impl(impl);
+
+    printk("Using %s string functions\n", nk_string_impl_name(impl));
+}
+
+
 void 
 detect_cpu (void)
 {
@@ -98,6 +128,8 @@ detect_cpu (void)
     memset(&branding[12], 0, 4);
     
     printk("Detected %s Processor\n", branding);
+
+    select_string_impl();
 }
 
 
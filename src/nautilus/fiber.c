@@ -39,7 +39,6 @@
 #include <nautilus/list.h>
 #include <nautilus/errno.h>
 #include <nautilus/mm.h>
-#include <nautilus/random.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/cpu_state.h>
 
@@ -71,17 +70,100 @@
 #define _LOCK_FIBER(f) spin_lock(&(f->lock))
 #define _UNLOCK_FIBER(f) spin_unlock(&(f->lock))
 
+/* Values of a fiber's queued field */
+#define F_NOT_QUEUED   0 /* running, waiting, or being switched to */
+#define F_QUEUED_LOCAL 1 /* in some CPU's run queue */
+#define F_QUEUED_INBOX 2 /* in curr_cpu's inbox */
+
+/* 
+ * Each CPU's run queue is a bounded FIFO ring.  Only the CPU itself
+ * pushes at the tail, with interrupts off and no atomics.  Any CPU,
+ * including the owner, takes from the head with a CAS per fiber.
+ * Fibers that do not fit, and fibers placed on a CPU by other CPUs,
+ * go on its locked inbox instead, which the owner drains into the ring.
+ *
+ * A slot in a ring is only a hint.  Whoever takes it must then claim
+ * the fiber by moving its queued field from F_QUEUED_LOCAL to
+ * F_NOT_QUEUED.  nk_fiber_yield_to() claims a fiber the same way
+ * without touching the ring, which leaves a stale slot that is
+ * skipped when it is reached.  Each slot holds a reference on the
+ * fiber so that it is not freed while a stale slot still names it.
+ */
+#define FIBER_QUEUE_SIZE 256 /* power of two */
+
+typedef struct fiber_queue {
+    volatile sint64_t head __attribute__((aligned(64))); /* any CPU takes here */
+    volatile sint64_t tail __attribute__((aligned(64))); /* owner pushes here */
+    nk_fiber_t *fibers[FIBER_QUEUE_SIZE];
+} fiber_queue;
+
+/*
+ * With NAUT_CONFIG_FIBER_STACK_CACHE, fiber stacks of up to 64 KB are
+ * rounded up to a power of two, and each CPU keeps a cache of free
+ * stacks of each of these sizes, and one of free fiber structures.
+ * A fiber is created from the caches of the CPU that creates it, and
+ * goes back to those of the CPU that frees it, which is normally the
+ * one it exited on.  Only a CPU itself touches its caches, so turning
+ * interrupts off is all the locking they need.
+ */
+#define FIBER_STACK_MIN_SHIFT   11   /* 2 KB */
+#define FIBER_STACK_MAX_SHIFT   16   /* 64 KB */
+#define FIBER_STACK_NUM_CLASSES (FIBER_STACK_MAX_SHIFT - FIBER_STACK_MIN_SHIFT + 1)
+#define FIBER_STACK_CLASS_SIZE(c) (1UL << (FIBER_STACK_MIN_SHIFT + (c)))
+
+/* Fibers that save FP state need room for it below their saved GPRs,
+   and for the C part of yield below that */
+#if NAUT_CONFIG_FIBER_FSAVE
+#define FIBER_MIN_STACK_SIZE 0x2000
+#else
+#define FIBER_MIN_STACK_SIZE 0x800
+#endif
+
+#ifdef NAUT_CONFIG_FIBER_SMALL_STACKS
+#define FIBER_DEFAULT_STACK_SIZE NAUT_CONFIG_FIBER_SMALL_STACK_SIZE
+#else
+#define FIBER_DEFAULT_STACK_SIZE FSTACK_16KB
+#endif
+
+#ifdef NAUT_CONFIG_FIBER_STACK_CACHE
+#define FIBER_CACHE_DEPTH NAUT_CONFIG_FIBER_STACK_CACHE_DEPTH
+
+struct fiber_cache_class {
+    uint32_t count;
+    void     *objs[FIBER_CACHE_DEPTH];
+};
+
+struct fiber_stack_cache {
+    struct fiber_cache_class fibers; /* fiber structures */
+    struct fiber_cache_class stacks[FIBER_STACK_NUM_CLASSES];
+    uint64_t hits;   /* creations that found a cached stack */
+    uint64_t misses; /* creations that had to allocate one */
+};
+#endif
+
 /* Each CPU has a fiber state associated with it */
 typedef struct nk_fiber_percpu_state {
-    spinlock_t  lock; /* lock for the entire fiber percpu state */
+    spinlock_t  lock; /* lock for the inbox and the rest of the fiber percpu state */
     nk_thread_t *fiber_thread; /* Points to the CPU's Fiber thread which is created at bootup */
     nk_fiber_t *curr_fiber; /* points to the fiber currently running on this CPU */
     nk_fiber_t *idle_fiber; /* points to this CPU's idle fiber */
-    struct list_head f_sched_queue; /* sched queue for fibers on this CPU (can be accessed by other CPUs) */
+    fiber_queue queue; /* run queue for fibers on this CPU (can be stolen from by other CPUs) */
+    struct list_head f_sched_queue; /* inbox for fibers placed here by other CPUs (or that did not fit) */
+    nk_fiber_t *switch_from; /* fiber to queue once we are off its stack */
+    nk_fiber_t *switch_join; /* fiber that switch_from is to wait on instead */
+    nk_fiber_t *switch_exited; /* fiber to release once we are off its stack */
+    volatile int sleeping; /* fiber thread is asleep (or about to be) on waitq */
+    uint64_t num_steals; /* fibers this CPU has taken from others */
     struct nk_wait_queue *waitq; /* Wait queue that the fiber thread can sleep on */
     int fork_cpu; /* Determines which CPU forked fibers will be placed on. Default => curr CPU */
+#ifdef NAUT_CONFIG_FIBER_STACK_CACHE
+    struct fiber_stack_cache stack_cache; /* free stacks and fiber structures */
+#endif
 } fiber_state;
 
+/* number of fiber threads that are asleep, so producers know whether to wake one */
+static volatile int fiber_sleepers = 0;
+
 /* These functions are implemented in assembly. Can be found in src/asm/fiber_lowlevel.S */
 extern void _nk_fiber_context_switch(nk_fiber_t *f_to);
 extern void _nk_fiber_context_switch_early(nk_fiber_t* f_to);
@@ -94,6 +176,9 @@ extern int _nk_fiber_join_yield();
 extern int nk_fiber_yield();
 extern int nk_fiber_yield_to(nk_fiber_t* f_to, int earlyRetFlag);
 
+/* Called from _nk_fiber_context_switch once it is on the new fiber's stack */
+void _nk_fiber_switch_finish();
+
 #if NAUT_CONFIG_FIBER_FSAVE
 extern void _nk_fiber_fp_save(nk_fiber_t* f);
 #endif
@@ -143,20 +228,302 @@ static void _fiber_push(nk_fiber_t * f, uint64_t x)
     *(uint64_t*)(f->rsp) = x;
 }
 
-// Round Robin policy for fibers. Returns the first fiber in the curr CPU's sched queue
-// Returns NULL if no fiber is available in the curr CPU's sched queue
-static nk_fiber_t* _rr_policy()
+#ifdef NAUT_CONFIG_FIBER_STACK_CACHE
+// returns the class of stacks of size bytes, or -1 if they are not cached
+static int _stack_class(nk_stack_size_t size)
 {
-  // Grab the first fiber from the sched queue
-  struct list_head *f_queue = _GET_SCHED_HEAD(); 
-  nk_fiber_t *fiber_to_schedule = list_first_entry(f_queue, nk_fiber_t, sched_node); 
-  
-  // If sched queue not empty, fiber_to_schedule != NULL
-  if (fiber_to_schedule){
-    // Remove the fiber from the sched queue
-    list_del_init(&(fiber_to_schedule->sched_node));
+  int c;
+
+  if (size > FIBER_STACK_CLASS_SIZE(FIBER_STACK_NUM_CLASSES - 1)) {
+    return -1;
+  }
+
+  for (c = 0; FIBER_STACK_CLASS_SIZE(c) < size; c++) {
+  }
+
+  return c;
+}
+
+static inline void *_cache_get(struct fiber_cache_class *c)
+{
+  return c->count ? c->objs[--c->count] : NULL;
+}
+
+// returns 0 if obj was cached, or -1 if the cache is full
+static inline int _cache_put(struct fiber_cache_class *c, void *obj)
+{
+  if (c->count >= FIBER_CACHE_DEPTH) {
+    return -1;
+  }
+  c->objs[c->count++] = obj;
+  return 0;
+}
+#endif
+
+// Allocates a zeroed fiber structure with a stack of at least stack_size bytes
+// returns NULL on failure
+static nk_fiber_t *_fiber_alloc(nk_stack_size_t stack_size)
+{
+  nk_fiber_t *f = NULL;
+  void *stack = NULL;
+
+  if (stack_size < FIBER_MIN_STACK_SIZE) {
+    stack_size = FIBER_MIN_STACK_SIZE;
+  }
+
+#ifdef NAUT_CONFIG_FIBER_STACK_CACHE
+  int c = _stack_class(stack_size);
+  uint8_t flags = irq_disable_save();
+  fiber_state *state = _GET_FIBER_STATE();
+
+  // fibers may be created before this CPU's fiber state exists
+  if (state) {
+    f = _cache_get(&state->stack_cache.fibers);
+    if (c >= 0) {
+      stack_size = FIBER_STACK_CLASS_SIZE(c);
+      if ((stack = _cache_get(&state->stack_cache.stacks[c]))) {
+        state->stack_cache.hits++;
+      } else {
+        state->stack_cache.misses++;
+      }
+    }
+  }
+
+  irq_enable_restore(flags);
+#endif
+
+  if (!f && !(f = malloc(sizeof(nk_fiber_t)))) {
+    goto fail;
+  }
+
+  if (!stack) {
+    if (!(stack = malloc(stack_size))) {
+      goto fail;
+    }
+#ifdef NAUT_CONFIG_FIBER_STACK_GUARD
+    nk_stack_guard_set(stack);
+#endif
+  }
+
+  memset(f, 0, sizeof(nk_fiber_t));
+  f->stack = stack;
+  f->stack_size = stack_size;
+
+  return f;
+
+ fail:
+  // anything taken from a cache came from malloc in the first place
+  if (stack) {
+    free(stack);
+  }
+  if (f) {
+    free(f);
+  }
+  return NULL;
+}
+
+// Frees f and its stack, or puts them in this CPU's caches
+static void _fiber_free(nk_fiber_t *f)
+{
+  void *stack = f->stack;
+  nk_stack_size_t size = f->stack_size;
+
+#ifdef NAUT_CONFIG_FIBER_STACK_GUARD
+  if (!nk_stack_guard_intact(stack)) {
+    FIBER_ERROR("Fiber %p has overrun its %lu byte stack %p, so it will not be reused\n", f, size, stack);
+    free(stack);
+    stack = NULL;
+  }
+#endif
+
+#ifdef NAUT_CONFIG_FIBER_STACK_CACHE
+  int c = _stack_class(size);
+  uint8_t flags = irq_disable_save();
+  fiber_state *state = _GET_FIBER_STATE();
+
+  if (state) {
+    // stacks of other sizes came straight from malloc
+    if (stack && c >= 0 && FIBER_STACK_CLASS_SIZE(c) == size &&
+        !_cache_put(&state->stack_cache.stacks[c], stack)) {
+      stack = NULL;
+    }
+    if (!_cache_put(&state->stack_cache.fibers, f)) {
+      f = NULL;
+    }
+  }
+
+  irq_enable_restore(flags);
+#endif
+
+  if (stack) {
+    free(stack);
+  }
+  if (f) {
+    free(f);
+  }
+}
+
+// Drops a reference to f, freeing it once it has exited and no run queue slot names it
+static void _fiber_put(nk_fiber_t *f)
+{
+  if (__sync_sub_and_fetch(&f->refs, 1) == 0) {
+    _fiber_free(f);
+  }
+}
+
+// Pushes f at the tail of q. Owner only, interrupts off.
+// returns -1 if q is full
+static inline int _queue_push(fiber_queue *q, nk_fiber_t *f)
+{
+  sint64_t t = q->tail;
+
+  if (t - q->head >= FIBER_QUEUE_SIZE) {
+    return -1;
+  }
+
+  q->fibers[t & (FIBER_QUEUE_SIZE-1)] = f;
+  // the slot must be visible before the new tail, which
+  // x86 guarantees for stores, so only the compiler must not reorder
+  __asm__ __volatile__ ("" ::: "memory");
+  q->tail = t + 1;
+
+  return 0;
+}
+
+// Takes the slot at the head of q. Any CPU.
+// returns NULL if q is empty
+static inline nk_fiber_t *_queue_take(fiber_queue *q)
+{
+  sint64_t h, t;
+  nk_fiber_t *f;
+
+  do {
+    h = q->head;
+    // x86 does not reorder loads, so only the compiler must not
+    __asm__ __volatile__ ("" ::: "memory");
+    t = q->tail;
+    if (h >= t) {
+      return NULL;
+    }
+    // if the owner has since reused this slot, the head has moved and the CAS fails
+    f = q->fibers[h & (FIBER_QUEUE_SIZE-1)];
+  } while (!__sync_bool_compare_and_swap(&q->head, h, h + 1));
+
+  return f;
+}
+
+static inline sint64_t _queue_size(fiber_queue *q)
+{
+  sint64_t n = q->tail - q->head;
+  return n > 0 ? n : 0;
+}
+
+// Takes fibers from state's run queue until one can be claimed
+// returns NULL if there is none
+static nk_fiber_t *_take(fiber_state *state)
+{
+  nk_fiber_t *f;
+  int won;
+
+  while ((f = _queue_take(&state->queue))) {
+    won = __sync_bool_compare_and_swap(&f->queued, F_QUEUED_LOCAL, F_NOT_QUEUED);
+    // drop the slot's reference; if we lost, the slot was stale
+    _fiber_put(f);
+    if (won) {
+      return f;
+    }
+  }
+
+  return NULL;
+}
+
+// Takes the first fiber in state's inbox, or returns NULL if it is empty
+static nk_fiber_t *_inbox_take(fiber_state *state)
+{
+  nk_fiber_t *f;
+
+  if (list_empty_careful(&(state->f_sched_queue))) {
+    return NULL;
+  }
+
+  _LOCK_SCHED_QUEUE(state);
+  f = list_first_entry(&(state->f_sched_queue), nk_fiber_t, sched_node);
+  if (f) {
+    list_del_init(&(f->sched_node));
+    f->queued = F_NOT_QUEUED;
+  }
+  _UNLOCK_SCHED_QUEUE(state);
+
+  return f;
+}
+
+// Queues f in the inbox of cpu, whose fiber state is state. Any CPU.
+static void _enqueue_inbox(fiber_state *state, int cpu, nk_fiber_t *f)
+{
+  _LOCK_SCHED_QUEUE(state);
+  f->curr_cpu = cpu;
+  f->f_status = READY;
+  // curr_cpu must be visible before queued (for _check_yield_to)
+  __asm__ __volatile__ ("" ::: "memory");
+  f->queued = F_QUEUED_INBOX;
+  list_add_tail(&(f->sched_node), &(state->f_sched_queue));
+  _UNLOCK_SCHED_QUEUE(state);
+}
+
+// Queues f on this CPU's run queue, or in its inbox if the run queue is full.
+// state must be this CPU's fiber state. Interrupts off.
+static void _enqueue_local(fiber_state *state, nk_fiber_t *f)
+{
+  f->curr_cpu = my_cpu_id();
+  f->f_status = READY;
+
+  if (_queue_size(&state->queue) >= FIBER_QUEUE_SIZE) {
+    _enqueue_inbox(state, f->curr_cpu, f);
+    return;
+  }
+
+  // only we push, so the push below cannot fail, and f must be
+  // claimable before its slot can be taken
+  __sync_fetch_and_add(&f->refs, 1);
+  f->queued = F_QUEUED_LOCAL;
+  _queue_push(&state->queue, f);
+}
+
+// Moves the fibers in this CPU's inbox to the tail of its run queue,
+// so they take their turn behind the fibers already there
+static void _drain_inbox(fiber_state *state)
+{
+  nk_fiber_t *f;
+  uint8_t flags;
+
+  if (list_empty_careful(&(state->f_sched_queue))) {
+    return;
   }
 
+  flags = irq_disable_save();
+  _LOCK_SCHED_QUEUE(state);
+  while (_queue_size(&state->queue) < FIBER_QUEUE_SIZE &&
+         (f = list_first_entry(&(state->f_sched_queue), nk_fiber_t, sched_node))) {
+    list_del_init(&(f->sched_node));
+    __sync_fetch_and_add(&f->refs, 1);
+    f->queued = F_QUEUED_LOCAL;
+    _queue_push(&state->queue, f);
+  }
+  _UNLOCK_SCHED_QUEUE(state);
+  irq_enable_restore(flags);
+}
+
+// Round Robin policy for fibers. Returns the first fiber in the curr CPU's run queue,
+// after the fibers placed here by other CPUs have joined it.
+// Returns NULL if no fiber is available on the curr CPU
+static nk_fiber_t* _rr_policy()
+{
+  fiber_state *state = _GET_FIBER_STATE();
+
+  _drain_inbox(state);
+
+  nk_fiber_t *fiber_to_schedule = _take(state);
+
   //DEBUG: prints the fiber that was just dequeued and indicates current and idle fiber
   FIBER_DEBUG("_rr_policy() : just dequeued a fiber : %p\n", fiber_to_schedule);
   FIBER_DEBUG("_rr_policy() : current fiber is %p and idle fiber is %p\n", _GET_FIBER_STATE()->curr_fiber,_GET_FIBER_STATE()->idle_fiber); 
@@ -199,9 +566,9 @@ static void _nk_fiber_exit(nk_fiber_t *f)
     // DEBUG: Prints out what fibers are in waitq and what the waitq size is
     //FIBER_DEBUG("_nk_fiber_exit() : In waitq loop. Temp is %p and size is %d\n", temp, waitq->size);
     
-    // if temp is a valid fiber, add it to a random sched queue
+    // if temp is a valid fiber, queue it here, where what it waited on just ran
     if (temp){
-      nk_fiber_run(temp, F_RAND_CPU);
+      nk_fiber_run(temp, F_CURR_CPU);
 
       // DEBUG: prints the number of fibers that temp is waiting on
       FIBER_DEBUG("_nk_fiber_exit() : restarting fiber %p on wait_queue %p\n", temp, waitq);
@@ -212,25 +579,25 @@ static void _nk_fiber_exit(nk_fiber_t *f)
   f->is_done = 1;
 
   // Picks fiber to switch to and updates fiber state
-  _LOCK_SCHED_QUEUE(state);
   next = _rr_policy();
   if (!(next)) {
     next = state->idle_fiber;
   }
   state->curr_fiber = next;
-  _UNLOCK_SCHED_QUEUE(state);
   
   // Unlock the fiber before free (in case we implement reaping)
   _UNLOCK_FIBER(f);
 
-  // Free the current fiber's memory (stack and fiber structure)
-  free(f->stack);
-  free(f);
+  // The current fiber's memory (stack and fiber structure) is freed once the
+  // switch is off its stack, since on this CPU a cached stack is soon reused,
+  // or left to whoever takes the last stale run queue slot that names it
+  state->switch_exited = f;
   
-  // Switch back to the idle fiber using special exit function
-  // Jumps to exit switch so we avoid pushing return addr to freed stack
-  __asm__ __volatile__ ("movq %0, %%rdi;"
-                        "jmp _nk_exit_switch;" : : "r"(next) : "memory");
+  // Switch to the next fiber; we never come back here
+  _nk_fiber_context_switch(next);
+
+  // Tells compiler this point is unreachable, stops compiler warning
+  __builtin_unreachable();
 }
 
 // Wrapper used to execute a fiber's routine
@@ -380,23 +747,13 @@ __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, f
     FIBER_INFO("_nk_fiber_yield_helper() : Switched to idle fiber on CPU %d\n", my_cpu_id());
   }*/
   
-  // Enqueue the current fiber (if it is not the idle fiber)
+  // Enqueue the current fiber (if it is not the idle fiber) once the
+  // context switch is off its stack, since another CPU may steal it
+  // as soon as it is queued
   if (!(f_from->is_idle)) {
-    // Gets the sched queue for the current CPU
-    _LOCK_SCHED_QUEUE(state);
-    struct list_head *fiber_sched_queue = &(state->f_sched_queue);
-     
     // DEBUG: Prints the fiber that's about to be enqueued
     FIBER_DEBUG("_nk_fiber_yield_helper() : About to enqueue fiber: %p \n", f_from);
-    
-    _LOCK_FIBER(f_from);
-    f_from->f_status = READY;
-    f_from->curr_cpu = my_cpu_id();
-    _UNLOCK_FIBER(f_from);
-
-    // Adds fiber we're switching away from to the current CPU's fiber queue
-    list_add_tail(&(f_from->sched_node), fiber_sched_queue);
-    _UNLOCK_SCHED_QUEUE(state);
+    state->switch_from = f_from;
   }
   // Begin context switch (register saving and stack switch)
   _nk_fiber_context_switch(f_to);
@@ -419,9 +776,7 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   f_from->rsp = rsp;
 
   // get next fiber to yield to
-  _LOCK_SCHED_QUEUE(state);
   nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
   if (!(f_to)) { 
     if (f_from->is_idle) {
       // Should never come from the idle fiber
@@ -446,6 +801,10 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   f_to->f_status = RUN;
   _UNLOCK_FIBER(f_to);
 
+  // f_from joins the wait queue of the fiber it waits on once the
+  // context switch is off its stack, since it may be run as soon as it has
+  state->switch_from = f_from;
+
   // Begin context switch (register saving and stack change)
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
   _nk_fiber_context_switch(f_to);
@@ -463,83 +822,179 @@ static void _nk_fiber_cleanup()
   _nk_fiber_exit(curr);
 }
 
-// returns a random number
-static inline uint64_t _get_random()
-{
-    uint64_t t;
-    nk_get_rand_bytes((uint8_t *)&t,sizeof(t));
-    return t;
-}
-
 // If needed, wakes up the fiber thread so fiber routines can be executed
 // Called in nk_fiber_run to ensure fibers placed on queues will be run ASAP.
+// The fiber thread says when it is asleep, so a waker that finds it awake
+// touches nothing but that flag
 static int _wake_fiber_thread(fiber_state *state)
 {
-  #if NAUT_CONFIG_FIBER_ENABLE_SLEEP
-  nk_thread_t *curr_thread = state->fiber_thread;
-  // Wake up fiber thread if it is sleeping (so it can schedule & run fibers)
-  if (curr_thread->timer) {
-    //DEBUG: Prints info whenever a fiber thread is awakened
-    FIBER_DEBUG("nk_fiber_run() : waking fiber thread\n");
-    FIBER_DEBUG("nk_fiber_run() : curr_thread = %p named %s, timer = %p named %s, cpu = %d \n", curr_thread, curr_thread->name, curr_thread->timer, curr_thread->timer->name, curr_thread->current_cpu);
-
-    // Cancel the timer for the desired fiber thread
-    nk_timer_cancel(curr_thread->timer);
+  #if NAUT_CONFIG_FIBER_ENABLE_SLEEP || NAUT_CONFIG_FIBER_ENABLE_WAIT
+  // our queueing must be visible before we look at the flag, as the sleeper
+  // sets the flag before it looks at its queues
+  __sync_synchronize();
+  if (state->sleeping) {
+    FIBER_DEBUG("nk_fiber_run() : waking fiber thread %p\n", state->fiber_thread);
+    nk_wait_queue_wake_one(state->waitq);
   }
   #endif
+  // NAUT_CONFIG_FIBER_ENABLE_SPIN case: No need to wake, so just return 0
+  return 0;
+}
+
+// Wakes cpu's fiber thread if it is asleep, so it can steal the work we have
+static int _wake_sleeper(int cpu, int level, void *s)
+{
+  fiber_state *state = per_cpu_get(system)->cpus[cpu]->f_state;
 
-  #if NAUT_CONFIG_FIBER_ENABLE_WAIT 
-  if (!(list_empty_careful(&(state->waitq->list)))) {
-    nk_wait_queue_wake_one_extended(state->waitq, 1);
+  if (state && state->sleeping) {
+    nk_wait_queue_wake_one(state->waitq);
+    return 1;
   }
-  #endif
-  // NAUT_CONFIG_FIBER_ENABLE_SPIN case: No need to wake, so just return 0
+
   return 0;
 }
 
-// Returns a random CPU's fiber thread
-static nk_thread_t *_get_random_fiber_thread()
+// Takes a fiber from cpu's run queue or inbox into *s
+static int _steal_from(int cpu, int level, void *s)
 {
-  // Picks a random CPU and returns that CPU's fiber thread
-  struct sys_info * sys = per_cpu_get(system);
-  int random_cpu = (int)(_get_random() % sys->num_cpus);
-  return sys->cpus[random_cpu]->f_state->fiber_thread;
+  fiber_state *victim = per_cpu_get(system)->cpus[cpu]->f_state;
+  nk_fiber_t **f = (nk_fiber_t **)s;
+
+  if (!victim) {
+    return 0;
+  }
+
+  *f = _take(victim);
+  if (!*f) {
+    *f = _inbox_take(victim);
+  }
+
+  return *f != NULL;
 }
 
-// Returns a random CPU's fiber state
-static fiber_state *_get_random_fiber_state()
+// Called by the idle fiber when this CPU has nothing to run. Takes a fiber
+// from the nearest CPU that has one to spare and queues it here.
+// returns 1 if it found one, 0 otherwise
+static int _steal(fiber_state *state)
 {
-  // Picks a random CPU and returns that CPU's fiber thread
-  struct sys_info * sys = per_cpu_get(system);
-  int random_cpu = (int)(_get_random() % sys->num_cpus);
-  return sys->cpus[random_cpu]->f_state;
+  nk_fiber_t *f = NULL;
+  uint8_t flags;
+
+  if (nk_sched_map_victims(_steal_from, &f) < 0) {
+    return 0;
+  }
+
+  FIBER_DEBUG("_steal() : took fiber %p from cpu %d\n", f, f->curr_cpu);
+
+  flags = irq_disable_save();
+  _enqueue_local(state, f);
+  irq_enable_restore(flags);
+
+  state->num_steals++;
+
+  return 1;
 }
 
-// Checks if to_del is on a sched queue (ready to be switched to)
+// Checks if to_del is on a sched queue (ready to be switched to), and if so claims it
 // returns -EINVAL if not ready, otherwise returns 0
 static int _check_yield_to(nk_fiber_t *to_del) {
-  _LOCK_FIBER(to_del);
-  // If the fiber isn't ready to switch to, indicate failure.
-  if (to_del->f_status != READY) {
-     FIBER_DEBUG("_check_yield_to() : to_del's status is %s\n", to_del->f_status);
-     _UNLOCK_FIBER(to_del);
-     return -EINVAL;
-  } else { /* The fiber is ready, so we will take it from its queue so we can use it */
-      // Gets the fiber state of the CPU of the target fiber
-      fiber_state *state = per_cpu_get(system)->cpus[to_del->curr_cpu]->f_state;
-      
-      // Prevents deadlock by avoiding lock if to_del is on own queue (would spin forever)
-      if (state == _GET_FIBER_STATE()) {
-        list_del_init(&(to_del->sched_node));
-        _UNLOCK_FIBER(to_del);
-      } else { 
+  int cpu = -1;
+  int rc = -EINVAL;
+
+  // queued must be read before curr_cpu, the reverse of the order they are written
+  switch (to_del->queued) {
+  case F_QUEUED_LOCAL:
+    // its slot goes stale, and whoever reaches it will skip it
+    if (__sync_bool_compare_and_swap(&to_del->queued, F_QUEUED_LOCAL, F_NOT_QUEUED)) {
+      rc = 0;
+    }
+    break;
+  case F_QUEUED_INBOX:
+    __asm__ __volatile__ ("" ::: "memory");
+    cpu = to_del->curr_cpu;
+    if (cpu >= 0 && cpu < per_cpu_get(system)->num_cpus) {
+      fiber_state *state = per_cpu_get(system)->cpus[cpu]->f_state;
       _LOCK_SCHED_QUEUE(state);
-      list_del_init(&(to_del->sched_node));
-      _UNLOCK_FIBER(to_del);
-      _UNLOCK_SCHED_QUEUE(state);
+      // it may have moved on before we got the lock
+      if (to_del->queued == F_QUEUED_INBOX && to_del->curr_cpu == cpu) {
+        list_del_init(&(to_del->sched_node));
+        to_del->queued = F_NOT_QUEUED;
+        rc = 0;
       }
-      return 0;
+      _UNLOCK_SCHED_QUEUE(state);
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (rc) {
+    FIBER_DEBUG("_check_yield_to() : fiber %p is not queued (status %d)\n", to_del, to_del->f_status);
+  }
+
+  return rc;
+}
+
+/*
+ * _nk_fiber_switch_finish
+ *
+ * Called from _nk_fiber_context_switch once it is running on the new
+ * fiber's stack, but before it has restored the new fiber's registers.
+ * Queues the fiber we switched away from (or puts it on the wait queue
+ * of the fiber it joined), which could not be done before the switch
+ * since it may then be run, here or elsewhere, while we are on its stack.
+ * Likewise, an exited fiber is only released here.
+ */
+void _nk_fiber_switch_finish()
+{
+  fiber_state *state = _GET_FIBER_STATE();
+  nk_fiber_t *f = state->switch_from;
+  nk_fiber_t *wait_on = state->switch_join;
+  uint8_t flags;
+
+  if (state->fiber_thread != get_cur_thread()) {
+    return;
+  }
+
+  if (state->switch_exited) {
+    // drop the reference the exited fiber held on itself
+    f = state->switch_exited;
+    state->switch_exited = NULL;
+    _fiber_put(f);
+    return;
+  }
+
+  if (!f) {
+    return;
   }
+
+  state->switch_from = NULL;
+  state->switch_join = NULL;
+
+#ifdef NAUT_CONFIG_FIBER_STACK_GUARD
+  if (!nk_stack_guard_intact(f->stack)) {
+    panic("Fiber %p has overrun its %lu byte stack %p\n", f, f->stack_size, f->stack);
+  }
+#endif
+
+  if (wait_on) {
+    _LOCK_FIBER(wait_on);
+    if (!(wait_on->is_done || wait_on->f_status == EXIT)) {
+      list_add_tail(&(f->wait_node), &(wait_on->wait_queue));
+      wait_on->num_wait++;
+      _UNLOCK_FIBER(wait_on);
+      // the reference nk_fiber_join() took kept wait_on from being freed until now
+      _fiber_put(wait_on);
+      return;
+    }
+    // it exited while we were switching away, so there is nothing to wait for
+    _UNLOCK_FIBER(wait_on);
+    _fiber_put(wait_on);
+  }
+
+  flags = irq_disable_save();
+  _enqueue_local(state, f);
+  irq_enable_restore(flags);
 }
 
 // sets up fiber state for current CPU
@@ -604,48 +1059,79 @@ int nk_fiber_init()
 }
 
 // Utility function used to determine if fiber thread should sleep or not
+// returns nonzero if there is a fiber to run on this CPU
 static int _check_empty(void *s) 
 {
   fiber_state *state = (fiber_state*)s;
-  return (!(list_empty(&(state->f_sched_queue)) && state->curr_fiber->is_idle));
+  return _queue_size(&(state->queue)) || !list_empty_careful(&(state->f_sched_queue));
+}
+
+#if NAUT_CONFIG_FIBER_ENABLE_SLEEP
+static int _check_timer(void *s)
+{
+  nk_timer_t *t = (nk_timer_t*)s;
+  return __sync_fetch_and_add(&t->state,0) == NK_TIMER_SIGNALLED;
+}
+#endif
+
+#if NAUT_CONFIG_FIBER_ENABLE_SLEEP || NAUT_CONFIG_FIBER_ENABLE_WAIT
+// Puts the fiber thread to sleep until a fiber is queued on this CPU,
+// another CPU wants us to steal from it, or (SLEEP) the sleep time elapses.
+static void _idle_sleep(fiber_state *state)
+{
+  FIBER_DEBUG("nk_fiber_idle() : fiber thread going to sleep\n");
+
+  // the flag must be visible before we look at the queues, as wakers
+  // queue before they look at the flag; the atomic add is a full fence
+  state->sleeping = 1;
+  __sync_fetch_and_add(&fiber_sleepers, 1);
+
+  #if NAUT_CONFIG_FIBER_ENABLE_SLEEP
+  nk_timer_t *t = nk_timer_get_thread_default();
+  if (!t ||
+      nk_timer_set(t, NAUT_CONFIG_FIBER_THREAD_SLEEP_TIME, NK_TIMER_WAIT_ONE, 0, 0, 0) ||
+      nk_timer_start(t)) {
+    ERROR("Cannot start sleep timer for fiber thread\n");
+  } else {
+    nk_wait_queue_t *queues[2] = { state->waitq, t->waitq };
+    int (*condchecks[2])(void *) = { _check_empty, _check_timer };
+    void *states[2] = { state, t };
+    nk_wait_queue_sleep_extended_multiple(2, queues, condchecks, states);
+    // our own timer, in case the queue woke us first
+    nk_timer_cancel(t);
+  }
+  #else
+  nk_wait_queue_sleep_extended(state->waitq, _check_empty, state);
+  #endif
+
+  __sync_fetch_and_sub(&fiber_sleepers, 1);
+  state->sleeping = 0;
+
+  FIBER_DEBUG("nk_fiber_idle() : fiber thread waking up\n");
 }
+#endif
 
-// The idle fiber has different behavior depending on those chosen Kconfig option.
+// The idle fiber runs whatever is queued on this CPU, and when there is nothing,
+// steals a fiber from the nearest CPU that has one. If there is nothing to steal
+// either, the fiber thread's behavior depends on those chosen Kconfig option.
 // SPIN: yields continuously (even if there are no fibers to yield to)
-// SLEEP: yields continuously, but will force fiber thread to sleep for set amt. of time if no fibers are avail.
-    // nk_fiber_run will wake up fiber_thread if a fiber is added to queue when it is sleeping
-// WAIT: yields continuously, but will put fiber thread onto wait queue if no fibers are available
-    // nk_fiber_run will wake up fiber_thread when a fiber is added to the queue
+// SLEEP: sleeps until a fiber is queued here, or for at most the set amt. of time
+// WAIT: puts fiber thread onto wait queue until a fiber is queued here
+    // nk_fiber_run will wake up fiber_thread when a fiber is added to the queue,
+    // and may wake a sleeping fiber thread nearby to steal it
 static void __nk_fiber_idle(void *in, void **out)
 {
-  while (1) {
-    // If we have fiber thread spin enabled
-    #ifdef NAUT_CONFIG_FIBER_ENABLE_SPIN
-    nk_fiber_yield();
-    #endif
+  fiber_state *state = _GET_FIBER_STATE();
 
-    // If we have fiber thread sleep enabled
-    #ifdef NAUT_CONFIG_FIBER_ENABLE_SLEEP  
-    nk_fiber_yield();
-    if (list_empty_careful(_GET_SCHED_HEAD())){
-      FIBER_DEBUG("nk_fiber_idle() : fiber thread going to sleep\n");
-      nk_sleep(NAUT_CONFIG_FIBER_THREAD_SLEEP_TIME);
-      FIBER_DEBUG("nk_fiber-idle() : fiber thread waking up\n");
+  while (1) {
+    // returns 1 at once when there is nothing to run here
+    if (nk_fiber_yield() != 1 || _steal(state)) {
+      continue;
     }
+
+    #if NAUT_CONFIG_FIBER_ENABLE_SLEEP || NAUT_CONFIG_FIBER_ENABLE_WAIT
+    _idle_sleep(state);
     #endif
-    
-    // If we have fiber thread wait enabled
-    // Instead of sleep, have thread sleep on per cpu fiber state wait queue
-    // wakes up when nk_fiber_run is called
-    #ifdef NAUT_CONFIG_FIBER_ENABLE_WAIT
-    nk_fiber_yield();
-    fiber_state *state = _GET_FIBER_STATE();
-    if (!(_check_empty((void*)state))){
-      FIBER_DEBUG("nk_fiber_idle() : fiber thread waiting on more fibers\n");
-      nk_wait_queue_sleep_extended(state->waitq, _check_empty, state);
-      FIBER_DEBUG("nk_fiber-idle() : fiber thread waking up\n");
-    }
-    #endif 
   }
 }
 
@@ -756,10 +1242,18 @@ static void _debug_yield(nk_fiber_t *f_to)
     FIBER_DEBUG("nk_fiber_yield() : The fiber picked to schedule is %p\n", f_to); 
   
     //DEBUG: Will print out the fiber queue for this CPU's fiber thread
+    // (racy, since other CPUs may be taking from it)
+    fiber_queue *q = &(_GET_FIBER_STATE()->queue);
+    sint64_t i;
+    for (i = q->head; i < q->tail; i++) {
+      nk_fiber_t *f_slot = q->fibers[i & (FIBER_QUEUE_SIZE-1)];
+      FIBER_DEBUG("nk_fiber_yield() : The fiber queue contains fiber: %p%s\n", f_slot,
+                  f_slot->queued == F_QUEUED_LOCAL ? "" : " (stale)");
+    }
     nk_fiber_t *f_iter = NULL;
     struct list_head *f_sched = _GET_SCHED_HEAD();
     list_for_each_entry(f_iter, f_sched, sched_node){
-      FIBER_DEBUG("nk_fiber_yield() : The fiber queue contains fiber: %p\n", f_iter);
+      FIBER_DEBUG("nk_fiber_yield() : The fiber inbox contains fiber: %p\n", f_iter);
     }
     //DEBUG: Will indicate when fiber queue is done printing (to indicate whether queue is finite)
     FIBER_DEBUG("nk_fiber_yield() : Done printing out the fiber queue.\n");
@@ -837,36 +1331,24 @@ int nk_fiber_create(nk_fiber_fun_t fun,
   nk_fiber_t *fiber = NULL;
 
   // Get stack size
-  nk_stack_size_t required_stack_size = stack_size ? stack_size: FSTACK_16KB;
+  nk_stack_size_t required_stack_size = stack_size ? stack_size: FIBER_DEFAULT_STACK_SIZE;
 
-  // Allocate space for a fiber
-  fiber = malloc(sizeof(nk_fiber_t));
+  // Allocate a zeroed fiber and its stack (possibly rounding up the stack size)
+  fiber = _fiber_alloc(required_stack_size);
 
-  // Check if malloc for nk_fiber_t struct failed
+  // Check if allocation failed
   if (!fiber) {
     // Print error here
     return -EINVAL;
   }
-
-  // Initialize the whole struct with zeros
-  memset(fiber, 0, sizeof(nk_fiber_t));
   
   // Set fiber status to init
   fiber->f_status = INIT;
- 
-  // Set stack size
-  fiber->stack_size = required_stack_size;
- 
-  // Allocate stack space
-  fiber->stack = (void*) malloc(required_stack_size);
-
-  // Check if malloc for the stack failed
-  if (!fiber->stack){
-    // Free the previously allocated nk_fiber_t
-    free(fiber);
-    return -EINVAL;
-  }
 
+  // The fiber holds a reference on itself until it exits
+  fiber->queued = F_NOT_QUEUED;
+  fiber->refs = 1;
+ 
   // Initialize function, input, and output related to the fiber
   fiber->fun = fun;
   fiber->input = input;
@@ -907,7 +1389,9 @@ int nk_fiber_create(nk_fiber_fun_t fun,
  *
  * @f: the fiber to add to the sched queue
  * @target_cpu: which CPU to start the fiber on. F_CURR_CPU => run on current CPU,
- *              F_RAND_CPU => run on random CPU. 
+ *              F_RAND_CPU => run on any CPU. The fiber is queued on the current
+ *              CPU, where it may share a cache with its creator, and a sleeping
+ *              fiber thread nearby is woken to steal it if this CPU is busy.
  *
  * on error (invalid target_cpu), returns -EINVAL, otherwise 0.
  */
@@ -916,46 +1400,49 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
   // system info gathered
   struct sys_info * sys = per_cpu_get(system);
   int num_cpus = sys->num_cpus;
-  int t_cpu = 0;
+  fiber_state *state;
+  int busy = 0;
+  uint8_t flags;
  
-  // by default, the state is set to the current cpu's fiber state
-  // This means we only have to update state if target_cpu != F_CURR_CPU (3 cases)
-  fiber_state *state = _GET_FIBER_STATE();
-
   // Check to see if target_cpu is sane 
-  if (target_cpu < F_RAND_CPU || target_cpu > num_cpus) {
+  if (target_cpu < F_RAND_CPU || target_cpu >= num_cpus) {
     // If target_cpu is insane, return an error
     return  -EINVAL;
-  } else if (target_cpu > F_CURR_CPU) { /* if value is greater than -1, must be specific CPU */
-      //state is is set to the f_state of target_cpu
-      state = sys->cpus[target_cpu]->f_state;
-  } else if(target_cpu == F_RAND_CPU) { /* RAND and CURR are only choices left */
-      // Random fiber state selected
-      state = _get_random_fiber_state();
-  } /* if target_cpu != RAND, then it must be CURR. Fiber state is already set to CURR CPU by default */
-
-  // t_cpu is updated to the cpu number of the selected state 
-  t_cpu = state->fiber_thread->current_cpu;
- 
-  //DEBUG: Prints the fiber that is about to be enqueued and the CPU it will be enqueued on
-  FIBER_DEBUG("nk_fiber_run() : about to enqueue a fiber: %p on cpu: %d\n", f, state->fiber_thread->current_cpu); 
-  
-  // Lock the fiber, change it's curr cpu, and change status to ready (since we are about to queue it)
-  _LOCK_FIBER(f);
-  f->curr_cpu = t_cpu;
-  f->f_status = READY;
-  
-  // Lock the CPU fiber state and enqueue the fiber into sched queue 
-  _LOCK_SCHED_QUEUE(state);
-  list_add_tail(&(f->sched_node), &(state->f_sched_queue));
-  
-  // Unlock CPU fiber state and f
-  _UNLOCK_SCHED_QUEUE(state);
-  _UNLOCK_FIBER(f);
+  }
+
+  // we must stay on this CPU to push on its run queue
+  flags = irq_disable_save();
+
+  if (target_cpu >= 0 && target_cpu != my_cpu_id()) {
+    // another CPU's run queue is pushed only by that CPU, so use its inbox
+    state = sys->cpus[target_cpu]->f_state;
+    
+    //DEBUG: Prints the fiber that is about to be enqueued and the CPU it will be enqueued on
+    FIBER_DEBUG("nk_fiber_run() : about to enqueue a fiber: %p in inbox of cpu: %d\n", f, target_cpu); 
+
+    _enqueue_inbox(state, target_cpu, f);
+  } else {
+    state = _GET_FIBER_STATE();
+    
+    //DEBUG: Prints the fiber that is about to be enqueued and the CPU it will be enqueued on
+    FIBER_DEBUG("nk_fiber_run() : about to enqueue a fiber: %p on cpu: %d\n", f, my_cpu_id()); 
+
+    _enqueue_local(state, f);
+
+    // if our fiber thread will not get to f right away, someone else should
+    busy = target_cpu == F_RAND_CPU &&
+           (_queue_size(&(state->queue)) > 1 || !state->curr_fiber || !state->curr_fiber->is_idle);
+  }
+
+  irq_enable_restore(flags);
  
   // Wake up fiber thread for selected CPU (or do nothing if it is already awake)
   _wake_fiber_thread(state); 
 
+  if (busy && fiber_sleepers) {
+    nk_sched_map_victims(_wake_sleeper, 0);
+  }
+
   return 0;
 }
 
@@ -969,7 +1456,7 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
  * @output: where the fiber should store its output
  * @stack_size: size of the fiber's stack. 0 => let us decide
  * @target_cpu: which CPU to start the fiber on. F_CURR_CPU => run on current CPU,
- *              F_RAND_CPU => run on random CPU. 
+ *              F_RAND_CPU => run on any CPU (see nk_fiber_run). 
  * @fiber_output: Holds the pointer to the fiber pointer once it is created 
  *
  *
@@ -1027,11 +1514,8 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
     _nk_fiber_context_switch(curr_fiber);
   }
   
-  // Pick a random fiber to yield to (NULL if no fiber in queue)
-
-  _LOCK_SCHED_QUEUE(state);
+  // Pick the next fiber to yield to (NULL if no fiber in queue)
   nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
   
   #if NAUT_CONFIG_DEBUG_FIBERS
   //_debug_yield(f_to);
@@ -1086,17 +1570,14 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   curr_fiber->fpu_state_offset = offset;
   #endif
 
-  // Locks fiber state
-  _LOCK_SCHED_QUEUE(state);
-  // Remove f_to from its respective fiber queue (need to check all CPUs)
-  // This is currently not safe, fiber may be running and therefore not in sched queue
+  // Claim f_to from whichever CPU's queue it is on
+  // This fails if it is running, waiting, or was claimed by someone else first
   if (_check_yield_to(f_to) < 0){
     //DEBUG: Will indicate whether the fiber we're attempting to yield to was not found
     FIBER_DEBUG("nk_fiber_yield_to() : Failed to find fiber in queues :(\n");
     
     // If early ret flag is set, we will indicate failure instead of yielding to random fiber
     if (earlyRetFlag) {
-      _UNLOCK_SCHED_QUEUE(state);
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1;
       _nk_fiber_context_switch(curr_fiber);
       FIBER_DEBUG("nk_fiber_yield_to() : early ret flag set, returning early\n");
@@ -1104,7 +1585,6 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
     
     // early ret flag not set, so we find a random fiber to yield to instead
     nk_fiber_t *new_to = _rr_policy();
-    _UNLOCK_SCHED_QUEUE(state);
     
     // Checks to see if we received a valid fiber from _rr_policy (NULL = no fibers to schedule)
     if (!(new_to)) { 
@@ -1122,7 +1602,6 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   }
 
   // Use utility function to perform rest of yield 
-  _UNLOCK_SCHED_QUEUE(state);
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
   _nk_fiber_yield_helper(f_to, state, curr_fiber);
 }
@@ -1195,20 +1674,18 @@ int nk_fiber_join(nk_fiber_t *wait_on)
   // DEBUG: Prints out our intent to add curr_fiber to wait_on's wait queue
   FIBER_DEBUG("nk_fiber_join() : about to enqueue fiber %p on the wait queue %p\n", curr_fiber, &(wait_on->wait_queue));
 
-  // Adds curr_fiber to wait_on's wait queue
+  // Checks that wait_on is still running
   _LOCK_FIBER(wait_on);
   if (wait_on->is_done || wait_on->f_status == EXIT){
     FIBER_INFO("nk_fiber_join() : tried to join a thread which is finshed or exiting\n");
     _UNLOCK_FIBER(wait_on);
     return -1;
   }
-  // Change wait_on's curr CPU since it will no longer be associated with one
-  wait_on->curr_cpu = -1;
 
-  // Adding curr_fiber to wait_on's wait queue
-  struct list_head *wait_q = &(wait_on->wait_queue);
-  list_add_tail(&(curr_fiber->wait_node), wait_q);
-  wait_on->num_wait++;
+  // curr_fiber is added to wait_on's wait queue once we have switched away
+  // from it (see _nk_fiber_switch_finish), and wait_on must last until then
+  __sync_fetch_and_add(&wait_on->refs, 1);
+  _GET_FIBER_STATE()->switch_join = wait_on;
 
   // Update status of curr_fiber and yield
   curr_fiber->f_status = WAIT;
@@ -1287,7 +1764,7 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
   FIBER_DEBUG("__nk_fiber_fork() : rbp_stash_addr: %p, rbp1_offset_from_ret0: %p, rbp_stash_offset: %p, rbp_offset_from: %p\n", rbp_stash_addr, rbp1_offset_from_ret0_addr, rbp_stash_offset_from_ret0_addr, rbp_offset_from_ret0_addr);
    
   // Allocate new fiber struct using current fiber's data
-  nk_fiber_t *new;
+  nk_fiber_t *new = NULL;
   nk_fiber_create(NULL, NULL, 0, alloc_size, &new);
   if (!new) {
     //panic("__nk_fiber_fork() : could not allocate new fiber. Fork failed.\n");
@@ -1369,8 +1846,7 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
 
   // Add the forked fiber to the sched queue
   if (nk_fiber_run(new, state->fork_cpu) < 0) {
-    free(new->stack);
-    free(new);
+    _fiber_free(new);
     return (nk_fiber_t*)-1;
   } 
 
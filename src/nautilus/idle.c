@@ -96,6 +96,14 @@ idle (void * in, void ** out)
 	    preempt_enable();
 	}
 #endif
+
+#if NAUT_CONFIG_REAP_IN_IDLE
+	nk_sched_reap_local();
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+	nk_thread_stack_pool_refill();
+#endif
 	    
 
         nk_yield();
@@ -482,6 +482,12 @@ setup_idt (void)
     }
 #endif
 
+#ifdef NAUT_CONFIG_LAZY_FPU_SAVE
+    // this bypasses the common exception path entirely
+    extern void nk_fpu_lazy_restore(void);
+    set_intr_gate(idt64, NM_EXCP, (void*)nk_fpu_lazy_restore);
+#endif
+
 #if defined(NAUT_CONFIG_ENABLE_MONITOR) || defined(NAUT_CONFIG_WATCHDOG)
     if (idt_assign_entry(NMI_INT, (ulong_t)nmi_handler, 0) < 0) {
         ERROR_PRINT("Couldn't assign NMI handler\n");
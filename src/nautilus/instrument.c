@@ -32,6 +32,10 @@
 #include <nautilus/irq.h>
 
 #include <nautilus/instrument.h>
+#include <nautilus/thread.h>
+#include <nautilus/backtrace.h>
+#include <nautilus/vc.h>
+#include <dev/serial.h>
 
 
 #define INFO(fmt, args...) INFO_PRINT("instrument: " fmt, ##args)
@@ -227,6 +231,9 @@ void
 nk_instrument_init (void) 
 {
     nk_instrument_clear();
+#ifdef NAUT_CONFIG_HEAP_PROFILE
+    nk_heap_profile_init();
+#endif
     INFO("inited\n");
 }
 
@@ -534,6 +541,385 @@ nk_instrument_calibrate (unsigned loops)
 }
 
 
+#ifdef NAUT_CONFIG_HEAP_PROFILE
+
+/*
+ * Sampling heap profiler
+ *
+ * On average one in every HEAP_PROFILE_RATE allocations (the interval
+ * is drawn uniformly from [1, 2*rate-1] so that periodic allocation
+ * patterns do not alias with it) we walk the frame pointers to get
+ * the allocation's call stack, and charge the allocation to that
+ * stack's entry in the current CPU's callsite table.  Only the
+ * owning CPU adds entries or updates the allocation counts, with 
+ * interrupts off; the live counts are also decremented by frees on
+ * other CPUs, and so are updated atomically.
+ *
+ * Sampled objects are remembered in a global table keyed by address
+ * and organized in groups of HP_LIVE_WAYS slots that share a cache 
+ * line, so that a free can tell whether its object was sampled by 
+ * looking at one line.   An object whose group is full is simply not 
+ * sampled.
+ *
+ * The profile is dumped in the legacy text format of pprof's heap
+ * profiles, with counts scaled up by the sampling rate.
+ */
+
+#define HP_MAX_DEPTH   16
+#define HP_SITES       1024                 // per cpu, power of two
+#define HP_LIVE_WAYS   8                    // slots per group
+#define HP_LIVE_SLOTS  (HP_LIVE_WAYS*8192)
+
+struct hp_site {
+    uint64_t          hash;                 // 0 => unused
+    uint32_t          depth;
+    void             *pc[HP_MAX_DEPTH];
+    uint64_t          alloc_count;
+    uint64_t          alloc_bytes;
+    volatile uint64_t live_count;
+    volatile uint64_t live_bytes;
+};
+
+struct hp_cpu {
+    uint64_t        countdown;
+    uint64_t        rand;
+    uint64_t        dropped;                // samples not recorded
+    struct hp_site  sites[HP_SITES];
+};
+
+struct hp_live {
+    struct hp_site *site;
+    uint64_t        size;
+};
+
+static volatile int      hp_active = 0;
+static uint64_t          hp_rate = NAUT_CONFIG_HEAP_PROFILE_RATE;
+static volatile uint64_t hp_num_live = 0;
+static struct hp_cpu    *hp_cpus[NAUT_CONFIG_MAX_CPUS];
+static volatile addr_t  *hp_live_keys;
+static struct hp_live   *hp_live_vals;
+
+static inline uint64_t hp_hash64 (uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline uint64_t hp_next_countdown (struct hp_cpu *c)
+{
+    // xorshift64
+    c->rand ^= c->rand << 13;
+    c->rand ^= c->rand >> 7;
+    c->rand ^= c->rand << 17;
+
+    return hp_rate <= 1 ? 1 : 1 + c->rand % (2*hp_rate - 1);
+}
+
+// walk the frame pointers of the current stack, skipping our own frame
+static int hp_backtrace (void **pc)
+{
+    struct nk_thread *t = get_cur_thread();
+    void **fp = __builtin_frame_address(0);
+    void **next;
+    addr_t lo = 0, hi = -1UL;
+    int n = 0;
+
+    if (t && t->stack && (addr_t)fp >= (addr_t)t->stack && (addr_t)fp < (addr_t)t->stack + t->stack_size) {
+	lo = (addr_t)t->stack;
+	hi = (addr_t)t->stack + t->stack_size;
+    }
+
+    while (n < HP_MAX_DEPTH && fp && !((addr_t)fp & 7) && 
+	   (addr_t)fp >= lo && (addr_t)fp + 16 <= hi && IS_CANONICAL(fp)) {
+	if (!IS_VALID(fp[1])) {
+	    break;
+	}
+	pc[n++] = fp[1];
+	next = (void **)fp[0];
+	if (next <= fp) {
+	    break;
+	}
+	fp = next;
+    }
+
+    return n;
+}
+
+static struct hp_site *hp_find_site (struct hp_cpu *c, void **pc, int depth)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    uint64_t i, j;
+    int k;
+
+    for (k = 0; k < depth; k++) {
+	h = hp_hash64(h ^ (uint64_t)pc[k]);
+    }
+    h |= 1;   // never 0
+
+    for (i = 0; i < HP_SITES; i++) {
+	struct hp_site *s = &c->sites[(h + i) & (HP_SITES - 1)];
+
+	if (!s->hash) {
+	    s->depth = depth;
+	    for (j = 0; j < depth; j++) {
+		s->pc[j] = pc[j];
+	    }
+	    s->hash = h;
+	    return s;
+	}
+
+	if (s->hash == h && s->depth == depth && !memcmp(s->pc, pc, depth*sizeof(void*))) {
+	    return s;
+	}
+    }
+
+    return NULL;
+}
+
+static int hp_live_insert (void *ptr, struct hp_site *site, uint64_t size)
+{
+    uint64_t g = (hp_hash64((addr_t)ptr) % (HP_LIVE_SLOTS / HP_LIVE_WAYS)) * HP_LIVE_WAYS;
+    int i;
+
+    for (i = 0; i < HP_LIVE_WAYS; i++) {
+	if (!hp_live_keys[g+i] && __sync_bool_compare_and_swap(&hp_live_keys[g+i], 0, (addr_t)ptr)) {
+	    hp_live_vals[g+i].site = site;
+	    hp_live_vals[g+i].size = size;
+	    __sync_fetch_and_add(&hp_num_live, 1);
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+
+void nk_heap_profile_alloc (void *ptr, size_t size)
+{
+    struct hp_cpu *c;
+    struct hp_site *site;
+    void *pc[HP_MAX_DEPTH];
+    uint8_t flags;
+    int depth;
+
+    if (!hp_active || !ptr) {
+	return;
+    }
+
+    flags = irq_disable_save();
+
+    c = hp_cpus[my_cpu_id()];
+
+    if (!c || --c->countdown) {
+	irq_enable_restore(flags);
+	return;
+    }
+
+    c->countdown = hp_next_countdown(c);
+
+    depth = hp_backtrace(pc);
+
+    if (!(site = hp_find_site(c, pc, depth)) || hp_live_insert(ptr, site, size)) {
+	c->dropped++;
+	irq_enable_restore(flags);
+	return;
+    }
+
+    site->alloc_count++;
+    site->alloc_bytes += size;
+    __sync_fetch_and_add(&site->live_count, 1);
+    __sync_fetch_and_add(&site->live_bytes, size);
+
+    irq_enable_restore(flags);
+}
+
+
+void nk_heap_profile_free (void *ptr)
+{
+    uint64_t g;
+    int i;
+
+    if (!hp_num_live) {
+	return;
+    }
+
+    g = (hp_hash64((addr_t)ptr) % (HP_LIVE_SLOTS / HP_LIVE_WAYS)) * HP_LIVE_WAYS;
+
+    for (i = 0; i < HP_LIVE_WAYS; i++) {
+	if (hp_live_keys[g+i] == (addr_t)ptr) {
+	    struct hp_live v = hp_live_vals[g+i];
+	    // an object can only be freed once, so the slot is ours
+	    hp_live_keys[g+i] = 0;
+	    __sync_fetch_and_sub(&v.site->live_count, 1);
+	    __sync_fetch_and_sub(&v.site->live_bytes, v.size);
+	    __sync_fetch_and_sub(&hp_num_live, 1);
+	    return;
+	}
+    }
+}
+
+
+void nk_heap_profile_init (void)
+{
+    int i;
+
+    // the profiler's own tables are allocated before it is active
+    hp_live_keys = malloc(HP_LIVE_SLOTS*sizeof(addr_t));
+    hp_live_vals = malloc(HP_LIVE_SLOTS*sizeof(struct hp_live));
+
+    if (!hp_live_keys || !hp_live_vals) {
+	ERROR("Cannot allocate heap profiler live object table\n");
+	return;
+    }
+
+    memset((void*)hp_live_keys, 0, HP_LIVE_SLOTS*sizeof(addr_t));
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+	if (!(hp_cpus[i] = malloc(sizeof(struct hp_cpu)))) {
+	    ERROR("Cannot allocate heap profiler state for cpu %d\n", i);
+	    return;
+	}
+	memset(hp_cpus[i], 0, sizeof(struct hp_cpu));
+	hp_cpus[i]->rand = hp_hash64(i + 1);
+	hp_cpus[i]->countdown = hp_next_countdown(hp_cpus[i]);
+    }
+
+    hp_active = 1;
+
+    INFO("heap profiler sampling 1 in %lu allocations\n", hp_rate);
+}
+
+
+typedef void (*hp_print_t)(const char *fmt, ...);
+
+static void hp_dump (hp_print_t print)
+{
+    extern addr_t _loadStart;
+    extern addr_t _bssEnd;
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    uint64_t i, j, dropped = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+	struct hp_cpu *c = hp_cpus[cpu];
+	if (!c) {
+	    continue;
+	}
+	dropped += c->dropped;
+	for (i = 0; i < HP_SITES; i++) {
+	    struct hp_site *s = &c->sites[i];
+	    if (s->hash) {
+		live_count += s->live_count;
+		live_bytes += s->live_bytes;
+		alloc_count += s->alloc_count;
+		alloc_bytes += s->alloc_bytes;
+	    }
+	}
+    }
+
+    print("heap profile: %lu: %lu [%lu: %lu] @ heap\n",
+	  live_count*hp_rate, live_bytes*hp_rate, alloc_count*hp_rate, alloc_bytes*hp_rate);
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+	struct hp_cpu *c = hp_cpus[cpu];
+	if (!c) {
+	    continue;
+	}
+	for (i = 0; i < HP_SITES; i++) {
+	    struct hp_site *s = &c->sites[i];
+	    if (!s->hash) {
+		continue;
+	    }
+	    print("%lu: %lu [%lu: %lu] @",
+		  s->live_count*hp_rate, s->live_bytes*hp_rate, 
+		  s->alloc_count*hp_rate, s->alloc_bytes*hp_rate);
+	    for (j = 0; j < s->depth; j++) {
+		print(" %p", s->pc[j]);
+	    }
+	    print("\n");
+	}
+    }
+
+    print("\nMAPPED_LIBRARIES:\n");
+    print("%016lx-%016lx r-xp 00000000 00:00 0 nautilus.bin\n", (addr_t)&_loadStart, (addr_t)&_bssEnd);
+
+    if (dropped) {
+	ERROR("heap profiler dropped %lu samples (tables full)\n", dropped);
+    }
+}
+
+
+static void hp_vc_print (const char *fmt, ...)
+{
+    va_list ap;
+    char buf[256];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    nk_vc_printf("%s", buf);
+}
+
+static void hp_serial_print (const char *fmt, ...)
+{
+    va_list ap;
+    char buf[256];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    serial_print("%s", buf);
+}
+
+
+static int
+handle_heapprof (char * buf, void * priv)
+{
+    char what[32];
+    uint64_t rate;
+
+    if (sscanf(buf, "heapprof rate %lu", &rate) == 1) {
+	hp_rate = rate ? rate : 1;
+	nk_vc_printf("sampling 1 in %lu allocations\n", hp_rate);
+	return 0;
+    }
+
+    if (sscanf(buf, "heapprof %31s", what) != 1) {
+	nk_vc_printf("heap profiler is %s, sampling 1 in %lu allocations, %lu live samples\n",
+		     hp_active ? "on" : "off", hp_rate, hp_num_live);
+	return 0;
+    }
+
+    if (!strcmp(what, "on")) {
+	hp_active = hp_live_keys != 0;
+    } else if (!strcmp(what, "off")) {
+	hp_active = 0;
+    } else if (!strcmp(what, "dump")) {
+	hp_dump(hp_vc_print);
+    } else if (!strcmp(what, "serial")) {
+	hp_dump(hp_serial_print);
+    } else {
+	nk_vc_printf("unknown heapprof request\n");
+    }
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl heapprof_impl = {
+    .cmd      = "heapprof",
+    .help_str = "heapprof [on|off|dump|serial|rate n]",
+    .handler  = handle_heapprof,
+};
+nk_register_shell_cmd(heapprof_impl);
+
+#endif /* NAUT_CONFIG_HEAP_PROFILE */
+
+
 static int
 handle_shell_instr (char * buf, void * priv)
 {
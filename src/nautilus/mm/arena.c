@@ -0,0 +1,356 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/arena.h>
+#include <nautilus/numa.h>
+#include <nautilus/list.h>
+#include <nautilus/spinlock.h>
+
+#ifndef NAUT_CONFIG_DEBUG_KMEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ARENA_DEBUG(fmt, args...) DEBUG_PRINT("ARENA: " fmt, ##args)
+#define ARENA_ERROR(fmt, args...) ERROR_PRINT("ARENA: " fmt, ##args)
+
+#define ARENA_DEFAULT_ALIGN 16
+
+/*
+ * Chunks and large allocations are both extents, tracked by these
+ * descriptors so that the extents themselves stay fully usable and
+ * keep their alignment.   The current chunk is the first on the list.
+ */
+struct arena_extent {
+    struct list_head node;
+    void            *addr;
+    size_t           size;
+};
+
+struct nk_arena {
+    spinlock_t       lock;
+    char             name[32];
+
+    size_t           chunk_size;
+    size_t           chunk_align;
+    int              cpu;          // -1 => cpu doing the allocation
+
+    struct list_head chunks;
+    struct list_head large;
+
+    addr_t           cur;          // bump pointer within the current chunk
+    addr_t           end;
+
+    uint64_t         num_chunks;
+    uint64_t         num_large;
+    uint64_t         large_bytes;
+    uint64_t         used_bytes;
+};
+
+
+static inline addr_t align_up(addr_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static int domain_cpu(int domain)
+{
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+	if (sys->cpus[i]->domain && sys->cpus[i]->domain->id == domain) {
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+static struct arena_extent *extent_alloc(struct nk_arena *a, size_t size, size_t align)
+{
+    struct arena_extent *e = malloc(sizeof(*e));
+
+    if (!e) {
+	ARENA_ERROR("Cannot allocate extent descriptor for arena %s\n", a->name);
+	return NULL;
+    }
+
+    e->size = (size + KMEM_PAGE_SIZE - 1) & ~(KMEM_PAGE_SIZE - 1);
+    e->addr = kmem_malloc_extent(e->size, align, a->cpu, 0);
+
+    if (!e->addr) {
+	ARENA_ERROR("Cannot allocate %lu bytes for arena %s\n", e->size, a->name);
+	free(e);
+	return NULL;
+    }
+
+    return e;
+}
+
+static void extent_free(struct arena_extent *e)
+{
+    kmem_free_extent(e->addr, e->size);
+    free(e);
+}
+
+static void extent_free_list(struct list_head *list)
+{
+    struct arena_extent *e, *n;
+
+    list_for_each_entry_safe(e, n, list, node) {
+	list_del(&e->node);
+	extent_free(e);
+    }
+}
+
+
+struct nk_arena *
+nk_arena_create (char *name, size_t chunk_size, nk_arena_place_t place, int where)
+{
+    struct nk_arena *a;
+    int cpu;
+
+    switch (place) {
+    case NK_ARENA_LOCAL:
+	cpu = -1;
+	break;
+    case NK_ARENA_CPU:
+	cpu = where;
+	if (cpu < 0 || cpu >= nk_get_num_cpus()) {
+	    ARENA_ERROR("Invalid cpu %d for arena %s\n", where, name);
+	    return NULL;
+	}
+	break;
+    case NK_ARENA_DOMAIN:
+	cpu = domain_cpu(where);
+	if (cpu < 0) {
+	    ARENA_ERROR("No cpu in domain %d for arena %s\n", where, name);
+	    return NULL;
+	}
+	break;
+    default:
+	ARENA_ERROR("Invalid placement %d for arena %s\n", place, name);
+	return NULL;
+    }
+
+    a = malloc(sizeof(*a));
+
+    if (!a) {
+	ARENA_ERROR("Cannot allocate arena %s\n", name);
+	return NULL;
+    }
+
+    memset(a, 0, sizeof(*a));
+
+    spinlock_init(&a->lock);
+    strncpy(a->name, name ? name : "(anon)", sizeof(a->name) - 1);
+    INIT_LIST_HEAD(&a->chunks);
+    INIT_LIST_HEAD(&a->large);
+
+    if (!chunk_size) {
+	chunk_size = NK_ARENA_CHUNK_2MB;
+    }
+
+    a->chunk_size = align_up(chunk_size, NK_ARENA_CHUNK_2MB);
+    a->chunk_align = a->chunk_size >= NK_ARENA_CHUNK_1GB ? NK_ARENA_CHUNK_1GB : NK_ARENA_CHUNK_2MB;
+    a->cpu = cpu;
+
+    ARENA_DEBUG("Created arena %s chunk size %lu align %lu cpu %d\n",
+		a->name, a->chunk_size, a->chunk_align, a->cpu);
+
+    return a;
+}
+
+
+void
+nk_arena_destroy (struct nk_arena *a)
+{
+    extent_free_list(&a->large);
+    extent_free_list(&a->chunks);
+    free(a);
+}
+
+
+static void *alloc_large(struct nk_arena *a, size_t size, size_t align)
+{
+    struct arena_extent *e;
+    uint8_t flags;
+
+    // back the allocation with the largest pages it can use
+    if (size >= NK_ARENA_CHUNK_1GB && align < NK_ARENA_CHUNK_1GB) {
+	align = NK_ARENA_CHUNK_1GB;
+    } else if (size >= NK_ARENA_CHUNK_2MB && align < NK_ARENA_CHUNK_2MB) {
+	align = NK_ARENA_CHUNK_2MB;
+    }
+
+    if (!(e = extent_alloc(a, size, align))) {
+	return NULL;
+    }
+
+    flags = spin_lock_irq_save(&a->lock);
+    list_add(&e->node, &a->large);
+    a->num_large++;
+    a->large_bytes += e->size;
+    spin_unlock_irq_restore(&a->lock, flags);
+
+    ARENA_DEBUG("Arena %s large allocation %p (%lu bytes)\n", a->name, e->addr, e->size);
+
+    return e->addr;
+}
+
+
+void *
+nk_arena_alloc (struct nk_arena *a, size_t size, size_t align)
+{
+    struct arena_extent *e;
+    uint8_t flags;
+    addr_t p;
+
+    if (!align) {
+	align = ARENA_DEFAULT_ALIGN;
+    }
+
+    if (align & (align - 1)) {
+	ARENA_ERROR("Invalid alignment %lu for arena %s\n", align, a->name);
+	return NULL;
+    }
+
+    if (!size) {
+	size = 1;
+    }
+
+    if (size > a->chunk_size / NK_ARENA_LARGE_FRAC || align > a->chunk_align) {
+	return alloc_large(a, size, align);
+    }
+
+    flags = spin_lock_irq_save(&a->lock);
+
+    while ((p = align_up(a->cur, align)) + size > a->end) {
+	// we need a new chunk, which we cannot get with the lock held
+	spin_unlock_irq_restore(&a->lock, flags);
+
+	if (!(e = extent_alloc(a, a->chunk_size, a->chunk_align))) {
+	    return NULL;
+	}
+
+	flags = spin_lock_irq_save(&a->lock);
+
+	// whatever is left of the current chunk is abandoned until reset
+	list_add(&e->node, &a->chunks);
+	a->num_chunks++;
+	a->cur = (addr_t)e->addr;
+	a->end = a->cur + e->size;
+    }
+
+    a->used_bytes += p + size - a->cur;
+    a->cur = p + size;
+
+    spin_unlock_irq_restore(&a->lock, flags);
+
+    return (void *)p;
+}
+
+
+void
+nk_arena_free (struct nk_arena *a, void *ptr)
+{
+    struct arena_extent *e, *found = NULL;
+    uint8_t flags;
+
+    if (!ptr) {
+	return;
+    }
+
+    flags = spin_lock_irq_save(&a->lock);
+
+    list_for_each_entry(e, &a->large, node) {
+	if (e->addr == ptr) {
+	    found = e;
+	    list_del(&e->node);
+	    a->num_large--;
+	    a->large_bytes -= e->size;
+	    break;
+	}
+    }
+
+    spin_unlock_irq_restore(&a->lock, flags);
+
+    if (found) {
+	ARENA_DEBUG("Arena %s free of large allocation %p\n", a->name, ptr);
+	extent_free(found);
+    }
+}
+
+
+void
+nk_arena_reset (struct nk_arena *a)
+{
+    struct list_head chunks, large;
+    struct arena_extent *keep = NULL;
+    uint8_t flags;
+
+    INIT_LIST_HEAD(&chunks);
+    INIT_LIST_HEAD(&large);
+
+    flags = spin_lock_irq_save(&a->lock);
+
+    list_splice_init(&a->chunks, &chunks);
+    list_splice_init(&a->large, &large);
+
+    if (!list_empty(&chunks)) {
+	keep = list_first_entry(&chunks, struct arena_extent, node);
+	list_del(&keep->node);
+	list_add(&keep->node, &a->chunks);
+	a->cur = (addr_t)keep->addr;
+	a->end = a->cur + keep->size;
+    } else {
+	a->cur = a->end = 0;
+    }
+
+    a->num_chunks = keep ? 1 : 0;
+    a->num_large = 0;
+    a->large_bytes = 0;
+    a->used_bytes = 0;
+
+    spin_unlock_irq_restore(&a->lock, flags);
+
+    extent_free_list(&large);
+    extent_free_list(&chunks);
+
+    ARENA_DEBUG("Arena %s reset\n", a->name);
+}
+
+
+void
+nk_arena_get_stats (struct nk_arena *a, struct nk_arena_stats *s)
+{
+    uint8_t flags = spin_lock_irq_save(&a->lock);
+
+    s->num_chunks = a->num_chunks;
+    s->chunk_bytes = a->num_chunks * a->chunk_size;
+    s->used_bytes = a->used_bytes;
+    s->num_large = a->num_large;
+    s->large_bytes = a->large_bytes;
+
+    spin_unlock_irq_restore(&a->lock, flags);
+}
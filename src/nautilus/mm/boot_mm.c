@@ -27,6 +27,9 @@
 #include <nautilus/mb_utils.h>
 #include <nautilus/multiboot2.h>
 #include <nautilus/macros.h>
+#include <nautilus/thread.h>
+#include <nautilus/percpu.h>
+#include <nautilus/numa.h>
 #include <lib/bitmap.h>
 
 #define CACHE_LINE_SIZE_DEFAULT 64
@@ -466,46 +469,135 @@ mm_boot_free (void *addr, ulong_t size)
 }
 
 
-/* add the unused pages to this mem region's mem-pool */
+/*
+ * Adds a run of free boot pages to the kmem pool, as a whole if it
+ * is usable RAM, and otherwise page by page
+ */
 static ulong_t
-add_free_pages (struct mem_region * region) 
+add_free_run (struct mem_region * region, ulong_t addr, ulong_t len)
+{
+    ulong_t count = 0;
+    ulong_t end = addr + len;
+
+    if (is_usable_ram(addr, len)) {
+	kmem_add_memory(region, addr, len);
+	return len;
+    }
+
+    for (; addr < end; addr += PAGE_SIZE) {
+	if (is_usable_ram(addr,PAGE_SIZE)) { 
+	    kmem_add_memory(region, addr, PAGE_SIZE);
+	    count += PAGE_SIZE;
+	} else {
+	    ERROR_PRINT("Skipping addition of memory at %p (%p bytes) - Likely memory map / SRAT mismatch\n",addr,PAGE_SIZE);
+	}
+    }
+
+    return count;
+}
+
+
+/* 
+ * add the unused pages in [start,end) of this mem region to its 
+ * mem-pool, in runs of consecutive free pages 
+ */
+static ulong_t
+add_free_pages (struct mem_region * region, ulong_t start, ulong_t end) 
 {
     ulong_t count = 0;
     ulong_t * pm  = bootmem.page_map;
-    ulong_t addr, i, m;
+    ulong_t i, run = 0, in_run = 0;
 
     ASSERT(region);
 
-    ulong_t start_pfn = region->base_addr >> PAGE_SHIFT;
-    ulong_t end_pfn   = (region->base_addr + region->len) >> PAGE_SHIFT;
+    ulong_t start_pfn = PFN_ROUND_UP(start);
+    ulong_t end_pfn   = PFN_ROUND_DOWN(end);
 
     ASSERT(end_pfn < bootmem.npages);
 
     for (i = start_pfn; i < end_pfn; ) {
 
-        ulong_t v = ~pm[i/BITS_PER_LONG];
-       
-
-        /* we have free pages in this index */
-        if (v) {
-            addr = start_pfn << PAGE_SHIFT;
-            for (m = 1; m && i < end_pfn; m <<= 1, addr += PAGE_SIZE, i++) {
-                if (v & m) {
-		    if (is_usable_ram(addr,PAGE_SIZE)) { 
-			kmem_add_memory(region, addr, PAGE_SIZE);
-			++count;
-		    } else {
-			ERROR_PRINT("Skipping addition of memory at %p (%p bytes) - Likely memory map / SRAT mismatch\n",addr,PAGE_SIZE);
-		    }
-                } 
-            }
-        } else {
-            i += BITS_PER_LONG;
-        }
-        start_pfn += BITS_PER_LONG;
+	// skip whole words of reserved pages
+	if (!in_run && !(i % BITS_PER_LONG) && !~pm[i/BITS_PER_LONG] && i + BITS_PER_LONG <= end_pfn) {
+	    i += BITS_PER_LONG;
+	    continue;
+	}
+
+	if (!test_bit(i, pm)) {
+	    if (!in_run) {
+		run = i;
+		in_run = 1;
+	    }
+	} else if (in_run) {
+	    count += add_free_run(region, run << PAGE_SHIFT, (i - run) << PAGE_SHIFT);
+	    in_run = 0;
+	}
+	i++;
+    }
+
+    if (in_run) {
+	count += add_free_run(region, run << PAGE_SHIFT, (end_pfn - run) << PAGE_SHIFT);
+    }
+
+    return count;
+}
+
+
+#define DEFERRED_SLICE_SIZE PAGE_SIZE_1GB
+
+/*
+ * The parts of zones beyond kmem_zone_boot_len() are added in the
+ * background by one thread per cpu, in slices that are claimed
+ * first by cpus in the slice's domain and then by any cpu.   The boot 
+ * page map is needed until they are done, and is only reclaimed then.
+ */
+struct deferred_slice {
+    struct mem_region *region;
+    ulong_t            offset;     // within the region
+    ulong_t            len;
+    volatile int       claimed;
+};
+
+static struct {
+    struct deferred_slice *slices;
+    ulong_t                num_slices;
+    volatile int           pending;    // slices still to be added
+    volatile int           running;    // and their threads are started
+    volatile int           refs;
+    int                    page_map_deferred;
+    volatile ulong_t       bytes;
+    uint64_t               start_tsc;
+    int                    num_threads;
+} deferred;
+
+
+static ulong_t
+num_deferred_slices (struct mem_region * region)
+{
+    ulong_t boot_len;
+
+    if (!region->mm_state) {
+	return 0;
     }
 
-    return count*PAGE_SIZE;
+    boot_len = kmem_zone_boot_len(region);
+
+    return (region->len - boot_len + DEFERRED_SLICE_SIZE - 1) / DEFERRED_SLICE_SIZE;
+}
+
+
+static ulong_t
+reclaim_page_map (void)
+{
+    if (is_usable_ram(va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len)) {
+	kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)bootmem.page_map)),
+			va_to_pa((ulong_t)bootmem.page_map), 
+			bootmem.pm_len);
+	return bootmem.pm_len;
+    } else {
+	ERROR_PRINT("Skipping reclaim of boot page map as memory is not usable: %p (%p bytes) - Likely memory map / SRAT mismatch\n",va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len);
+	return 0;
+    }
 }
 
 
@@ -519,28 +611,57 @@ mm_boot_kmem_init (void)
 {
     unsigned i;
     ulong_t count = 0;
+    ulong_t num_slices = 0;
     struct nk_locality_info * loc = &(nk_get_nautilus_info()->sys.locality_info);
+    struct mem_region * region = NULL;
+
+    /* the slice list must be allocated before any of the 
+     * boot allocator's free pages are handed to kmem */
+    for (i = 0; i < loc->num_domains; i++) {
+        list_for_each_entry(region, &(loc->domains[i]->regions), entry) {
+	    num_slices += num_deferred_slices(region);
+	}
+    }
+
+    if (num_slices) {
+	deferred.slices = mm_boot_alloc(num_slices * sizeof(struct deferred_slice));
+	if (!deferred.slices) {
+	    panic("Cannot allocate %lu slices for deferred memory initialization\n", num_slices);
+	}
+	memset(deferred.slices, 0, num_slices * sizeof(struct deferred_slice));
+    }
 
     /* we walk ALL of the registered memory regions
      * and add their associated pages in the existing bitmap to the
      * kernel mem pool */
     BMM_PRINT("Adding boot memory regions to the kernel memory pool:\n");
     for (i = 0; i < loc->num_domains; i++) {
-        struct mem_region * region = NULL;
         unsigned j = 0;
         list_for_each_entry(region, &(loc->domains[i]->regions), entry) {
-            ulong_t added = add_free_pages(region);
-            BMM_PRINT("    [Domain %02u : Region %02u] (%0lu.%02lu MB)\n", 
+	    ulong_t boot_len = region->mm_state ? kmem_zone_boot_len(region) : region->len;
+            ulong_t added = add_free_pages(region, region->base_addr, region->base_addr + boot_len);
+	    ulong_t off;
+
+            BMM_PRINT("    [Domain %02u : Region %02u] (%0lu.%02lu MB)%s\n", 
                     i, j,
                     added / 1000000,
-                    added % 1000000);
+                    added % 1000000,
+		    boot_len < region->len ? " rest deferred" : "");
             count += added;
             j++;
+
+	    for (off = boot_len; off < region->len; off += DEFERRED_SLICE_SIZE) {
+		struct deferred_slice *s = &deferred.slices[deferred.num_slices++];
+		s->region = region;
+		s->offset = off;
+		s->len = region->len - off < DEFERRED_SLICE_SIZE ? region->len - off : DEFERRED_SLICE_SIZE;
+	    }
         }
     }
 
     ASSERT(count != 0);
 
+    deferred.pending = deferred.num_slices != 0;
 
     /* we no longer need to use the boot allocator */
     boot_mm_inactive = 1;
@@ -548,8 +669,116 @@ mm_boot_kmem_init (void)
     BMM_PRINT("    =======\n");
     BMM_PRINT("    [TOTAL] (%lu.%lu MB)\n", count/1000000, count%1000000);
 
+    if (deferred.pending) {
+	BMM_PRINT("    %lu slices of memory deferred to background initialization\n", deferred.num_slices);
+    }
+}
+
+
+int
+mm_boot_kmem_deferred_pending (void)
+{
+    return deferred.running;
 }
 
+
+static void
+deferred_put (void)
+{
+    uint64_t cycles, khz;
+
+    if (__sync_sub_and_fetch(&deferred.refs, 1)) {
+	return;
+    }
+
+    if (deferred.page_map_deferred) {
+	reclaim_page_map();
+    }
+
+    cycles = rdtsc() - deferred.start_tsc;
+    khz = nk_get_nautilus_info()->sys.cpus[0]->cpu_khz;
+
+    BMM_PRINT("Background memory initialization added %lu MB on %d cpus in %lu cycles (%lu ms)\n",
+	      deferred.bytes >> 20, deferred.num_threads, cycles, khz ? cycles / khz : 0);
+
+    deferred.pending = 0;
+    deferred.running = 0;
+}
+
+
+static void
+deferred_work (void)
+{
+    int dom = per_cpu_get(domain) ? per_cpu_get(domain)->id : -1;
+    int pass;
+    ulong_t i;
+
+    // first the slices local to us, then whatever is left
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < deferred.num_slices; i++) {
+	    struct deferred_slice *s = &deferred.slices[i];
+
+	    if ((pass || s->region->domain_id == dom) &&
+		!s->claimed && __sync_bool_compare_and_swap(&s->claimed, 0, 1)) {
+
+		kmem_zone_clear_pages(s->region, s->offset, s->len);
+
+		__sync_fetch_and_add(&deferred.bytes, 
+				     add_free_pages(s->region, 
+						    s->region->base_addr + s->offset, 
+						    s->region->base_addr + s->offset + s->len));
+	    }
+	}
+    }
+}
+
+
+static void
+deferred_thread (void * in, void ** out)
+{
+    nk_thread_name(get_cur_thread(), "kmem-init");
+    deferred_work();
+    deferred_put();
+}
+
+
+/*
+ * Adds the deferred parts of the zones with a thread per cpu, and 
+ * returns without waiting for them.   Allocations that fail while
+ * this is in progress wait for it rather than failing.
+ */
+void
+mm_boot_kmem_init_deferred (void)
+{
+    int i;
+
+    if (!deferred.pending) {
+	return;
+    }
+
+    deferred.start_tsc = rdtsc();
+    deferred.refs = 1;
+    deferred.running = 1;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+	__sync_fetch_and_add(&deferred.refs, 1);
+	if (nk_thread_start(deferred_thread, 0, 0, 1, TSTACK_DEFAULT, 0, i)) {
+	    BMM_WARN("Cannot start memory initialization thread on cpu %d\n", i);
+	    __sync_fetch_and_sub(&deferred.refs, 1);
+	} else {
+	    deferred.num_threads++;
+	}
+    }
+
+    if (!deferred.num_threads) {
+	deferred.num_threads = 1;
+	deferred_work();
+    }
+
+    deferred_put();
+}
+
+
 void 
 mm_boot_kmem_cleanup (void)
 {
@@ -557,14 +786,13 @@ mm_boot_kmem_cleanup (void)
 
     BMM_PRINT("Reclaiming boot sections and data:\n");
 
-    BMM_PRINT("    [Boot alloc. page map] (%0lu.%02lu MB)\n", bootmem.pm_len/1000000, bootmem.pm_len%1000000);
-    if (is_usable_ram(va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len)) {
-	kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)bootmem.page_map)),
-			va_to_pa((ulong_t)bootmem.page_map), 
-			bootmem.pm_len);
-	count += bootmem.pm_len;
+    BMM_PRINT("    [Boot alloc. page map] (%0lu.%02lu MB)%s\n", bootmem.pm_len/1000000, bootmem.pm_len%1000000,
+	      deferred.pending ? " after background initialization" : "");
+    if (deferred.pending) {
+	// still needed to find the free pages of the deferred slices
+	deferred.page_map_deferred = 1;
     } else {
-	ERROR_PRINT("Skipping reclaim of boot page map as memory is not usable: %p (%p bytes) - Likely memory map / SRAT mismatch\n",va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len);
+	count += reclaim_page_map();
     }
 
 
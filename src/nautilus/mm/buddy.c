@@ -106,68 +106,109 @@ static inline void clearb(ulong_t nr, volatile char *addr)
 
 }
 /**
- * Converts a block address to its block index in the specified buddy allocator.
- * A block's index is used to find the block's tag bit, mp->tag_bits[block_id].
+ * Converts a block address to its block index at the given order.
+ * A block's index is used to find the block's tag bit, 
+ * mp->orders[order].tag_bits[block_id].
  */
 static inline ulong_t
-block_to_id (struct buddy_mempool *mp, struct block *block)
+block_to_id (struct buddy_mempool *mp, struct block *block, ulong_t order)
 {
     ulong_t block_id =
-        ((ulong_t)block - mp->base_addr) >> mp->min_order;
-#if 0
-    if (block_id >= mp->num_blocks) {
-        printk("The block %p\n", block);
-        printk("Block ID is greater than the number of blocks in this pool!\n"
-              "    MemPool Base Addr: %p\n"
-              "    MemPool Size:    0x%lx\n"
-              "    Min Order:       %u\n"
-              "    Num Blocks:      0x%lx\n"
-              "    Block ID :       0x%lx\n", 
-              mp->base_addr,
-              1UL<<mp->pool_order,
-              mp->min_order,
-              mp->num_blocks,
-              block_id);
+        ((ulong_t)block - mp->base_addr) >> order;
 
-    }
-#endif
-    ASSERT(block_id < mp->num_blocks);
+    ASSERT(block_id < (mp->num_blocks >> (order - mp->min_order)));
 
     return block_id;
 }
 
 
 /**
- * Marks a block as free by setting its tag bit to one.
+ * Marks a block as free at the given order by setting its tag bit to one.
+ * The order's lock must be held.
  */
 static inline void
-mark_available (struct buddy_mempool *mp, struct block *block)
+mark_available (struct buddy_mempool *mp, struct block *block, ulong_t order)
 {
-    if (block==(struct block*)0xdfa00000ULL) {
-	BUDDY_DEBUG("Magic block %p: block_to_id=%lu\n", block, block_to_id(mp,block));
-    }
-
-    __set_bit(block_to_id(mp, block), (volatile char*)mp->tag_bits);
+    __set_bit(block_to_id(mp, block, order), (volatile char*)mp->orders[order].tag_bits);
 }
 
 
 /**
- * Marks a block as allocated by setting its tag bit to zero.
+ * Marks a block as not free at the given order by setting its tag bit to zero.
+ * The order's lock must be held.
  */
 static inline void
-mark_allocated (struct buddy_mempool *mp, struct block *block)
+mark_allocated (struct buddy_mempool *mp, struct block *block, ulong_t order)
 {
-    __clear_bit(block_to_id(mp, block), (volatile char *)mp->tag_bits);
+    __clear_bit(block_to_id(mp, block, order), (volatile char *)mp->orders[order].tag_bits);
 }
 
 
 /**
- * Returns true if block is free, false if it is allocated.
+ * Returns true if block is free at the given order, false otherwise.
+ * The answer is only stable while the order's lock is held.
  */
 static inline int
-is_available (struct buddy_mempool *mp, struct block *block)
+is_available (struct buddy_mempool *mp, struct block *block, ulong_t order)
+{
+    return test_bit(block_to_id(mp, block, order), mp->orders[order].tag_bits);
+}
+
+
+/**
+ * Adds a free block to the free list of its order, and notes in the 
+ * summary that the order has free blocks.  The order's lock must be held.
+ */
+static inline void
+push_block (struct buddy_mempool *mp, struct block *block, ulong_t order)
+{
+    struct buddy_order *o = &mp->orders[order];
+
+    block->order = order;
+    mark_available(mp, block, order);
+    if (list_empty(&o->avail)) {
+	__sync_fetch_and_or(&mp->avail_mask, 1UL << order);
+    }
+    list_add(&block->link, &o->avail);
+}
+
+
+/**
+ * Removes a free block from the free list of its order, and notes in the 
+ * summary if the order no longer has free blocks.  The order's lock 
+ * must be held.
+ */
+static inline void
+remove_block (struct buddy_mempool *mp, struct block *block, ulong_t order)
 {
-    return test_bit(block_to_id(mp, block), mp->tag_bits);
+    struct buddy_order *o = &mp->orders[order];
+
+    list_del_init(&block->link);
+    mark_allocated(mp, block, order);
+    if (list_empty(&o->avail)) {
+	__sync_fetch_and_and(&mp->avail_mask, ~(1UL << order));
+    }
+}
+
+
+/**
+ * Brackets a split, coalesce, or grow, which holds free blocks off
+ * every list between taking them and putting them (or what they 
+ * become) back.   in_flight must be raised before the first block is
+ * taken, and seq bumped before in_flight drops, for buddy_alloc's
+ * check of an empty pool to be sound.
+ */
+static inline void
+begin_in_flight (struct buddy_mempool *mp)
+{
+    __sync_fetch_and_add(&mp->in_flight, 1);
+}
+
+static inline void
+end_in_flight (struct buddy_mempool *mp)
+{
+    __sync_fetch_and_add(&mp->seq, 1);
+    __sync_fetch_and_sub(&mp->in_flight, 1);
 }
 
 
@@ -215,6 +256,12 @@ buddy_init (ulong_t base_addr,
         return NULL;
     }
 
+    /* The summary has one bit per order */
+    if (pool_order >= sizeof(ulong_t)*8) {
+	ERROR_PRINT("Pool order %lu is too large\n", pool_order);
+	return NULL;
+    }
+
     mp = mm_boot_alloc(sizeof(struct buddy_mempool));
     if (!mp) {
         ERROR_PRINT("Could not allocate mempool\n");
@@ -225,35 +272,44 @@ buddy_init (ulong_t base_addr,
     mp->base_addr  = base_addr;
     mp->pool_order = pool_order;
     mp->min_order  = min_order;
+    mp->num_blocks = (1UL << pool_order) / (1UL << min_order);
 
-    /* Allocate a list for every order up to the maximum allowed order */
-    mp->avail = mm_boot_alloc((pool_order + 1) * sizeof(struct list_head));
+    /* Allocate the state for every order up to the maximum allowed order */
+    mp->orders = mm_boot_alloc_aligned((pool_order + 1) * sizeof(struct buddy_order),
+				       __alignof__(struct buddy_order));
 
-    if (!mp->avail) { 
-	ERROR_PRINT("Cannot allocate list heads\n");
+    if (!mp->orders) { 
+	ERROR_PRINT("Cannot allocate order state\n");
 	return NULL;
     }
 
+    memset(mp->orders, 0, (pool_order + 1) * sizeof(struct buddy_order));
 
-    /* Initially all lists are empty */
     for (i = 0; i <= pool_order; i++) {
-        INIT_LIST_HEAD(&mp->avail[i]);
-    }
+	/* Initially all lists are empty */
+	spinlock_init(&mp->orders[i].lock);
+        INIT_LIST_HEAD(&mp->orders[i].avail);
 
-    /* Allocate a bitmap with 1 bit per minimum-sized block */
-    mp->num_blocks = (1UL << pool_order) / (1UL << min_order);
-    mp->tag_bits   = mm_boot_alloc(BITS_TO_LONGS(mp->num_blocks) * sizeof(long));
+	if (i < min_order) {
+	    continue;
+	}
 
-    if (!mp->tag_bits) { 
-	ERROR_PRINT("Could not allocate bitmap for mempool\n");
-	return NULL;
-    }
+	/* Allocate a bitmap with 1 bit per block of this order */
+	ulong_t num_blocks = 1UL << (pool_order - i);
+
+	mp->orders[i].tag_bits = mm_boot_alloc(BITS_TO_LONGS(num_blocks) * sizeof(long));
 
-    BUDDY_DEBUG("num_blocks=%lu, tag_bits=%p alloc=%lu\n",mp->num_blocks, mp->tag_bits,
-		BITS_TO_LONGS(mp->num_blocks)*sizeof(long));
+	if (!mp->orders[i].tag_bits) { 
+	    ERROR_PRINT("Could not allocate bitmap for mempool\n");
+	    return NULL;
+	}
 
-    /* Initially mark all minimum-sized blocks as allocated */
-    bitmap_zero(mp->tag_bits, mp->num_blocks);
+	BUDDY_DEBUG("order=%lu num_blocks=%lu, tag_bits=%p alloc=%lu\n",i, num_blocks, mp->orders[i].tag_bits,
+		    BITS_TO_LONGS(num_blocks)*sizeof(long));
+
+	/* Initially mark all blocks as allocated */
+	bitmap_zero(mp->orders[i].tag_bits, num_blocks);
+    }
 
     BUDDY_DEBUG("Created memory pool %p\n",mp);
 
@@ -276,14 +332,17 @@ void *
 buddy_alloc (struct buddy_mempool *mp, ulong_t order)
 {
     ulong_t j;
-    struct list_head *list;
+    ulong_t mask;
+    ulong_t seq;
+    uint8_t flags;
+    struct buddy_order *o;
     struct block *block;
     struct block *buddy_block;
 
     ASSERT(mp);
 
     BUDDY_DEBUG("BUDDY ALLOC on mempool : %p order: %lu mempool_order: %lu\n", mp, order, mp->pool_order);
-;
+
     if (order > mp->pool_order) {
 	BUDDY_DEBUG("order is too big\n");
         return NULL;
@@ -295,32 +354,56 @@ buddy_alloc (struct buddy_mempool *mp, ulong_t order)
 	BUDDY_DEBUG("order expanded to %lu\n",order);
     }
 
-    for (j = order; j <= mp->pool_order; j++) {
+    flags = irq_disable_save();
+
+ retry:
+
+    seq = mp->seq;
+    __sync_synchronize();
+
+    /* The summary tells us the smallest order with free blocks */
+    while ((mask = mp->avail_mask >> order)) {
 
-        /* Try to allocate the first block in the order j list */
-        list = &mp->avail[j];
+	j = order + __builtin_ctzl(mask);
+	o = &mp->orders[j];
 
-        if (list_empty(list)) {
-	    BUDDY_DEBUG("Skipping order %lu as the list is empty\n",j);
+	spin_lock(&o->lock);
+
+        if (list_empty(&o->avail)) {
+	    /* Another CPU got the last block first - the summary bit
+	       is already clear, so we will pick a different order */
+	    spin_unlock(&o->lock);
+	    BUDDY_DEBUG("Lost race for order %lu\n",j);
             continue;
         }
 
-        block = list_first_entry(list, struct block, link);
-        list_del_init(&block->link);
-        mark_allocated(mp, block);
+	if (j > order) {
+	    /* the rest of the block is off the lists until it is split */
+	    begin_in_flight(mp);
+	}
+
+        block = list_first_entry(&o->avail, struct block, link);
+	remove_block(mp, block, j);
+
+	spin_unlock(&o->lock);
 
 	BUDDY_DEBUG("Found block %p at order %lu\n",block,j);
 
-        /* Trim if a higher order block than necessary was allocated */
-        while (j > order) {
-            --j;
-            buddy_block = (struct block *)((ulong_t)block + (1UL << j));
-            buddy_block->order = j;
-            mark_available(mp, buddy_block);
-	    BUDDY_DEBUG("Inserted buddy block %p into order %lu\n",buddy_block,j);
-            list_add(&buddy_block->link, &mp->avail[j]);
-        }
-	
+	if (j > order) {
+	    /* Trim since a higher order block than necessary was allocated */
+	    while (j > order) {
+		--j;
+		buddy_block = (struct block *)((ulong_t)block + (1UL << j));
+		spin_lock(&mp->orders[j].lock);
+		push_block(mp, buddy_block, j);
+		spin_unlock(&mp->orders[j].lock);
+		BUDDY_DEBUG("Inserted buddy block %p into order %lu\n",buddy_block,j);
+	    }
+	    end_in_flight(mp);
+	}
+
+	irq_enable_restore(flags);
+
 	block->order = j;
 
 	BUDDY_DEBUG("Returning block %p which is in memory pool %p-%p\n",block,mp->base_addr,mp->base_addr+(1ULL << mp->pool_order));
@@ -328,6 +411,20 @@ buddy_alloc (struct buddy_mempool *mp, ulong_t order)
         return block;
     }
 
+    /* Every list we could use was empty when we looked, but a split or
+       coalesce on another CPU may have been holding the block we need
+       off the lists.   If none was in flight then, or has finished
+       since, the pool really had nothing for us.   Those operations
+       run with interrupts off, so they will not keep us waiting long */
+    __sync_synchronize();
+    if (mp->in_flight || mp->seq != seq) {
+	BUDDY_DEBUG("Pool %p looked empty during a split or coalesce, retrying\n", mp);
+	asm volatile ("pause");
+	goto retry;
+    }
+
+    irq_enable_restore(flags);
+
     BUDDY_DEBUG("FAILED TO ALLOCATE from %p - RETURNING  NULL\n", mp);
 
     return NULL;
@@ -347,6 +444,10 @@ buddy_free(
     ulong_t order
 )
 {
+    uint8_t flags;
+    struct buddy_order *o;
+    int merged = 0;
+
     ASSERT(mp);
     ASSERT(order <= mp->pool_order);
     ASSERT(// cannot be aligned to own size if pool start is not multiple of alignment
@@ -370,58 +471,150 @@ buddy_free(
     /* Overlay block structure on the memory block being freed */
     struct block * block = (struct block *) addr;
 
-    ASSERT(!is_available(mp, block));
+    ASSERT(!is_available(mp, block, order));
+
+    flags = irq_disable_save();
+
+    /* Coalesce as much as possible with adjacent free buddy blocks.
+       Whether our buddy is free at this order can only change under 
+       this order's lock, so we hold it while we decide */
+    while (1) {
+
+	o = &mp->orders[order];
+
+	spin_lock(&o->lock);
+
+	if (order < mp->pool_order) {
+
+	    /* Determine our buddy block's address */
+	    struct block * buddy = find_buddy(mp, block, order);
+
+	    BUDDY_DEBUG("buddy at order %lu is %p\n",order,buddy);
+
+	    /* Make sure buddy is available with the same size as us */
+	    if (is_available(mp, buddy, order)) {
 
-    /* Coalesce as much as possible with adjacent free buddy blocks */
-    while (order < mp->pool_order) {
+		BUDDY_DEBUG("buddy merge\n");
 
-        /* Determine our buddy block's address */
-        struct block * buddy = find_buddy(mp, block, order);
+		if (!merged) {
+		    /* the buddy is off the lists until we push the result */
+		    begin_in_flight(mp);
+		    merged = 1;
+		}
 
-	BUDDY_DEBUG("buddy at order %lu is %p\n",order,buddy);
+		/* OK, we're good to go... buddy merge! */
+		remove_block(mp, buddy, order);
+
+		spin_unlock(&o->lock);
+
+		if (buddy < block) {
+		    block = buddy;
+		}
+		++order;
+		continue;
+	    }
 
-        /* Make sure buddy is available and has the same size as us */
-        if (!is_available(mp, buddy)) {
 	    BUDDY_DEBUG("buddy not available\n");
-	    break;
 	}
 
-        if (is_available(mp, buddy) && (buddy->order != order)) {
-	    BUDDY_DEBUG("buddy available but has order %lu\n",buddy->order);
-            break;
-        }
+	/* Add the (possibly coalesced) block to the appropriate free list */
+	push_block(mp, block, order);
 
-	BUDDY_DEBUG("buddy merge\n");
+	spin_unlock(&o->lock);
 
-        /* OK, we're good to go... buddy merge! */
-        list_del_init(&buddy->link);
-        if (buddy < block) {
-            block = buddy;
-	}
-        ++order;
-        block->order = order;
+	break;
     }
-    
-    /* Add the (possibly coalesced) block to the appropriate free list */
-    block->order = order;
 
-    BUDDY_DEBUG("End of search: block=%p order=%lu pool_order=%lu block->order=%lu\n",block,order,mp->pool_order,block->order);
+    if (merged) {
+	end_in_flight(mp);
+    }
 
+    irq_enable_restore(flags);
 
-    mark_available(mp, block);
+    BUDDY_DEBUG("block at %p of order %lu being made available\n",block,order);
+}
 
-    BUDDY_DEBUG("End of mark: block=%p order=%lu pool_order=%lu block->order=%lu\n",block,order,mp->pool_order,block->order);
 
-    list_add(&block->link, &mp->avail[order]);
+/**
+ * Grows an allocated block in place from 2^order to 2^new_order bytes
+ * by absorbing the free blocks above it.   This is possible only if
+ * the block is the lower buddy at every order in between, and each
+ * upper buddy is free as a whole.   Each buddy is claimed under its
+ * own order's lock, and those already claimed are given back if a
+ * later one is not free.   Giving them back cannot coalesce them,
+ * since their buddy is the part of our block already allocated.
+ *
+ * Returns 0 if the block now has order new_order, -1 if it is unchanged.
+ */
+int
+buddy_grow (struct buddy_mempool *mp, void *addr, ulong_t order, ulong_t new_order)
+{
+    ulong_t offset = (ulong_t)addr - mp->base_addr;
+    uint8_t flags;
+    ulong_t j, k;
 
-    BUDDY_DEBUG("block at %p of order %lu being made available\n",block,block->order);
-    
-    if (block->order==-1) { 
-	ERROR_PRINT("FAIL: block order went nuts\n");
-	ERROR_PRINT("mp->base_addr=%p mp->num_blocks=%lu  mp->min_order=%lu, block=%p\n",mp->base_addr,mp->num_blocks, mp->min_order,block);
-	panic("Block order\n");
+    if (order < mp->min_order) {
+	order = mp->min_order;
+    }
+
+    if (new_order > mp->pool_order || (offset & ((1UL << new_order) - 1))) {
+	BUDDY_DEBUG("Block %p cannot grow from order %lu to %lu\n", addr, order, new_order);
+	return -1;
     }
 
+    flags = irq_disable_save();
+
+    /* what we claim is off the lists until we keep it or give it back */
+    begin_in_flight(mp);
+
+    for (j = order; j < new_order; j++) {
+	struct block *buddy = (struct block *)((ulong_t)addr + (1UL << j));
+
+	spin_lock(&mp->orders[j].lock);
+
+	if (!is_available(mp, buddy, j)) {
+	    spin_unlock(&mp->orders[j].lock);
+	    BUDDY_DEBUG("Block %p cannot grow past order %lu\n", addr, j);
+	    for (k = order; k < j; k++) {
+		buddy = (struct block *)((ulong_t)addr + (1UL << k));
+		spin_lock(&mp->orders[k].lock);
+		push_block(mp, buddy, k);
+		spin_unlock(&mp->orders[k].lock);
+	    }
+	    end_in_flight(mp);
+	    irq_enable_restore(flags);
+	    return -1;
+	}
+
+	remove_block(mp, buddy, j);
+
+	spin_unlock(&mp->orders[j].lock);
+    }
+
+    end_in_flight(mp);
+    irq_enable_restore(flags);
+
+    BUDDY_DEBUG("Block %p grown from order %lu to %lu\n", addr, order, new_order);
+
+    return 0;
+}
+
+
+/**
+ * Shrinks an allocated block in place from 2^order to 2^new_order 
+ * bytes, returning the upper part of the block to the pool.
+ */
+void
+buddy_shrink (struct buddy_mempool *mp, void *addr, ulong_t order, ulong_t new_order)
+{
+    if (new_order < mp->min_order) {
+	new_order = mp->min_order;
+    }
+
+    while (order > new_order) {
+	--order;
+	buddy_free(mp, (void *)((ulong_t)addr + (1UL << order)), order);
+    }
 }
 
 
@@ -441,7 +634,11 @@ static int _buddy_sanity_check(struct buddy_mempool *mp, struct buddy_pool_stats
 
     rc=0;
 
-    flags = spin_lock_irq_save(&mp->lock);
+    // take all order locks (in increasing order) for a consistent snapshot
+    flags = irq_disable_save();
+    for (i = 0; i <= mp->pool_order; i++) {
+	spin_lock(&mp->orders[i].lock);
+    }
 
     stats->start_addr = (void*)(mp->base_addr);
     stats->end_addr = (void*)(mp->base_addr + (1ULL<<mp->pool_order));
@@ -457,7 +654,7 @@ static int _buddy_sanity_check(struct buddy_mempool *mp, struct buddy_pool_stats
 
         /* Count the number of memory blocks in the list */
         num_blocks = 0;
-        list_for_each(entry, &mp->avail[i])  {
+        list_for_each(entry, &mp->orders[i].avail)  {
 	    struct block *block = list_entry(entry, struct block, link);
 	    //nk_vc_printf("order %lu block %lu\n",i, num_blocks);
 	    //nk_vc_printf("entry %p - block %p order %lx\n",entry, block,block->order);
@@ -474,7 +671,7 @@ static int _buddy_sanity_check(struct buddy_mempool *mp, struct buddy_pool_stats
 		rc|=-1;
 		break;
 	    }
-	    if (!is_available(mp,block)) { 
+	    if (!is_available(mp,block,i)) { 
 		ERROR_PRINT("BLOCK %p IS NOT MARKED AVAILABLE BUT IS ON FREE LIST\n", block);
 		ERROR_PRINT("FIRST WORDS: 0x%016lx 0x%016lx 0x%016lx 0x%016lx\n", ((uint64_t*)block)[0],((uint64_t*)block)[1],((uint64_t*)block)[2],((uint64_t*)block)[3]);
 		rc|=-1;
@@ -485,6 +682,11 @@ static int _buddy_sanity_check(struct buddy_mempool *mp, struct buddy_pool_stats
 
 	//nk_vc_printf("%lu blocks at order %lu\n",num_blocks,i);
 
+	if (!(mp->avail_mask & (1UL << i)) != !num_blocks) { 
+	    ERROR_PRINT("SUMMARY FOR ORDER %lu DOES NOT MATCH FREE LIST\n", i);
+	    rc|=-1;
+	}
+
 	if (min_alloc==0) { 
 	    min_alloc = 1ULL << mp->min_order ;
 	}
@@ -501,7 +703,10 @@ static int _buddy_sanity_check(struct buddy_mempool *mp, struct buddy_pool_stats
     stats->min_alloc_size = min_alloc;
     stats->max_alloc_size = max_alloc;
     
-    spin_unlock_irq_restore(&mp->lock,flags);
+    for (i = mp->pool_order + 1; i > 0; i--) {
+	spin_unlock(&mp->orders[i-1].lock);
+    }
+    irq_enable_restore(flags);
 
     return rc;
 }
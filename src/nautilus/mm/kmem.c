@@ -27,6 +27,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/mm.h>
 #include <nautilus/buddy.h>
+#include <nautilus/slab.h>
 #include <nautilus/paging.h>
 #include <nautilus/numa.h>
 #include <nautilus/spinlock.h>
@@ -36,6 +37,8 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/percpu.h>
 #include <nautilus/shell.h>
+#include <nautilus/thread.h>
+#include <nautilus/cpu_state.h>
 
 #include <dev/gpio.h>
 
@@ -66,15 +69,22 @@
 
 /**
  * This specifies the minimum sized memory block to request from the underlying
- * buddy system memory allocator, 2^MIN_ORDER bytes. It must be at least big
- * enough to hold a 'struct kmem_block_hdr'.
+ * buddy system memory allocator, 2^MIN_ORDER bytes.   Every block kmem
+ * allocates from a zone is thus at least a page and is described by the 
+ * page descriptor of its first page.   Smaller requests are served by the
+ * slab layer.
  */
-#define MIN_ORDER   5  /* 32 bytes */
+#define MIN_ORDER   KMEM_PAGE_ORDER  /* 4 KB */
 
-// The factor by which to reduce the hash table size
-// next_prime(total_mem >> 5 / BLOAT) is the maximum number of
-// blocks we can allocate with malloc
-#define BLOAT  1024
+/*
+ * Zones are made available up to this size during boot, the rest
+ * is added in parallel once the APs are up
+ */
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+#define KMEM_BOOT_ZONE_LEN  ((ulong_t)NAUT_CONFIG_KMEM_BOOT_ZONE_MB << 20)
+#else
+#define KMEM_BOOT_ZONE_LEN  (-1UL)
+#endif
 
 
 /**
@@ -89,152 +99,75 @@ static unsigned long kmem_bytes_managed;
 static unsigned long kmem_bytes_allocated = 0;
 
 
-/* This is the list of all memory zones */
-static struct list_head glob_zone_list;
+/*
+ * Per-domain accounting of allocations of a page or more
+ */
+static struct kmem_domain_stats domain_stats[MAX_NUMA_DOMAINS];
 
 
-/**
- * Each block of memory allocated from the kernel memory pool has 
- * associated with it one of these structures.   The structure 
- * maps the address handed out by malloc to the order of the block
- * that was allocated and the buddy allocator that provided the
- * block 
+/*
+ * Like each cpu, each NUMA domain has a list of all zones ordered by
+ * distance from it, which the policies other than local walk
  */
-struct kmem_block_hdr {
-    void *   addr;   /* address of block */
-    uint64_t order;  /* order of the block allocated from buddy system */
-                     /* order>=MIN_ORDER => in use, safe to examine */
-                     /* order==0 => unallocated header */
-                     /* order==1 => allocation in progress, unsafe */
-    struct buddy_mempool * zone; /* zone to which this block belongs */
-    uint64_t flags;  /* flags for this allocated block */
-} __packed __attribute((aligned(8)));
-
-
-static struct kmem_block_hdr *block_hash_entries=0;
-static uint64_t               block_hash_num_entries=0;
-
-// roughly power-of-two primes
-static const uint64_t primes[] = 
-{ 
-    53, 97, 193, 389,
-    769, 1543, 3079, 6151,
-    12289, 24593, 49157, 98317,
-    196613, 393241, 786433, 1572869,
-    3145739, 6291469, 12582917, 25165843,
-    50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741 
-};
+static struct list_head domain_regions[MAX_NUMA_DOMAINS];
 
-static uint64_t next_prime(uint64_t n)
-{
-  uint64_t i;
-  for (i=0;i<sizeof(primes)/sizeof(primes[0]);i++) {
-    if (primes[i]>=n) { 
-      return primes[i];
-    }
-  }
-  KMEM_DEBUG("next_prime: %lu is too big, returning maximum prime in table (%lu)\n",primes[i-1]);
+// next domain for the interleave policy
+static unsigned long interleave_next = 0;
 
-  return primes[i-1];
-}
 
-static int block_hash_init(uint64_t bytes)
-{
-  uint64_t num_entries = next_prime((bytes >> MIN_ORDER) / BLOAT);
-  uint64_t entry_size = sizeof(*block_hash_entries);
-  
-  KMEM_DEBUG("block_hash_init with %lu entries each of size %lu bytes (%lu bytes)\n",
-	     num_entries, entry_size, num_entries*entry_size);
+/* This is the list of all memory zones */
+static struct list_head glob_zone_list;
 
-  block_hash_entries = mm_boot_alloc(num_entries*entry_size);
 
-  if (!block_hash_entries) { 
-    KMEM_ERROR("block_hash_init failed\n");
-    return -1;
-  }
+/*
+ * The zone directory allows constant time lookup of the zone that 
+ * contains an address.  Each entry covers 2^ZONE_DIR_SHIFT bytes of
+ * the physical address space and points to the only zone that 
+ * intersects that range, if any.   Ranges that are shared by
+ * several zones are marked ZONE_DIR_MULTI and fall back to a scan of 
+ * the global zone list.
+ */
+#define ZONE_DIR_SHIFT 30  /* 1 GB */
+#define ZONE_DIR_MULTI ((struct mem_region *)-1UL)
 
-  memset(block_hash_entries,0,num_entries*entry_size);
-  
-  block_hash_num_entries = num_entries;
+static struct mem_region **zone_dir=0;
+static uint64_t            zone_dir_num_entries=0;
 
-  return 0;
-}
-
-static inline uint64_t block_hash_hash(const void *ptr)
+static int zone_dir_init(void)
 {
-  uint64_t n = ((uint64_t) ptr)>>MIN_ORDER;
+    struct mem_region *region;
+    uint64_t max_addr = 0;
+    uint64_t i;
 
-  n =  n ^ (n>>1) ^ (n<<2) ^ (n>>3) ^ (n<<5) ^ (n>>7)
-    ^ (n<<11) ^ (n>>13) ^ (n<<17) ^ (n>>19) ^ (n<<23) 
-    ^ (n>>29) ^ (n<<31) ^ (n>>37) ^ (n<<41) ^ (n>>43)
-    ^ (n<<47) ^ (n<<53) ^ (n>>59) ^ (n<<61);
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	if (region->base_addr + region->len > max_addr) {
+	    max_addr = region->base_addr + region->len;
+	}
+    }
 
-  n = n % block_hash_num_entries;
+    zone_dir_num_entries = ((max_addr - 1) >> ZONE_DIR_SHIFT) + 1;
 
-  KMEM_DEBUG("hash of %p returns 0x%lx\n",ptr, n);
-  
-  return n;
-}
-    
-static inline struct kmem_block_hdr * block_hash_find_entry(const void *ptr)
-{
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
-    }
-  }
-  for (i=0;i<start;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
-    }
-  }
-  return 0;
-}
+    KMEM_DEBUG("zone_dir_init with %lu entries\n", zone_dir_num_entries);
 
-static inline struct kmem_block_hdr * block_hash_alloc(void *ptr)
-{
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
-    }
-  }
-  for (i=0;i<start;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
-    }
-  }
-  return 0;
-}
+    zone_dir = mm_boot_alloc(zone_dir_num_entries*sizeof(struct mem_region *));
 
-static inline void block_hash_free_entry(struct kmem_block_hdr *b)
-{
-  b->addr = 0;
-  b->zone = 0;
-  b->flags = 0;
-  __sync_fetch_and_and (&b->order,0);
-}
+    if (!zone_dir) {
+	KMEM_ERROR("zone_dir_init failed\n");
+	zone_dir_num_entries = 0;
+	return -1;
+    }
 
-static inline int block_hash_free(void *ptr)
-{
-  struct kmem_block_hdr *b = block_hash_find_entry(ptr);
+    memset(zone_dir,0,zone_dir_num_entries*sizeof(struct mem_region *));
+
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	for (i = region->base_addr >> ZONE_DIR_SHIFT; 
+	     i <= (region->base_addr + region->len - 1) >> ZONE_DIR_SHIFT; 
+	     i++) {
+	    zone_dir[i] = zone_dir[i] ? ZONE_DIR_MULTI : region;
+	}
+    }
 
-  if (!b) { 
-    return -1;
-  } else {
-    block_hash_free_entry(b);
     return 0;
-  }
 }
 
 
@@ -246,13 +179,24 @@ kmem_get_base_zone (void)
 }
 
 
-/* TODO: if we're going to be using this at runtime, really need to 
- * key these regions in a tree
- */
 struct mem_region *
 kmem_get_region_by_addr (ulong_t addr)
 {
     struct mem_region * region = NULL;
+
+    if ((addr >> ZONE_DIR_SHIFT) < zone_dir_num_entries) {
+	region = zone_dir[addr >> ZONE_DIR_SHIFT];
+	if (region != ZONE_DIR_MULTI) {
+	    if (region && 
+		addr >= region->base_addr && 
+		addr < (region->base_addr + region->len)) {
+		return region;
+	    }
+	    return NULL;
+	}
+    }
+
+    // directory is not built yet, or the range is shared by several zones
     list_for_each_entry(region, &glob_zone_list, glob_link) {
         if (addr >= region->base_addr && 
             addr < (region->base_addr + region->len)) {
@@ -264,6 +208,33 @@ kmem_get_region_by_addr (ulong_t addr)
 }
 
 
+/*
+ * Find the page descriptor for a (virtual) address, and optionally its zone
+ */
+static inline struct kmem_page *
+kmem_page_of (void *addr, struct mem_region **region_out)
+{
+    struct mem_region *region = kmem_get_region_by_addr(va_to_pa((addr_t)addr));
+
+    if (!region || !region->page_desc) {
+	return NULL;
+    }
+
+    if (region_out) {
+	*region_out = region;
+    }
+
+    return &region->page_desc[((addr_t)addr - region->mm_state->base_addr) >> KMEM_PAGE_ORDER];
+}
+
+// true if addr is the first byte of its page, relative to the zone
+static inline int
+kmem_page_aligned (struct mem_region *region, void *addr)
+{
+    return !(((addr_t)addr - region->mm_state->base_addr) & (KMEM_PAGE_SIZE-1));
+}
+
+
 /**
  * This adds a zone to the kernel memory pool. Zones exist to allow there to be
  * multiple non-adjacent regions of physically contiguous memory, and to represent
@@ -302,11 +273,74 @@ create_zone (struct mem_region * region)
     /* add this region to the global region list */
     list_add(&(region->glob_link), &glob_zone_list);
 
+    /* one descriptor for each page of the region */
+    region->page_desc = mm_boot_alloc(KMEM_NUM_PAGES(region->len)*sizeof(struct kmem_page));
+    if (!region->page_desc) {
+	KMEM_ERROR("Cannot allocate page descriptors for region at %p\n", region->base_addr);
+	return NULL;
+    }
+
+    /* the descriptors of the part of a large zone that is set up 
+       later are cleared then, in parallel (see kmem_zone_clear_pages()) */
+    kmem_zone_clear_pages(region, 0, kmem_zone_boot_len(region));
+
     /* Initialize the underlying buddy allocator */
     return buddy_init(pa_to_va(region->base_addr), pool_order, min_order);
 }
 
 
+/*
+ * The part of a zone that is made available during boot, before the
+ * APs are up.   The rest of a zone larger than this is added later,
+ * in the background, by mm_boot_kmem_init_deferred(), and starts on 
+ * a 1 GB boundary so that it can be split into aligned slices.
+ */
+ulong_t
+kmem_zone_boot_len (struct mem_region * region)
+{
+    ulong_t split;
+
+    if (region->len <= KMEM_BOOT_ZONE_LEN) {
+	return region->len;
+    }
+
+    split = ((region->base_addr + KMEM_BOOT_ZONE_LEN + PAGE_SIZE_1GB - 1) & ~(PAGE_SIZE_1GB - 1)) - region->base_addr;
+
+    return split < region->len ? split : region->len;
+}
+
+
+/*
+ * Clears the page descriptors of a page-aligned range of a zone,
+ * which must precede adding the range with kmem_add_memory()
+ */
+void
+kmem_zone_clear_pages (struct mem_region * region, ulong_t offset, ulong_t len)
+{
+    nk_memzero(&region->page_desc[offset >> KMEM_PAGE_ORDER], 
+	       KMEM_NUM_PAGES(len)*sizeof(struct kmem_page));
+}
+
+
+/*
+ * The largest block, aligned to its own size relative to the zone, 
+ * that starts at zone offset offset and ends at or before end.  
+ * Walking a page-aligned range with this splits it into the pieces
+ * the buddy allocator can accept.
+ */
+static inline ulong_t
+piece_order (struct buddy_mempool *mp, uint64_t offset, uint64_t end)
+{
+    ulong_t order = offset ? __builtin_ctzl(offset) : mp->pool_order;
+
+    while ((1ULL << order) > end - offset) {
+	order--;
+    }
+
+    return order;
+}
+
+
 /**
  * This adds memory to the kernel memory pool. The memory region being added
  * must fall within a zone previously specified via kmem_create_zone().
@@ -326,30 +360,74 @@ kmem_add_memory (struct mem_region * mem,
      * Memory is added to it via buddy_free().
      * buddy_free() will panic if there are any problems with the args.
      * However, buddy_free() does expect chunks of memory aligned
-     * to their size, which we manufacture out of the memory given.
-     * buddy_free() will coalesce these chunks as appropriate
+     * to their size (relative to the zone), which we manufacture out of
+     * the memory given.  buddy_free() will coalesce these chunks as 
+     * appropriate.  The zone only manages whole pages, so any partial
+     * page at either end of the memory is dropped.
      */
 
-    uint64_t max_chunk_size = base_addr ? 1ULL << __builtin_ctzl(base_addr) : size;
-    uint64_t chunk_size = max_chunk_size < size ? max_chunk_size : size;
-    uint64_t chunk_order = ilog2(chunk_size); // floor
-    uint64_t num_chunks = size/chunk_size; // floor
     void *addr=(void*)pa_to_va(base_addr);
-    uint64_t i;
+    uint64_t offset = (uint64_t)addr - mem->mm_state->base_addr;
+    uint64_t end = (offset + size) & ~(KMEM_PAGE_SIZE-1);
+    uint64_t chunk_order;
 
-    KMEM_DEBUG("Add Memory to region %p base_addr=0x%llx size=0x%llx chunk_size=0x%llx, chunk_order=0x%llx, num_chunks=0x%llx, addr=%p\n",
-	       mem,base_addr,size,chunk_size,chunk_order,num_chunks,addr);
-    
-    for (i=0;i<num_chunks;i++) { 
-	buddy_free(mem->mm_state, addr+i*chunk_size, chunk_order);
-    }
+    offset = (offset + KMEM_PAGE_SIZE - 1) & ~(KMEM_PAGE_SIZE-1);
+
+    KMEM_DEBUG("Add Memory to region %p base_addr=0x%llx size=0x%llx addr=%p zone offsets 0x%llx-0x%llx\n",
+	       mem,base_addr,size,addr,offset,end);
+
+    while (offset < end) {
+	chunk_order = piece_order(mem->mm_state, offset, end);
+	buddy_free(mem->mm_state, (void*)(mem->mm_state->base_addr + offset), chunk_order);
+	offset += 1ULL << chunk_order;
 
-    /* Update statistics */
-    kmem_bytes_managed += chunk_size*num_chunks;
+	/* Update statistics; zones may be filled by several cpus at once */
+	__sync_fetch_and_add(&kmem_bytes_managed, 1ULL << chunk_order);
+	__sync_fetch_and_add(&domain_stats[mem->domain_id].bytes_managed, 1ULL << chunk_order);
+    }
 }
 
 void *boot_mm_get_cur_top();
 
+
+/*
+ * Build a list of all zones, those of the given domain first, 
+ * followed by those of the other domains in order of distance
+ */
+static int
+build_ordered_regions (struct list_head *list, struct numa_domain *dom)
+{
+    struct domain_adj_entry * rem_dom_ent = NULL;
+    struct mem_region * mem = NULL;
+
+    INIT_LIST_HEAD(list);
+
+    list_for_each_entry(mem, &dom->regions, entry) {
+        struct mem_reg_entry * newent = mm_boot_alloc(sizeof(struct mem_reg_entry));
+        if (!newent) {
+            KMEM_ERROR("Could not allocate mem region entry\n");
+            return -1;
+        }
+        newent->mem = mem;
+        list_add_tail(&newent->mem_ent, list);
+    }
+
+    list_for_each_entry(rem_dom_ent, &dom->adj_list, list_ent) {
+        struct numa_domain * rem_dom = rem_dom_ent->domain;
+        list_for_each_entry(mem, &rem_dom->regions, entry) {
+            struct mem_reg_entry * newent = mm_boot_alloc(sizeof(struct mem_reg_entry));
+            if (!newent) {
+                KMEM_ERROR("Could not allocate mem region entry\n");
+                return -1;
+            }
+            newent->mem = mem;
+            list_add_tail(&newent->mem_ent, list);
+        }
+    }
+
+    return 0;
+}
+
 static void *kmem_private_start;
 static void *kmem_private_end;
 
@@ -384,6 +462,8 @@ nk_kmem_init (void)
                 panic("Could not create kmem zone for region %u in domain %u\n", j, i);
                 return -1;
             }
+            // zones that cannot hold slabs are simply skipped by the slab layer
+            ent->slab_state = slab_zone_init(ent);
 	    total_phys_mem += ent->len;
             ++j;
         }
@@ -394,43 +474,16 @@ nk_kmem_init (void)
      * based on distance from its home node. 
      * We'll try to allocate from these in order */
     for (i = 0; i < sys->num_cpus; i++) {
-        struct list_head * local_regions = &(sys->cpus[i]->kmem.ordered_regions);
-        INIT_LIST_HEAD(local_regions);
-
-        // first add the local domain's regions
-        struct numa_domain * loc_dom = sys->cpus[i]->domain;
-        struct mem_region * mem = NULL;
-        list_for_each_entry(mem, &loc_dom->regions, entry) {
-            struct mem_reg_entry * newent = mm_boot_alloc(sizeof(struct mem_reg_entry));
-            if (!newent) {
-                KMEM_ERROR("Could not allocate mem region entry\n");
-                return -1;
-            }
-            newent->mem = mem;
-            KMEM_DEBUG("Adding region [%p] in domain %u to CPU %u's local region list\n",
-                    mem->base_addr, 
-                    loc_dom->id,
-                    i);
-            list_add_tail(&newent->mem_ent, local_regions);
+        if (build_ordered_regions(&(sys->cpus[i]->kmem.ordered_regions), sys->cpus[i]->domain)) {
+            return -1;
         }
+    }
 
-        struct domain_adj_entry * rem_dom_ent = NULL;
-        list_for_each_entry(rem_dom_ent, &loc_dom->adj_list, list_ent) {
-            struct numa_domain * rem_dom = rem_dom_ent->domain;
-            struct mem_region *rem_reg = NULL;
-
-            list_for_each_entry(rem_reg, &rem_dom->regions, entry) {
-                struct mem_reg_entry * newent = mm_boot_alloc(sizeof(struct mem_reg_entry));
-                if (!newent) {
-                    ERROR_PRINT("Could not allocate mem region entry\n");
-                    return -1;
-                }
-                newent->mem = rem_reg;
-                list_add_tail(&newent->mem_ent, local_regions);
-            }
-
+    /* and the same for each domain, for the non-local policies */
+    for (i = 0; i < numa_info->num_domains; i++) {
+        if (build_ordered_regions(&domain_regions[i], numa_info->domains[i])) {
+            return -1;
         }
-
     }
 
     total_mem = 0;
@@ -451,11 +504,21 @@ nk_kmem_init (void)
 
     KMEM_PRINT("Malloc configured to support a maximum of: 0x%lx bytes of physical memory\n", total_phys_mem);
 
-    if (block_hash_init(total_phys_mem)) { 
-      KMEM_ERROR("Failed to initialize block hash\n");
+    if (zone_dir_init()) { 
+      KMEM_ERROR("Failed to initialize zone directory\n");
       return -1;
     }
 
+    slab_init();
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    for (i = 0; i < sys->num_cpus; i++) {
+        sys->cpus[i]->kmem.slab = slab_cpu_init(i);
+    }
+
+    KMEM_PRINT("Per-CPU slab caches configured for allocations of up to %lu bytes\n", SLAB_MAX_SIZE);
+#endif
+
 
     // the assumption here is that no further boot_mm allocations will
     // be made by kmem from this point on
@@ -481,38 +544,143 @@ void kmem_inform_boot_allocation(void *low, void *high)
 }
 
 
+static inline void
+account_alloc (struct mem_region *region, uint64_t bytes)
+{
+    struct kmem_domain_stats *d = &domain_stats[region->domain_id];
+
+    __sync_fetch_and_add(&kmem_bytes_allocated, bytes);
+    __sync_fetch_and_add(&d->bytes_allocated, bytes);
+    __sync_fetch_and_add(&d->num_allocs, 1);
+
+    if (per_cpu_get(domain)->id != region->domain_id) {
+	__sync_fetch_and_add(&d->num_remote_allocs, 1);
+    }
+}
+
+static inline void
+account_free (struct mem_region *region, uint64_t bytes)
+{
+    struct kmem_domain_stats *d = &domain_stats[region->domain_id];
+
+    __sync_fetch_and_sub(&kmem_bytes_allocated, bytes);
+    __sync_fetch_and_sub(&d->bytes_allocated, bytes);
+    __sync_fetch_and_add(&d->num_frees, 1);
+}
+
+
+/*
+ * The zones to try, in order, for an allocation on behalf of a cpu
+ * (>=0) or, for cpu -1, under a policy.   For the bind policy, *bind
+ * is set to the only domain whose zones may be used, otherwise to -1.
+ */
+static struct list_head *
+placement (int cpu, nk_kmem_policy_t policy, int domain, int *bind)
+{
+    unsigned num_domains = nk_get_nautilus_info()->sys.locality_info.num_domains;
+
+    *bind = -1;
+
+    if (cpu >= 0 && cpu < nk_get_num_cpus()) {
+	return &(nk_get_nautilus_info()->sys.cpus[cpu]->kmem.ordered_regions);
+    }
+
+    switch (policy) {
+    case NK_KMEM_POLICY_INTERLEAVE:
+	return &domain_regions[__sync_fetch_and_add(&interleave_next, 1) % num_domains];
+    case NK_KMEM_POLICY_BIND:
+	*bind = domain;
+	return &domain_regions[domain];
+    case NK_KMEM_POLICY_PREFERRED:
+	return &domain_regions[domain];
+    case NK_KMEM_POLICY_LOCAL:
+    default:
+	return &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem.ordered_regions);
+    }
+}
+
+static inline int
+valid_policy (nk_kmem_policy_t policy, int domain)
+{
+    switch (policy) {
+    case NK_KMEM_POLICY_LOCAL:
+    case NK_KMEM_POLICY_INTERLEAVE:
+	return 1;
+    case NK_KMEM_POLICY_BIND:
+    case NK_KMEM_POLICY_PREFERRED:
+	return domain >= 0 && domain < nk_get_nautilus_info()->sys.locality_info.num_domains;
+    default:
+	return 0;
+    }
+}
+
+// The cpu magazines of the slab layer hold objects from that cpu's
+// nearest zones, which is only what the policy asks for if it is
+// local, or prefers the local domain.   Other policies are served
+// from the slab depots of the zones they select.
+static inline int
+slab_follows_policy (int cpu, nk_kmem_policy_t policy, int domain)
+{
+    struct cpu *c;
+
+    if (cpu >= 0 && cpu < nk_get_num_cpus()) {
+	return 1;
+    }
+
+    switch (policy) {
+    case NK_KMEM_POLICY_LOCAL:
+	return 1;
+    case NK_KMEM_POLICY_PREFERRED:
+	c = nk_get_nautilus_info()->sys.cpus[my_cpu_id()];
+	return c->domain && c->domain->id == domain;
+    default:
+	return 0;
+    }
+}
+
+// the current thread's policy, which is local until threads exist
+static inline nk_kmem_policy_t
+thread_policy (int *domain)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    if (!t) {
+	*domain = 0;
+	return NK_KMEM_POLICY_LOCAL;
+    }
+
+    *domain = t->mem_policy_domain;
+    return t->mem_policy;
+}
+
+
 /**
  * Allocates memory from the kernel memory pool. This will return a memory
  * region that is at least 16-byte aligned. The memory returned is 
  * optionally zeroed.
  *
  * Arguments:
- *       [IN] size: Amount of memory to allocate in bytes.
- *       [IN] cpu:  affinity cpu (-1 => current cpu)
- *       [IN] zero: Whether to zero the whole allocated block
+ *       [IN] size:   Amount of memory to allocate in bytes.
+ *       [IN] cpu:    affinity cpu (-1 => use the policy)
+ *       [IN] policy: placement policy if cpu is -1
+ *       [IN] domain: domain for the bind and preferred policies
+ *       [IN] zero:   Whether to zero the whole allocated block
  *
  * Returns:
  *       Success: Pointer to the start of the allocated memory.
  *       Failure: NULL
  */
 static void *
-_kmem_malloc (size_t size, int cpu, int zero)
+_kmem_malloc (size_t size, int cpu, nk_kmem_policy_t policy, int domain, int zero)
 {
     NK_GPIO_OUTPUT_MASK(0x20,GPIO_OR);
     int first = 1;
     void *block = 0;
-    struct kmem_block_hdr *hdr = NULL;
+    struct kmem_page *pg = NULL;
     struct mem_reg_entry * reg = NULL;
+    struct list_head * regions;
     ulong_t order;
-    cpu_id_t my_id;
-
-    if (cpu<0 || cpu>= nk_get_num_cpus()) {
-	my_id = my_cpu_id();
-    } else {
-	my_id = cpu;
-    }
-
-    struct kmem_data * my_kmem = &(nk_get_nautilus_info()->sys.cpus[my_id]->kmem);
+    int bind;
 
     KMEM_DEBUG("malloc of %lu bytes (zero=%d) from:\n",size,zero);
     KMEM_DEBUG_BACKTRACE();
@@ -524,6 +692,29 @@ _kmem_malloc (size_t size, int cpu, int zero)
     }
 #endif
 
+    // choose the zones once, since interleaving advances on each choice
+    regions = placement(cpu, policy, domain, &bind);
+
+    // small allocations are served by the slab layer when possible,
+    // from the zones the placement policy selects, otherwise we fall
+    // through to the buddy zones
+    if (size <= SLAB_MAX_SIZE) {
+	if (slab_follows_policy(cpu, policy, domain)) {
+	    block = slab_alloc(size, (cpu<0 || cpu>=nk_get_num_cpus()) ? -1 : cpu);
+	} else {
+	    block = slab_alloc_placed(size, regions, bind);
+	}
+	if (block) {
+	    KMEM_DEBUG("malloc succeeded from slab: size %lu -> 0x%lx\n", size, block);
+	    if (zero) {
+		memset(block,0,size);
+	    }
+	    NK_HEAP_PROF_ALLOC(block,size);
+	    NK_GPIO_OUTPUT_MASK(~0x20,GPIO_AND);
+	    return block;
+	}
+    }
+
     /* Calculate the block order needed */
     order = ilog2(roundup_pow_of_two(size));
     if (order < MIN_ORDER) {
@@ -533,39 +724,41 @@ _kmem_malloc (size_t size, int cpu, int zero)
  retry:
 
     /* scan the blocks in order of affinity */
-    list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+    list_for_each_entry(reg, regions, mem_ent) {
         struct buddy_mempool * zone = reg->mem->mm_state;
 
+	if (bind >= 0 && reg->mem->domain_id != bind) {
+	    continue;
+	}
+
         /* Allocate memory from the underlying buddy system */
-        uint8_t flags = spin_lock_irq_save(&zone->lock);
         block = buddy_alloc(zone, order);
-        spin_unlock_irq_restore(&zone->lock, flags);
-
-	if (block) {
-	  hdr = block_hash_alloc(block);
-	  if (!hdr) {
-            KMEM_ERROR("malloc cannot allocate header, releasing block\n");
-	    flags = spin_lock_irq_save(&zone->lock);
-	    buddy_free(zone,block,order);
-	    spin_unlock_irq_restore(&zone->lock, flags);
-	    block=0;
-	  }
-	}
 
-        if (hdr) {
-	    hdr->addr = block;
-            hdr->zone = zone;
+        if (block) {
+	    // the block is ours, and so is the descriptor of its first page
+	    pg = &reg->mem->page_desc[((addr_t)block - zone->base_addr) >> KMEM_PAGE_ORDER];
+	    pg->order = order;
+	    pg->attrs = 0;
+	    pg->flags = 0;
 	    // force a software barrier here, since our next write must come last
 	    __asm__ __volatile__ ("" :::"memory");
-	    hdr->order = order; // allocation complete
+	    pg->type = KMEM_PAGE_BLOCK; // allocation complete
+	    account_alloc(reg->mem, 1UL << order);
             break;
         }
         
     }
 
-    if (hdr) {
-        kmem_bytes_allocated += (1UL << order);
-    } else {
+    if (!block) {
+	// the zones may still be filling in the background, so wait for
+	// them if we can yield, that is, if we are a preemptible thread.
+	// Otherwise fail as if there were no background initialization
+	if (mm_boot_kmem_deferred_pending() && get_cur_thread() && !in_interrupt_context() &&
+	    irqs_enabled() && !preempt_is_disabled()) {
+	    KMEM_DEBUG("malloc waiting for background memory initialization for size %lu\n",size);
+	    nk_yield();
+	    goto retry;
+	}
 	// attempt to get memory back by reaping threads now...
 	if (first) {
 	    KMEM_ERROR("malloc initially failed for size %lu order %lu attempting reap\n",size,order);
@@ -581,7 +774,8 @@ _kmem_malloc (size_t size, int cpu, int zero)
     KMEM_DEBUG("malloc succeeded: size %lu order %lu -> 0x%lx\n",size, order, block);
  
     if (zero) { 
-	memset(block,0,1ULL << hdr->order);
+	// large blocks are zeroed with streaming stores
+	nk_memzero(block,1ULL << order);
     }
      
 #if SANITY_CHECK_PER_OP
@@ -591,6 +785,8 @@ _kmem_malloc (size_t size, int cpu, int zero)
     }
 #endif
 
+    NK_HEAP_PROF_ALLOC(block,size);
+
     NK_GPIO_OUTPUT_MASK(~0x20,GPIO_AND);
 
     /* Return address of the block */
@@ -600,17 +796,68 @@ _kmem_malloc (size_t size, int cpu, int zero)
 
 void *kmem_malloc(size_t size)
 {
-    return _kmem_malloc(size,-1,0);
+    int domain;
+    nk_kmem_policy_t policy = thread_policy(&domain);
+
+    return _kmem_malloc(size,-1,policy,domain,0);
 }
 
 void *kmem_mallocz(size_t size)
 {
-    return _kmem_malloc(size,-1,1);
+    int domain;
+    nk_kmem_policy_t policy = thread_policy(&domain);
+
+    return _kmem_malloc(size,-1,policy,domain,1);
 }
 
 void *kmem_malloc_specific(size_t size, int cpu, int zero)
 {
-    return _kmem_malloc(size,cpu,zero);
+    int domain;
+    nk_kmem_policy_t policy = thread_policy(&domain);
+
+    return _kmem_malloc(size,cpu,policy,domain,zero);
+}
+
+void *kmem_malloc_policy(size_t size, nk_kmem_policy_t policy, int domain, int zero)
+{
+    if (!valid_policy(policy, domain)) {
+	KMEM_ERROR("Invalid policy %d (domain %d) for malloc\n", policy, domain);
+	return NULL;
+    }
+
+    return _kmem_malloc(size,-1,policy,domain,zero);
+}
+
+
+int kmem_set_thread_policy(nk_kmem_policy_t policy, int domain)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    if (!t || !valid_policy(policy, domain)) {
+	KMEM_ERROR("Cannot set thread policy %d (domain %d)\n", policy, domain);
+	return -1;
+    }
+
+    t->mem_policy_domain = domain;
+    t->mem_policy = policy;
+
+    return 0;
+}
+
+void kmem_get_thread_policy(nk_kmem_policy_t *policy, int *domain)
+{
+    *policy = thread_policy(domain);
+}
+
+const char *kmem_policy_name(nk_kmem_policy_t policy)
+{
+    switch (policy) {
+    case NK_KMEM_POLICY_LOCAL:      return "local";
+    case NK_KMEM_POLICY_INTERLEAVE: return "interleave";
+    case NK_KMEM_POLICY_BIND:       return "bind";
+    case NK_KMEM_POLICY_PREFERRED:  return "preferred";
+    default:                        return "unknown";
+    }
 }
 
 /**
@@ -619,15 +866,15 @@ void *kmem_malloc_specific(size_t size, int cpu, int zero)
  * Arguments:
  *       [IN] addr: Address of the memory region to free.
  *
- * NOTE: The size of the memory region being freed is assumed to be in a
- *       'struct kmem_block_hdr' header located immediately before the address
- *       passed in by the caller. This header is created and initialized by
- *       kmem_alloc().
+ * NOTE: The size of the memory region being freed is found either from
+ *       the slab containing it or from the descriptor of its first page.
+ *       Both are located from the address in constant time.
  */
 void
 kmem_free (void * addr)
 {
-    struct kmem_block_hdr *hdr;
+    struct mem_region *region = NULL;
+    struct kmem_page *pg;
     struct buddy_mempool * zone;
     uint64_t order;
 
@@ -646,41 +893,42 @@ kmem_free (void * addr)
         return;
     }
 
+    NK_HEAP_PROF_FREE(addr);
 
-    // Note that if the user is doing a double-free, it is possible
-    // that we race on the block hash entry and so could end up invoking
-    // the buddy free more than once
+    if (!slab_free(addr)) {
+	KMEM_DEBUG("free succeeded to slab: addr=0x%lx\n",addr);
+	return;
+    }
 
-    hdr = block_hash_find_entry(addr);
+    pg = kmem_page_of(addr, &region);
 
-    if (!hdr) { 
+    if (!pg || !kmem_page_aligned(region, addr) || pg->type != KMEM_PAGE_BLOCK) { 
       KMEM_ERROR("Failed to find entry for block %p in kmem_free()\n",addr);
       KMEM_ERROR_BACKTRACE();
       return;
     }
 
-    zone = hdr->zone;
-    order = hdr->order;
+    if (pg->attrs & KMEM_PAGE_EXTENT) {
+      KMEM_ERROR("Extent %p must be freed with kmem_free_extent(), not kmem_free()\n",addr);
+      KMEM_ERROR_BACKTRACE();
+      return;
+    }
+
+    zone = region->mm_state;
+    order = pg->order;
 
-    // Sanity check things here
-    // this will in some cases catch a double free that is causing a
-    // race on the header
-    if (!zone || order<MIN_ORDER) {
-	KMEM_ERROR("Likely double free ignored- addr=%p, zone=%p order=%lu, hdr=%p, hdr->addr=%p, hdr->order=%lu\n", addr,zone, order, hdr,hdr->addr,hdr->order);
+    // If the user is doing a double-free, we may race with the other
+    // free here - only one of us can retire the descriptor
+    if (!__sync_bool_compare_and_swap(&pg->type, KMEM_PAGE_BLOCK, KMEM_PAGE_FREE)) {
+	KMEM_ERROR("Likely double free ignored- addr=%p, zone=%p order=%lu\n", addr, zone, order);
 	BACKTRACE(KMEM_ERROR,3);
-	// avoid freeing the header a second time
-	// block_hash_free_entry(hdr);
 	return;
     }
 
-    
     /* Return block to the underlying buddy system */
-    uint8_t flags = spin_lock_irq_save(&zone->lock);
-    kmem_bytes_allocated -= (1UL << order);
+    account_free(region, 1UL << order);
     buddy_free(zone, addr, order);
-    spin_unlock_irq_restore(&zone->lock, flags);
     KMEM_DEBUG("free succeeded: addr=0x%lx order=%lu\n",addr,order);
-    block_hash_free_entry(hdr);
 
 #if SANITY_CHECK_PER_OP
     if (kmem_sanity_check()) { 
@@ -692,16 +940,272 @@ kmem_free (void * addr)
 }
 
 /*
- * This is a *dead simple* implementation of realloc that tries to change the
- * size of the allocation pointed to by ptr to size, and returns ptr.  Realloc will
- * malloc a new block of memory, copy as much of the old data as it can, and free the
- * old block. If ptr is NULL, this is equivalent to a malloc for the specified size.
+ * Carve an extent of size bytes, aligned to align, out of a block of
+ * the given order.  The head and tail of the block that the extent
+ * does not need go back to the zone, and the extent itself is recorded 
+ * as the sequence of zone-aligned blocks that make it up, so that
+ * kmem_find_block() and friends see ordinary blocks.
  *
+ * Returns the extent, or NULL (having freed the block) if it does not fit.
+ */
+static void *
+carve_extent (struct mem_region *region, void *block, ulong_t order, size_t size, size_t align)
+{
+    struct buddy_mempool *zone = region->mm_state;
+    uint64_t blk_start = (addr_t)block - zone->base_addr;
+    uint64_t blk_end = blk_start + (1ULL << order);
+    uint64_t start = (((addr_t)block + align - 1) & ~(align - 1)) - zone->base_addr;
+    uint64_t end = start + size;
+    uint64_t off;
+    ulong_t  o;
+
+    if (end > blk_end) {
+	buddy_free(zone, block, order);
+	return NULL;
+    }
+
+    for (off = start; off < end; off += 1ULL << o) {
+	struct kmem_page *pg = &region->page_desc[off >> KMEM_PAGE_ORDER];
+	o = piece_order(zone, off, end);
+	pg->order = o;
+	pg->attrs = KMEM_PAGE_EXTENT;
+	pg->flags = 0;
+	__asm__ __volatile__ ("" :::"memory");
+	pg->type = KMEM_PAGE_BLOCK;
+    }
+
+    for (off = blk_start; off < start; off += 1ULL << o) {
+	o = piece_order(zone, off, start);
+	buddy_free(zone, (void*)(zone->base_addr + off), o);
+    }
+
+    for (off = end; off < blk_end; off += 1ULL << o) {
+	o = piece_order(zone, off, blk_end);
+	buddy_free(zone, (void*)(zone->base_addr + off), o);
+    }
+
+    return (void*)(zone->base_addr + start);
+}
+
+/**
+ * Allocates an extent of exactly size bytes (rounded up to a page)
+ * whose address is a multiple of align, a power of two.   Unlike 
+ * kmem_malloc(), a 1.1 GB request consumes 1.1 GB of the zone, not 2 GB.
+ *
+ * Arguments:
+ *       [IN] size:  Amount of memory to allocate in bytes.
+ *       [IN] align: Required alignment (at least a page)
+ *       [IN] cpu:   affinity cpu (-1 => the current thread's policy)
+ *       [IN] zero:  Whether to zero the extent
+ *
+ * Returns:
+ *       Success: Pointer to the start of the extent
+ *       Failure: NULL
+ */
+void *
+kmem_malloc_extent (size_t size, size_t align, int cpu, int zero)
+{
+    struct mem_reg_entry * reg = NULL;
+    struct list_head * regions;
+    nk_kmem_policy_t policy;
+    void *extent = NULL;
+    void *block;
+    ulong_t order;
+    int domain, bind;
+
+    if (!size || (align & (align - 1))) {
+	KMEM_ERROR("Invalid extent request: size %lu align %lu\n", size, align);
+	return NULL;
+    }
+
+    size = (size + KMEM_PAGE_SIZE - 1) & ~(KMEM_PAGE_SIZE - 1);
+
+    if (align < KMEM_PAGE_SIZE) {
+	align = KMEM_PAGE_SIZE;
+    }
+
+    order = ilog2(roundup_pow_of_two(size));
+
+    KMEM_DEBUG("malloc extent of %lu bytes align %lu (zero=%d)\n", size, align, zero);
+
+    policy = thread_policy(&domain);
+    regions = placement(cpu, policy, domain, &bind);
+
+    list_for_each_entry(reg, regions, mem_ent) {
+        struct buddy_mempool * zone = reg->mem->mm_state;
+
+	if (bind >= 0 && reg->mem->domain_id != bind) {
+	    continue;
+	}
+
+	// A block of the extent's order suffices if the zone happens to 
+	// give us a suitably aligned one, otherwise one twice the size
+	// of the larger of the extent and its alignment always does.
+	if ((block = buddy_alloc(zone, order)) &&
+	    (extent = carve_extent(reg->mem, block, order, size, align))) {
+	    break;
+	}
+
+	ulong_t big = (align > (1ULL << order) ? ilog2(align) : order) + 1;
+
+	if (big <= zone->pool_order && 
+	    (block = buddy_alloc(zone, big)) &&
+	    (extent = carve_extent(reg->mem, block, big, size, align))) {
+	    break;
+	}
+    }
+
+    if (!extent) {
+	KMEM_ERROR("malloc extent failed for size %lu align %lu\n", size, align);
+	return NULL;
+    }
+
+    account_alloc(reg->mem, size);
+
+    KMEM_DEBUG("malloc extent succeeded: size %lu -> %p\n", size, extent);
+
+    if (zero) {
+	nk_memzero(extent, size);
+    }
+
+    NK_HEAP_PROF_ALLOC(extent, size);
+
+    return extent;
+}
+
+/**
+ * Frees an extent previously allocated with kmem_malloc_extent()
+ *
+ * Arguments:
+ *       [IN] addr: Address of the extent
+ *       [IN] size: Size it was allocated with
+ */
+void
+kmem_free_extent (void * addr, size_t size)
+{
+    struct mem_region *region = NULL;
+    struct buddy_mempool *zone;
+    struct kmem_page *pg;
+    uint64_t start, end, off;
+    ulong_t o;
+
+    pg = kmem_page_of(addr, &region);
+
+    if (!pg || !kmem_page_aligned(region, addr) || pg->type != KMEM_PAGE_BLOCK ||
+	!(pg->attrs & KMEM_PAGE_EXTENT)) {
+	KMEM_ERROR("Failed to find extent %p in kmem_free_extent()\n", addr);
+	KMEM_ERROR_BACKTRACE();
+	return;
+    }
+
+    NK_HEAP_PROF_FREE(addr);
+
+    zone = region->mm_state;
+    size = (size + KMEM_PAGE_SIZE - 1) & ~(KMEM_PAGE_SIZE - 1);
+    start = (addr_t)addr - zone->base_addr;
+    end = start + size;
+
+    if (end > region->len) {
+	KMEM_ERROR("Extent %p of size %lu extends beyond its zone\n", addr, size);
+	return;
+    }
+
+    for (off = start; off < end; off += 1ULL << o) {
+	o = piece_order(zone, off, end);
+	pg = &region->page_desc[off >> KMEM_PAGE_ORDER];
+	if (pg->order != o || !(pg->attrs & KMEM_PAGE_EXTENT) ||
+	    !__sync_bool_compare_and_swap(&pg->type, KMEM_PAGE_BLOCK, KMEM_PAGE_FREE)) {
+	    KMEM_ERROR("Extent %p does not match size %lu at offset 0x%lx (double free?)\n", 
+		       addr, size, off - start);
+	    BACKTRACE(KMEM_ERROR,3);
+	    account_free(region, off - start);
+	    return;
+	}
+	buddy_free(zone, (void*)(zone->base_addr + off), o);
+    }
+
+    account_free(region, size);
+
+    KMEM_DEBUG("free extent succeeded: addr=%p size=%lu\n", addr, size);
+}
+
+
+static inline void
+count_realloc (int in_place, uint64_t bytes)
+{
+    struct kmem_realloc_stats *r = &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem.realloc);
+
+    __sync_fetch_and_add(&r->calls, 1);
+    if (in_place) {
+	__sync_fetch_and_add(&r->in_place, 1);
+	__sync_fetch_and_add(&r->bytes_not_copied, bytes);
+    } else {
+	__sync_fetch_and_add(&r->bytes_copied, bytes);
+    }
+}
+
+/*
+ * Try to resize a block without moving it.   A block can always shrink
+ * (the upper part goes back to the zone), and it can grow if it is
+ * the lower buddy at each order it grows through and those buddies
+ * are free.   Since buddy_alloc() hands out the lower part of the
+ * blocks it splits, this is often the case for a block that is
+ * repeatedly doubled.  Returns nonzero if the block has to move.
+ */
+static int
+realloc_in_place (struct mem_region *region, struct kmem_page *pg, void *ptr, size_t size)
+{
+    ulong_t order = pg->order;
+    ulong_t new_order = ilog2(roundup_pow_of_two(size));
+
+    if (new_order < MIN_ORDER) {
+	new_order = MIN_ORDER;
+    }
+
+    if (new_order == order) {
+	return 0;
+    }
+
+    if (new_order < order) {
+	pg->order = new_order;
+	buddy_shrink(region->mm_state, ptr, order, new_order);
+	__sync_fetch_and_sub(&kmem_bytes_allocated, (1UL << order) - (1UL << new_order));
+	__sync_fetch_and_sub(&domain_stats[region->domain_id].bytes_allocated, (1UL << order) - (1UL << new_order));
+	KMEM_DEBUG("realloc shrank %p from order %lu to %lu\n", ptr, order, new_order);
+	return 0;
+    }
+
+    if (!buddy_grow(region->mm_state, ptr, order, new_order)) {
+	pg->order = new_order;
+	__sync_fetch_and_add(&kmem_bytes_allocated, (1UL << new_order) - (1UL << order));
+	__sync_fetch_and_add(&domain_stats[region->domain_id].bytes_allocated, (1UL << new_order) - (1UL << order));
+	KMEM_DEBUG("realloc grew %p from order %lu to %lu\n", ptr, order, new_order);
+	return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Change the size of the allocation pointed to by ptr to size, 
+ * preserving its contents up to the lesser of the old and new sizes.
+ * If ptr is NULL, this is equivalent to a malloc for the specified size.
+ *
+ * Blocks are resized in place whenever the buddy allocator allows it,
+ * and slab objects stay put if the new size still fits and would not
+ * waste more than half the object.  Otherwise we malloc a new block,
+ * copy, and free the old one.   
+ *
+ * Large blocks cannot be moved by remapping their pages, since kmem
+ * addresses are identity mapped and identify their zone, so instead
+ * the copy uses streaming stores once it is large enough to wipe out
+ * the cache.
  */
 void * 
 kmem_realloc (void * ptr, size_t size)
 {
-	struct kmem_block_hdr *hdr;
+	struct mem_region *region = NULL;
+	struct kmem_page *pg = NULL;
 	size_t old_size;
 	void * tmp = NULL;
 
@@ -710,30 +1214,68 @@ kmem_realloc (void * ptr, size_t size)
 		return kmem_malloc(size);
 	}
 
-	hdr = block_hash_find_entry(ptr);
+	old_size = slab_size_of(ptr);
+
+	if (old_size) {
+		if (size <= old_size && size > old_size/2) {
+			count_realloc(1, size);
+			return ptr;
+		}
+	} else {
+		pg = kmem_page_of(ptr, &region);
+
+		if (!pg || !kmem_page_aligned(region, ptr) || pg->type != KMEM_PAGE_BLOCK) {
+			KMEM_ERROR("Realloc failed to find entry for block %p\n", ptr);
+			return NULL;
+		}
+
+		if (pg->attrs & KMEM_PAGE_EXTENT) {
+			KMEM_ERROR("Cannot realloc extent %p\n", ptr);
+			return NULL;
+		}
+
+		old_size = 1ULL << pg->order;
 
-	if (!hdr) {
-		KMEM_ERROR("Realloc failed to find entry for block %p\n", ptr);
-		return NULL;
+		if (!realloc_in_place(region, pg, ptr, size)) {
+			count_realloc(1, old_size < size ? old_size : size);
+			return ptr;
+		}
 	}
 
-	old_size = 1 << hdr->order;
 	tmp = kmem_malloc(size);
 	if (!tmp) {
 		panic("Realloc failed\n");
 	}
 
 	if (old_size >= size) {
-		memcpy(tmp, ptr, size);
+		nk_memcpy_bulk(tmp, ptr, size);
 	} else {
-		memcpy(tmp, ptr, old_size);
+		nk_memcpy_bulk(tmp, ptr, old_size);
 	}
+
+	count_realloc(0, old_size < size ? old_size : size);
 	
 	kmem_free(ptr);
 	return tmp;
 }
 
 
+void kmem_realloc_stats(struct kmem_realloc_stats *stats)
+{
+    int i;
+
+    memset(stats,0,sizeof(*stats));
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	struct kmem_realloc_stats *r = &(nk_get_nautilus_info()->sys.cpus[i]->kmem.realloc);
+	stats->calls += r->calls;
+	stats->in_place += r->in_place;
+	stats->bytes_copied += r->bytes_copied;
+	stats->bytes_not_copied += r->bytes_not_copied;
+    }
+}
+
+
 typedef enum {GET,COUNT} stat_type_t;
 
 static uint64_t _kmem_stats(struct kmem_stats *stats, stat_type_t what)
@@ -789,6 +1331,15 @@ void kmem_stats(struct kmem_stats *stats)
     _kmem_stats(stats,GET);
 }
 
+void kmem_domain_stats(unsigned domain, struct kmem_domain_stats *stats)
+{
+    if (domain >= MAX_NUMA_DOMAINS) {
+	memset(stats,0,sizeof(*stats));
+    } else {
+	*stats = domain_stats[domain];
+    }
+}
+
 int kmem_sanity_check()
 {
     int rc=0;
@@ -816,15 +1367,13 @@ void  kmem_get_internal_pointer_range(void **start, void **end)
 
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags)
 {
-    uint64_t i;
     uint64_t order;
     addr_t   zone_base;
-    uint64_t zone_min_order;
     uint64_t zone_max_order;
     addr_t   any_offset;
     struct mem_region *reg;
 
-    if (!(reg = kmem_get_region_by_addr((addr_t)any_addr))) {
+    if (!(reg = kmem_get_region_by_addr(va_to_pa((addr_t)any_addr)))) {
 	// not in any region we manage
 	return -1;
     }
@@ -838,23 +1387,35 @@ int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, ui
 	return 0;
     }
 
+    if (!slab_find_object(any_addr, block_addr, block_size, flags)) {
+	KMEM_DEBUG("Search of %p found slab object %p\n", any_addr, *block_addr);
+	return 0;
+    }
+
     zone_base = reg->mm_state->base_addr;
-    zone_min_order = reg->mm_state->min_order;
     zone_max_order = reg->mm_state->pool_order;
 
     any_offset = (addr_t)any_addr - (addr_t)zone_base;
     
-    for (order=zone_min_order;order<=zone_max_order;order++) {
+    // the block containing the address, if any, starts at the 
+    // address rounded down to its own size
+    for (order=MIN_ORDER;order<=zone_max_order;order++) {
 	addr_t mask = ~((1ULL << order)-1);
-	void *search_addr = (void*)(zone_base + (any_offset & mask));
-	struct kmem_block_hdr *hdr = block_hash_find_entry(search_addr);
-	// must exist and must be allocated
-	if (hdr && hdr->order>=MIN_ORDER) { 
-	    *block_addr = search_addr;
-	    *block_size = 0x1ULL<<hdr->order;
-	    *flags = hdr->flags;
+	addr_t search_offset = any_offset & mask;
+	struct kmem_page *pg;
+
+	if (search_offset >= reg->len) {
+	    continue;
+	}
+
+	pg = &reg->page_desc[search_offset >> KMEM_PAGE_ORDER];
+
+	// must be allocated and must be of this size
+	if (pg->type==KMEM_PAGE_BLOCK && pg->order==order) { 
+	    *block_addr = (void*)(zone_base + search_offset);
+	    *block_size = 0x1ULL<<order;
+	    *flags = pg->flags;
 	    return 0;
-	    
 	}
     }
     return -1;
@@ -870,12 +1431,19 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
 
     } else {
 
-	struct kmem_block_hdr *h =  block_hash_find_entry(block_addr);
+	struct mem_region *region;
+	struct kmem_page *pg;
+
+	if (!slab_set_object_flags(block_addr, flags)) {
+	    return 0;
+	}
+
+	pg = kmem_page_of(block_addr, &region);
 	
-	if (!h || h->order<MIN_ORDER) { 
+	if (!pg || !kmem_page_aligned(region, block_addr) || pg->type!=KMEM_PAGE_BLOCK) { 
 	    return -1;
 	} else {
-	    h->flags = flags;
+	    pg->flags = flags & KMEM_FLAGS_MASK;
 	    return 0;
 	}
     }
@@ -884,30 +1452,42 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
 // applies only to allocated blocks
 int  kmem_mask_all_blocks_flags(uint64_t mask, int or)
 {
-    uint64_t i;
+    struct mem_region *region;
+    uint64_t i, n;
 
     if (!or) { 
 	boot_flags &= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags &= mask;
-	    }
-	}
     } else {
 	boot_flags |= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags |= mask;
+    }
+
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	n = KMEM_NUM_PAGES(region->len);
+	for (i=0;i<n;) { 
+	    struct kmem_page *pg = &region->page_desc[i];
+	    if (pg->type==KMEM_PAGE_BLOCK) { 
+		if (!or) { 
+		    pg->flags &= mask;
+		} else {
+		    pg->flags = (pg->flags | mask) & KMEM_FLAGS_MASK;
+		}
+		// skip the remaining pages of the block
+		i += 1ULL << (pg->order - KMEM_PAGE_ORDER);
+	    } else {
+		i++;
 	    }
 	}
     }
 
+    slab_mask_all_object_flags(mask, or);
+
     return 0;
 }
     
 int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state)
 {
-    uint64_t i;
+    struct mem_region *region;
+    uint64_t i, n;
     
     if (((boot_flags & mask) == flags)) {
 	if (func(boot_start,state)) { 
@@ -915,17 +1495,26 @@ int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(vo
 	}
     }
 
-    for (i=0;i<block_hash_num_entries;i++) { 
-	if (block_hash_entries[i].order>=MIN_ORDER) { 
-	    if ((block_hash_entries[i].flags & mask) == flags) {
-		if (func(block_hash_entries[i].addr,state)) { 
-		    return -1;
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	n = KMEM_NUM_PAGES(region->len);
+	for (i=0;i<n;) { 
+	    struct kmem_page *pg = &region->page_desc[i];
+	    if (pg->type==KMEM_PAGE_BLOCK) { 
+		// the callback may free the block, so capture its size first
+		uint64_t pages = 1ULL << (pg->order - KMEM_PAGE_ORDER);
+		if ((pg->flags & mask) == flags) {
+		    if (func((void*)(region->mm_state->base_addr + (i << KMEM_PAGE_ORDER)),state)) { 
+			return -1;
+		    }
 		}
+		i += pages;
+	    } else {
+		i++;
 	    }
 	}
     } 
-    
-    return 0;
+
+    return slab_apply_to_matching_objects(mask, flags, func, state);
 }
     
 
@@ -978,6 +1567,42 @@ void *realloc(void *p, size_t n)
     return ext_realloc(p,n);
 }
 
+#ifdef NAUT_CONFIG_KMEM_SLAB
+static void
+handle_meminfo_slab (int detail)
+{
+    struct slab_class_stats total[SLAB_NUM_CLASSES];
+    struct slab_class_stats cur[SLAB_NUM_CLASSES];
+    uint64_t num_slabs[SLAB_NUM_CLASSES];
+    int i, j;
+
+    memset(total,0,sizeof(total));
+
+    slab_num_slabs(num_slabs);
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+        slab_cpu_stats(i,cur);
+        for (j=0;j<SLAB_NUM_CLASSES;j++) {
+            if (detail && (cur[j].hits || cur[j].misses)) {
+                nk_vc_printf("  cpu %d slab %lu: %lu hits %lu misses %lu frees %lu flushes\n",
+                             i, slab_class_size(j), cur[j].hits, cur[j].misses,
+                             cur[j].frees, cur[j].flushes);
+            }
+            total[j].hits += cur[j].hits;
+            total[j].misses += cur[j].misses;
+            total[j].frees += cur[j].frees;
+            total[j].flushes += cur[j].flushes;
+        }
+    }
+
+    for (j=0;j<SLAB_NUM_CLASSES;j++) {
+        nk_vc_printf("slab %lu: %lu slabs %lu hits %lu misses %lu frees %lu flushes\n",
+                     slab_class_size(j), num_slabs[j], total[j].hits, total[j].misses,
+                     total[j].frees, total[j].flushes);
+    }
+}
+#endif
+
 static int
 handle_meminfo (char * buf, void * priv)
 {
@@ -1010,6 +1635,24 @@ handle_meminfo (char * buf, void * priv)
 
     free(s);
 
+    {
+        struct kmem_realloc_stats r;
+        kmem_realloc_stats(&r);
+        nk_vc_printf("realloc: %lu calls %lu in place %lu bytes copied %lu bytes not copied\n",
+                     r.calls, r.in_place, r.bytes_copied, r.bytes_not_copied);
+    }
+
+    for (i=0;i<nk_get_num_domains();i++) {
+        struct kmem_domain_stats d;
+        kmem_domain_stats(i,&d);
+        nk_vc_printf("domain %lu: %lu bytes managed %lu bytes allocated\n  %lu allocs (%lu remote) %lu frees\n",
+                     i, d.bytes_managed, d.bytes_allocated, d.num_allocs, d.num_remote_allocs, d.num_frees);
+    }
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    handle_meminfo_slab(strstr(buf,"detail")!=0);
+#endif
+
     return 0;
 }
 
@@ -1022,6 +1665,52 @@ static struct shell_cmd_impl meminfo_impl = {
 nk_register_shell_cmd(meminfo_impl);
 
 
+static int
+handle_mempolicy (char * buf, void * priv)
+{
+    nk_kmem_policy_t policy;
+    char name[32];
+    int domain = 0;
+
+    if (sscanf(buf,"mempolicy %31s %d", name, &domain) < 1) {
+        kmem_get_thread_policy(&policy,&domain);
+        nk_vc_printf("%s", kmem_policy_name(policy));
+        if (policy==NK_KMEM_POLICY_BIND || policy==NK_KMEM_POLICY_PREFERRED) {
+            nk_vc_printf(" %d", domain);
+        }
+        nk_vc_printf("\n");
+        return 0;
+    }
+
+    if (!strcmp(name,"local")) {
+        policy = NK_KMEM_POLICY_LOCAL;
+    } else if (!strcmp(name,"interleave")) {
+        policy = NK_KMEM_POLICY_INTERLEAVE;
+    } else if (!strcmp(name,"bind")) {
+        policy = NK_KMEM_POLICY_BIND;
+    } else if (!strcmp(name,"preferred")) {
+        policy = NK_KMEM_POLICY_PREFERRED;
+    } else {
+        nk_vc_printf("Unknown policy %s\n", name);
+        return 0;
+    }
+
+    if (kmem_set_thread_policy(policy,domain)) {
+        nk_vc_printf("Cannot set policy %s domain %d\n", name, domain);
+    }
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl mempolicy_impl = {
+    .cmd      = "mempolicy",
+    .help_str = "mempolicy [local|interleave|bind d|preferred d]",
+    .handler  = handle_mempolicy,
+};
+nk_register_shell_cmd(mempolicy_impl);
+
+
 #define BYTES_PER_LINE 16
 
 static int
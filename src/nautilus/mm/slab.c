@@ -0,0 +1,777 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/buddy.h>
+#include <nautilus/slab.h>
+#include <nautilus/numa.h>
+#include <nautilus/paging.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/naut_assert.h>
+
+#ifndef NAUT_CONFIG_DEBUG_KMEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define SLAB_DEBUG(fmt, args...) DEBUG_PRINT("SLAB: " fmt, ##args)
+#define SLAB_ERROR(fmt, args...) ERROR_PRINT("SLAB: " fmt, ##args)
+#define SLAB_PRINT(fmt, args...) INFO_PRINT("SLAB: " fmt, ##args)
+
+#define SLAB_MAGIC 0x51ab51ab
+
+/*
+ * Every slab starts with this header.  Objects follow it, beginning
+ * at the first multiple of the object size past the header, so that
+ * power of two classes stay naturally aligned (relative to the zone,
+ * exactly as buddy blocks of the same size would be).
+ *
+ * Objects that have never been handed out are carved from the slab
+ * on demand (num_carved), so creating a slab does not touch all of
+ * its memory.  Objects that have been returned are kept on a free
+ * list threaded through their first word.
+ *
+ * With garbage collection, the header is followed by a word of
+ * metadata per object, holding SLAB_META_ALLOC when the object is
+ * allocated, and its kmem block flags.
+ */
+struct slab {
+    struct list_head   link;        // on depot->partial when it has free objects
+    struct slab_zone  *zone;
+    struct slab_depot *depot;
+    void              *free;
+    uint32_t           magic;
+    uint32_t           cls;
+    uint32_t           obj_size;
+    uint32_t           first_off;
+    uint32_t           num_objs;
+    uint32_t           num_carved;
+    uint32_t           num_inuse;
+#ifdef NAUT_CONFIG_GARBAGE_COLLECTION
+    uint32_t           meta[];
+#endif
+};
+
+#define SLAB_META_ALLOC  0x80000000U
+
+static const uint32_t class_sizes[SLAB_NUM_CLASSES] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256,
+    384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+// size class for each request size, in SLAB_MIN_SIZE granules
+static uint8_t size_to_class[SLAB_MAX_SIZE/SLAB_MIN_SIZE + 1];
+
+static inline int class_of(size_t size)
+{
+    return size_to_class[(size + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE];
+}
+
+static inline struct slab *slab_of(void *obj)
+{
+    // slab_zone_init only accepts zones whose base is slab-aligned
+    return (struct slab *)((addr_t)obj & ~(SLAB_SIZE-1));
+}
+
+static inline struct kmem_data *cpu_kmem(int cpu)
+{
+    return &(nk_get_nautilus_info()->sys.cpus[cpu]->kmem);
+}
+
+static inline int cpu_domain_is(int cpu, int domain)
+{
+    struct cpu *c = nk_get_nautilus_info()->sys.cpus[cpu];
+
+    return !c->domain || c->domain->id == domain;
+}
+
+static inline struct kmem_page *slab_page(struct mem_region *reg, struct slab *s)
+{
+    return &reg->page_desc[((addr_t)s - reg->mm_state->base_addr) >> KMEM_PAGE_ORDER];
+}
+
+static inline uint32_t obj_index(struct slab *s, void *obj)
+{
+    return ((addr_t)obj - (addr_t)s - s->first_off) / s->obj_size;
+}
+
+// track allocation state of an object for the garbage collector
+static inline void obj_mark(void *obj, int alloc)
+{
+#ifdef NAUT_CONFIG_GARBAGE_COLLECTION
+    struct slab *s = slab_of(obj);
+
+    s->meta[obj_index(s, obj)] = alloc ? SLAB_META_ALLOC : 0;
+#endif
+}
+
+
+void slab_init(void)
+{
+    uint64_t i;
+    int cls = 0;
+
+    for (i = 0; i <= SLAB_MAX_SIZE/SLAB_MIN_SIZE; i++) {
+	while (class_sizes[cls] < i*SLAB_MIN_SIZE) {
+	    cls++;
+	}
+	size_to_class[i] = cls;
+    }
+}
+
+
+struct slab_zone *slab_zone_init(struct mem_region *region)
+{
+    struct buddy_mempool *mp = region->mm_state;
+    struct slab_zone *sz;
+    int i;
+
+    if (!mp || mp->pool_order < SLAB_ORDER) {
+	SLAB_DEBUG("zone %p is too small for slabs\n", mp);
+	return NULL;
+    }
+
+    if (mp->base_addr & (SLAB_SIZE-1)) {
+	SLAB_DEBUG("zone %p base %p is not slab-aligned, not using it for slabs\n",
+		   mp, (void*)mp->base_addr);
+	return NULL;
+    }
+
+    sz = mm_boot_alloc(sizeof(struct slab_zone));
+    if (!sz) {
+	SLAB_ERROR("Failed to allocate slab zone\n");
+	return NULL;
+    }
+    memset(sz, 0, sizeof(*sz));
+
+    sz->region = region;
+    sz->mp = mp;
+
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+	spinlock_init(&sz->depot[i].lock);
+	INIT_LIST_HEAD(&sz->depot[i].partial);
+    }
+
+    SLAB_DEBUG("slab zone for %p\n", (void*)mp->base_addr);
+
+    return sz;
+}
+
+
+struct slab_cpu_cache *slab_cpu_init(int cpu)
+{
+    struct slab_cpu_cache *c = mm_boot_alloc(sizeof(struct slab_cpu_cache));
+
+    if (!c) {
+	SLAB_ERROR("Failed to allocate slab cache for cpu %d\n", cpu);
+	return NULL;
+    }
+
+    memset(c, 0, sizeof(*c));
+
+    return c;
+}
+
+
+// depot lock must be held
+static struct slab *slab_create(struct slab_zone *sz, int cls)
+{
+    struct slab *s;
+
+    s = buddy_alloc(sz->mp, SLAB_ORDER);
+
+    if (!s) {
+	return NULL;
+    }
+
+    s->zone = sz;
+    s->depot = &sz->depot[cls];
+    s->free = NULL;
+    s->magic = SLAB_MAGIC;
+    s->cls = cls;
+    s->obj_size = class_sizes[cls];
+#ifdef NAUT_CONFIG_GARBAGE_COLLECTION
+    {
+	// leave room for one word of metadata per object
+	uint32_t n = (SLAB_SIZE - sizeof(struct slab)) / (s->obj_size + sizeof(uint32_t));
+	s->first_off = ((sizeof(struct slab) + n*sizeof(uint32_t) + s->obj_size - 1) / s->obj_size) * s->obj_size;
+	s->num_objs = (SLAB_SIZE - s->first_off) / s->obj_size;
+	if (s->num_objs > n) {
+	    s->num_objs = n;
+	}
+	memset(s->meta, 0, n*sizeof(uint32_t));
+    }
+#else
+    s->first_off = ((sizeof(struct slab) + s->obj_size - 1) / s->obj_size) * s->obj_size;
+    s->num_objs = (SLAB_SIZE - s->first_off) / s->obj_size;
+#endif
+    s->num_carved = 0;
+    s->num_inuse = 0;
+
+    // descriptors of different slabs are written under different
+    // depot locks, but never concurrently for the same slab
+    slab_page(sz->region, s)->order = SLAB_ORDER;
+    __sync_synchronize();
+    slab_page(sz->region, s)->type = KMEM_PAGE_SLAB;
+
+    SLAB_DEBUG("created slab %p for class %d (%u objects of %u bytes)\n",
+	       s, cls, s->num_objs, s->obj_size);
+
+    return s;
+}
+
+// depot lock must be held
+static void slab_destroy(struct slab *s)
+{
+    struct slab_zone *sz = s->zone;
+
+    SLAB_DEBUG("returning empty slab %p of class %u to buddy\n", s, s->cls);
+
+    slab_page(sz->region, s)->type = KMEM_PAGE_FREE;
+    s->magic = 0;
+
+    buddy_free(sz->mp, s, SLAB_ORDER);
+}
+
+static inline int slab_has_free(struct slab *s)
+{
+    return s->free || s->num_carved < s->num_objs;
+}
+
+// depot lock must be held
+static inline void *slab_take(struct slab *s)
+{
+    void *obj;
+
+    if (s->free) {
+	obj = s->free;
+	s->free = *(void **)obj;
+    } else if (s->num_carved < s->num_objs) {
+	obj = (void *)((addr_t)s + s->first_off + (addr_t)s->num_carved * s->obj_size);
+	s->num_carved++;
+    } else {
+	return NULL;
+    }
+
+    if (!s->num_inuse++) {
+	s->depot->num_empty--;
+    }
+
+    return obj;
+}
+
+// depot lock must be held
+static inline void slab_give(struct slab *s, void *obj)
+{
+    struct slab_depot *d = s->depot;
+
+    if (!slab_has_free(s)) {
+	list_add_tail(&s->link, &d->partial);
+    }
+
+    *(void **)obj = s->free;
+    s->free = obj;
+
+    if (!--s->num_inuse) {
+	if (d->num_empty >= SLAB_EMPTY_KEEP) {
+	    list_del_init(&s->link);
+	    d->num_slabs--;
+	    slab_destroy(s);
+	} else {
+	    d->num_empty++;
+	}
+    }
+}
+
+
+/*
+ * Fetch up to n objects of class cls, trying the given zones in
+ * order, and only those of domain bind if it is not -1.   Existing
+ * partial slabs in a zone are used before a new slab is taken from
+ * its buddy allocator.   Returns the number of objects fetched.
+ */
+static int depot_get(struct list_head *regions, int bind, int cls, void **objs, int n)
+{
+    struct mem_reg_entry *reg;
+    int got = 0;
+
+    list_for_each_entry(reg, regions, mem_ent) {
+	struct slab_zone *sz = reg->mem->slab_state;
+	struct slab_depot *d;
+	uint8_t flags;
+
+	if (!sz || (bind >= 0 && reg->mem->domain_id != bind)) {
+	    continue;
+	}
+
+	d = &sz->depot[cls];
+
+	flags = spin_lock_irq_save(&d->lock);
+
+	while (got < n) {
+	    struct slab *s;
+
+	    if (list_empty(&d->partial)) {
+		s = slab_create(sz, cls);
+		if (!s) {
+		    break;
+		}
+		list_add(&s->link, &d->partial);
+		d->num_slabs++;
+		d->num_empty++;
+	    } else {
+		s = list_first_entry(&d->partial, struct slab, link);
+	    }
+
+	    while (got < n && slab_has_free(s)) {
+		objs[got++] = slab_take(s);
+	    }
+
+	    if (!slab_has_free(s)) {
+		list_del_init(&s->link);
+	    }
+	}
+
+	spin_unlock_irq_restore(&d->lock, flags);
+
+	if (got) {
+	    break;
+	}
+    }
+
+    return got;
+}
+
+// Return objects to their slabs, which may be in different zones
+static void depot_put(void **objs, int n)
+{
+    struct slab_depot *held = NULL;
+    uint8_t flags = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	struct slab *s = slab_of(objs[i]);
+
+	if (s->depot != held) {
+	    if (held) {
+		spin_unlock_irq_restore(&held->lock, flags);
+	    }
+	    held = s->depot;
+	    flags = spin_lock_irq_save(&held->lock);
+	}
+
+	slab_give(s, objs[i]);
+    }
+
+    if (held) {
+	spin_unlock_irq_restore(&held->lock, flags);
+    }
+}
+
+
+void *slab_alloc(size_t size, int cpu)
+{
+    struct slab_cpu_cache *c;
+    struct slab_magazine *m;
+    void *obj = NULL;
+    uint8_t flags;
+    int cls;
+    int my_id;
+
+    if (size > SLAB_MAX_SIZE) {
+	return NULL;
+    }
+
+    cls = class_of(size);
+
+    // interrupts off keeps us on this cpu and off its magazine
+    // while we are working with it
+    flags = irq_disable_save();
+
+    my_id = my_cpu_id();
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    c = cpu_kmem(my_id)->slab;
+#else
+    c = NULL;
+#endif
+
+    if ((cpu >= 0 && cpu != my_id) || !c) {
+	// on behalf of another cpu, so we cannot touch its magazine,
+	// or we have no magazines, so go to the depots directly
+	irq_enable_restore(flags);
+	if (!depot_get(&cpu_kmem(cpu >= 0 ? cpu : my_id)->ordered_regions, -1, cls, &obj, 1)) {
+	    return NULL;
+	}
+	obj_mark(obj, 1);
+	return obj;
+    }
+
+    m = &c->mag[cls];
+
+    if (m->count) {
+	c->stats[cls].hits++;
+    } else {
+	c->stats[cls].misses++;
+	m->count = depot_get(&cpu_kmem(my_id)->ordered_regions, -1, cls, m->objs, SLAB_MAG_BATCH);
+    }
+
+    if (m->count) {
+	obj = m->objs[--m->count];
+	obj_mark(obj, 1);
+    }
+
+    irq_enable_restore(flags);
+
+    return obj;
+}
+
+
+void *slab_alloc_placed(size_t size, struct list_head *regions, int bind)
+{
+    void *obj = NULL;
+
+    if (size > SLAB_MAX_SIZE) {
+	return NULL;
+    }
+
+    // the magazines hold objects from their cpu's nearest zones, so
+    // these come from the depots of the chosen zones
+    if (!depot_get(regions, bind, class_of(size), &obj, 1)) {
+	return NULL;
+    }
+
+    obj_mark(obj, 1);
+
+    return obj;
+}
+
+
+static struct slab *slab_find(void *addr)
+{
+    struct mem_region *reg = kmem_get_region_by_addr(va_to_pa((addr_t)addr));
+    struct slab *s;
+
+    if (!reg || !reg->slab_state) {
+	return NULL;
+    }
+
+    s = slab_of(addr);
+
+    if ((addr_t)s < reg->mm_state->base_addr ||
+	(addr_t)s - reg->mm_state->base_addr >= reg->len ||
+	slab_page(reg, s)->type != KMEM_PAGE_SLAB) {
+	return NULL;
+    }
+
+    if (s->magic != SLAB_MAGIC) {
+	SLAB_ERROR("slab %p for %p has a bad magic number (0x%x)\n", s, addr, s->magic);
+	return NULL;
+    }
+
+    if ((addr_t)addr < (addr_t)s + s->first_off ||
+	((addr_t)addr - (addr_t)s - s->first_off) % s->obj_size) {
+	SLAB_ERROR("%p is not the start of an object in slab %p\n", addr, s);
+	return NULL;
+    }
+
+    return s;
+}
+
+
+int slab_free(void *addr)
+{
+    struct slab_cpu_cache *c;
+    struct slab_magazine *m;
+    struct slab *s;
+    uint8_t flags;
+
+    if (!(s = slab_find(addr))) {
+	return -1;
+    }
+
+    obj_mark(addr, 0);
+
+    flags = irq_disable_save();
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    c = cpu_kmem(my_cpu_id())->slab;
+#else
+    c = NULL;
+#endif
+
+    // objects from another domain's zones, which placement policies
+    // ask for, go straight back so the magazine stays local
+    if (!c || !cpu_domain_is(my_cpu_id(), s->zone->region->domain_id)) {
+	irq_enable_restore(flags);
+	depot_put(&addr, 1);
+	return 0;
+    }
+
+    m = &c->mag[s->cls];
+
+    if (m->count == SLAB_MAG_SIZE) {
+	// the oldest half goes back, the hottest half stays
+	c->stats[s->cls].flushes++;
+	depot_put(m->objs, SLAB_MAG_BATCH);
+	memmove(m->objs, m->objs + SLAB_MAG_BATCH, (SLAB_MAG_SIZE - SLAB_MAG_BATCH) * sizeof(void *));
+	m->count -= SLAB_MAG_BATCH;
+    }
+
+    m->objs[m->count++] = addr;
+    c->stats[s->cls].frees++;
+
+    irq_enable_restore(flags);
+
+    return 0;
+}
+
+
+size_t slab_size_of(void *addr)
+{
+    struct slab *s = slab_find(addr);
+
+    return s ? s->obj_size : 0;
+}
+
+
+uint64_t slab_class_size(int cls)
+{
+    return class_sizes[cls];
+}
+
+
+void slab_cpu_stats(int cpu, struct slab_class_stats *stats)
+{
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    struct slab_cpu_cache *c = cpu_kmem(cpu)->slab;
+#else
+    struct slab_cpu_cache *c = NULL;
+#endif
+
+    if (c) {
+	memcpy(stats, c->stats, sizeof(c->stats));
+    } else {
+	memset(stats, 0, sizeof(c->stats));
+    }
+}
+
+
+void slab_num_slabs(uint64_t *num_slabs)
+{
+    struct nk_locality_info *numa = &(nk_get_nautilus_info()->sys.locality_info);
+    struct mem_region *reg;
+    unsigned i;
+    int j;
+
+    memset(num_slabs, 0, sizeof(uint64_t) * SLAB_NUM_CLASSES);
+
+    for (i = 0; i < numa->num_domains; i++) {
+	list_for_each_entry(reg, &(numa->domains[i]->regions), entry) {
+	    if (reg->slab_state) {
+		for (j = 0; j < SLAB_NUM_CLASSES; j++) {
+		    num_slabs[j] += reg->slab_state->depot[j].num_slabs;
+		}
+	    }
+	}
+    }
+}
+
+
+#ifdef NAUT_CONFIG_GARBAGE_COLLECTION
+
+// visit every live slab in every zone; stops if func returns nonzero
+static int for_each_slab(int (*func)(struct mem_region *reg, struct slab *s, void *state), void *state)
+{
+    struct nk_locality_info *numa = &(nk_get_nautilus_info()->sys.locality_info);
+    struct mem_region *reg;
+    uint64_t i, n;
+    unsigned d;
+
+    for (d = 0; d < numa->num_domains; d++) {
+	list_for_each_entry(reg, &(numa->domains[d]->regions), entry) {
+	    if (!reg->slab_state) {
+		continue;
+	    }
+	    // the zone base is slab-aligned, so slabs start every SLAB_SIZE
+	    n = KMEM_NUM_PAGES(reg->len);
+	    for (i = 0; i < n; i += SLAB_SIZE / KMEM_PAGE_SIZE) {
+		if (reg->page_desc[i].type == KMEM_PAGE_SLAB) {
+		    if (func(reg, (struct slab *)(reg->mm_state->base_addr + (i << KMEM_PAGE_ORDER)), state)) {
+			return -1;
+		    }
+		}
+	    }
+	}
+    }
+
+    return 0;
+}
+
+int slab_find_object(void *any_addr, void **obj_addr, uint64_t *obj_size, uint64_t *flags)
+{
+    struct mem_region *reg = kmem_get_region_by_addr(va_to_pa((addr_t)any_addr));
+    struct slab *s;
+    uint32_t idx;
+
+    if (!reg || !reg->slab_state) {
+	return -1;
+    }
+
+    s = slab_of(any_addr);
+
+    if ((addr_t)s < reg->mm_state->base_addr ||
+	(addr_t)s - reg->mm_state->base_addr >= reg->len ||
+	slab_page(reg, s)->type != KMEM_PAGE_SLAB ||
+	(addr_t)any_addr < (addr_t)s + s->first_off) {
+	return -1;
+    }
+
+    idx = obj_index(s, any_addr);
+
+    if (idx >= s->num_carved || !(s->meta[idx] & SLAB_META_ALLOC)) {
+	return -1;
+    }
+
+    *obj_addr = (void *)((addr_t)s + s->first_off + (addr_t)idx * s->obj_size);
+    *obj_size = s->obj_size;
+    *flags = s->meta[idx] & ~SLAB_META_ALLOC;
+
+    return 0;
+}
+
+int slab_set_object_flags(void *obj_addr, uint64_t flags)
+{
+    struct slab *s = slab_find(obj_addr);
+    uint32_t idx;
+
+    if (!s) {
+	return -1;
+    }
+
+    idx = obj_index(s, obj_addr);
+
+    if (!(s->meta[idx] & SLAB_META_ALLOC)) {
+	return -1;
+    }
+
+    s->meta[idx] = SLAB_META_ALLOC | (flags & KMEM_FLAGS_MASK);
+
+    return 0;
+}
+
+struct mask_state {
+    uint32_t mask;
+    int      or;
+};
+
+static int mask_slab(struct mem_region *reg, struct slab *s, void *state)
+{
+    struct mask_state *ms = (struct mask_state *)state;
+    uint32_t i;
+
+    for (i = 0; i < s->num_carved; i++) {
+	if (s->meta[i] & SLAB_META_ALLOC) {
+	    if (ms->or) {
+		s->meta[i] |= ms->mask;
+	    } else {
+		s->meta[i] &= ms->mask | SLAB_META_ALLOC;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+void slab_mask_all_object_flags(uint64_t mask, int or)
+{
+    struct mask_state ms = { .mask = mask & KMEM_FLAGS_MASK, .or = or };
+
+    for_each_slab(mask_slab, &ms);
+}
+
+struct apply_state {
+    uint32_t mask;
+    uint32_t flags;
+    int    (*func)(void *obj, void *state);
+    void    *state;
+};
+
+static int apply_slab(struct mem_region *reg, struct slab *s, void *state)
+{
+    struct apply_state *as = (struct apply_state *)state;
+    uint32_t n = s->num_carved;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+	if ((s->meta[i] & SLAB_META_ALLOC) &&
+	    (s->meta[i] & as->mask) == as->flags) {
+	    if (as->func((void *)((addr_t)s + s->first_off + (addr_t)i * s->obj_size), as->state)) {
+		return -1;
+	    }
+	    // the callback may have freed the last object of the slab
+	    if (slab_page(reg, s)->type != KMEM_PAGE_SLAB) {
+		break;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+int slab_apply_to_matching_objects(uint64_t mask, uint64_t flags, int (*func)(void *obj, void *state), void *state)
+{
+    struct apply_state as = { .mask = mask & KMEM_FLAGS_MASK,
+			      .flags = flags,
+			      .func = func,
+			      .state = state };
+
+    // flags outside of the mask can never match
+    if (flags & ~(uint64_t)as.mask) {
+	return 0;
+    }
+
+    return for_each_slab(apply_slab, &as);
+}
+
+#else
+
+int slab_find_object(void *any_addr, void **obj_addr, uint64_t *obj_size, uint64_t *flags)
+{
+    return -1;
+}
+
+int slab_set_object_flags(void *obj_addr, uint64_t flags)
+{
+    return -1;
+}
+
+void slab_mask_all_object_flags(uint64_t mask, int or)
+{
+}
+
+int slab_apply_to_matching_objects(uint64_t mask, uint64_t flags, int (*func)(void *obj, void *state), void *state)
+{
+    return 0;
+}
+
+#endif
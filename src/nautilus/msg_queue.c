@@ -30,14 +30,26 @@
 #include <nautilus/list.h>
 #include <nautilus/shell.h>
 
-// This is a trival implementation of classic message queues for threads ONLY
+// Classic bounded message queues for threads ONLY
 // interrupt handlers can use the "try" functions
 
-// that is NOT intended to be used for anything that requires performance
-
-
-// this is also a place where we can enhance performance by adding new types
-// of message queues
+/*
+ * The ring is Vyukov's bounded MPMC queue.  Each cell carries a
+ * sequence number that says whose turn it is.  The cell for position
+ * pos is free for the producer that claims pos when seq==2*pos, and
+ * holds a message for the consumer that claims pos when seq==2*pos+1.
+ * Producers claim positions by advancing cur_push with a compare and
+ * swap, fill their cells, and set seq=2*pos+1.  Consumers advance
+ * cur_pull, empty their cells, and set seq=2*(pos+size), which hands
+ * the cell to the producer on the next lap.  (Vyukov uses pos, pos+1,
+ * and pos+size, which cannot tell the states apart in a one-slot queue.)  A queue created with a single
+ * producer or consumer hint advances that side with a plain store.
+ *
+ * Nobody sleeps unless the ring is full (for push) or empty (for
+ * pull) when checked under the wait queue's lock.  Sleepers are
+ * counted, so the other side only goes to the wait queue when someone
+ * is, or is about to be, on it.
+ */
 
 // set this to one to use the tried and true polling based implementation
 // of push/pull with timeout instead of the (efficient) multiple wait queue
@@ -45,20 +57,31 @@
 #define USE_POLLING_TIMEOUT_FUNCS 0
 
 
+struct nk_msg_queue_cell {
+    volatile uint64_t  seq;
+    void              *msg;
+};
+
 struct nk_msg_queue {
-    spinlock_t         lock;
+    spinlock_t         lock; // for the refcount
     struct list_head   node; // for the global list of named queues
     uint64_t           refcount;
     char               name[NK_MSG_QUEUE_NAME_LEN];
 
+    nk_msg_queue_type_t type;
+
     nk_wait_queue_t    *push_wait_queue;
     nk_wait_queue_t    *pull_wait_queue;
+    volatile uint32_t  push_waiters;
+    volatile uint32_t  pull_waiters;
 
     uint64_t           queue_size;
-    uint64_t           cur_count;
-    uint64_t           cur_push;
-    uint64_t           cur_pull;
-    void              *msgs[0];
+
+    // producers and consumers each get a cache line
+    volatile uint64_t  cur_push __attribute__((aligned(64)));
+    volatile uint64_t  cur_pull __attribute__((aligned(64)));
+
+    struct nk_msg_queue_cell cells[0] __attribute__((aligned(64)));
 };
 
 #ifndef NAUT_CONFIG_DEBUG_MSG_QUEUES
@@ -80,9 +103,10 @@ static spinlock_t state_lock;
 
 #define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
 #define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
-#define QUEUE_TRY_LOCK(q) spin_try_lock_irq_save(&(q)->lock,&_queue_lock_flags)
 #define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags);
-#define QUEUE_UNIRQ(q) irq_enable_restore(_queue_lock_flags);
+
+// keeps the compiler from moving cell accesses across seq accesses
+#define COMPILER_BARRIER() __asm__ __volatile__ ("" : : : "memory")
 
 static struct list_head queue_list;
 
@@ -115,15 +139,21 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
     uint64_t mynum = __sync_fetch_and_add(&count,1);
     char buf[NK_MSG_QUEUE_NAME_LEN];
     char mbuf[NK_WAIT_QUEUE_NAME_LEN];
+    uint64_t i;
     
+    if (!size || type > NK_MSG_QUEUE_SPSC) {
+	ERROR("Cannot create queue of size %lu and type %d\n",size,type);
+	return 0;
+    }
+
     if (!name) {
 	snprintf(buf,NK_MSG_QUEUE_NAME_LEN,"msg_queue%lu",mynum);
 	name = buf;
     }
 
-    DEBUG("create %s with size %lu\n",name,size);
+    DEBUG("create %s with size %lu type %d\n",name,size,type);
     
-    struct nk_msg_queue *q = malloc(sizeof(*q)+size*sizeof(void*));
+    struct nk_msg_queue *q = malloc(sizeof(*q)+size*sizeof(struct nk_msg_queue_cell));
 
     if (!q) {
 	ERROR("Cannot allocate\n");
@@ -150,9 +180,14 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
 	ERROR("Failed to allocate pull wait queue\n");
 	return 0;
     }
+    q->type = type;
     q->queue_size = size;
     q->cur_push = 0;
     q->cur_pull = 0;
+    for (i=0;i<size;i++) {
+	q->cells[i].seq = 2*i;
+	q->cells[i].msg = 0;
+    }
 
     strncpy(q->name,name,NK_MSG_QUEUE_NAME_LEN); q->name[NK_MSG_QUEUE_NAME_LEN-1]=0;
 
@@ -209,8 +244,9 @@ void nk_msg_queue_dump_queues()
     STATE_LOCK();
     list_for_each(cur,&queue_list) {
 	q = list_entry(cur,struct nk_msg_queue, node);
-	nk_vc_printf("%s : refcount=%lu cur_count=%lu cur_push=%lu cur_pull=%lu\n",
-		     q->name, q->refcount, q->cur_count, q->cur_push, q->cur_pull);
+	nk_vc_printf("%s : type=%d refcount=%lu cur_count=%lu cur_push=%lu cur_pull=%lu push_waiters=%u pull_waiters=%u\n",
+		     q->name, q->type, q->refcount, q->cur_push - q->cur_pull, q->cur_push, q->cur_pull,
+		     q->push_waiters, q->pull_waiters);
     }
     STATE_UNLOCK();
 }
@@ -246,177 +282,218 @@ void nk_msg_queue_release(struct nk_msg_queue *q)
     }
 }
 
+#define CELL(q,pos) (&(q)->cells[(pos) % (q)->queue_size])
+
+// these are only hints unless the caller is the only producer (consumer)
+
 int nk_msg_queue_full(struct nk_msg_queue *q)
 {
-    //DEBUG("full %s q->curcount=%lu q->queue_size=%lu\n", q->name, q->cur_count, q->queue_size);
-    return  q->cur_count==q->queue_size;
+    uint64_t pos = q->cur_push;
+    return (sint64_t)(CELL(q,pos)->seq - 2*pos) < 0;
 }    
 
 int nk_msg_queue_empty(struct nk_msg_queue *q)
 {
-    //DEBUG("empty %s q->curcount=%lu q->queue_size=%lu\n", q->name, q->cur_count, q->queue_size);
-    return  q->cur_count==0;
+    uint64_t pos = q->cur_pull;
+    return (sint64_t)(CELL(q,pos)->seq - (2*pos+1)) < 0;
 }    
-    
-    
 
-#define SLOT(q,n) ((q)->msgs[(((q)->n)) % ((q)->queue_size)])
 
-// with lock held
-static inline int _nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+// claim up to n consecutive positions whose cells are ready for us
+// returns the number claimed, the first in *start
+static uint64_t claim(struct nk_msg_queue *q, uint64_t n, int pull, uint64_t *start)
 {
-    //DEBUG("try push %s\n",q->name);
-    if (q->cur_count < q->queue_size) {
-	SLOT(q,cur_push) = m;
-	q->cur_push++;
-	q->cur_count++;
-	//DEBUG("try push %s done\n",q->name);
-	return 0;
-    } else {
-	//DEBUG("try push %s full\n",q->name);
-	return -1;
+    volatile uint64_t *posp = pull ? &q->cur_pull : &q->cur_push;
+    int single = q->type & (pull ? NK_MSG_QUEUE_SINGLE_CONSUMER : NK_MSG_QUEUE_SINGLE_PRODUCER);
+    uint64_t pos = *posp;
+    uint64_t k;
+
+    if (n > q->queue_size) {
+	n = q->queue_size;
     }
+
+    while (1) {
+	for (k=0;k<n;k++) {
+	    if (CELL(q,pos+k)->seq != 2*(pos+k)+pull) {
+		break;
+	    }
+	}
+	if (!k) {
+	    if ((sint64_t)(CELL(q,pos)->seq - (2*pos+pull)) < 0) {
+		// full (push) or empty (pull)
+		return 0;
+	    }
+	    // another producer (consumer) got there first
+	    pos = *posp;
+	    continue;
+	}
+	if (single) {
+	    *posp = pos + k;
+	    break;
+	}
+	if (__sync_bool_compare_and_swap(posp,pos,pos+k)) {
+	    break;
+	}
+	pos = *posp;
+    }
+
+    *start = pos;
+    return k;
 }
 
-// with lock held
-static inline int _nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
+// after n pushes wake pullers, or after n pulls wake pushers
+static inline void mq_wake(struct nk_msg_queue *q, uint64_t n, int pullers)
 {
-    //DEBUG("try pull %s\n",q->name);
-    if (q->cur_count > 0) {
-	*m = SLOT(q,cur_pull);
-	q->cur_pull++;
-	q->cur_count--;
-	//DEBUG("try pull %s done\n",q->name);
-	return 0;
-    } else {
-	//DEBUG("try pull %s empty\n",q->name);
-	return -1;
+    volatile uint32_t *waiters = pullers ? &q->pull_waiters : &q->push_waiters;
+    nk_wait_queue_t *wq = pullers ? q->pull_wait_queue : q->push_wait_queue;
+
+    // orders our cell updates before the check, against the
+    // sleeper's increment
+    __sync_synchronize();
+
+    if (*waiters) {
+	if (n>1) {
+	    nk_wait_queue_wake_all(wq);
+	} else {
+	    nk_wait_queue_wake_one(wq);
+	}
     }
 }
 
-int  nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+static uint64_t _nk_msg_queue_try_push(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
-    int rc;
+    struct nk_msg_queue_cell *c;
+    uint64_t pos, i, k;
 
-    //DEBUG("try push %s\n",q->name);
+    k = claim(q,n,0,&pos);
 
-    if (QUEUE_TRY_LOCK(q)) {
-	return -1;
+    COMPILER_BARRIER();
+
+    for (i=0;i<k;i++) {
+	c = CELL(q,pos+i);
+	c->msg = m[i];
+	COMPILER_BARRIER();
+	c->seq = 2*(pos+i)+1;
     }
-    rc = _nk_msg_queue_try_push(q,m);
-    QUEUE_UNLOCK(q);
-    if (!rc) {
-	//DEBUG("try push %s succeeded\n",q->name);
-	nk_wait_queue_wake_one(q->pull_wait_queue);
-    } else {
-	//DEBUG("try push %s failed\n",q->name);
+
+    if (k) {
+	mq_wake(q,k,1);
     }
-    return rc;
+
+    return k;
 }
-    
-int  nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
+
+static uint64_t _nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
-    int rc;
+    struct nk_msg_queue_cell *c;
+    uint64_t pos, i, k;
+
+    k = claim(q,n,1,&pos);
 
-    //DEBUG("try pull %s\n",q->name);
+    COMPILER_BARRIER();
 
-    if (QUEUE_TRY_LOCK(q)) {
-	return -1;
+    for (i=0;i<k;i++) {
+	c = CELL(q,pos+i);
+	m[i] = c->msg;
+	COMPILER_BARRIER();
+	c->seq = 2*(pos+i+q->queue_size);
     }
-    rc = _nk_msg_queue_try_pull(q,m);
-    QUEUE_UNLOCK(q);
-    if (!rc) {
-	//DEBUG("try pull %s succeeded\n",q->name);
-	nk_wait_queue_wake_one(q->push_wait_queue);
-    } else {
-	//DEBUG("try pull %s failed\n",q->name);
+
+    if (k) {
+	mq_wake(q,k,0);
     }
-    return rc;
-}
 
+    return k;
+}
 
+struct op {
+    struct nk_msg_queue *queue;
+    nk_timer_t          *timer;
+    int                  pull;
+};
 
-void nk_msg_queue_push(struct nk_msg_queue *q, void *m)
+static int check_queue(void *s)
 {
-    QUEUE_LOCK_CONF;
+    struct op *o = (struct op *)s;
+    return o->pull ? !nk_msg_queue_empty(o->queue) : !nk_msg_queue_full(o->queue);
+}
 
-    DEBUG("push begin %s\n",q->name);
- retry:
-    QUEUE_LOCK(q);
-    if (!_nk_msg_queue_try_push(q,m)) {
-	// success is immediate
-	QUEUE_UNLOCK(q);
-	// we may need to wake up someone trying to pull
-	nk_wait_queue_wake_one(q->pull_wait_queue);
- 	DEBUG("push end %s\n",q->name);
-	return;
-    } else {
-	DEBUG("push sleep %s\n", q->name);
-	// we need to gracefully put ourselves to sleep
-	nk_thread_t *t = get_cur_thread();
+// returns once the queue may no longer be full (push) or empty (pull)
+static void mq_sleep(struct nk_msg_queue *q, int pull)
+{
+    volatile uint32_t *waiters = pull ? &q->pull_waiters : &q->push_waiters;
+    struct op o = { q, 0, pull };
 
-	// disable preemption early since interrupts may remain on given our locking model
-	preempt_disable();
+    DEBUG("%s sleep %s\n", pull ? "pull" : "push", q->name);
 
-	// onto the msg_queue's wait queue we go
-	t->status = NK_THR_WAITING;
-	nk_wait_queue_enqueue(q->push_wait_queue,t);
+    // the increment orders us against mq_wake's check
+    __sync_fetch_and_add(waiters,1);
+    nk_wait_queue_sleep_extended(pull ? q->pull_wait_queue : q->push_wait_queue, check_queue, &o);
+    __sync_fetch_and_sub(waiters,1);
 
-	// and go to sleep - this will also release the lock
-	// and reenable preemption
-	nk_sched_sleep(&q->lock);
+    DEBUG("%s retry %s\n", pull ? "pull" : "push", q->name);
+}
 
-	// We need to restore interrupts
-	QUEUE_UNIRQ(q);
-	
-	DEBUG("push retry %s\n", q->name);
-	// now we are awake, so try again
-	goto retry;
-    }
+int  nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+{
+    return _nk_msg_queue_try_push(q,&m,1) ? 0 : -1;
+}
+    
+int  nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
+{
+    return _nk_msg_queue_try_pull(q,m,1) ? 0 : -1;
+}
 
+uint64_t nk_msg_queue_try_push_batch(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    return _nk_msg_queue_try_push(q,m,n);
+}
 
+uint64_t nk_msg_queue_try_pull_batch(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    return _nk_msg_queue_try_pull(q,m,n);
 }
 
-void nk_msg_queue_pull(struct nk_msg_queue *q, void **m)
+void nk_msg_queue_push_batch(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
+    uint64_t done = 0, k;
 
-    DEBUG("pull begin %s\n",q->name);
- retry:
-    QUEUE_LOCK(q);
-    if (!_nk_msg_queue_try_pull(q,m)) {
-	// success is immediate
-	QUEUE_UNLOCK(q);
-	// we may need to wake up someone trying to push
-	nk_wait_queue_wake_one(q->push_wait_queue);
-	DEBUG("pull end %s\n",q->name);
-	return;
-    } else {
-	DEBUG("pull sleep %s\n", q->name);
-	
-	// we need to gracefully put ourselves to sleep
-	nk_thread_t *t = get_cur_thread();
+    DEBUG("push batch begin %s n=%lu\n",q->name,n);
 
-	// disable preemption early since interrupts remain on
-	preempt_disable();
+    while (done < n) {
+	k = _nk_msg_queue_try_push(q,m+done,n-done);
+	if (!k) {
+	    mq_sleep(q,0);
+	}
+	done += k;
+    }
 
-	// onto the msg_queue's wait queue we go
-	t->status = NK_THR_WAITING;
-	nk_wait_queue_enqueue(q->pull_wait_queue,t);
+    DEBUG("push batch end %s\n",q->name);
+}
 
-	// and go to sleep - this will also release the lock
-	// and reenable preemption
-	nk_sched_sleep(&q->lock);
+uint64_t nk_msg_queue_pull_batch(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    uint64_t k = 0;
 
-	QUEUE_UNIRQ(q)
-	
-	DEBUG("pull retry %s\n", q->name);
-	
-	// now we are awake, so try again
-	goto retry;
+    DEBUG("pull batch begin %s n=%lu\n",q->name,n);
+
+    while (n && !(k = _nk_msg_queue_try_pull(q,m,n))) {
+	mq_sleep(q,1);
     }
+
+    DEBUG("pull batch end %s k=%lu\n",q->name,k);
+
+    return k;
+}
+
+void nk_msg_queue_push(struct nk_msg_queue *q, void *m)
+{
+    nk_msg_queue_push_batch(q,&m,1);
+}
+
+void nk_msg_queue_pull(struct nk_msg_queue *q, void **m)
+{
+    nk_msg_queue_pull_batch(q,m,1);
 }
 
 
@@ -470,18 +547,6 @@ int nk_msg_queue_pull_timeout(struct nk_msg_queue *q, void **m, uint64_t timeout
 
 #else
 
-struct op {
-    struct nk_msg_queue *queue;
-    nk_timer_t          *timer;
-    int                  pull;
-};
-
-static int check_queue(void *s)
-{
-    struct op *o = (struct op *)s;
-    return o->pull ? !nk_msg_queue_empty(o->queue) : !nk_msg_queue_full(o->queue);
-}
-
 static int check_timer(void *s)
 {
     struct op *o = (struct op *)s;
@@ -491,7 +556,6 @@ static int check_timer(void *s)
 
 static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uint64_t timeout_ns, int pull)
 {
-    QUEUE_LOCK_CONF;
     uint64_t start = nk_sched_get_realtime();
     uint64_t now = start;
     int done=0;
@@ -506,9 +570,7 @@ static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uin
 	return 1;
     }
     
-    QUEUE_LOCK(q);
-    done = pull ? !_nk_msg_queue_try_pull(q,m) : !_nk_msg_queue_try_push(q,*m);
-    QUEUE_UNLOCK(q);
+    done = pull ? _nk_msg_queue_try_pull(q,m,1) : _nk_msg_queue_try_push(q,m,1);
 
     if (done) {
 	DEBUG("%s timeout  %s ends with action\n",kind,q->name);
@@ -544,7 +606,10 @@ static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uin
 
 	DEBUG("starting multiple sleep\n");
 	
+	// the increment orders us against mq_wake's check
+	__sync_fetch_and_add(pull ? &q->pull_waiters : &q->push_waiters, 1);
 	nk_wait_queue_sleep_extended_multiple(2,queues,condchecks,states);
+	__sync_fetch_and_sub(pull ? &q->pull_waiters : &q->push_waiters, 1);
 
 	DEBUG("returned from multiple sleep and checking\n");
 
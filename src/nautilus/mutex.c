@@ -0,0 +1,231 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mutex.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/cpu.h>
+#include <nautilus/errno.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("mutex: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("mutex: " fmt, ##args)
+
+// the most pauses spent waiting on a running owner before parking,
+// in case it is in a long critical section
+#define MUTEX_SPIN_LIMIT 4096
+
+#define MUTEX_LOCK_CONF uint8_t _mutex_lock_flags
+#define MUTEX_LOCK(m) _mutex_lock_flags = spin_lock_irq_save(&(m)->lock)
+#define MUTEX_UNLOCK(m) spin_unlock_irq_restore(&(m)->lock, _mutex_lock_flags)
+#define MUTEX_UNIRQ(m) irq_enable_restore(_mutex_lock_flags)
+
+// a parked thread, which lives on its own stack
+struct mutex_waiter {
+    struct list_head  node;
+    nk_thread_t      *thread;
+};
+
+
+int nk_mutex_init(nk_mutex_t *m)
+{
+    DEBUG("init %p\n", m);
+    memset(m, 0, sizeof(*m));
+    spinlock_init(&m->lock);
+    INIT_LIST_HEAD(&m->waiters);
+    return 0;
+}
+
+int nk_mutex_deinit(nk_mutex_t *m)
+{
+    DEBUG("deinit %p\n", m);
+    if (m->owner || m->num_waiters) {
+        ERROR("deinit of mutex %p that is in use\n", m);
+        return -EINVAL;
+    }
+    spinlock_deinit(&m->lock);
+    return 0;
+}
+
+// Could the owner release the mutex soon?  Only if it is on a cpu.
+// The owner can exit and be reaped while we look, but the thread
+// structure is still mapped memory, so at worst we spin a bit longer
+static inline int owner_running(nk_thread_t *owner)
+{
+    return owner->status == NK_THR_RUNNING && owner->current_cpu != my_cpu_id();
+}
+
+// returns once the mutex has been handed to us, or if it
+// turns out to be free when we try to park
+static void park(nk_mutex_t *m, nk_thread_t *me)
+{
+    struct mutex_waiter w = { .thread = me };
+    MUTEX_LOCK_CONF;
+
+    MUTEX_LOCK(m);
+
+    // an unlock that misses this count will have freed the mutex
+    // before we try it below
+    __sync_fetch_and_add(&m->num_waiters, 1);
+
+    if (__sync_bool_compare_and_swap(&m->owner, NULL, me)) {
+        __sync_fetch_and_sub(&m->num_waiters, 1);
+        MUTEX_UNLOCK(m);
+        return;
+    }
+
+    DEBUG("%p parking thread %lu (%s)\n", m, me->tid, me->name);
+
+    // disable preemption early since interrupts may remain on given our locking model
+    preempt_disable();
+
+    list_add_tail(&w.node, &m->waiters);
+    me->status = NK_THR_WAITING;
+
+    // this releases the mutex lock once we are off the cpu, so
+    // an unlock cannot try to wake us before we are asleep
+    nk_sched_sleep(&m->lock);
+
+    MUTEX_UNIRQ(m);
+
+    DEBUG("%p thread %lu (%s) was handed the mutex\n", m, me->tid, me->name);
+}
+
+static void wake(nk_thread_t *t)
+{
+    if (__sync_bool_compare_and_swap(&t->status, NK_THR_WAITING, NK_THR_SUSPENDED)) {
+        if (nk_sched_awaken(t, t->current_cpu)) {
+            ERROR("failed to awaken thread %lu\n", t->tid);
+            return;
+        }
+        nk_sched_kick_cpu(t->current_cpu);
+    }
+}
+
+// Hand the mutex to the first parked waiter if it is still ours or
+// free, otherwise leave it to whoever has it now.   Returns the
+// thread to wake, if any.
+static nk_thread_t *handoff(nk_mutex_t *m, nk_thread_t *me)
+{
+    struct mutex_waiter *w;
+    nk_thread_t *next = NULL;
+    MUTEX_LOCK_CONF;
+
+    MUTEX_LOCK(m);
+
+    w = list_first_entry(&m->waiters, struct mutex_waiter, node);
+
+    if (w) {
+        if (m->owner == me) {
+            m->owner = w->thread;
+            next = w->thread;
+        } else if (__sync_bool_compare_and_swap(&m->owner, NULL, w->thread)) {
+            next = w->thread;
+        }
+        if (next) {
+            list_del_init(&w->node);
+            __sync_fetch_and_sub(&m->num_waiters, 1);
+        }
+    } else if (m->owner == me) {
+        // the waiters we saw got the mutex while trying to park
+        (void)__sync_lock_test_and_set(&m->owner, NULL);
+    }
+
+    MUTEX_UNLOCK(m);
+
+    return next;
+}
+
+
+int nk_mutex_lock(nk_mutex_t *m)
+{
+    nk_thread_t *me = get_cur_thread();
+    nk_thread_t *owner;
+    int spins = 0;
+
+    NK_PROFILE_ENTRY();
+
+    while (!__sync_bool_compare_and_swap(&m->owner, NULL, me)) {
+
+        owner = m->owner;
+
+        if (owner == me) {
+            ERROR("thread %lu (%s) relocking mutex %p\n", me->tid, me->name, m);
+            NK_PROFILE_EXIT();
+            return -EINVAL;
+        }
+
+        if (owner && (m->num_waiters || !owner_running(owner) || spins >= MUTEX_SPIN_LIMIT)) {
+            park(m, me);
+            if (m->owner == me) {
+                break;
+            }
+            spins = 0;
+            continue;
+        }
+
+        spins++;
+        asm volatile ("pause");
+    }
+
+    NK_PROFILE_EXIT();
+    return 0;
+}
+
+int nk_mutex_try_lock(nk_mutex_t *m)
+{
+    return __sync_bool_compare_and_swap(&m->owner, NULL, get_cur_thread()) ? 0 : -1;
+}
+
+int nk_mutex_unlock(nk_mutex_t *m)
+{
+    nk_thread_t *me = get_cur_thread();
+    nk_thread_t *next;
+
+    NK_PROFILE_ENTRY();
+
+    if (m->owner != me) {
+        ERROR("thread %lu (%s) unlocking mutex %p it does not hold\n", me->tid, me->name, m);
+        NK_PROFILE_EXIT();
+        return -EINVAL;
+    }
+
+    if (!m->num_waiters) {
+        // the exchange orders our check of the waiters after the release
+        (void)__sync_lock_test_and_set(&m->owner, NULL);
+        if (!m->num_waiters) {
+            NK_PROFILE_EXIT();
+            return 0;
+        }
+    }
+
+    if ((next = handoff(m, me))) {
+        DEBUG("%p handed to thread %lu (%s)\n", m, next->tid, next->name);
+        wake(next);
+    }
+
+    NK_PROFILE_EXIT();
+    return 0;
+}
@@ -52,6 +52,178 @@ _L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,       /* 224-239 */
 _L,_L,_L,_L,_L,_L,_L,_P,_L,_L,_L,_L,_L,_L,_L,_L};      /* 240-255 */
 
 
+/*
+ * Block memory functions
+ *
+ * These are dispatched on size.   Below NK_STRING_SMALL bytes we use
+ * a handful of possibly overlapping scalar moves.  Above that, the
+ * implementation selected at boot (see nk_string_set_impl(), which
+ * detect_cpu() invokes based on CPUID) decides between rep movsb/stosb
+ * and 16 byte SSE2 loops.   We never use AVX here since only the 
+ * legacy SSE state is saved across thread switches.   Until an 
+ * implementation is selected, only generic 64 bit integer code and 
+ * rep movsq/stosq are used, so these are safe before the FPU is up.
+ *
+ * All of the copy paths load any bytes they will store out of order 
+ * (the head and tail) before storing anything, so forward copies are 
+ * also correct for overlapping buffers with dst < src, which memmove 
+ * relies on.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__)
+// keep the compiler from turning our loops back into calls to us
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+#endif
+
+#define NK_STRING_SMALL      16    // below this, scalar code only
+#define NK_STRING_ERMS_MIN   512   // rep movsb/stosb wins above this with ERMS
+
+typedef uint64_t  u64_u   __attribute__((aligned(1), may_alias));
+typedef uint32_t  u32_u   __attribute__((aligned(1), may_alias));
+typedef uint16_t  u16_u   __attribute__((aligned(1), may_alias));
+typedef long long v16_u   __attribute__((vector_size(16), aligned(1), may_alias));
+typedef long long v16_a   __attribute__((vector_size(16), aligned(16), may_alias));
+typedef char      v16_b   __attribute__((vector_size(16)));
+
+static inline void 
+rep_movsb (void *d, const void *s, size_t n)
+{
+    __asm__ __volatile__ ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static inline void 
+rep_movsq (void *d, const void *s, size_t n)
+{
+    __asm__ __volatile__ ("rep movsq" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static inline void 
+rep_stosb (void *d, uint8_t c, size_t n)
+{
+    __asm__ __volatile__ ("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+}
+
+static inline void 
+rep_stosq (void *d, uint64_t v, size_t n)
+{
+    __asm__ __volatile__ ("rep stosq" : "+D"(d), "+c"(n) : "a"(v) : "memory");
+}
+
+// n < NK_STRING_SMALL, all loads happen before all stores
+static inline void 
+copy_small (uint8_t *d, const uint8_t *s, size_t n)
+{
+    if (n >= 8) {
+	uint64_t a = *(u64_u *)s, b = *(u64_u *)(s + n - 8);
+	*(u64_u *)d = a;
+	*(u64_u *)(d + n - 8) = b;
+    } else if (n >= 4) {
+	uint32_t a = *(u32_u *)s, b = *(u32_u *)(s + n - 4);
+	*(u32_u *)d = a;
+	*(u32_u *)(d + n - 4) = b;
+    } else if (n) {
+	uint8_t a = s[0], b = s[n >> 1], c = s[n - 1];
+	d[0] = a;
+	d[n >> 1] = b;
+	d[n - 1] = c;
+    }
+}
+
+// n >= 16, copies forward with aligned stores
+static inline void 
+copy_sse_fwd (uint8_t *d, const uint8_t *s, size_t n)
+{
+    v16_u head = *(v16_u *)s;
+    v16_u tail = *(v16_u *)(s + n - 16);
+    size_t skew = 16 - ((addr_t)d & 15);
+    uint8_t *dp = d + skew;
+    const uint8_t *sp = s + skew;
+    size_t left = n - skew;
+
+    while (left > 16) {
+	*(v16_a *)dp = *(v16_u *)sp;
+	dp += 16;
+	sp += 16;
+	left -= 16;
+    }
+
+    *(v16_u *)(d + n - 16) = tail;
+    *(v16_u *)d = head;
+}
+
+// n >= 16, copies backward with aligned stores, for memmove with dst > src
+static inline void 
+copy_sse_bwd (uint8_t *d, const uint8_t *s, size_t n)
+{
+    v16_u head = *(v16_u *)s;
+    v16_u tail = *(v16_u *)(s + n - 16);
+    size_t skew = ((addr_t)(d + n) & 15) ? ((addr_t)(d + n) & 15) : 16;
+    uint8_t *dp = d + n - skew;
+    const uint8_t *sp = s + n - skew;
+    size_t left = n - skew;
+
+    while (left > 16) {
+	dp -= 16;
+	sp -= 16;
+	*(v16_a *)dp = *(v16_u *)sp;
+	left -= 16;
+    }
+
+    *(v16_u *)d = head;
+    *(v16_u *)(d + n - 16) = tail;
+}
+
+// n >= 16
+static inline void 
+set_sse (uint8_t *d, uint64_t v, size_t n)
+{
+    v16_u vv = { (long long)v, (long long)v };
+    size_t skew = 16 - ((addr_t)d & 15);
+    uint8_t *dp = d + skew;
+    size_t left = n - skew;
+
+    *(v16_u *)d = vv;
+
+    while (left > 16) {
+	*(v16_a *)dp = vv;
+	dp += 16;
+	left -= 16;
+    }
+
+    *(v16_u *)(d + n - 16) = vv;
+}
+
+static int string_impl = NK_STRING_IMPL_BASIC;
+
+static const char *string_impl_names[NK_STRING_NUM_IMPLS] = 
+{
+    [NK_STRING_IMPL_BASIC] = "basic",
+    [NK_STRING_IMPL_SSE]   = "sse2",
+    [NK_STRING_IMPL_ERMS]  = "erms",
+    [NK_STRING_IMPL_FSRM]  = "fsrm",
+};
+
+int 
+nk_string_get_impl (void)
+{
+    return string_impl;
+}
+
+void 
+nk_string_set_impl (int impl)
+{
+    if (impl >= 0 && impl < NK_STRING_NUM_IMPLS) { 
+	string_impl = impl;
+    }
+}
+
+const char *
+nk_string_impl_name (int impl)
+{
+    return (impl >= 0 && impl < NK_STRING_NUM_IMPLS) ? string_impl_names[impl] : "unknown";
+}
+
+
 #ifdef NAUT_CONFIG_USE_NAUT_BUILTINS
 size_t 
 strlen (const char * str)
@@ -79,11 +251,32 @@ strnlen (const char * str, size_t max)
 void *
 memcpy (void * dst, const void * src, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    unsigned char * s = (unsigned char *)src;
+    uint8_t * d = (uint8_t *)dst;
+    const uint8_t * s = (const uint8_t *)src;
+
+    if (n < NK_STRING_SMALL) {
+	copy_small(d, s, n);
+	return dst;
+    }
 
-    while (n--) {
-        *d++ = *s++;
+    switch (string_impl) {
+    case NK_STRING_IMPL_FSRM:
+	rep_movsb(d, s, n);
+	break;
+    case NK_STRING_IMPL_ERMS:
+	if (n >= NK_STRING_ERMS_MIN) {
+	    rep_movsb(d, s, n);
+	} else {
+	    copy_sse_fwd(d, s, n);
+	}
+	break;
+    case NK_STRING_IMPL_SSE:
+	copy_sse_fwd(d, s, n);
+	break;
+    default:
+	rep_movsq(d, s, n >> 3);
+	copy_small(d + (n & ~7UL), s + (n & ~7UL), n & 7);
+	break;
     }
 
     return dst;
@@ -93,9 +286,40 @@ memcpy (void * dst, const void * src, size_t n)
 void * 
 memset (void * dst, char c, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    while (n--) {
-        *d++ = c;
+    uint8_t * d = (uint8_t *)dst;
+    uint64_t v = 0x0101010101010101ULL * (uint8_t)c;
+
+    if (n < NK_STRING_SMALL) {
+	if (n >= 8) {
+	    *(u64_u *)d = v;
+	    *(u64_u *)(d + n - 8) = v;
+	} else if (n >= 4) {
+	    *(u32_u *)d = (uint32_t)v;
+	    *(u32_u *)(d + n - 4) = (uint32_t)v;
+	} else if (n) {
+	    d[0] = c;
+	    d[n >> 1] = c;
+	    d[n - 1] = c;
+	}
+	return dst;
+    }
+
+    switch (string_impl) {
+    case NK_STRING_IMPL_FSRM:
+    case NK_STRING_IMPL_ERMS:
+	if (n >= NK_STRING_ERMS_MIN) {
+	    rep_stosb(d, (uint8_t)c, n);
+	} else {
+	    set_sse(d, v, n);
+	}
+	break;
+    case NK_STRING_IMPL_SSE:
+	set_sse(d, v, n);
+	break;
+    default:
+	rep_stosq(d, v, n >> 3);
+	*(u64_u *)(d + n - 8) = v;
+	break;
     }
 
     return dst;
@@ -105,37 +329,36 @@ memset (void * dst, char c, size_t n)
 void * 
 memmove (void * dst, const void * src, size_t n)
 {
-    unsigned long int dstp = (long int) dst;
-    unsigned long int srcp = (long int) src;
+    uint8_t * d = (uint8_t *)dst;
+    const uint8_t * s = (const uint8_t *)src;
 
     /* This test makes the forward copying code be used whenever possible.
        Reduces the working set.  */
-    if (dstp - srcp >= n) {
+    if ((addr_t)d - (addr_t)s >= n) {
         /* Copy from the beginning to the end.  */
-        dst = memcpy (dst, src, n);
+        return memcpy (dst, src, n);
+    } 
+
+    if (n < NK_STRING_SMALL) {
+	copy_small(d, s, n);
+    } else if (string_impl != NK_STRING_IMPL_BASIC) {
+	copy_sse_bwd(d, s, n);
     } else {
         /* Copy from the end to the beginning.  */
-        srcp += n;
-        dstp += n;
+	unsigned long int dstp = (long int) dst + n;
+	unsigned long int srcp = (long int) src + n;
 
-        /* If there not too few bytes to copy, use word copy.  */
-        if (n >= OP_T_THRES)
-        {
-            /* Copy just a few bytes to make DSTP aligned.  */
-            n -= dstp % OPSIZ;
-            BYTE_COPY_BWD (dstp, srcp, dstp % OPSIZ);
+        /* Copy just a few bytes to make DSTP aligned.  */
+	n -= dstp % OPSIZ;
+	BYTE_COPY_BWD (dstp, srcp, dstp % OPSIZ);
 
-            /* Copy from SRCP to DSTP taking advantage of the known
-               alignment of DSTP.  Number of bytes remaining is put
-               in the third argument, i.e. in LEN.  This number may
-               vary from machine to machine.  */
+	/* Copy from SRCP to DSTP taking advantage of the known
+	   alignment of DSTP.  Number of bytes remaining is put
+	   in the third argument, i.e. in LEN.  This number may
+	   vary from machine to machine.  */
+	WORD_COPY_BWD (dstp, srcp, n, n);
 
-            WORD_COPY_BWD (dstp, srcp, n, n);
-
-            /* Fall out and copy the tail.  */
-        }
-
-        /* There are just a few bytes to copy.  Use byte memory operations.  */
+        /* Copy the tail.  */
         BYTE_COPY_BWD (dstp, srcp, n);
     }
 
@@ -147,8 +370,36 @@ memmove (void * dst, const void * src, size_t n)
 int 
 memcmp (const void * s1_, const void * s2_, size_t n) 
 {
-    const char * s1 = s1_;
-    const char * s2 = s2_;
+    const uint8_t * s1 = s1_;
+    const uint8_t * s2 = s2_;
+
+    if (string_impl != NK_STRING_IMPL_BASIC) { 
+	while (n >= 16) {
+	    v16_b a = (v16_b)*(v16_u *)s1;
+	    v16_b b = (v16_b)*(v16_u *)s2;
+	    unsigned mask = __builtin_ia32_pmovmskb128((v16_b)(a == b)) ^ 0xffff;
+	    if (mask) {
+		int i = __builtin_ctz(mask);
+		return s1[i] - s2[i];
+	    }
+	    s1 += 16;
+	    s2 += 16;
+	    n -= 16;
+	}
+    }
+
+    while (n >= 8) {
+	uint64_t a = *(u64_u *)s1;
+	uint64_t b = *(u64_u *)s2;
+	if (a != b) {
+	    // little endian, so the first differing byte is the lowest
+	    int i = __builtin_ctzll(a ^ b) >> 3;
+	    return s1[i] - s2[i];
+	}
+	s1 += 8;
+	s2 += 8;
+	n -= 8;
+    }
 
     while (n > 0) {
 
@@ -391,6 +642,109 @@ strrchr (const char * s, int c)
 
 #endif  /* USE_NAUT_BUILTINS */
 
+
+/*
+ * Streaming versions of memset(0) and memcpy for large buffers that
+ * will not be read again soon.  The bulk of the destination is written
+ * with non-temporal stores, which bypass the cache instead of evicting
+ * useful data.  The stores are weakly ordered, so we fence before 
+ * returning.
+ */
+
+static inline void 
+stream_v16 (void *d, v16_u v)
+{
+    __asm__ __volatile__ ("movntdq %1, %0" : "=m"(*(v16_a *)d) : "x"(v));
+}
+
+static inline void 
+stream_u64 (void *d, uint64_t v)
+{
+    __asm__ __volatile__ ("movnti %1, %0" : "=m"(*(uint64_t *)d) : "r"(v));
+}
+
+void *
+nk_memzero_nt (void * dst, size_t n)
+{
+    uint8_t * d = (uint8_t *)dst;
+    size_t head = (-(addr_t)d) & 15;
+
+    if (n < NK_STRING_SMALL + head) {
+	return memset(dst, 0, n);
+    }
+
+    memset(d, 0, head);
+    d += head;
+    n -= head;
+
+    if (string_impl == NK_STRING_IMPL_BASIC) {
+	for (; n >= 8; n -= 8, d += 8) {
+	    stream_u64(d, 0);
+	}
+    } else {
+	v16_u z = { 0, 0 };
+	for (; n >= 64; n -= 64, d += 64) {
+	    stream_v16(d, z);
+	    stream_v16(d + 16, z);
+	    stream_v16(d + 32, z);
+	    stream_v16(d + 48, z);
+	}
+	for (; n >= 16; n -= 16, d += 16) {
+	    stream_v16(d, z);
+	}
+    }
+
+    memset(d, 0, n);
+
+    __asm__ __volatile__ ("sfence" : : : "memory");
+
+    return dst;
+}
+
+void *
+nk_memcpy_nt (void * dst, const void * src, size_t n)
+{
+    uint8_t * d = (uint8_t *)dst;
+    const uint8_t * s = (const uint8_t *)src;
+    size_t head = (-(addr_t)d) & 15;
+
+    if (n < NK_STRING_SMALL + head) {
+	return memcpy(dst, src, n);
+    }
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    if (string_impl == NK_STRING_IMPL_BASIC) {
+	for (; n >= 8; n -= 8, d += 8, s += 8) {
+	    stream_u64(d, *(u64_u *)s);
+	}
+    } else {
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+	    v16_u a = *(v16_u *)s;
+	    v16_u b = *(v16_u *)(s + 16);
+	    v16_u c = *(v16_u *)(s + 32);
+	    v16_u e = *(v16_u *)(s + 48);
+	    stream_v16(d, a);
+	    stream_v16(d + 16, b);
+	    stream_v16(d + 32, c);
+	    stream_v16(d + 48, e);
+	}
+	for (; n >= 16; n -= 16, d += 16, s += 16) {
+	    stream_v16(d, *(v16_u *)s);
+	}
+    }
+
+    memcpy(d, s, n);
+
+    __asm__ __volatile__ ("sfence" : : : "memory");
+
+    return dst;
+}
+
+
 int 
 atoi (const char * buf) 
 {
@@ -395,6 +395,24 @@ nk_gpf_handler (excp_entry_t * excp,
 }
 
 
+/*
+ * Allocate n contiguous, zeroed page table pages.  The identity map
+ * builds a level's tables in bulk, so for large maps the zeroing is
+ * done with streaming stores instead of churning through the cache.
+ */
+static void *
+__alloc_tables (ulong_t n)
+{
+    void * tables = mm_boot_alloc_aligned(n*PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+
+    if (tables) {
+        nk_memzero(tables, n*PAGE_SIZE_4KB);
+    }
+
+    return tables;
+}
+
+
 /* don't really use the page size here, unless we get bigger pages 
  * someday
  */
@@ -406,18 +424,18 @@ __fill_pml (pml4e_t * pml,
             ulong_t flags)
 {
     ulong_t i;
+    pdpte_t * pdpts = NULL;
 
     ASSERT(nents <= NUM_PML4_ENTRIES);
 
+    pdpts = __alloc_tables(nents);
+    if (!pdpts) {
+        ERROR_PRINT("Could not allocate pdpts\n");
+        return;
+    }
+
     for (i = 0; i < nents; i++) {
-        pdpte_t * pdpt = NULL;
-        pdpt = mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
-        if (!pdpt) {
-            ERROR_PRINT("Could not allocate pdpt\n");
-            return;
-        }
-        memset((void*)pdpt, 0, PAGE_SIZE_4KB);
-        pml[i] = (ulong_t)pdpt | flags;
+        pml[i] = (ulong_t)(pdpts + i*NUM_PDPT_ENTRIES) | flags;
     }
 
 }
@@ -431,22 +449,24 @@ __fill_pdpt (pdpte_t * pdpt,
              ulong_t flags)
 {
     ulong_t i;
+    pde_t * pds = NULL;
 
     ASSERT(nents <= NUM_PDPT_ENTRIES);
 
+    if (ps != PS_1G) {
+        pds = __alloc_tables(nents);
+        if (!pds) {
+            ERROR_PRINT("Could not allocate pds\n");
+            return;
+        }
+    }
+
     for (i = 0; i < nents; i++) {
 
         if (ps == PS_1G) {
             pdpt[i] = base_addr | flags | PTE_PAGE_SIZE_BIT;
         } else {
-            pde_t * pd = NULL;
-            pd = mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
-            if (!pd) {
-                ERROR_PRINT("Could not allocate pd\n");
-                return;
-            }
-            memset(pd, 0, PAGE_SIZE_4KB);
-            pdpt[i] = (ulong_t)pd | flags;
+            pdpt[i] = (ulong_t)(pds + i*NUM_PD_ENTRIES) | flags;
         }
 
         base_addr += PAGE_SIZE_1GB;
@@ -461,23 +481,25 @@ __fill_pd (pde_t * pd,
            ulong_t flags)
 {
     ulong_t i;
+    pte_t * pts = NULL;
 
     ASSERT(nents <= NUM_PD_ENTRIES);
     ASSERT(ps == PS_2M || ps == PS_4K);
 
+    if (ps == PS_4K) {
+        pts = __alloc_tables(nents);
+        if (!pts) {
+            ERROR_PRINT("Could not allocate pts\n");
+            return;
+        }
+    }
+
     for (i = 0; i < nents; i++) {
 
         if (ps == PS_2M) {
             pd[i] = base_addr | flags | PTE_PAGE_SIZE_BIT;
         } else {
-            pte_t * pt = NULL;
-            pt = mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
-            if (!pt) {
-                ERROR_PRINT("Could not allocate pt\n");
-                return;
-            }
-            memset(pt, 0, PAGE_SIZE_4KB);
-            pd[i] = (ulong_t)pt | flags;
+            pd[i] = (ulong_t)(pts + i*NUM_PT_ENTRIES) | flags;
         }
 
         base_addr += PAGE_SIZE_2MB;
@@ -26,6 +26,9 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpu_state.h>
+#include <nautilus/waitqueue.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SYNCH
 #undef DEBUG_PRINT
@@ -33,20 +36,243 @@
 #endif
 
 /*
+ * Phase-fair ticket lock (PF-T, Brandenburg and Anderson, 2009)
  *
- * TODO: right now we only support a reader-preferred
- * variant
+ * The low bits of rin tell arriving readers whether a writer is
+ * present (PRES) and, in PHID, which writer it is.  A reader waits
+ * only until those bits change, that is, until the end of the one
+ * writer phase it arrived in.  Writers queue on win/wout tickets,
+ * then publish themselves in rin and wait for the readers that got
+ * in before them to leave.
  *
  */
 
+#define RINC  0x100  // reader count increment
+#define WBITS 0x3    // writer bits in rin
+#define PRES  0x2    // writer present
+#define PHID  0x1    // writer phase id
+
+// pauses before a waiter on a blocking lock goes to sleep
+#define RWLOCK_SPIN_LIMIT 1024
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+/*
+ * BRAVO (Dice and Kogan, 2019)
+ *
+ * Readers of a biased lock claim a slot, hashed from the lock and
+ * the thread, in one table shared by all locks.  A writer clears the
+ * bias and waits for every slot holding its lock to empty.  Since
+ * that scan costs the same however few readers there are, the bias
+ * then stays off for INHIBIT_MULT times as long as it took.
+ */
+#define READERS_TABLE_BITS 12
+#define READERS_TABLE_SIZE (1UL << READERS_TABLE_BITS)
+#define INHIBIT_MULT       9
+
+static nk_rwlock_t * volatile visible_readers[READERS_TABLE_SIZE] __attribute__((aligned(64)));
+
+// the slot is keyed by thread, not cpu, as the reader can migrate
+// before it unlocks
+static inline uint64_t reader_slot (nk_rwlock_t * l)
+{
+    uint64_t key = (uint64_t)l ^ ((uint64_t)get_cur_thread() << 7);
+    return (key * 0x9e3779b97f4a7c15UL) >> (64 - READERS_TABLE_BITS);
+}
+#endif
+
 extern void nk_yield(void);
 
+struct rw_wait {
+    nk_rwlock_t * l;
+    uint64_t      val;
+};
+
+// reader: the writer phase it arrived in is over
+static int rd_phase_done (void * state)
+{
+    struct rw_wait * w = state;
+    return (w->l->rin & WBITS) != w->val;
+}
+
+// writer: its ticket is being served
+static int wr_turn (void * state)
+{
+    struct rw_wait * w = state;
+    return w->l->wout == w->val;
+}
+
+// writer: the readers that were in ahead of it have left
+static int rd_drained (void * state)
+{
+    struct rw_wait * w = state;
+    return w->l->rout == w->val;
+}
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+// writer: a visible reader has left
+static int slot_clear (void * state)
+{
+    struct rw_wait * w = state;
+    return visible_readers[w->val] != w->l;
+}
+#endif
+
+static inline int can_block (nk_rwlock_t * l)
+{
+    return (l->flags & NK_RWLOCK_BLOCKING) && irqs_enabled() && !in_interrupt_context();
+}
+
+static struct nk_wait_queue * get_waitq (nk_rwlock_t * l)
+{
+    struct nk_wait_queue * q = l->waitq;
+    char name[NK_WAIT_QUEUE_NAME_LEN];
+
+    if (q) {
+        return q;
+    }
+
+    snprintf(name, NK_WAIT_QUEUE_NAME_LEN, "rwlock-%p", l);
+
+    if (!(q = nk_wait_queue_create(name))) {
+        ERROR_PRINT("rwlock %p cannot allocate wait queue, spinning\n", l);
+        return NULL;
+    }
+
+    if (!__sync_bool_compare_and_swap(&l->waitq, NULL, q)) {
+        nk_wait_queue_destroy(q);
+        q = l->waitq;
+    }
+
+    return q;
+}
+
+static void 
+rw_wait (nk_rwlock_t * l, int (*cond)(void *), struct rw_wait * w, int block)
+{
+    struct nk_wait_queue * q;
+    int i;
+
+    for (i = 0; !cond(w); i++) {
+        if (block && i >= RWLOCK_SPIN_LIMIT && (q = get_waitq(l))) {
+            // the increment orders us against rw_wake's check
+            __sync_fetch_and_add(&l->waiters, 1);
+            while (!cond(w)) {
+                nk_wait_queue_sleep_extended(q, cond, w);
+            }
+            __sync_fetch_and_sub(&l->waiters, 1);
+            return;
+        }
+        asm volatile ("pause");
+    }
+}
+
+// caller must have made its change with an atomic operation
+static inline void rw_wake (nk_rwlock_t * l)
+{
+    if (l->waiters) {
+        nk_wait_queue_wake_all(l->waitq);
+    }
+}
+
+static void 
+rd_acquire (nk_rwlock_t * l, int block)
+{
+    struct rw_wait w = { .l = l };
+
+    w.val = __sync_fetch_and_add(&l->rin, RINC) & WBITS;
+
+    if (w.val) {
+        rw_wait(l, rd_phase_done, &w, block);
+    }
+}
+
+static inline void 
+rd_release (nk_rwlock_t * l)
+{
+    __sync_fetch_and_add(&l->rout, RINC);
+    rw_wake(l);
+}
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+static void 
+revoke_bias (nk_rwlock_t * l, int block)
+{
+    struct rw_wait w = { .l = l };
+    uint64_t start = rdtsc();
+    uint64_t i;
+
+    l->rbias = 0;
+    // a reader either sees the bias gone or we see its slot
+    __sync_synchronize();
+
+    for (i = 0; i < READERS_TABLE_SIZE; i++) {
+        if (visible_readers[i] == l) {
+            w.val = i;
+            rw_wait(l, slot_clear, &w, block);
+        }
+    }
+
+    l->inhibit_until = rdtsc() + (rdtsc() - start) * INHIBIT_MULT;
+}
+#endif
+
+static void 
+wr_acquire (nk_rwlock_t * l, int block)
+{
+    struct rw_wait w = { .l = l };
+
+    w.val = __sync_fetch_and_add(&l->win, 1);
+    rw_wait(l, wr_turn, &w, block);
+
+    // close the reader phase; the readers already in must drain
+    w.val = __sync_fetch_and_add(&l->rin, PRES | (w.val & PHID));
+    rw_wait(l, rd_drained, &w, block);
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+    if (l->rbias) {
+        revoke_bias(l, block);
+    }
+#endif
+}
+
+static inline void 
+wr_release (nk_rwlock_t * l)
+{
+    __sync_fetch_and_and(&l->rin, ~WBITS);
+    __sync_fetch_and_add(&l->wout, 1);
+    rw_wake(l);
+}
+
+
 int
 nk_rwlock_init (nk_rwlock_t * l)
 {
     DEBUG_PRINT("rwlock init (%p)\n", (void*)l);
-    l->readers = 0;
-    spinlock_init(&l->lock);
+    memset(l, 0, sizeof(*l));
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+    l->rbias = 1;
+#endif
+    return 0;
+}
+
+
+int
+nk_rwlock_init_blocking (nk_rwlock_t * l)
+{
+    nk_rwlock_init(l);
+    l->flags = NK_RWLOCK_BLOCKING;
+    return 0;
+}
+
+
+int
+nk_rwlock_deinit (nk_rwlock_t * l)
+{
+    DEBUG_PRINT("rwlock deinit (%p)\n", (void*)l);
+    if (l->waitq) {
+        nk_wait_queue_destroy(l->waitq);
+        l->waitq = NULL;
+    }
     return 0;
 }
 
@@ -56,9 +282,32 @@ nk_rwlock_rd_lock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock read lock: %p\n", (void*)l);
-    int flags = spin_lock_irq_save(&l->lock);
-    ++l->readers;
-    spin_unlock_irq_restore(&l->lock, flags);
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+    if (l->rbias) {
+        uint64_t slot = reader_slot(l);
+        if (__sync_bool_compare_and_swap(&visible_readers[slot], NULL, l)) {
+            // the swap orders this check after the slot is visible
+            if (likely(l->rbias)) {
+                NK_PROFILE_EXIT();
+                return 0;
+            }
+            // a writer is revoking the bias and may be waiting on us
+            (void)__sync_lock_test_and_set(&visible_readers[slot], NULL);
+            rw_wake(l);
+        }
+    }
+#endif
+
+    rd_acquire(l, can_block(l));
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+    // no writer can be in, so the bias may come back
+    if (!l->rbias && rdtsc() >= l->inhibit_until) {
+        l->rbias = 1;
+    }
+#endif
+
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -69,9 +318,24 @@ nk_rwlock_rd_unlock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock read unlock: %p\n", (void*)l);
-    int flags = spin_lock_irq_save(&l->lock);
-    --l->readers;
-    spin_unlock_irq_restore(&l->lock, flags);
+
+#ifdef NAUT_CONFIG_RWLOCK_READER_BIAS
+    uint64_t slot = reader_slot(l);
+    // a nested or interrupting reader of the same thread may release
+    // the other's slot instead - both are counted either way
+    if (visible_readers[slot] == l) {
+        if (l->flags & NK_RWLOCK_BLOCKING) {
+            (void)__sync_lock_test_and_set(&visible_readers[slot], NULL);
+            rw_wake(l);
+        } else {
+            __sync_lock_release(&visible_readers[slot]);
+        }
+        NK_PROFILE_EXIT();
+        return 0;
+    }
+#endif
+
+    rd_release(l);
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -82,18 +346,7 @@ nk_rwlock_wr_lock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write lock: %p\n", (void*)l);
-
-    while (1) {
-        spin_lock(&l->lock);
-
-        if (likely(l->readers == 0)) {
-            break;
-        } else { 
-            spin_unlock(&l->lock);
-            /* TODO: we should yield if we're not spread across cores */
-        }
-    }
-
+    wr_acquire(l, can_block(l));
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -104,7 +357,7 @@ nk_rwlock_wr_unlock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write unlock: %p\n", (void*)l);
-    spin_unlock(&l->lock);
+    wr_release(l);
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -113,20 +366,11 @@ nk_rwlock_wr_unlock (nk_rwlock_t * l)
 uint8_t 
 nk_rwlock_wr_lock_irq_save (nk_rwlock_t * l)
 {
-    int flags;
+    uint8_t flags;
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write lock (irq): %p\n", (void*)l);
-
-    while (1) {
-        flags = spin_lock_irq_save(&l->lock);
-
-        if (likely(l->readers == 0 )) {
-            break;
-        } else {
-            spin_unlock_irq_restore(&l->lock, flags);
-        }
-    }
-
+    flags = irq_disable_save();
+    wr_acquire(l, 0);
     NK_PROFILE_EXIT();
     return flags;
 }
@@ -137,7 +381,8 @@ nk_rwlock_wr_unlock_irq_restore (nk_rwlock_t * l, uint8_t flags)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write unlock (irq): %p\n", (void*)l);
-    spin_unlock_irq_restore(&l->lock, flags);
+    wr_release(l);
+    irq_enable_restore(flags);
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -132,10 +132,6 @@
 #define MAX_QUEUE (NAUT_CONFIG_MAX_THREADS)
 
 
-#define GLOBAL_LOCK_CONF uint8_t _global_flags=0
-#define GLOBAL_LOCK() _global_flags = spin_lock_irq_save(&global_sched_state.lock)
-#define GLOBAL_UNLOCK() spin_unlock_irq_restore(&global_sched_state.lock,_global_flags)
-
 #define LOCAL_LOCK_CONF uint8_t _local_flags=0
 #define LOCAL_LOCK(s) _local_flags = spin_lock_irq_save(&((s)->lock))
 #define LOCAL_UNLOCK(s) spin_unlock_irq_restore(&((s)->lock),_local_flags)
@@ -161,9 +157,11 @@
 #endif // sanity checks
 
 #define ZERO(x) memset(x, 0, sizeof(*x))
-//#define ZERO_QUEUE(x) memset(x, 0, sizeof(rt_priority_queue) + MAX_QUEUE * sizeof(rt_thread *))
 
 
+// longest timeout we program when tickless
+#define TICKLESS_MAX_TIMEOUT_NS 1000000000ULL
+
 // cause a GPF if this is ever followed as a pointer
 #define SCHEDULER_POISON ((void*)0xdeadbeefb000b000ULL)
 
@@ -173,10 +171,7 @@
 // Common to all cores
 //
 struct nk_sched_global_state {
-    spinlock_t          lock;
-    struct rt_list      *thread_list;
-    uint64_t             num_threads;
-    int                  reaping;
+    uint64_t             num_threads;  // updated atomically
 };
 
 static volatile int scheduler_ready = 0;
@@ -198,34 +193,31 @@ static volatile uint8_t      stop_flags;
 
 static struct nk_sched_global_state global_sched_state;
 
+typedef struct nk_sched_thread_state rt_thread;
+
 //
-// List implementation for use in scheduler
-// Avoids changing thread structures
+// Thread registry
 //
-typedef struct nk_sched_thread_state rt_thread;
-typedef struct rt_node {
-    rt_thread      *thread;
-    struct rt_node *next;
-    struct rt_node *prev;
-} rt_node;
+// Every thread is registered with the cpu that created it, on a list
+// threaded through the thread and protected by that cpu's registry
+// lock, so creation and destruction on different cpus do not
+// contend.  Threads are also hashed by tid, with a lock per bucket,
+// for nk_find_thread_by_tid().  Views of all the threads are built
+// by visiting the registries one at a time, and only when something
+// like the shell or a garbage collector asks for them.
+//
+#define TID_HASH_BUCKETS 1024   // power of two
 
-static rt_node* rt_node_init(rt_thread *t);
-static void     rt_node_deinit(rt_node *n);
+struct tid_bucket {
+    spinlock_t        lock;
+    struct hlist_head threads;
+};
 
-typedef struct rt_list {
-    rt_node *head;
-    rt_node *tail;
-} rt_list;
+static struct tid_bucket tid_hash[TID_HASH_BUCKETS];
 
-static rt_list*   rt_list_init();
-static void       rt_list_deinit(rt_list *l);
-static int        _rt_list_enqueue(rt_list *l, rt_thread *t, rt_node *newnode);
-static int        rt_list_enqueue(rt_list *l, rt_thread *t);
-static rt_thread* rt_list_dequeue(rt_list *l);
-static rt_thread* rt_list_remove(rt_list *l, rt_node *n);
-static rt_thread* rt_list_remove_search(rt_list *l, rt_thread *t);
-static void       rt_list_map(rt_list *l, void (*func)(rt_thread *t, void *priv), void *priv);
-static int        rt_list_empty(rt_list *l);
+static void registry_add(rt_thread *t);
+static void registry_remove(rt_thread *t);
+static void registry_map(void (*func)(rt_thread *t, void *priv), void *priv);
 
 
 
@@ -234,19 +226,18 @@ typedef enum { RUNNABLE_QUEUE = 0,
 	       APERIODIC_QUEUE = 2} queue_type;
 
 //
-// Queue specific to scheduler (circular buffer)
+// Queue specific to scheduler (fifo threaded through the threads)
 //
 typedef struct rt_queue {
-    queue_type type;
-    uint64_t   size;        // number of elements currently in the queue
-    uint64_t   head;        // index of newest element 
-    uint64_t   tail;        // index of oldest element
-    rt_thread *threads[MAX_QUEUE];
+    queue_type       type;
+    uint64_t         size;      // number of elements currently in the queue
+    struct list_head threads;   // oldest element first
 } rt_queue ;
 
 static int        rt_queue_enqueue(rt_queue *queue, rt_thread *thread);
 static rt_thread* rt_queue_dequeue(rt_queue *queue);
-static rt_thread* rt_queue_peek(rt_queue *queue, uint64_t pos);
+static rt_thread* rt_queue_first(rt_queue *queue);
+static rt_thread* rt_queue_next(rt_queue *queue, rt_thread *thread);
 static rt_thread* rt_queue_remove(rt_queue *queue, rt_thread *thread);
 static int        rt_queue_empty(rt_queue *queue);
 static void       rt_queue_dump(rt_queue *queue, char *pre);
@@ -258,16 +249,21 @@ static void       rt_queue_dump(rt_queue *queue, char *pre);
 //   Runnable:  deadline (EDF queue)
 //   Pending:   arrival time 
 //   Aperiodic: priority 
+//
+// These are pairing heaps threaded through the threads themselves,
+// so they have no size limit and need no allocation, and a thread
+// can be removed without searching for it.
 
 typedef struct rt_priority_queue {
     queue_type type;
     uint64_t   size;
-    rt_thread *threads[MAX_QUEUE];
+    rt_thread *root;        // earliest deadline
 } rt_priority_queue ;
 
 static int        rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread);
 static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue);
-static rt_thread* rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos);
+static rt_thread* rt_priority_queue_first(rt_priority_queue *queue);
+static rt_thread* rt_priority_queue_next(rt_priority_queue *queue, rt_thread *thread);
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread);
 static int        rt_priority_queue_empty(rt_priority_queue *queue);
 static void       rt_priority_queue_dump(rt_priority_queue *queue, char *pre);
@@ -285,15 +281,60 @@ typedef struct tsc_info {
 } tsc_info;
 
 
+// Unsized tasks produced on a cpu for any cpu go on its Chase-Lev
+// work-stealing deque.  The cpu pushes and pops at the bottom with
+// interrupts off and no atomics, except for a fence when popping
+// and a CAS when taking the last task.   Other cpus steal from the
+// top with a CAS per task.   The deque does not grow; tasks that do
+// not fit, and tasks produced for a specific cpu, go on its 
+// locked unsized queue instead, where they cannot be stolen.
+#define TASK_DEQUE_SIZE   1024   // power of two
+
+typedef struct task_deque {
+    volatile sint64_t   top __attribute__((aligned(64)));     // thieves take here
+    volatile sint64_t   bottom __attribute__((aligned(64)));  // owner pushes and pops here
+    struct nk_task    *tasks[TASK_DEQUE_SIZE];
+} task_deque;
+
+// Sized tasks are kept in buckets by the log2 of their size, so that
+// finding one that fits in a given time does not scan all of them
+#define TASK_SIZE_BUCKETS 64
+
+// Distance between cpus, nearest first, which is the order in which
+// they are chosen as victims when stealing
+#define STEAL_LEVEL_CORE   0   // hyperthreads of the same core
+#define STEAL_LEVEL_SOCKET 1   // same socket and NUMA domain
+#define STEAL_LEVEL_DOMAIN 2   // same NUMA domain
+#define STEAL_LEVEL_REMOTE 3   // everything else
+#define STEAL_LEVELS       4
+
+// a victim at a given distance must have this many more runnable
+// threads per level than the thief for a thread to be stolen from it
+#ifdef NAUT_CONFIG_WORK_STEALING_LOCALITY_PENALTY
+#define STEAL_LOCALITY_PENALTY NAUT_CONFIG_WORK_STEALING_LOCALITY_PENALTY
+#else
+#define STEAL_LOCALITY_PENALTY 1
+#endif
+
+// NUMA distance of local memory in the ACPI SLIT
+#define STEAL_LOCAL_DISTANCE 10
+
 typedef struct nk_sched_task_state {
-    spinlock_t  lock;
+    spinlock_t  lock;                    // for the sized buckets and unsized queue
     nk_wait_queue_t   *waitq;            // where the task thread blocks ultimately
+    volatile int       sleeping;         // task thread is sleeping or about to
     uint64_t           sized_enqueued;   // number of sized tasks enqueued
     uint64_t           sized_dequeued;   //   and dequeued (locally or remotely)
-    struct list_head   sized_queue;      // tasks with known sizes
-    uint64_t           unsized_enqueued; // number of unsized tasks enqueud
+    uint64_t           sized_mask;       // bit per nonempty bucket
+    struct list_head   sized_buckets[TASK_SIZE_BUCKETS];
+    uint64_t           unsized_enqueued; // number of unsized tasks enqueued on the queue
     uint64_t           unsized_dequeued; //   and dequeued (locally or remotely)
-    struct list_head   unsized_queue;    // tasks with unknown sizes;
+    struct list_head   unsized_queue;    // tasks with unknown sizes, not stealable
+    uint64_t           local_enqueued;   // number of tasks pushed on the deque
+    uint64_t           local_dequeued;   //   and popped by this cpu
+    uint64_t           stolen;           //   and stolen by others
+    uint64_t           steal_count[STEAL_LEVELS]; // tasks this cpu stole, by level
+    task_deque         deque;
 } task_info;
 
 typedef struct nk_sched_percpu_state {
@@ -321,7 +362,31 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t num_thefts;   // how many threads I've successfully stolen
 
+    // other cpus ordered by distance, for stealing work; those at
+    // distance level l are steal_order[steal_level_start[l]..steal_level_start[l+1]-1]
+    int     *steal_order;
+    int      steal_level_start[STEAL_LEVELS+1];
+    uint64_t thread_steals[STEAL_LEVELS];   // threads stolen from cpus at each level
+
     uint64_t reinject_count;  // how many timer/kick interrupts I've had to reinject
+    uint64_t tickless_count;  // how many passes left the timer unarmed
+
+    // Threads that have exited on this cpu and are waiting to be
+    // reaped, and reaped threads placed on this cpu that are kept
+    // for reanimation.  These have their own lock so that reaping
+    // and reanimation stay out of the scheduler's way.
+    spinlock_t        dead_lock;
+    struct list_head  dead;
+    uint64_t          num_dead;
+    struct list_head  reanimation_pool;   // most recently reaped first
+    uint64_t          num_reanimatable;
+    uint64_t          reap_count;         // threads reaped from the dead list
+    uint64_t          reanimate_count;    // threads reused from the pool
+
+    // threads created on this cpu, see registry_add()
+    spinlock_t        registry_lock;
+    struct list_head  registry;
+    uint64_t          num_registered;
 
 #if INSTRUMENT
     uint64_t resched_fast_num;
@@ -410,13 +475,15 @@ typedef struct nk_sched_percpu_state {
 #else
 #define DUMP_APERIODIC(s,p) 
 #endif
-#define PEEK_APERIODIC(s,k) rt_queue_peek(&(s)->aperiodic,k)
+#define FIRST_APERIODIC(s) rt_queue_first(&(s)->aperiodic)
+#define NEXT_APERIODIC(s,t) rt_queue_next(&(s)->aperiodic,t)
 #define SIZE_APERIODIC(s) ((s)->aperiodic.size)
 #else
 #define GET_NEXT_APERIODIC(s) rt_priority_queue_dequeue(&(s)->aperiodic)
 #define PUT_APERIODIC(s,t) rt_priority_queue_enqueue(&(s)->aperiodic,t)
 #define REMOVE_APERIODIC(s,t) rt_priority_queue_remove(&(s)->aperiodic,t)
-#define PEEK_APERIODIC(s,k) rt_priority_queue_peek(&(s)->aperiodic,k)
+#define FIRST_APERIODIC(s) rt_priority_queue_first(&(s)->aperiodic)
+#define NEXT_APERIODIC(s,t) rt_priority_queue_next(&(s)->aperiodic,t)
 #define SIZE_APERIODIC(s) ((s)->aperiodic.size)
 #define HAVE_APERIODIC(s) (!rt_priority_queue_empty(&(s)->aperiodic))
 #ifdef NAUT_CONFIG_DEBUG_SCHED
@@ -434,7 +501,7 @@ typedef struct nk_sched_percpu_state {
 #define PUT_RT_PENDING(s,t) rt_priority_queue_enqueue(&(s)->pending,t)
 #define REMOVE_RT_PENDING(s,t) rt_priority_queue_remove(&(s)->pending,t)
 #define HAVE_RT_PENDING(s) (!rt_priority_queue_empty(&(s)->pending))
-#define PEEK_RT_PENDING(s) (s->pending.threads[0])
+#define PEEK_RT_PENDING(s) (s->pending.root)
 #ifdef NAUT_CONFIG_DEBUG_SCHED
 #if DUMP_SCHED_STATE
 #define DUMP_RT_PENDING(s,p) rt_priority_queue_dump(&(s)->pending,p)
@@ -449,7 +516,7 @@ typedef struct nk_sched_percpu_state {
 #define PUT_RT(s,t) rt_priority_queue_enqueue(&(s)->runnable,t)
 #define REMOVE_RT(s,t) rt_priority_queue_remove(&(s)->runnable,t)
 #define HAVE_RT(s) (!rt_priority_queue_empty(&(s)->runnable))
-#define PEEK_RT(s) (s->runnable.threads[0])
+#define PEEK_RT(s) (s->runnable.root)
 #ifdef NAUT_CONFIG_DEBUG_SCHED
 #if DUMP_SCHED_STATE
 #define DUMP_RT(s,p) rt_priority_queue_dump(&(s)->runnable,p)
@@ -479,6 +546,7 @@ typedef enum { ARRIVED=0,          // no admission control done
                                    // will not return
 	       DENIED,             // not admitted
 	       REAPABLE,           // it's OK for the reaper to destroy the thread
+	       REAPING,            // claimed by the reaper or a destroy, which will free it
              } rt_status;
 
 typedef struct nk_sched_thread_state {
@@ -488,6 +556,12 @@ typedef struct nk_sched_thread_state {
     rt_status status;
     // which queue the thread is currently on
     queue_type q_type;
+    void      *q;          // the queue itself, null if none
+    // links within the queue - q_node for a fifo, the rest for a heap
+    struct list_head q_node;
+    struct nk_sched_thread_state *q_child;
+    struct nk_sched_thread_state *q_next;
+    struct nk_sched_thread_state *q_prev;
     
     int      is_intr;      // this is an interrupt thread
     int      is_task;      // this is a task thread
@@ -514,8 +588,17 @@ typedef struct nk_sched_thread_state {
     // the thread context itself
     struct nk_thread *thread;
 
-    // the thread node in a thread list (the global thread list)
-    struct rt_node   *list; 
+    // the cpu whose registry holds the thread, or -1 if none
+    int               reg_cpu;
+    struct list_head  reg_node;
+    struct hlist_node tid_node;
+
+    // link on a cpu's dead list, and then on its reanimation pool
+    struct list_head  dead_node;
+    // the cpu whose dead list the thread went on when it exited, or
+    // -1 if it has not, and who took it off that list (see REAPING)
+    int               dead_cpu;
+    struct nk_thread  *reaper;
 
 } rt_thread ;
 
@@ -581,7 +664,8 @@ static void print_thread(rt_thread *r, void *priv)
 		     r->status==EXITING ? "exi" :
 		     r->status==SLEEPING ? "sle" :
 		     r->status==DENIED ? "den" :
-		     r->status==REAPABLE ? "rea" : "UNK",
+		     r->status==REAPABLE ? "rea" :
+		     r->status==REAPING ? "rpg" : "UNK",
 		     CO(r->start_time),
 		     CO(r->cur_run_time),
 		     CO(r->run_time),
@@ -615,24 +699,6 @@ static void print_thread(rt_thread *r, void *priv)
 }
 
 
-static uint64_t   reap_count;
-static rt_thread *reap_pool[MAX_QUEUE];
-
-static void pre_reap_thread(rt_thread *r, void *priv)
-{
-    ASSERT(r);
-    ASSERT(r->thread);
-
-    nk_thread_t  * t = r->thread;
-    rt_node      * temp;
-
-    if (reap_count<MAX_QUEUE && !t->refcount && t->status==NK_THR_EXITED && r->status==REAPABLE) {
-	DEBUG("Reaping tid %llu (%s)\n",t->tid,t->name);
-	reap_pool[reap_count++] = r;
-    }
-}
-
-
 void nk_sched_dump_cores(int cpu_arg)
 {
     LOCAL_LOCK_CONF;
@@ -662,7 +728,7 @@ void nk_sched_dump_cores(int cpu_arg)
 
 	    s = sys->cpus[cpu]->sched_state;
 	    LOCAL_LOCK(s);
-	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic) [%s]\n",
+	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic %lutl) [%s]\n",
 		     cpu, 
 		     intr_model,
 		     sys->cpus[cpu]->interrupt_nesting_level,
@@ -694,8 +760,9 @@ void nk_sched_dump_cores(int cpu_arg)
 		     s->cfg.sporadic_reservation, s->cfg.aperiodic_reservation, 
 		     s->cfg.aperiodic_quantum, s->cfg.aperiodic_default_priority,
 		     s->tasks.sized_enqueued, s->tasks.sized_dequeued,
-		     s->tasks.unsized_enqueued, s->tasks.unsized_dequeued,
-		     apic->timer_count,
+		     s->tasks.unsized_enqueued + s->tasks.local_enqueued, 
+		     s->tasks.unsized_dequeued + s->tasks.local_dequeued + s->tasks.stolen,
+		     apic->timer_count, s->tickless_count,
 		     aspace ? aspace->name : "default");
 #if INSTRUMENT
 	    char buf2[256];
@@ -704,6 +771,13 @@ void nk_sched_dump_cores(int cpu_arg)
 	    LOCAL_UNLOCK(s);
 
 	    nk_vc_printf(buf);
+	    nk_vc_printf("    stolen by level (core/socket/domain/remote): threads %lu/%lu/%lu/%lu tasks %lu/%lu/%lu/%lu\n",
+			 s->thread_steals[STEAL_LEVEL_CORE], s->thread_steals[STEAL_LEVEL_SOCKET],
+			 s->thread_steals[STEAL_LEVEL_DOMAIN], s->thread_steals[STEAL_LEVEL_REMOTE],
+			 s->tasks.steal_count[STEAL_LEVEL_CORE], s->tasks.steal_count[STEAL_LEVEL_SOCKET],
+			 s->tasks.steal_count[STEAL_LEVEL_DOMAIN], s->tasks.steal_count[STEAL_LEVEL_REMOTE]);
+	    nk_vc_printf("    dead threads: %lu waiting %lu reaped %lu pooled %lu reanimated\n",
+			 s->num_dead, s->reap_count, s->num_reanimatable, s->reanimate_count);
 #if INSTRUMENT
 	    nk_vc_printf(buf2);
 #endif
@@ -724,10 +798,10 @@ void nk_sched_dump_time(int cpu_arg)
 	    struct apic_dev *apic = sys->cpus[cpu]->apic;
 	    struct tsc_info *tsc = &sys->cpus[cpu]->sched_state->tsc;
 			 
-            nk_vc_printf("%dc %luhz %luppt %lucpu %lucpt %uts %uct %lutc %lust %lustc %ldstr %ldstrc\n",
+            nk_vc_printf("%dc %luhz %luppt %lucpu %lucpt %uts %uct %utd %lutc %lust %lustc %ldstr %ldstrc\n",
 			 cpu, apic->bus_freq_hz, apic->ps_per_tick,
 			 apic->cycles_per_us, apic->cycles_per_tick,
-			 apic->timer_set, apic->current_ticks, apic->timer_count,
+			 apic->timer_set, apic->current_ticks, apic->timer_tsc_deadline, apic->timer_count,
 			 tsc->sync_time, tsc->sync_time_cycles,
 			 tsc->sync_time - tsc0->sync_time,
 			 tsc->sync_time_cycles - tsc0->sync_time_cycles);
@@ -737,32 +811,29 @@ void nk_sched_dump_time(int cpu_arg)
 
 void nk_sched_dump_threads(int cpu)
 {
-    GLOBAL_LOCK_CONF;
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
+    registry_map(print_thread,(void*)(long)cpu);
+}
 
-    GLOBAL_LOCK();
+struct thread_map {
+    int    cpu;
+    void (*func)(struct nk_thread *t, void *state);
+    void  *state;
+};
 
-    rt_list_map(global_sched_state.thread_list,print_thread,(void*)(long)cpu);
+static void map_thread(rt_thread *r, void *priv)
+{
+    struct thread_map *m = (struct thread_map *)priv;
 
-    GLOBAL_UNLOCK();
+    if (m->cpu==-1 || r->thread->current_cpu==m->cpu) {
+	m->func(r->thread,m->state);
+    }
 }
 
 void nk_sched_map_threads(int cpu, void (func)(struct nk_thread *t, void *state), void *state)
 {
-    GLOBAL_LOCK_CONF;
-   
-    GLOBAL_LOCK();
-
-    rt_node *n = global_sched_state.thread_list->head;
-    while (n != NULL) {
-	if (cpu==-1 || n->thread->thread->current_cpu==cpu) { 
-	    func(n->thread->thread,state);
-	}
-        n = n->next;
-    }
+    struct thread_map m = { .cpu = cpu, .func = func, .state = state };
 
-    GLOBAL_UNLOCK();
+    registry_map(map_thread,&m);
 }
 
 /* KCH NOTE: The following helper functions *currently* assume that they will
@@ -817,26 +888,30 @@ static uint8_t (*const thread_filter_funcs[])(struct nk_thread*, struct nk_threa
     [NK_TOPO_SOCKET_FILT]    = nk_topo_threads_share_socket,
 };
 
-// Map a function to all other threads on the same X, where X can be hwthread, physical core, or socket
-void nk_topo_map_sibling_threads(void (func)(struct nk_thread *t, void *state), nk_topo_filt_t filter, void *state)
-{
-    GLOBAL_LOCK_CONF;
-    GLOBAL_LOCK();
-
-    rt_node *n = global_sched_state.thread_list->head;
+struct sibling_map {
+    nk_topo_filt_t filter;
+    void         (*func)(struct nk_thread *t, void *state);
+    void          *state;
+};
 
-    while (n != NULL) {
-        if (n->thread->thread != get_cur_thread()) { // skip myself
-            if (filter == NK_TOPO_ALL_FILT ||
-                    thread_filter_funcs[filter](get_cur_thread(), n->thread->thread)) {
-                func(n->thread->thread, state);
-            }
-        }
+static void map_sibling_thread(rt_thread *r, void *priv)
+{
+    struct sibling_map *m = (struct sibling_map *)priv;
 
-        n = n->next;
+    if (r->thread != get_cur_thread()) { // skip myself
+	if (m->filter == NK_TOPO_ALL_FILT ||
+	    thread_filter_funcs[m->filter](get_cur_thread(), r->thread)) {
+	    m->func(r->thread, m->state);
+	}
     }
+}
+
+// Map a function to all other threads on the same X, where X can be hwthread, physical core, or socket
+void nk_topo_map_sibling_threads(void (func)(struct nk_thread *t, void *state), nk_topo_filt_t filter, void *state)
+{
+    struct sibling_map m = { .filter = filter, .func = func, .state = state };
 
-    GLOBAL_UNLOCK();
+    registry_map(map_sibling_thread, &m);
 }
 
 void nk_topo_map_hwthread_sibling_threads(void (func)(struct nk_thread *t, void *state), void *state)
@@ -961,45 +1036,145 @@ void nk_sched_start_world()
 }
 
 
-struct thread_query {
-    uint64_t     tid;
-    nk_thread_t *thread;
-};
-
-static void find_thread(rt_thread *r, void *priv)
+struct nk_thread *nk_find_thread_by_tid(uint64_t tid)
 {
-    nk_thread_t  * t = r->thread;
-    struct thread_query *q = (struct thread_query *)priv;
+    struct tid_bucket *b = &tid_hash[tid & (TID_HASH_BUCKETS-1)];
+    struct hlist_node *pos;
+    rt_thread *r;
+    nk_thread_t *t = 0;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&b->lock);
 
-    if (t->tid == q->tid) { 
-	q->thread = t;
+    hlist_for_each_entry(r, pos, &b->threads, tid_node) {
+	if (r->thread->tid == tid) {
+	    t = r->thread;
+	    break;
+	}
     }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+
+    return t;
 }
 
+//
+// Reaping
+//
+// A thread goes on the dead list of the cpu it exits on.  It can be
+// reaped once it is off its stack (REAPABLE) and no one else refers
+// to it, which for an attached thread means its parent has joined
+// it.  Reaped threads are unregistered and put in the reanimation
+// pool of the cpu they were placed on, or destroyed if that pool is
+// full.  Each cpu's lists are handled in batches under that cpu's
+// dead_lock.
+//
+// A parent may also destroy a thread itself once it has joined it.
+// The reaper and such a destroy race to take the thread off the dead
+// list, and the winner claims it (REAPING) under the dead_lock.  Only
+// the claimant frees the thread; the loser leaves it alone.
+//
+#define REAP_BATCH      NAUT_CONFIG_REAP_BATCH
+#define REAP_SCAN_LIMIT (4*REAP_BATCH)
+#define REANIMATION_POOL_DEPTH NAUT_CONFIG_REANIMATION_POOL_DEPTH
+
+static inline int reapable(rt_thread *r)
+{
+    return r->status==REAPABLE && r->thread->status==NK_THR_EXITED && !r->thread->refcount;
+}
 
-struct nk_thread *nk_find_thread_by_tid(uint64_t tid)
+static void recycle_thread(rt_thread *r)
 {
-    GLOBAL_LOCK_CONF;
-    struct thread_query q;
-    
-    q.tid=tid;
-    q.thread=0;
+    struct sys_info *sys = per_cpu_get(system);
+    nk_thread_t *t = r->thread;
+    rt_scheduler *s = sys->cpus[t->placement_cpu]->sched_state;
+    int pooled = 0;
+    uint8_t flags;
+
+    nk_sched_thread_pre_destroy(t);
+
+    flags = spin_lock_irq_save(&s->dead_lock);
+    if (s->num_reanimatable < REANIMATION_POOL_DEPTH) {
+	list_add(&r->dead_node, &s->reanimation_pool);
+	s->num_reanimatable++;
+	pooled = 1;
+    }
+    spin_unlock_irq_restore(&s->dead_lock, flags);
 
-    GLOBAL_LOCK();
+    if (!pooled) {
+	nk_thread_destroy(t);
+    }
+}
+
+// reaps up to one batch of threads from the cpu's dead list
+// returns the number reaped, and the number looked at in *scanned
+static uint64_t reap_batch(int cpu, uint64_t *scanned)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s = sys->cpus[cpu]->sched_state;
+    struct list_head batch;
+    rt_thread *r, *n;
+    uint64_t count = 0;
+    uint8_t flags;
+
+    INIT_LIST_HEAD(&batch);
+    *scanned = 0;
+
+    flags = spin_lock_irq_save(&s->dead_lock);
+
+    list_for_each_entry_safe(r, n, &s->dead, dead_node) {
+	if (count == REAP_BATCH || *scanned == REAP_SCAN_LIMIT) {
+	    break;
+	}
+	(*scanned)++;
+	if (reapable(r)) {
+	    list_move_tail(&r->dead_node, &batch);
+	    r->status = REAPING;
+	    r->reaper = get_cur_thread();
+	    s->num_dead--;
+	    count++;
+	} else {
+	    // typically waiting to be joined, so look at others first next time
+	    list_move_tail(&r->dead_node, &s->dead);
+	}
+    }
+
+    s->reap_count += count;
+
+    spin_unlock_irq_restore(&s->dead_lock, flags);
+
+    list_for_each_entry_safe(r, n, &batch, dead_node) {
+	DEBUG("Reaping thread %lu\n", r->thread->tid);
+	list_del_init(&r->dead_node);
+	recycle_thread(r);
+    }
 
-    rt_list_map(global_sched_state.thread_list,find_thread,(void*)&q);
+    return count;
+}
 
-    GLOBAL_UNLOCK();
+// reaps every thread on the cpu's dead list that can be reaped
+static void reap_all(int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t left = sys->cpus[cpu]->sched_state->num_dead;
+    uint64_t scanned;
 
-    return q.thread;
+    while (left) {
+	reap_batch(cpu, &scanned);
+	if (!scanned) {
+	    break;
+	}
+	left = scanned < left ? left - scanned : 0;
+    }
 }
 
 void nk_sched_reap(int uncond)
 {
     DEBUG("Executing Reap (%s)\n", uncond? "UNCOND": "cond");
     
-    GLOBAL_LOCK_CONF;
-    uint64_t i;
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t scanned;
+    int i, cpu;
 
     if (in_interrupt_context()) {
 	// never reap in interrupt context, even unconditionally
@@ -1016,61 +1191,35 @@ void nk_sched_reap(int uncond)
 	return;
     }
 
-    if (!__sync_bool_compare_and_swap(&global_sched_state.reaping,0,1)) {
-	// reaping pass is already in progress elsewhere
-	// we will wait for it to  inish.  In this way, our caller
-	// will also see the benefit of that pass
-	DEBUG("%sconditional reap waiting on previous reap to complete\n", uncond ? "un" : "");
-	while (__sync_fetch_and_or(&global_sched_state.reaping,0)) {
-	    // wait for the reapping pass to finish
-	}
-	DEBUG("%sconditional reap - previous reap now complete, ignoring this reap\n", uncond ? "un" : "");
-	return;
-    }
-
     DEBUG("Reap begins (%lu threads)\n", global_sched_state.num_threads);
 
-    GLOBAL_LOCK();
-
-    reap_count = 0;
-
-    // We need to do this in two phases since
-    // destroy thread also needs the global lock
-    // first phase, collect
-    rt_list_map(global_sched_state.thread_list,pre_reap_thread,0);
-
-    GLOBAL_UNLOCK();
-
-    // Now reap
-    // We are still holding global_sched_state.reaping, so
-    // we must have exclusive access to the reap_pool built
-    // in the previous step
-    if (reap_count!=0) { 
-	// reverse order to potentially improve frees
-	for (i=reap_count;i>0;i--) { 
-	    DEBUG("Reaping thread %lu\n", reap_pool[i-1]->thread->tid);
-	    // thread destruction calls back to pre_destory, which
-	    // will acquire the global lock when it removes the thread from
-	    // the global thread list, hence we do not need to hold
-	    // global lock here.
-	    nk_thread_destroy(reap_pool[i-1]->thread);
+    // start with our own cpu, whose lists are most likely in our cache
+    for (i=0;i<sys->num_cpus;i++) {
+	cpu = (my_cpu_id() + i) % sys->num_cpus;
+	if (uncond) {
+	    reap_all(cpu);
+	} else {
+	    reap_batch(cpu,&scanned);
 	}
     }
 
     DEBUG("%sconditional reap ends (%lu threads)\n", uncond ? "un" : "", global_sched_state.num_threads);
-    
-    // done with reaping - another core can now go
-    __sync_fetch_and_and(&global_sched_state.reaping,0);
+
+}
+
+void nk_sched_reap_local()
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+    uint64_t scanned;
+
+    if (s->num_dead && !in_interrupt_context()) {
+	reap_batch(my_cpu_id(),&scanned);
+    }
 }
 
 //
-// The current implementation is essentially a specialized reaping pass,
-// looking in reverse order on the logic that recent threads will be similar
-// to the requested thread
-//
-// Eventually, we will move threads to separate per-cpu queues and perhaps
-// do a smarter search for ones with the required constraints
-//
+// Reanimation reuses the most recently reaped thread placed on the
+// given cpu that has a large enough stack
 //
 struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
 				     int             placement_cpu)
@@ -1078,60 +1227,39 @@ struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
     DEBUG("Reanimation request for a thread of stack minimum size %lu for CPU %d\n",
 	 min_stack_size, placement_cpu);
     
-    GLOBAL_LOCK_CONF;
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s;
+    rt_thread *r, *found = 0;
+    uint8_t flags;
 
     if (in_interrupt_context()) {
 	DEBUG("Reanimation request while in interrupt context ignored\n");
 	return 0;
     }
 
-    // We are currently overloaded with reaping, so we will wait until
-    // we are the sole "reaper"
-    while (!__sync_bool_compare_and_swap(&global_sched_state.reaping,0,1)) {
+    if (placement_cpu<0 || placement_cpu>=sys->num_cpus) {
+	placement_cpu = my_cpu_id();
     }
-    DEBUG("Reanimation search begins (%lu threads)\n", global_sched_state.num_threads);
 
-    GLOBAL_LOCK();
+    s = sys->cpus[placement_cpu]->sched_state;
 
-    // start search from the oldest thread
-    rt_node *cur = global_sched_state.thread_list->head;
+    flags = spin_lock_irq_save(&s->dead_lock);
 
-    uint64_t count = 0;
-    
-    while (cur &&
-	   !(cur->thread->status == REAPABLE &&
-	     cur->thread->thread->status==NK_THR_EXITED &&
-	     !cur->thread->thread->refcount &&
-	     cur->thread->thread->stack_size >= min_stack_size &&
-	     (placement_cpu<0 || cur->thread->thread->placement_cpu==placement_cpu))) {
-	
-	//DEBUG("Skipping thread %p (%lu) \"%s\"\n", cur->thread->thread, cur->thread->thread->tid,
-	//      cur->thread->thread->is_idle ? "*idle*" ::q!
-	//      cur->thread->thread->name[0] ? cur->thread->thread->name : "(no name)");
-	cur=cur->next;
-	count++;
-    }
-    
-    
-    rt_thread *rt = 0;
-    
-    
-    if (cur) {
-	rt = rt_list_remove(global_sched_state.thread_list, cur);
-	global_sched_state.num_threads--;
-	DEBUG("Examined %lu threads before finding a matching one\n", count+1); 
-    } else {
-	DEBUG("Examined %lu threads without finding a matching one\n", count);
+    list_for_each_entry(r, &s->reanimation_pool, dead_node) {
+	if (r->thread->stack_size >= min_stack_size) {
+	    list_del_init(&r->dead_node);
+	    s->num_reanimatable--;
+	    s->reanimate_count++;
+	    found = r;
+	    break;
+	}
     }
-    
-    GLOBAL_UNLOCK();
 
-    // done with "reaping" - another core can now go
-    __sync_fetch_and_and(&global_sched_state.reaping,0);
-    
-    if (rt) {
-	DEBUG("Reanimation successful - returning thread %p (sched state %p name \"%s\")\n", rt->thread, rt, rt->thread->name);
-	return rt->thread;
+    spin_unlock_irq_restore(&s->dead_lock, flags);
+
+    if (found) {
+	DEBUG("Reanimation successful - returning thread %p (sched state %p name \"%s\")\n", found->thread, found, found->thread->name);
+	return found->thread;
     } else {
 	DEBUG("Reanimation attempt failed\n");
 	return 0;
@@ -1193,6 +1321,10 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
     c = &t->constraints;
 
     t->status = ARRIVED;
+    t->reg_cpu = -1;
+    t->dead_cpu = -1;
+    t->reaper = 0;
+    INIT_LIST_HEAD(&t->dead_node);
 
     t->start_time = 0;
     t->run_time = 0;
@@ -1218,74 +1350,69 @@ int nk_sched_initial_placement()
 
 int nk_sched_thread_post_create(nk_thread_t * t)
 {
-    GLOBAL_LOCK_CONF;
-
     nk_sched_reap(0); // conditional reap to make room for new thread
 
     // the caller is expected to have already set current_cpu!
 
-    // we allocate the new thread node here because a malloc inside
-    // of the global list enqueue could itself trigger a reap
-    // in which case we would deadlock, since reaping also acquires the
-    // global scheduler lock
-
-    rt_node *n = rt_node_init(t->sched_state); 
-    
-    DEBUG("create: node %p for thread %p (%lu)\n",n,t->sched_state,t->sched_state->thread->tid);
-    
-    if (!n) {
-    	ERROR("Failed to allocate rt_node in post create\n");
-    	return 0;
-    }
-    
-    // now we can safely acquire the lock and put the new thread
-    // on the global thread list
-    
-    GLOBAL_LOCK();
-
-    if (global_sched_state.num_threads >= MAX_QUEUE) {
+    if (__sync_fetch_and_add(&global_sched_state.num_threads,1) >= MAX_QUEUE) {
+	__sync_fetch_and_sub(&global_sched_state.num_threads,1);
 	DEBUG("Scheduler vetos thread creation as there are %lu active threads in system\n", global_sched_state.num_threads);
 	DEBUG("You can increase the maximum of %lu active threads using NAUT_CONFIG_MAX_THREADS\n", NAUT_CONFIG_MAX_THREADS);
-	GLOBAL_UNLOCK();
-	rt_node_deinit(n);
 	return -1;
     }
-    
-    // this enqueue avoids any malloc and thus no reap should be
-    // triggered by it
-    if (_rt_list_enqueue(global_sched_state.thread_list, t->sched_state, n)) {
-	ERROR("Failed to add new thread to global thread list\n");
-	GLOBAL_UNLOCK();
-	return -1;
-    }
-    global_sched_state.num_threads++;
+
+    registry_add(t->sched_state);
 
     DEBUG("Post Create of thread %p (%d) [numthreads=%d]\n",
 	  t, t->tid, global_sched_state.num_threads);
     
-    GLOBAL_UNLOCK();
-
     return 0;
 }
 
 
 
+// returns nonzero if someone else has claimed the exited thread,
+// in which case the caller must not free it
 int nk_sched_thread_pre_destroy(nk_thread_t * t)
 {
-    rt_thread *r;
-    GLOBAL_LOCK_CONF;
-    
-    GLOBAL_LOCK();
+    rt_thread *r = t->sched_state;
+    rt_scheduler *s;
+    rt_status status;
+    uint8_t flags;
+    int theirs = 0;
+
+    // an exited thread must be claimed from the dead list of the cpu
+    // it exited on, unless we are the reaper that claimed it
+    if (t->status == NK_THR_EXITED) {
+	// nk_join can return while the thread is still leaving its stack
+	while ((status = *(volatile rt_status *)&r->status) != REAPABLE && status != REAPING) {
+	    asm volatile ("pause");
+	}
+	s = per_cpu_get(system)->cpus[r->dead_cpu]->sched_state;
+	flags = spin_lock_irq_save(&s->dead_lock);
+	if (r->status == REAPABLE) {
+	    list_del_init(&r->dead_node);
+	    s->num_dead--;
+	    r->status = REAPING;
+	    r->reaper = get_cur_thread();
+	} else if (r->reaper != get_cur_thread()) {
+	    theirs = 1;
+	}
+	spin_unlock_irq_restore(&s->dead_lock, flags);
+	if (theirs) {
+	    DEBUG("Thread %lu was claimed by the reaper, leaving it to it\n", t->tid);
+	    return -1;
+	}
+    }
 
-    if (!(r=rt_list_remove(global_sched_state.thread_list,t->sched_state->list))) {
-	ERROR("Failed to remove thread from global list....\n");
-	GLOBAL_UNLOCK();
-	return -1;
+    if (t->sched_state->reg_cpu < 0) {
+	// already removed when the thread was put in a reanimation pool
+	return 0;
     }
 
-    global_sched_state.num_threads--;
-    
-    GLOBAL_UNLOCK();
+    registry_remove(t->sched_state);
+
+    __sync_fetch_and_sub(&global_sched_state.num_threads,1);
     
     return 0;
 }
@@ -1345,8 +1472,6 @@ static inline rt_thread *lottery_get_next_aperiodic(rt_scheduler *s)
 {
     // this is the dumb, obvious algorithm (linear in # threads in queue)
     rt_thread *t=NULL;
-    uint64_t cur;
-    uint64_t pos;
     rt_queue *q=&s->aperiodic;
     uint64_t target_prob;
     uint64_t cum_prob;
@@ -1356,57 +1481,32 @@ static inline rt_thread *lottery_get_next_aperiodic(rt_scheduler *s)
 
     target_prob = get_random() % s->total_prob;
 
-    for (cur=0, cum_prob=0;
-	 cur<q->size;
-	 cur++) {
-	pos = (q->tail + cur) % MAX_QUEUE;
-	cum_prob += q->threads[pos]->constraints.aperiodic.priority;
+    for (t=rt_queue_first(q), cum_prob=0;
+	 t;
+	 t=rt_queue_next(q,t)) {
+	cum_prob += t->constraints.aperiodic.priority;
 	if (cum_prob>=target_prob) {
 	    // don't pick the idle thread if it can be avoided
-	    if (q->threads[pos]->thread->is_idle && q->size>1) { 
+	    if (t->thread->is_idle && q->size>1) { 
 		// there is at least one other thread
-		if (cur<(q->size-1)) {
+		if (rt_queue_next(q,t)) {
 		    // pick the very next one if possible
-		    cur++;
+		    t = rt_queue_next(q,t);
 		} else {
 		    // pick the previous one if not
-		    // cur must be >0
-		    cur--;
+		    t = list_entry(t->q_node.prev, rt_thread, q_node);
 		}
-		// update position
-		pos = (q->tail + cur) % MAX_QUEUE;
 	    }
 	    break;
 	}
     }
 
-    if (cur==q->size) { 
+    if (!t) { 
 	panic("Cannot find thread in lottery scheduler\n");
 	return 0;
     }
 
-    // grab the thread we will return
-    t = q->threads[pos];
-
-
-    // cur => position within the queue (0=oldest, ...)
-    // pos => position within the array
-    // We now need to "copy down" everything above this position
-
-    uint64_t i, p, n;
-    for (i=cur;
-	 i<(q->size-1);
-	 i++) {
-	
-	p = (q->tail + i) % MAX_QUEUE;
-	n = (q->tail + i + 1 ) % MAX_QUEUE;
-	q->threads[p] = q->threads[n];
-    }
-
-    // decrement head
-    q->head = (q->head + MAX_QUEUE - 1) % MAX_QUEUE;
-    
-    q->size--;
+    rt_queue_remove(q,t);
 
     s->total_prob -= t->constraints.aperiodic.priority;
 
@@ -1514,173 +1614,62 @@ void nk_sched_exit(spinlock_t *lock_to_release)
 }
 
 
-static rt_list* rt_list_init() 
-{
-    rt_list *list = (rt_list *)MALLOC(sizeof(rt_list));
-    if (list) { 
-	list->head = NULL;
-	list->tail = NULL;
-    }
-    return list;
-}
-
-static void rt_list_deinit(rt_list *l) 
-{
-    rt_node *cur = l->head;
-    rt_node *next = l->head;
-
-    while (cur) { 
-	next = cur->next;
-	rt_node_deinit(cur);
-	cur = next;
-    }
-    FREE(l);
-}
-
-
- 
-// node setup without allocation
-static void _rt_node_init(rt_node *node, rt_thread *t)
-{
-    ASSERT(t);
-    node->thread = t;
-    node->next = NULL;
-    node->prev = NULL;
-}
-
-// node setup with allocation
-static rt_node* rt_node_init(rt_thread *t) 
-{
-    rt_node *node = (rt_node *)MALLOC_SPECIFIC(sizeof(rt_node),t->thread->current_cpu);
-    if (node) { 
-	_rt_node_init(node,t);
-    }
-    return node;
-}
-
-static void rt_node_deinit(rt_node *n)
-{
-    n->next = SCHEDULER_POISON;
-    n->prev = SCHEDULER_POISON;
-    n->thread = SCHEDULER_POISON;
-    FREE(n);
-}
-
-static int rt_list_empty(rt_list *l) 
-{
-    return (l->head == NULL);
-}
-
-// insert with pre-allocated node structure
-// no memory allocation
-static int _rt_list_enqueue(rt_list *l, rt_thread *t, rt_node *newnode)
+static void registry_add(rt_thread *t)
 {
-    if (l == NULL) {
-        ERROR("RT_LIST IS UNINITIALIZED.\n");
-        return -1;
-    }
-
-    _rt_node_init(newnode,t);
-
-    if (l->head == NULL) {
-        l->head = newnode;
-	l->tail = l->head;
-	t->list = l->head;
-	return 0;
-    }
-
-    rt_node *n = l->tail;
-
-    l->tail = newnode;
-    l->tail->prev = n;
-    n->next = l->tail;
-    t->list = l->tail;
-
-    return 0;
-}
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu = my_cpu_id();
+    rt_scheduler *s = sys->cpus[cpu]->sched_state;
+    struct tid_bucket *b = &tid_hash[t->thread->tid & (TID_HASH_BUCKETS-1)];
+    uint8_t flags;
 
+    flags = spin_lock_irq_save(&s->registry_lock);
+    list_add_tail(&t->reg_node, &s->registry);
+    s->num_registered++;
+    t->reg_cpu = cpu;
+    spin_unlock_irq_restore(&s->registry_lock, flags);
 
-static int rt_list_enqueue(rt_list *l, rt_thread *t)
-{
-    rt_node *n = rt_node_init(t);
-    
-    if (!n) {
-	ERROR("Failed to allocate node for rt list enqueue\n");
-	return -1;
-    } else {
-	return _rt_list_enqueue(l,t,n);
-    }
+    flags = spin_lock_irq_save(&b->lock);
+    hlist_add_head(&t->tid_node, &b->threads);
+    spin_unlock_irq_restore(&b->lock, flags);
 }
 
-
-static rt_thread* rt_list_dequeue(rt_list *l) 
+static void registry_remove(rt_thread *t)
 {
-    if (l == NULL) {
-        ERROR("RT_LIST IS UNINITIALIZED.\n");
-        return NULL;
-    }
-
-    if (l->head == NULL) {
-        return NULL;
-    }
-
-    rt_node *n = l->head;
-    rt_thread *t= n->thread;
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s = sys->cpus[t->reg_cpu]->sched_state;
+    struct tid_bucket *b = &tid_hash[t->thread->tid & (TID_HASH_BUCKETS-1)];
+    uint8_t flags;
 
-    l->head = n->next;
-    l->head->prev = NULL;
-    n->next = NULL;
-    n->prev = NULL;
-    rt_node_deinit(n);
-    t->list = SCHEDULER_POISON;
-    return t;
-}
+    flags = spin_lock_irq_save(&b->lock);
+    hlist_del_init(&t->tid_node);
+    spin_unlock_irq_restore(&b->lock, flags);
 
-static void rt_list_map(rt_list *l, void (func)(rt_thread *t, void *priv), void *priv)  
-{
-    ASSERT(l);
-    rt_node *n = l->head;
-    while (n != NULL) {
-	//DEBUG("scan: node %p for thread %p\n",n, n->thread);
-	//DEBUG("      (%lu)\n", n->thread->thread->tid);
-	func(n->thread,priv);
-        n = n->next;
-    }
+    flags = spin_lock_irq_save(&s->registry_lock);
+    list_del_init(&t->reg_node);
+    s->num_registered--;
+    t->reg_cpu = -1;
+    spin_unlock_irq_restore(&s->registry_lock, flags);
 }
 
-static rt_thread* rt_list_remove(rt_list *l, rt_node *n) 
+// func is invoked with the registry lock of the thread's cpu held
+static void registry_map(void (*func)(rt_thread *t, void *priv), void *priv)
 {
-    rt_node *tmp = n->next;
-    rt_thread *f;
-
-    if (n->next != NULL) {
-	n->next->prev = n->prev;
-    } else {
-	l->tail = n->prev;
-    }
-    if (n->prev != NULL) {
-	n->prev->next = tmp;
-    } else {
-	l->head = tmp;
-    }
-    n->next = NULL;
-    n->prev = NULL;
-    f = n->thread;
-    rt_node_deinit(n);
-    return f;
-}
-
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s;
+    rt_thread *t;
+    uint8_t flags;
+    int i;
 
-static rt_thread* rt_list_remove_search(rt_list *l, rt_thread *t) 
-{
-    rt_node *n = l->head;
-    while (n != NULL) {
-        if (n->thread == t) {
-	    return rt_list_remove(l,n);
-        }
-        n = n->next;
+    for (i=0;i<sys->num_cpus;i++) {
+	if (!(s = sys->cpus[i]->sched_state)) {
+	    continue;
+	}
+	flags = spin_lock_irq_save(&s->registry_lock);
+	list_for_each_entry(t, &s->registry, reg_node) {
+	    func(t,priv);
+	}
+	spin_unlock_irq_restore(&s->registry_lock, flags);
     }
-    return NULL;
 }
 
 
@@ -1688,14 +1677,15 @@ static rt_thread* rt_list_remove_search(rt_list *l, rt_thread *t)
 
 static int        rt_queue_enqueue(rt_queue *queue, rt_thread *thread)
 {
-    if (queue->size==MAX_QUEUE) {
+    if (thread->q) {
+	ERROR("Thread is already on a queue, cannot put it on fifo\n");
 	return -1;
-    } else {
-	queue->threads[queue->head] = thread;
-	queue->head = (queue->head + 1 ) % MAX_QUEUE;
-	queue->size++;
-	return 0;
     }
+    list_add_tail(&thread->q_node, &queue->threads);
+    thread->q = queue;
+    thread->q_type = queue->type;
+    queue->size++;
+    return 0;
 }
 	
 static rt_thread* rt_queue_dequeue(rt_queue *queue)
@@ -1703,8 +1693,9 @@ static rt_thread* rt_queue_dequeue(rt_queue *queue)
     if (queue->size==0) { 
 	return 0;
     } else {
-	rt_thread *r = queue->threads[queue->tail];
-	queue->tail = (queue->tail+1) % MAX_QUEUE;
+	rt_thread *r = list_first_entry(&queue->threads, rt_thread, q_node);
+	list_del_init(&r->q_node);
+	r->q = 0;
 	queue->size--;
 	return r;
     }
@@ -1712,46 +1703,25 @@ static rt_thread* rt_queue_dequeue(rt_queue *queue)
 
 static rt_thread* rt_queue_remove(rt_queue *queue, rt_thread *thread)
 {
-    if (queue->size==0) { 
+    if (thread->q != queue) { 
+	// not found
 	return 0;
     } else {
-	uint64_t now, cur, next;
-
-	for (now=0;now<queue->size;now++) { 
-	    cur = (queue->tail + now) % MAX_QUEUE;
-	    if (queue->threads[cur] == thread) { 
-		break;
-	    }
-	}
-
-	if (now==queue->size) {
-	    // not found
-	    return 0;
-	}
-
-	// copy down
-	for (;now<queue->size-1;now++) {
-	    cur = (queue->tail + now) % MAX_QUEUE;
-	    next = (queue->tail + now + 1) % MAX_QUEUE;
-	    queue->threads[cur] = queue->threads[next];
-	}
-	
-	// decrement head
-	queue->head = (queue->head + MAX_QUEUE - 1) % MAX_QUEUE;
-    
+	list_del_init(&thread->q_node);
+	thread->q = 0;
 	queue->size--;
-	
 	return thread;
     }
 }
 
-static rt_thread *rt_queue_peek(rt_queue *queue, uint64_t pos)
+static rt_thread *rt_queue_first(rt_queue *queue)
 {
-    if (pos>=queue->size) { 
-	return 0;
-    } else {
-	return queue->threads[(queue->tail+pos)%MAX_QUEUE];
-    }
+    return list_empty(&queue->threads) ? 0 : list_first_entry(&queue->threads, rt_thread, q_node);
+}
+
+static rt_thread *rt_queue_next(rt_queue *queue, rt_thread *thread)
+{
+    return thread->q_node.next == &queue->threads ? 0 : list_entry(thread->q_node.next, rt_thread, q_node);
 }
 
 static int        rt_queue_empty(rt_queue *queue)
@@ -1761,64 +1731,112 @@ static int        rt_queue_empty(rt_queue *queue)
 
 static void rt_queue_dump(rt_queue *queue, char *pre)
 {
-    int now;
-    int cur;
+    rt_thread *cur;
     DEBUG("======%s==BEGIN=====\n",pre);
-    for (now=0;now<queue->size;now++) { 
-	cur = (queue->tail + now) % MAX_QUEUE;
-	DEBUG("   %llu %s (%llu)\n",queue->threads[cur]->thread->tid,
-	      queue->threads[cur]->thread->is_idle ? "*idle*" : 
-	      queue->threads[cur]->thread->name[0] ? queue->threads[cur]->thread->name : "(no name)" ,queue->threads[cur]->deadline);
+    for (cur=rt_queue_first(queue); cur; cur=rt_queue_next(queue,cur)) { 
+	DEBUG("   %llu %s (%llu)\n",cur->thread->tid,
+	      cur->thread->is_idle ? "*idle*" : 
+	      cur->thread->name[0] ? cur->thread->name : "(no name)" ,cur->deadline);
     }
     DEBUG("======%s==END=====\n",pre);
 }
 
-#if SANITY_CHECKS
-#define parent(i) ({ uint64_t _t = ((i) ? (((i) - 1) >> 1) : 0); if (_t>=MAX_QUEUE) panic("parent too big\n"); _t; })
-#define left_child(i) ({ uint64_t _t = (((i) << 1) + 1); if (_t>=MAX_QUEUE) panic("left too big\n"); _t; })
-#define right_child(i) ({ uint64_t _t = (((i) << 1) + 2); if (_t>=MAX_QUEUE) panic("right too big\n"); _t; })
-#else // no sanity checks
-#define parent(i)      ((i) ? (((i) - 1) >> 1) : 0)
-#define left_child(i)  (((i) << 1) + 1)
-#define right_child(i) (((i) << 1) + 2)
-#endif // sanity checks
+//
+// Pairing heap
+//
+// Each thread links to its first child and to its siblings.  q_prev
+// is the previous sibling, or the parent for a first child, which
+// lets a thread cut itself out of the heap without a search.
+// Insertion is O(1), and removal of the minimum or of an arbitrary
+// thread is O(log n) amortized.
+//
+
+// link two detached heaps, the later deadline becoming the first child
+static rt_thread *heap_link(rt_thread *a, rt_thread *b)
+{
+    rt_thread *t;
+
+    if (!a) {
+	return b;
+    }
+    if (!b) {
+	return a;
+    }
+    if (b->deadline < a->deadline) {
+	t = a; a = b; b = t;
+    }
+
+    b->q_prev = a;
+    b->q_next = a->q_child;
+    if (a->q_child) {
+	a->q_child->q_prev = b;
+    }
+    a->q_child = b;
+
+    return a;
+}
+
+// combine a list of siblings into one heap (the usual two passes)
+static rt_thread *heap_merge_pairs(rt_thread *first)
+{
+    rt_thread *a, *b, *next, *pairs=0, *root=0;
+
+    // link adjacent pairs, left to right, stacking the results
+    while (first) {
+	a = first;
+	b = a->q_next;
+	next = b ? b->q_next : 0;
+	a->q_next = a->q_prev = 0;
+	if (b) {
+	    b->q_next = b->q_prev = 0;
+	}
+	a = heap_link(a,b);
+	a->q_next = pairs;
+	pairs = a;
+	first = next;
+    }
+
+    // then fold the stack, right to left
+    while (pairs) {
+	next = pairs->q_next;
+	pairs->q_next = 0;
+	root = heap_link(root,pairs);
+	pairs = next;
+    }
+
+    return root;
+}
 
 static void rt_priority_queue_dump(rt_priority_queue *queue, char *pre)
 {
-    int now;
+    rt_thread *cur;
     DEBUG("======%s==BEGIN=====\n",pre);
-    for (now=0;now<queue->size;now++) { 
-	DEBUG("   %llu %s (%llu)\n",queue->threads[now]->thread->tid,
-	      queue->threads[now]->thread->is_idle ? "*idle*" : 
-	      queue->threads[now]->thread->name[0] ? queue->threads[now]->thread->name : "(no name)" ,queue->threads[now]->deadline);
+    for (cur=rt_priority_queue_first(queue); cur; cur=rt_priority_queue_next(queue,cur)) { 
+	DEBUG("   %llu %s (%llu)\n",cur->thread->tid,
+	      cur->thread->is_idle ? "*idle*" : 
+	      cur->thread->name[0] ? cur->thread->name : "(no name)" ,cur->deadline);
     }
     DEBUG("======%s==END=====\n",pre);
 }
 
 static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread)
 {
-    if (queue->size == MAX_QUEUE)        {
-	ERROR("Too many threads for priority queue %s\n", 
+    if (thread->q) {
+	ERROR("Thread is already on a queue, cannot put it on priority queue %s\n", 
 	      queue->type==RUNNABLE_QUEUE ? "Runnable" :
 	      queue->type==PENDING_QUEUE ? "Pending" :
 	      queue->type==APERIODIC_QUEUE ? "Aperiodic Runnable" : "UNKNOWN");
 	      
 	return -1;
     }
-        
-    uint64_t pos = queue->size++;
-    queue->threads[pos] = thread;
 
-    // update heap
-    while (queue->threads[parent(pos)]->deadline > thread->deadline 
-	   && pos != parent(pos))  {
-	queue->threads[pos] = queue->threads[parent(pos)];
-	pos = parent(pos);
-    }
+    thread->q_child = thread->q_next = thread->q_prev = 0;
 
-    thread->q_type = queue->type;
-    queue->threads[pos] = thread;
+    queue->root = heap_link(queue->root, thread);
+    queue->size++;
 
+    thread->q = queue;
+    thread->q_type = queue->type;
 
     return 0;
 }
@@ -1847,32 +1865,13 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
 	return NULL;
     }
     
-    rt_thread *min, *last;
-    int now, child;
-    
-    // Get the entry we are about to remove (min)
-    min = queue->threads[0];
-    last = queue->threads[--queue->size];
-        
-    // update the heap
-    for (now = 0; left_child(now) < queue->size; now = child) {
-	
-	child = left_child(now);
+    rt_thread *min = queue->root;
 
-	if (child < queue->size && 
-	    queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)  {
-	    
-	    child = right_child(now);
-	}
-            
-	if (last->deadline > queue->threads[child]->deadline) {
-	    queue->threads[now] = queue->threads[child];
-	} else {
-	    break;
-	}
-    }
-        
-    queue->threads[now] = last;
+    queue->root = heap_merge_pairs(min->q_child);
+    queue->size--;
+
+    min->q_child = min->q_next = min->q_prev = 0;
+    min->q = 0;
         
     return min;
 
@@ -1880,38 +1879,56 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
 
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread)
 {
-    // this is currently hideous beyond belief
-
-    rt_priority_queue temp = *queue;
-    rt_thread *cur;
-    int found=0;
-
-    queue->size=0;
+    if (thread->q != queue) { 
+	return 0;
+    }
 
-    while (!rt_priority_queue_empty(&temp)) {
-	cur=rt_priority_queue_dequeue(&temp);
-	if (cur && cur!=thread) {
-	    if (rt_priority_queue_enqueue(queue,cur)) { 
-		ERROR("Failed to re-enqueue in removal process...\n");
-	    } 
-	} else {
-	    found = 1;
-	}
+    if (thread == queue->root) {
+	return rt_priority_queue_dequeue(queue);
     }
-    if (!found) { 
-	return 0;
+
+    // cut the thread's subtree out of the heap
+    if (thread->q_prev->q_child == thread) {
+	thread->q_prev->q_child = thread->q_next;
     } else {
-	return thread;
+	thread->q_prev->q_next = thread->q_next;
+    }
+    if (thread->q_next) {
+	thread->q_next->q_prev = thread->q_prev;
     }
+
+    // and put its children back
+    queue->root = heap_link(queue->root, heap_merge_pairs(thread->q_child));
+    queue->size--;
+
+    thread->q_child = thread->q_next = thread->q_prev = 0;
+    thread->q = 0;
+
+    return thread;
 }
 
-static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
+// preorder walk, in no particular deadline order
+static rt_thread *rt_priority_queue_first(rt_priority_queue *queue)
 {
-    if (pos>=queue->size) { 
-	return 0;
-    } else {
-	return queue->threads[pos];
+    return queue->root;
+}
+
+static rt_thread *rt_priority_queue_next(rt_priority_queue *queue, rt_thread *thread)
+{
+    if (thread->q_child) {
+	return thread->q_child;
+    }
+    while (thread) {
+	if (thread->q_next) {
+	    return thread->q_next;
+	}
+	// climb to the parent through the earlier siblings
+	while (thread->q_prev && thread->q_prev->q_child != thread) {
+	    thread = thread->q_prev;
+	}
+	thread = thread->q_prev;
     }
+    return 0;
 }
 
 static int rt_priority_queue_empty(rt_priority_queue *queue)
@@ -1934,6 +1951,36 @@ static void rt_thread_dump(rt_thread *thread, char *pre)
 }
 
 
+#ifdef NAUT_CONFIG_TICKLESS
+// Could anything take the cpu away from this aperiodic thread
+// at the end of its quantum?  Only another aperiodic thread
+// can, since real-time arrivals are handled separately, and the
+// idle thread does not count as it only runs when nothing else can
+static int preemption_needed(rt_scheduler *scheduler, rt_thread *thread)
+{
+    rt_thread *other;
+
+    if (HAVE_RT(scheduler)) {
+	return 1;
+    }
+
+#if NAUT_CONFIG_WORK_STEALING
+    // an idle cpu still needs to wake up to steal work
+    if (thread->thread->is_idle) {
+	return 1;
+    }
+#endif
+
+    for (other=FIRST_APERIODIC(scheduler); other; other=NEXT_APERIODIC(scheduler,other)) {
+	if (!other->thread->is_idle) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+#endif
+
 static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 {
     struct sys_info *sys = per_cpu_get(system);
@@ -1951,6 +1998,11 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 	uint64_t remaining_time;
 	switch (thread->constraints.type) { 
 	case APERIODIC:
+#ifdef NAUT_CONFIG_TICKLESS
+	    if (!preemption_needed(scheduler, thread)) {
+		break;
+	    }
+#endif
 	    next_preempt = now + scheduler->cfg.aperiodic_quantum;
 	    break;
 	case SPORADIC:
@@ -1968,12 +2020,30 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
     }
 
 
+#ifdef NAUT_CONFIG_TICKLESS
+    // each cpu's timer interrupt fires the timer events started on it
+    next_arrival = MIN(next_arrival, nk_timer_next_expiry());
+#endif
+
     // set timer to the minimum of the next arrival and the timeout
     // of the current thread, adding slack for scheduler overhead
 
     scheduler->tsc.start_time = now;
     scheduler->tsc.set_time = MIN(next_arrival,next_preempt);
     
+#ifdef NAUT_CONFIG_TICKLESS
+    if (scheduler->tsc.set_time == -1) {
+	// nothing to wake up for - stop the timer if it is running
+	scheduler->tickless_count++;
+	apic_update_oneshot_timer(apic, APIC_TIMER_INFINITE, UNCOND);
+	return;
+    }
+    // a distant timer event is reached in steps the APIC can count
+    if (scheduler->tsc.set_time > now + TICKLESS_MAX_TIMEOUT_NS) {
+	scheduler->tsc.set_time = now + TICKLESS_MAX_TIMEOUT_NS;
+    }
+#endif
+
   
     // the set time has been computed based on the "now" argument
     // which is the start of the scheduling pass.   We need to set
@@ -2738,6 +2808,10 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	      rt_n->thread->tid, rt_n->thread->name,
 	      my_cpu_id());
 
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+	nk_thread_stack_guard_check(rt_c->thread);
+#endif
+
 	rt_n->switch_in_count++;
 	      
 	// we are switching threads, start accounting for the new one
@@ -2981,34 +3055,168 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 	    } else {
 		return -1;
 	    }
-	} else {
-	    return 0;
+	} else {
+	    return 0;
+	}
+    }
+
+ out_fail:
+    LOCAL_UNLOCK(os);
+    return -1;
+}
+
+
+// Stealing threads or tasks
+
+static int steal_level(struct cpu *a, struct cpu *b)
+{
+    int same_domain = a->domain && b->domain && a->domain->id == b->domain->id;
+
+    if (a->coord && b->coord) {
+	if (nk_topo_cpus_share_phys_core(a,b)) {
+	    return STEAL_LEVEL_CORE;
+	}
+	if (nk_topo_cpus_share_socket(a,b) && same_domain) {
+	    return STEAL_LEVEL_SOCKET;
+	}
+    }
+
+    return same_domain ? STEAL_LEVEL_DOMAIN : STEAL_LEVEL_REMOTE;
+}
+
+// order the other cpus by distance from this one, which needs the
+// topology of all of them, and so is done once they are all up
+static int build_steal_order(rt_scheduler *s)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct cpu *me = get_cpu();
+    int level, i, n=0;
+
+    s->steal_order = (int*) MALLOC_SPECIFIC(sizeof(int)*sys->num_cpus, me->id);
+
+    if (!s->steal_order) {
+	ERROR("Cannot allocate steal order\n");
+	return -1;
+    }
+
+    for (level=0; level<STEAL_LEVELS; level++) {
+	s->steal_level_start[level] = n;
+	// start just after us so that cpus at the same level spread out
+	for (i=1; i<sys->num_cpus; i++) {
+	    int cpu = (me->id + i) % sys->num_cpus;
+	    if (steal_level(me, sys->cpus[cpu]) == level) {
+		s->steal_order[n++] = cpu;
+	    }
+	}
+    }
+    s->steal_level_start[STEAL_LEVELS] = n;
+
+    return 0;
+}
+
+// visit the other cpus by distance, starting at a random one within each level
+// returns the first for which func returns nonzero, or -1 
+static int for_each_victim(int (*func)(int cpu, int level, void *state), void *state)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    rt_scheduler *s = sys->cpus[my_cpu_id()]->sched_state;
+    int level, i, cpu;
+
+    if (!s->steal_order) {
+	// not yet built, so just go around the cpus
+	for (i=1; i<sys->num_cpus; i++) {
+	    cpu = (my_cpu_id() + i) % sys->num_cpus;
+	    if (func(cpu, STEAL_LEVEL_REMOTE, state)) {
+		return cpu;
+	    }
+	}
+	return -1;
+    }
+
+    for (level=0; level<STEAL_LEVELS; level++) {
+	int first = s->steal_level_start[level];
+	int num = s->steal_level_start[level+1] - first;
+	int start = num ? get_random() % num : 0;
+	for (i=0; i<num; i++) {
+	    cpu = s->steal_order[first + (start + i) % num];
+	    if (func(cpu, level, state)) {
+		return cpu;
+	    }
 	}
     }
 
- out_fail:
-    LOCAL_UNLOCK(os);
     return -1;
 }
 
+int nk_sched_map_victims(int (*func)(int cpu, int level, void *state), void *state)
+{
+    return for_each_victim(func, state);
+}
+
+
+static int numa_distance(struct cpu *a, struct cpu *b)
+{
+    struct nk_locality_info *loc = &per_cpu_get(system)->locality_info;
+
+    if (!a->domain || !b->domain) {
+	return STEAL_LOCAL_DISTANCE;
+    }
+
+    if (!loc->numa_matrix) {
+	return a->domain->id == b->domain->id ? STEAL_LOCAL_DISTANCE : 2*STEAL_LOCAL_DISTANCE;
+    }
+
+    return loc->numa_matrix[a->domain->id*loc->num_domains + b->domain->id];
+}
+
+// how many more runnable threads than the thief a victim must have
+// before we steal from it, which grows with distance, and for remote
+// domains, with their NUMA distance relative to local memory
+static uint64_t steal_threshold(struct cpu *thief, struct cpu *victim, int level)
+{
+    uint64_t cost = level;
+
+    if (level == STEAL_LEVEL_REMOTE) {
+	cost = (level * numa_distance(thief, victim)) / STEAL_LOCAL_DISTANCE;
+    }
+
+    return 1 + STEAL_LOCALITY_PENALTY * cost;
+}
 
-static int select_victim(int new_cpu)
+// Hierarchical selection: within each level, nearest first, pick the
+// richer of two random cpus (power of two choices), and take it if
+// it has enough more threads than we do to be worth the distance
+static int select_victim(int new_cpu, int *level_out)
 {
-    int a,b;
     struct sys_info *sys = per_cpu_get(system);
- 
-    // power of two random choices selection
+    rt_scheduler *ns = sys->cpus[new_cpu]->sched_state;
+    int level, a, b, v;
+
+    if (!ns->steal_order) {
+	return -1;
+    }
+
+    for (level=0; level<STEAL_LEVELS; level++) {
+	int first = ns->steal_level_start[level];
+	int num = ns->steal_level_start[level+1] - first;
+
+	if (!num) {
+	    continue;
+	}
 
-    // pick two, return the one with the most threads
+	a = ns->steal_order[first + get_random() % num];
+	b = ns->steal_order[first + get_random() % num];
 
-    do {
-	a = (int)(get_random() % sys->num_cpus);
-	b = (int)(get_random() % sys->num_cpus);
-    } while (a==new_cpu || b==new_cpu);
+	v = SIZE_APERIODIC(sys->cpus[a]->sched_state) > SIZE_APERIODIC(sys->cpus[b]->sched_state) ? a : b;
 
-    return (sys->cpus[a]->sched_state->aperiodic.size  >
-	    sys->cpus[b]->sched_state->aperiodic.size) ? a : b;
+	if (SIZE_APERIODIC(sys->cpus[v]->sched_state) >= 
+	    SIZE_APERIODIC(ns) + steal_threshold(sys->cpus[new_cpu], sys->cpus[v], level)) {
+	    *level_out = level;
+	    return v;
+	}
+    }
 
+    return -1;
 }
 
 uint64_t nk_sched_get_runtime(struct nk_thread *t)
@@ -3024,15 +3232,27 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
     rt_scheduler *os;
     rt_scheduler *ns = sys->cpus[new_cpu]->sched_state;
     rt_thread *prosp[maxcount];
+    rt_thread *t;
     uint64_t count=0;
-    uint64_t cur, pos;
+    uint64_t cur;
     int rc=-1;
+    int level;
 
 
     *actualcount = 0;
 
     if (old_cpu==-1) { 
-	old_cpu = select_victim(new_cpu);
+	old_cpu = select_victim(new_cpu, &level);
+	if (old_cpu<0) {
+	    DEBUG("Work stealing: no victim is worth stealing from\n");
+	    return 0;
+	}
+    } else {
+	if (old_cpu<0 || old_cpu>=sys->num_cpus) { 
+	    ERROR("Cannot steal from cpu %d (out of range)\n", old_cpu);
+	    return -1;
+	}
+	level = steal_level(sys->cpus[new_cpu], sys->cpus[old_cpu]);
     }
 
     if (old_cpu==new_cpu) {
@@ -3043,12 +3263,7 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
     os = sys->cpus[old_cpu]->sched_state;
  
-    DEBUG("Work stealing: selected victim is %d\n",old_cpu);
-
-    if (old_cpu>=sys->num_cpus) { 
-	ERROR("Cannot steal from cpu %d (out of range)\n", old_cpu);
-	return -1;
-    }
+    DEBUG("Work stealing: selected victim is %d (level %d)\n",old_cpu,level);
 
     if (SIZE_APERIODIC(os) <= SIZE_APERIODIC(ns)) { 
 	DEBUG("Avoiding theft from insufficiently rich CPU\n");
@@ -3061,8 +3276,7 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
     count=0;
 
-    for (cur=0;cur<SIZE_APERIODIC(os);cur++) {
-	rt_thread *t = PEEK_APERIODIC(os,cur);
+    for (t=FIRST_APERIODIC(os);t;t=NEXT_APERIODIC(os,t)) {
 	// do not steal the idle thread, interrupt thread, task thread, or any bound thread
 	if (t && !t->thread->is_idle && !t->is_intr && !t->is_task && t->thread->bound_cpu<0 ) { 
 	    DEBUG("Found thread %llu %s\n",t->thread->tid,t->thread->name);
@@ -3094,6 +3308,7 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
     }
     
     ns->num_thefts += *actualcount;
+    ns->thread_steals[level] += *actualcount;
     
     DEBUG("Thread theft complete\n");
 
@@ -3220,6 +3435,14 @@ static void handle_special_switch(rt_status what, int have_lock, uint8_t flags,
     preempt_reset();
 
     if (what==EXITING) {
+	// The reaper will leave us alone until the helper below has
+	// marked us REAPABLE, which it does once we are off our stack
+	spin_lock(&s->dead_lock);
+	list_add_tail(&rt_c->dead_node, &s->dead);
+	rt_c->dead_cpu = my_cpu_id();
+	s->num_dead++;
+	spin_unlock(&s->dead_lock);
+
 	// We need to make the exit transition extremely cleanly as we can
 	// race with the reaper - this invokes an assembly snippet that does this
 	// correctly, and also avoids any state save costs for this now dead
@@ -3462,21 +3685,19 @@ static inline void get_periodic_util(rt_scheduler *sched, uint64_t *util, uint64
 {
     rt_priority_queue *pending = &sched->pending;
     rt_priority_queue *runnable = &sched->runnable;
-    int i;
+    rt_thread *thread;
 
     *util=0;
     *count=0;
 
-    for (i = 0; i < runnable->size; i++) {
-        rt_thread *thread = runnable->threads[i];
+    for (thread = rt_priority_queue_first(runnable); thread; thread = rt_priority_queue_next(runnable, thread)) {
         if (thread->constraints.type == PERIODIC) {
 	    (*count)++;
             *util += (thread->constraints.periodic.slice * UTIL_ONE) / thread->constraints.periodic.period;
         }
     }
     
-    for (i = 0; i < pending->size; i++) {
-        rt_thread *thread = pending->threads[i];
+    for (thread = rt_priority_queue_first(pending); thread; thread = rt_priority_queue_next(pending, thread)) {
         if (thread->constraints.type == PERIODIC) {
 	    (*count)++;
             *util += (thread->constraints.periodic.slice * UTIL_ONE) / thread->constraints.periodic.period;
@@ -3489,13 +3710,12 @@ static inline void get_sporadic_util(rt_scheduler *sched, uint64_t now, uint64_t
 {
     rt_priority_queue *pending = &sched->pending;
     rt_priority_queue *runnable = &sched->runnable;
-    int i;
+    rt_thread *thread;
 
     *util=0;
     *count=0;
 
-    for (i = 0; i < runnable->size; i++) {
-        rt_thread *thread = runnable->threads[i];
+    for (thread = rt_priority_queue_first(runnable); thread; thread = rt_priority_queue_next(runnable, thread)) {
         if (thread->constraints.type == SPORADIC) {
 	    (*count)++;
 	    // runnable task measured based on its remaining time
@@ -3505,8 +3725,7 @@ static inline void get_sporadic_util(rt_scheduler *sched, uint64_t now, uint64_t
         }
     }
     
-    for (i = 0; i < pending->size; i++) {
-        rt_thread *thread = pending->threads[i];
+    for (thread = rt_priority_queue_first(pending); thread; thread = rt_priority_queue_next(pending, thread)) {
         if (thread->constraints.type == SPORADIC) {
 	    (*count)++;
 	    // runnable task measured based on its total size
@@ -3665,20 +3884,18 @@ static inline uint64_t get_avg_per(rt_priority_queue *runnable, rt_priority_queu
 {
     uint64_t sum_period = 0;
     uint64_t num_periodic = 0;
-    int i;
+    rt_thread *thread;
     
-    for (i = 0; i < runnable->size; i++)
+    for (thread = rt_priority_queue_first(runnable); thread; thread = rt_priority_queue_next(runnable, thread))
     {
-        rt_thread *thread = runnable->threads[i];
         if (thread->constraints.type == PERIODIC) {
             sum_period += thread->constraints.periodic.period;
             num_periodic++;
         }
     }
     
-    for (i = 0; i < pending->size; i++)
+    for (thread = rt_priority_queue_first(pending); thread; thread = rt_priority_queue_next(pending, thread))
     {
-        rt_thread *thread = pending->threads[i];
         if (thread->constraints.type == PERIODIC) {
             sum_period += thread->constraints.periodic.period;
             num_periodic++;
@@ -3697,22 +3914,20 @@ static inline uint64_t get_avg_per(rt_priority_queue *runnable, rt_priority_queu
     return (sum_period / num_periodic);
 }
 
-static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queue *pending, rt_thread *thread)
+static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queue *pending, rt_thread *new_thread)
 {
     uint64_t min_period = 0xFFFFFFFFFFFFFFFF;
-    int i;
-    for (i = 0; i < runnable->size; i++)
+    rt_thread *thread;
+    for (thread = rt_priority_queue_first(runnable); thread; thread = rt_priority_queue_next(runnable, thread))
     {
-        rt_thread *thread = runnable->threads[i];
         if (thread->constraints.type == PERIODIC)
         {
             min_period = MIN(thread->constraints.periodic.period, min_period);
         }
     }
     
-    for (i = 0; i < pending->size; i++)
+    for (thread = rt_priority_queue_first(pending); thread; thread = rt_priority_queue_next(pending, thread))
     {
-        rt_thread *thread = pending->threads[i];
         if (thread->constraints.type == PERIODIC)
         {
             min_period = MIN(thread->constraints.periodic.period, min_period);
@@ -3721,6 +3936,140 @@ static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queu
     return min_period;
 }
 
+static inline task_info *task_info_of(int cpu)
+{
+    return &per_cpu_get(system)->cpus[cpu]->sched_state->tasks;
+}
+
+static inline int task_size_bucket(uint64_t size_ns)
+{
+    return 63 - __builtin_clzl(size_ns);
+}
+
+// owner only, interrupts off
+static inline int deque_push(task_deque *d, struct nk_task *t)
+{
+    sint64_t b = d->bottom;
+
+    if (b - d->top >= TASK_DEQUE_SIZE) {
+	return -1;
+    }
+
+    d->tasks[b & (TASK_DEQUE_SIZE-1)] = t;
+    // the task must be visible before the new bottom, which
+    // x86 guarantees for stores, so only the compiler must not reorder
+    __asm__ __volatile__ ("" ::: "memory");
+    d->bottom = b + 1;
+
+    return 0;
+}
+
+// owner only, interrupts off
+static inline struct nk_task *deque_pop(task_deque *d)
+{
+    sint64_t b = d->bottom - 1;
+    sint64_t t;
+    struct nk_task *task;
+
+    if (b < d->top) {
+	// empty; top only increases, so a stale value cannot mislead us
+	return 0;
+    }
+
+    d->bottom = b;
+    // our claim on the bottom must be visible before we look at the top
+    __sync_synchronize();
+    t = d->top;
+
+    if (t > b) {
+	// a thief took the last one
+	d->bottom = b + 1;
+	return 0;
+    }
+
+    task = d->tasks[b & (TASK_DEQUE_SIZE-1)];
+
+    if (t == b) {
+	// last one, so we race with the thieves for it
+	if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+	    task = 0;
+	}
+	d->bottom = b + 1;
+    }
+
+    return task;
+}
+
+// any cpu
+static inline struct nk_task *deque_steal(task_deque *d)
+{
+    sint64_t t = d->top;
+    // x86 does not reorder loads, so only the compiler must not
+    __asm__ __volatile__ ("" ::: "memory");
+    sint64_t b = d->bottom;
+    struct nk_task *task;
+
+    if (t >= b) {
+	return 0;
+    }
+
+    task = d->tasks[t & (TASK_DEQUE_SIZE-1)];
+
+    if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+	// lost to the owner or another thief
+	return 0;
+    }
+
+    return task;
+}
+
+static inline sint64_t deque_size(task_deque *d)
+{
+    sint64_t n = d->bottom - d->top;
+    return n > 0 ? n : 0;
+}
+
+
+// number of task threads that are asleep, so producers know 
+// whether they need to wake one up
+static volatile int task_sleepers = 0;
+
+static int wake_sleeper(int cpu, int level, void *state)
+{
+    task_info *ti = task_info_of(cpu);
+
+    if (ti->sleeping) {
+	nk_wait_queue_wake_all(ti->waitq);
+	return 1;
+    }
+
+    return 0;
+}
+
+// after making a task available on cpu, wake its task thread, or if
+// the task can be stolen, the nearest sleeping task thread
+static void task_kick(int cpu, int stealable)
+{
+    task_info *ti = task_info_of(cpu);
+
+    // our task must be visible before we look for sleepers, which 
+    // announce themselves before checking for tasks (see await_task())
+    __sync_synchronize();
+
+    if (!task_sleepers) {
+	return;
+    }
+
+    if (ti->sleeping) {
+	nk_wait_queue_wake_all(ti->waitq);
+    }
+
+    if (stealable && cpu == my_cpu_id()) {
+	for_each_victim(wake_sleeper, 0);
+    }
+}
+
+
 static int task_initial_placement()
 {
     struct sys_info * sys = per_cpu_get(system);
@@ -3728,11 +4077,31 @@ static int task_initial_placement()
 }
 
 
-struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), void *input, uint64_t flags)
+// queue a task on a cpu's locked sized buckets or unsized queue
+static void task_enqueue_locked(task_info *ti, struct nk_task *t)
 {
     TASK_LOCK_CONF;
-    
-    int placement_cpu = cpu>=0 ? cpu : task_initial_placement();
+
+    TASK_LOCK(ti);
+    if (t->stats.size_ns) {
+	int b = task_size_bucket(t->stats.size_ns);
+	list_add_tail(&t->queue_node, &ti->sized_buckets[b]);
+	ti->sized_mask |= 1ULL << b;
+	ti->sized_enqueued++;
+    } else {
+	list_add_tail(&t->queue_node, &ti->unsized_queue);
+	ti->unsized_enqueued++;
+    }
+    TASK_UNLOCK(ti);
+}
+
+
+struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), void *input, uint64_t flags)
+{
+    // unsized tasks without a cpu stay here, to be stolen if need be, 
+    // but sized tasks are expected to be pumped where they are placed,
+    // and tasks bound to a cpu (even this one) must never be stolen
+    int placement_cpu = cpu>=0 ? cpu : size_ns ? task_initial_placement() : my_cpu_id();
     uint64_t start = cur_time();
     
     struct nk_task *t = MALLOC_SPECIFIC(sizeof(struct nk_task),placement_cpu);
@@ -3753,44 +4122,89 @@ struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), vo
 
     INIT_LIST_HEAD(&t->queue_node);
 
-    struct sys_info * sys = per_cpu_get(system);
-    task_info *ti = &sys->cpus[placement_cpu]->sched_state->tasks;
+    task_info *ti = task_info_of(placement_cpu);
 
-    // own the target scheduler's task queue
-    TASK_LOCK(ti);
-    if (t->stats.size_ns) {
-	list_add_tail(&t->queue_node, &ti->sized_queue);
-	ti->sized_enqueued++;
-    } else {
-	list_add_tail(&t->queue_node, &ti->unsized_queue);
-	ti->unsized_enqueued++;
+    if (!size_ns && cpu<0) {
+	uint8_t flags = irq_disable_save();
+	// we may have been migrated since choosing the cpu
+	if (placement_cpu == my_cpu_id() && !deque_push(&ti->deque, t)) {
+	    ti->local_enqueued++;
+	    irq_enable_restore(flags);
+	    task_kick(placement_cpu, 1);
+	    return t;
+	}
+	irq_enable_restore(flags);
     }
-    TASK_UNLOCK(ti);
 
-    // kick any waitqueue
-    nk_wait_queue_wake_all(ti->waitq);
+    task_enqueue_locked(ti, t);
+
+    task_kick(placement_cpu, 0);
 
     return t;
 }
 
-static int task_cpu_selection()
+
+// take a task that will run in size_ns from the sized buckets, looking 
+// at no more than search_limit tasks in the one bucket that may have
+// tasks that do not fit, or with size_ns==0, the smallest task
+static struct nk_task *take_sized(task_info *ti, uint64_t size_ns, uint64_t search_limit)
 {
-    struct sys_info * sys = per_cpu_get(system);
-    return (int)(get_random() % sys->num_cpus);
+    struct list_head *cur;
+    struct nk_task *t = 0;
+    uint64_t mask = ti->sized_mask;
+    int b;
+
+    if (!mask) {
+	return 0;
+    }
+
+    if (!size_ns) {
+	b = __builtin_ctzl(mask);
+	t = list_first_entry(&ti->sized_buckets[b], struct nk_task, queue_node);
+    } else {
+	uint64_t count = 0;
+	b = task_size_bucket(size_ns);
+	// tasks in this bucket may or may not fit
+	if (mask & (1ULL << b)) {
+	    list_for_each(cur, &ti->sized_buckets[b]) {
+		struct nk_task *test = list_entry(cur,struct nk_task, queue_node);
+		if (test->stats.size_ns <= size_ns) {
+		    t = test;
+		    break;
+		}
+		if (++count >= search_limit) {
+		    break;
+		}
+	    }
+	}
+	// while those in smaller buckets all fit, so take the largest
+	if (!t && (mask & ((1ULL << b) - 1))) {
+	    b = 63 - __builtin_clzl(mask & ((1ULL << b) - 1));
+	    t = list_first_entry(&ti->sized_buckets[b], struct nk_task, queue_node);
+	}
+    }
+
+    if (t) {
+	list_del_init(&t->queue_node);
+	if (list_empty(&ti->sized_buckets[b])) {
+	    ti->sized_mask &= ~(1ULL << b);
+	}
+	ti->sized_dequeued++;
+    }
+
+    return t;
 }
 
-// dequeue a task, typically used internally
-// dequeuing a task does not execute it.
-static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+// take a task from a cpu's locked queues
+static struct nk_task *take_locked(task_info *ti, uint64_t size_ns, uint64_t search_limit, int try)
 {
     TASK_LOCK_CONF;
-    
-    int source_cpu = cpu>=0 ? cpu : task_cpu_selection();
-
-    struct sys_info * sys = per_cpu_get(system);
-    task_info *ti = &sys->cpus[source_cpu]->sched_state->tasks;
     struct nk_task *t = 0;
-    struct list_head *cur;
+
+    if (size_ns ? !ti->sized_mask : !ti->sized_mask && list_empty(&ti->unsized_queue)) {
+	// nothing there, so don't bother with the lock
+	return 0;
+    }
 
     if (try) {
 	if (TASK_TRY_LOCK(ti)) {
@@ -3800,48 +4214,124 @@ static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t sear
     } else {
 	TASK_LOCK(ti);
     }
-    
-    if (size_ns) {
-	uint64_t count=0;
-	// search for a task that is smaller than the given size
-	// this could of course be much smarter...
-	list_for_each(cur, &ti->sized_queue) {
-	    struct nk_task *test = list_entry(cur,struct nk_task, queue_node);
-	    if (test->stats.size_ns <= size_ns) {
-		t = test;
-		list_del_init(cur);
-		ti->sized_dequeued++;
+
+    if (!size_ns && !list_empty(&ti->unsized_queue)) {
+	// unsized queue first
+	t = list_first_entry(&ti->unsized_queue, struct nk_task, queue_node);
+	list_del_init(&t->queue_node);
+	ti->unsized_dequeued++;
+    } else {
+	t = take_sized(ti, size_ns, search_limit);
+    }
+
+    TASK_UNLOCK(ti);
+
+    return t;
+}
+
+
+struct steal_state {
+    uint64_t        size_ns;
+    uint64_t        search_limit;
+    int             try;
+    struct nk_task *task;
+};
+
+// steal up to half of a victim's deque, keeping one task and pushing 
+// the rest on our own, or failing that, take from its locked queues
+static int steal_from(int cpu, int level, void *state)
+{
+    struct steal_state *ss = (struct steal_state *)state;
+    task_info *victim = task_info_of(cpu);
+    task_info *me;
+    sint64_t i, n = 0;
+    struct nk_task *t;
+
+    if (!ss->size_ns) {
+	sint64_t want = (deque_size(&victim->deque) + 1) / 2;
+	uint8_t flags = irq_disable_save();
+
+	me = task_info_of(my_cpu_id());
+
+	for (i=0; i<want; i++) {
+	    if (!(t = deque_steal(&victim->deque))) {
 		break;
 	    }
-	    count++;
-	    if (count >= search_limit) {
+	    n++;
+	    if (!ss->task) {
+		ss->task = t;
+	    } else if (deque_push(&me->deque, t)) {
+		// no room, so give it back to its cpu's queue
+		task_enqueue_locked(victim, t);
+		n--;
 		break;
+	    } else {
+		me->local_enqueued++;
 	    }
 	}
-    } else {
-	// try unsized queue first
-	if (!list_empty(&ti->unsized_queue)) {
-	    cur = ti->unsized_queue.next;
-	    t = list_entry(cur,struct nk_task, queue_node);
-	    list_del_init(cur);
-	    ti->unsized_dequeued++;
-	} else if (!list_empty(&ti->sized_queue)) {
-	    cur = ti->sized_queue.next;
-	    t = list_entry(cur,struct nk_task, queue_node);
-	    list_del_init(cur);
-	    ti->sized_dequeued++;
-	} else {
-	    // we got nuthin
+
+	if (n) {
+	    me->steal_count[level] += n;
+	}
+
+	irq_enable_restore(flags);
+
+	if (n) {
+	    __sync_fetch_and_add(&victim->stolen, n);
+	    if (n > 1) {
+		// there is now stealable work here
+		task_kick(my_cpu_id(), 1);
+	    }
+	    return 1;
 	}
     }
 
-    TASK_UNLOCK(ti);
+    if ((ss->task = take_locked(victim, ss->size_ns, ss->search_limit, ss->try))) {
+	__sync_fetch_and_add(&task_info_of(my_cpu_id())->steal_count[level], 1);
+	return 1;
+    }
 
-    if (t) {
-	t->stats.dequeue_time_ns = cur_time();
+    return 0;
+}
+
+
+// dequeue a task, typically used internally
+// dequeuing a task does not execute it.
+static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+{
+    struct steal_state ss = { .size_ns = size_ns, .search_limit = search_limit, .try = try, .task = 0 };
+    int my_cpu;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+
+    my_cpu = my_cpu_id();
+
+    if (cpu < 0 || cpu == my_cpu) {
+	task_info *ti = task_info_of(my_cpu);
+	// our own deque first, then our locked queues
+	if (!size_ns && (ss.task = deque_pop(&ti->deque))) {
+	    ti->local_dequeued++;
+	}
+	irq_enable_restore(flags);
+	if (!ss.task) {
+	    ss.task = take_locked(ti, size_ns, search_limit, try);
+	}
+	// then, if we are allowed, the nearest cpu that has work
+	if (!ss.task && cpu < 0) {
+	    for_each_victim(steal_from, &ss);
+	}
+    } else {
+	irq_enable_restore(flags);
+	// a specific other cpu
+	steal_from(cpu, steal_level(get_cpu(), per_cpu_get(system)->cpus[cpu]), &ss);
+    }
+
+    if (ss.task) {
+	ss.task->stats.dequeue_time_ns = cur_time();
     }
 	
-    return t;
+    return ss.task;
 }    
 
 
@@ -3937,6 +4427,7 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
 {
     struct nk_sched_percpu_state *state = (struct nk_sched_percpu_state*)MALLOC_SPECIFIC(sizeof(struct nk_sched_percpu_state),my_cpu_id());
     char buf[NK_WAIT_QUEUE_NAME_LEN];
+    int i;
     
     if (!state) {
         ERROR("Could not allocate rt state\n");
@@ -3950,13 +4441,23 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
 	state->runnable.type = RUNNABLE_QUEUE;
         state->pending.type = PENDING_QUEUE;
         state->aperiodic.type = APERIODIC_QUEUE;
+#if NAUT_CONFIG_APERIODIC_ROUND_ROBIN || NAUT_CONFIG_APERIODIC_LOTTERY
+	INIT_LIST_HEAD(&state->aperiodic.threads);
+#endif
+	INIT_LIST_HEAD(&state->dead);
+	INIT_LIST_HEAD(&state->reanimation_pool);
+	INIT_LIST_HEAD(&state->registry);
 
     }
     
     spinlock_init(&state->lock);
+    spinlock_init(&state->dead_lock);
+    spinlock_init(&state->registry_lock);
 
     spinlock_init(&state->tasks.lock);
-    INIT_LIST_HEAD(&state->tasks.sized_queue);
+    for (i=0;i<TASK_SIZE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&state->tasks.sized_buckets[i]);
+    }
     INIT_LIST_HEAD(&state->tasks.unsized_queue);
 
     snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"sched%d-task-wait",my_cpu_id());
@@ -4030,11 +4531,24 @@ static int start_interrupt_thread_for_this_cpu()
 
 #if NAUT_CONFIG_TASK_THREAD
 
+// we sleep only if there is nothing for us, and nothing to steal
 static int await_task(void *p)
 {
     task_info *ti = (task_info *) p;
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
+
+    if ((ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued)) {
+	return 1;
+    }
+
+    for (i=0; i<sys->num_cpus; i++) {
+	if (deque_size(&sys->cpus[i]->sched_state->tasks.deque)) {
+	    return 1;
+	}
+    }
 
-    return (ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued);
+    return 0;
 }
 
 static void task(void *in, void **out)
@@ -4073,9 +4587,14 @@ static void task(void *in, void **out)
 	    nk_task_complete(t,output);
 	} else {
 	    // no task, let's put ourselves to sleep on our own cpu's task queues
-	    struct sys_info * sys = per_cpu_get(system);
-	    task_info *ti = &sys->cpus[my_cpu_id()]->sched_state->tasks;
+	    task_info *ti = task_info_of(my_cpu_id());
+	    // producers check for sleepers after queueing, and we check
+	    // for tasks after announcing ourselves, so one of us will notice
+	    ti->sleeping = 1;
+	    __sync_fetch_and_add(&task_sleepers,1);
 	    nk_wait_queue_sleep_extended(ti->waitq, await_task, ti);
+	    __sync_fetch_and_sub(&task_sleepers,1);
+	    ti->sleeping = 0;
 	    // when we wake up, we will try again
 	}
     }
@@ -4207,14 +4726,14 @@ static int shared_init(struct cpu *my_cpu, struct nk_sched_config *cfg)
 
 static int init_global_state()
 {
+    int i;
+
     ZERO(&global_sched_state);
-    global_sched_state.thread_list = rt_list_init();
-    if (!global_sched_state.thread_list) { 
-	ERROR("Cannot allocate global thread list\n");
-	return -1;
-    }
 
-    spinlock_init(&global_sched_state.lock);
+    for (i=0;i<TID_HASH_BUCKETS;i++) {
+	spinlock_init(&tid_hash[i].lock);
+	INIT_HLIST_HEAD(&tid_hash[i].threads);
+    }
 
     nk_counting_barrier_init(&stop_barrier,nk_get_num_cpus());
 
@@ -4328,6 +4847,11 @@ void nk_sched_start()
 
     DEBUG("Time restarted at %lu cycles (currently %lu cycles / %lu ns)\n", tsc_start, cur_cycles, my_cpu->sched_state->tsc.sync_time);
 
+    // all cpus are now up, so we know their topology
+    if (build_steal_order(my_cpu->sched_state)) {
+	ERROR("Cannot determine steal order for CPU %d\n", my_cpu->id);
+    }
+
     // with the schedulers now synchronized and running, we launch the 
     // ancilary threads if needed
     // note that we are still running with interrupts off
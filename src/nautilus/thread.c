@@ -164,6 +164,14 @@ _nk_thread_init (nk_thread_t * t,
     t->current_cpu = placement_cpu;
     t->fpu_state_offset = offsetof(struct nk_thread, fpu_state);
 
+    if (parent) {
+	t->mem_policy = parent->mem_policy;
+	t->mem_policy_domain = parent->mem_policy_domain;
+    } else {
+	t->mem_policy = NK_KMEM_POLICY_LOCAL;
+	t->mem_policy_domain = 0;
+    }
+
     INIT_LIST_HEAD(&(t->children));
 
     /* I go on my parent's child list if I'm not detached */
@@ -280,6 +288,337 @@ thread_setup_init_stack (nk_thread_t * t, nk_thread_fun_t fun, void * arg)
 static void nk_thread_brain_wipe(nk_thread_t *t);
 
 
+/*
+ * Stack guards
+ *
+ * The stack grows down, so an overflow runs into its lowest bytes
+ * first.   These fill them with a pattern and check it, for thread
+ * stacks (NAUT_CONFIG_THREAD_STACK_GUARD) and fiber stacks
+ * (NAUT_CONFIG_FIBER_STACK_GUARD) alike.
+ */
+#define STACK_GUARD_PATTERN     0x5a5a5a5a5a5a5a5aULL
+
+void nk_stack_guard_set (void *stack)
+{
+    uint64_t *p = (uint64_t *)stack;
+    int i;
+
+    for (i = 0; i < NK_STACK_GUARD_SIZE/8; i++) {
+	p[i] = STACK_GUARD_PATTERN;
+    }
+}
+
+int nk_stack_guard_intact (void *stack)
+{
+    uint64_t *p = (uint64_t *)stack;
+    int i;
+
+    for (i = 0; i < NK_STACK_GUARD_SIZE/8; i++) {
+	if (p[i] != STACK_GUARD_PATTERN) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+
+/*
+ * Thread stacks
+ *
+ * With NAUT_CONFIG_THREAD_STACK_POOL, stacks of up to 2 MB are
+ * rounded up to a power of two, and each CPU keeps a pool of free
+ * stacks of each of these sizes, allocated from its own zones.  When
+ * a thread is destroyed, which is normally done by nk_sched_reap(),
+ * its stack goes back to the pool of the CPU it was placed on.
+ * Creations that find a pool empty are counted, and that CPU's idle
+ * thread refills the pool so that the next burst of creations finds
+ * it stocked.  Refilling is never done from nk_sched_reap(), since
+ * the allocator reaps when it runs out of memory, and refilling
+ * then would take back the memory the reap just freed.
+ */
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+
+#define STACK_POOL_MIN_SHIFT    12     // 4 KB
+#define STACK_POOL_MAX_SHIFT    21     // 2 MB
+#define STACK_POOL_NUM_CLASSES  (STACK_POOL_MAX_SHIFT - STACK_POOL_MIN_SHIFT + 1)
+#define STACK_POOL_DEPTH        NAUT_CONFIG_THREAD_STACK_POOL_DEPTH
+#define STACK_POOL_REFILL       ((STACK_POOL_DEPTH + 1) / 2)
+#define STACK_POOL_WARM         (NAUT_CONFIG_THREAD_STACK_POOL_WARM < STACK_POOL_DEPTH ? \
+				 NAUT_CONFIG_THREAD_STACK_POOL_WARM : STACK_POOL_DEPTH)
+#define STACK_CLASS_SIZE(c)     (1UL << (STACK_POOL_MIN_SHIFT + (c)))
+
+struct stack_pool_class {
+    uint32_t  count;
+    uint32_t  misses;      // creations that found the pool empty since the last refill
+    void     *stacks[STACK_POOL_DEPTH];
+};
+
+struct nk_thread_stack_pool {
+    spinlock_t              lock;
+    int                     cpu;
+    struct stack_pool_class cls[STACK_POOL_NUM_CLASSES];
+};
+
+
+static int stack_class (nk_stack_size_t size)
+{
+    int c;
+
+    if (size > STACK_CLASS_SIZE(STACK_POOL_NUM_CLASSES - 1)) {
+	return -1;
+    }
+
+    for (c = 0; STACK_CLASS_SIZE(c) < size; c++) {
+    }
+
+    return c;
+}
+
+static struct nk_thread_stack_pool *stack_pool (int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+
+    if (cpu < 0 || cpu >= sys->num_cpus) {
+	return 0;
+    }
+
+    return sys->cpus[cpu]->stack_pool;
+}
+
+static inline void stack_set_guard (void *stack)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    nk_stack_guard_set(stack);
+#endif
+}
+
+static inline int stack_guard_intact (void *stack)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    return nk_stack_guard_intact(stack);
+#else
+    return 1;
+#endif
+}
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+void nk_thread_stack_guard_check (nk_thread_t *t)
+{
+    // an overrun has already clobbered whatever lies below the stack,
+    // so there is no safe way to continue
+    if (t->stack_guard && !stack_guard_intact(t->stack)) {
+	panic("Thread %p (tid=%lu, \"%s\") has overrun the guard of its stack %p (%lu bytes)\n",
+	      t, t->tid, t->name, t->stack, t->stack_size);
+    }
+}
+#endif
+
+// readies a stack to be handed out from a pool
+static void stack_prepare (void *stack, nk_stack_size_t size)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL_ZERO
+    memset(stack, 0, size);
+#endif
+    stack_set_guard(stack);
+}
+
+// returns 0 if the stack was added, or -1 if the pool is full
+static int stack_pool_push (struct nk_thread_stack_pool *p, int c, void *stack)
+{
+    uint8_t flags = spin_lock_irq_save(&p->lock);
+    int rc = -1;
+
+    if (p->cls[c].count < STACK_POOL_DEPTH) {
+	p->cls[c].stacks[p->cls[c].count++] = stack;
+	rc = 0;
+    }
+
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    return rc;
+}
+
+// fills class c of the pool up to target stacks, returning -1 if
+// we ran out of memory on the way
+static int stack_pool_fill (struct nk_thread_stack_pool *p, int c, uint32_t target)
+{
+    nk_stack_size_t size = STACK_CLASS_SIZE(c);
+    uint32_t count = p->cls[c].count;
+    uint32_t n = target > count ? target - count : 0;
+    void *stack;
+
+    while (n--) {
+	if (!(stack = malloc_specific(size, p->cpu))) {
+	    THREAD_DEBUG("Cannot allocate %lu byte stack for pool of cpu %d\n", size, p->cpu);
+	    return -1;
+	}
+	stack_prepare(stack, size);
+	if (stack_pool_push(p, c, stack)) {
+	    free(stack);
+	    return 0;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * stack_alloc
+ *
+ * @size: the minimum size, updated to the size of the stack returned
+ * @cpu: the cpu the thread is placed on
+ *
+ */
+static void *stack_alloc (nk_stack_size_t *size, int cpu)
+{
+    struct nk_thread_stack_pool *p = stack_pool(cpu);
+    int c = stack_class(*size);
+    void *stack = 0;
+    uint8_t flags;
+
+    if (!p || c < 0) {
+	// not pooled, but guarded all the same
+	if ((stack = malloc_specific(*size, cpu))) {
+	    stack_set_guard(stack);
+	}
+	return stack;
+    }
+
+    *size = STACK_CLASS_SIZE(c);
+
+    flags = spin_lock_irq_save(&p->lock);
+
+    if (p->cls[c].count) {
+	stack = p->cls[c].stacks[--p->cls[c].count];
+    } else {
+	p->cls[c].misses++;
+    }
+
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    if (!stack && (stack = malloc_specific(*size, cpu))) {
+	stack_set_guard(stack);
+    }
+
+    return stack;
+}
+
+static void stack_free (void *stack, nk_stack_size_t size, int cpu)
+{
+    struct nk_thread_stack_pool *p = stack_pool(cpu);
+    int c = stack_class(size);
+
+    if (!stack) {
+	return;
+    }
+
+    // stacks of other sizes came straight from malloc_specific()
+    if (!p || c < 0 || STACK_CLASS_SIZE(c) != size) {
+	free(stack);
+	return;
+    }
+
+    if (!stack_guard_intact(stack)) {
+	THREAD_ERROR("Stack %p (%lu bytes) has overrun its guard, so it will not be reused\n", stack, size);
+	free(stack);
+	return;
+    }
+
+    // the unlocked check avoids preparing a stack that will be freed anyway
+    if (p->cls[c].count >= STACK_POOL_DEPTH) {
+	free(stack);
+	return;
+    }
+
+    stack_prepare(stack, size);
+
+    if (stack_pool_push(p, c, stack)) {
+	free(stack);
+    }
+}
+
+/*
+ * nk_thread_stack_pool_refill
+ *
+ * tops up the pools of the current CPU that creations have found
+ * empty since the last refill, in proportion to the number of times
+ * that happened, and gives up at the first allocation that fails
+ *
+ * This allocates, so it is called from the idle thread only
+ */
+void nk_thread_stack_pool_refill (void)
+{
+    struct nk_thread_stack_pool *p = per_cpu_get(stack_pool);
+    uint32_t target;
+    uint8_t flags;
+    int c;
+
+    if (!p || in_interrupt_context()) {
+	return;
+    }
+
+    for (c = 0; c < STACK_POOL_NUM_CLASSES; c++) {
+	if (!p->cls[c].misses) {
+	    continue;
+	}
+
+	flags = spin_lock_irq_save(&p->lock);
+	target = p->cls[c].misses < STACK_POOL_REFILL ? p->cls[c].misses : STACK_POOL_REFILL;
+	p->cls[c].misses = 0;
+	spin_unlock_irq_restore(&p->lock, flags);
+
+	THREAD_DEBUG("Refilling pool of %lu byte stacks for cpu %d to %u\n",
+		     STACK_CLASS_SIZE(c), p->cpu, target);
+	if (stack_pool_fill(p, c, target)) {
+	    // memory is short, so leave the rest for later
+	    return;
+	}
+    }
+}
+
+int nk_thread_stack_pool_init (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_thread_stack_pool *p;
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+	if (!(p = malloc_specific(sizeof(*p), i))) {
+	    THREAD_ERROR("Cannot allocate stack pool for cpu %d\n", i);
+	    return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	spinlock_init(&p->lock);
+	p->cpu = i;
+
+	stack_pool_fill(p, stack_class(PAGE_SIZE), STACK_POOL_WARM);
+
+	sys->cpus[i]->stack_pool = p;
+    }
+
+    THREAD_INFO("Stack pools of %d stacks per size (%lu to %lu bytes) ready on %d cpus\n",
+		STACK_POOL_DEPTH, STACK_CLASS_SIZE(0), STACK_CLASS_SIZE(STACK_POOL_NUM_CLASSES - 1),
+		sys->num_cpus);
+
+    return 0;
+}
+
+#else
+
+static inline void *stack_alloc (nk_stack_size_t *size, int cpu)
+{
+    return malloc_specific(*size, cpu);
+}
+
+static inline void stack_free (void *stack, nk_stack_size_t size, int cpu)
+{
+    free(stack);
+}
+
+#endif
+
+
 /****** EXTERNAL THREAD INTERFACE ******/
 
 
@@ -341,9 +680,9 @@ nk_thread_create (nk_thread_fun_t fun,
 
 	memset(t, 0, sizeof(nk_thread_t));
 
-	t->stack_size = required_stack_size;
+	t->stack = stack_alloc(&required_stack_size,placement_cpu);
 
-	t->stack = (void*)malloc_specific(required_stack_size,placement_cpu);
+	t->stack_size = required_stack_size;
 
 	if (!t->stack) {
 
@@ -351,6 +690,10 @@ nk_thread_create (nk_thread_fun_t fun,
 	    free(t);
 	    return -EINVAL;
 	}
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+	t->stack_guard = 1;
+#endif
 	
     }
     
@@ -407,7 +750,7 @@ out_err:
     // note that VC is not assigned on thread creation
     // so we do not need to clean it up
     
-    free(t->stack);
+    stack_free(t->stack, t->stack_size, placement_cpu);
     free(t);
 
     return -EINVAL;
@@ -637,7 +980,11 @@ nk_thread_destroy (nk_thread_id_t t)
 
     preempt_disable();
 
-    nk_sched_thread_pre_destroy(thethread);
+    if (nk_sched_thread_pre_destroy(thethread)) {
+	// the reaper got to it first, and will recycle or free it
+	preempt_enable();
+	return;
+    }
 
     // If we are on any wait queue at this point, it is an error
     if (thethread->num_wait) {
@@ -660,7 +1007,7 @@ nk_thread_destroy (nk_thread_id_t t)
     nk_gc_bdwgc_thread_state_deinit(thethread);
 #endif
 
-    free(thethread->stack);
+    stack_free(thethread->stack, thethread->stack_size, thethread->placement_cpu);
     free(thethread);
     
     preempt_enable();
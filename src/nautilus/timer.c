@@ -33,6 +33,7 @@
 #include <nautilus/scheduler.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/shell.h>
+#include <dev/apic.h>
 
 #include <stddef.h>
 
@@ -53,18 +54,237 @@ static spinlock_t state_lock;
 #define STATE_TRY_LOCK()  spin_try_lock_irq_save(&state_lock,&_state_lock_flags)
 #define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
 
-// guards list of active timers
-static spinlock_t active_lock;
-#define ACTIVE_LOCK_CONF uint8_t _active_lock_flags
-#define ACTIVE_LOCK() _active_lock_flags = spin_lock_irq_save(&active_lock)
-#define ACTIVE_TRY_LOCK()  spin_try_lock_irq_save(&active_lock,&_active_lock_flags)
-#define ACTIVE_UNLOCK() spin_unlock_irq_restore(&active_lock, _active_lock_flags);
+// guards a cpu's timer wheel
+#define WHEEL_LOCK_CONF uint8_t _wheel_lock_flags
+#define WHEEL_LOCK(w) _wheel_lock_flags = spin_lock_irq_save(&(w)->lock)
+#define WHEEL_UNLOCK(w) spin_unlock_irq_restore(&(w)->lock, _wheel_lock_flags);
 
 static struct list_head timer_list;
-static struct list_head active_timer_list;
 
 static uint64_t count=0;
 
+//
+// Each cpu keeps the timers started on it in a hierarchical timing
+// wheel.  Time is counted in ticks of 2^WHEEL_SHIFT ns.  Level 0 has
+// a slot per tick, and each level above has slots WHEEL_SLOTS times
+// as wide as the one below.  A timer goes in the lowest level at which
+// its tick falls in the same slot of the level above as the wheel's
+// clock, so that it is in a later slot of its level than the clock.
+// When the clock reaches a slot of a higher level, its timers are
+// "cascaded" into lower levels.  Per level bitmaps of nonempty slots
+// make finding the next slot of interest a handful of bit scans.
+// The wheel spans about 19 hours; timers further out wait on an
+// overflow list that is resorted each time the clock gets that far.
+//
+#define WHEEL_SHIFT       10    // a tick is 1.024 us
+#define WHEEL_LEVEL_BITS  6
+#define WHEEL_SLOTS       (1UL << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS      6
+#define WHEEL_OVERFLOW    (WHEEL_LEVELS * WHEEL_SLOTS)
+
+#define LEVEL_SHIFT(l)    ((l) * WHEEL_LEVEL_BITS)
+#define SLOT_OF(tick,l)   (((tick) >> LEVEL_SHIFT(l)) & (WHEEL_SLOTS - 1))
+
+#define TIMER_SLACK_NS    NAUT_CONFIG_TIMER_SLACK_NS
+
+struct nk_timer_percpu_state {
+    spinlock_t       lock;
+    uint64_t         clk;          // current tick - earlier ticks have been fired
+    uint64_t         next_expiry;  // earliest active timer (ns), -1 if none
+    uint64_t         occupied[WHEEL_LEVELS];  // nonempty slots
+    struct list_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct list_head overflow;
+
+    uint64_t         num_active;
+    uint64_t         num_fired;
+    uint64_t         num_interrupts;  // handler calls that fired timers
+    uint64_t         num_cascaded;
+};
+
+static inline struct nk_timer_percpu_state *wheel_of(uint32_t cpu)
+{
+    return per_cpu_get(system)->cpus[cpu]->timer_state;
+}
+
+// wheel lock must be held for all of the following
+
+static void wheel_insert(struct nk_timer_percpu_state *w, nk_timer_t *t)
+{
+    uint64_t tick = t->time_ns >> WHEEL_SHIFT;
+    int l;
+
+    if (tick < w->clk) {
+	// already expired - fire it with the current tick
+	tick = w->clk;
+    }
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+	if ((tick >> LEVEL_SHIFT(l+1)) == (w->clk >> LEVEL_SHIFT(l+1))) {
+	    uint64_t s = SLOT_OF(tick,l);
+	    list_add_tail(&t->active_node, &w->slots[l][s]);
+	    w->occupied[l] |= 1UL << s;
+	    t->wheel_slot = l * WHEEL_SLOTS + s;
+	    return;
+	}
+    }
+
+    list_add_tail(&t->active_node, &w->overflow);
+    t->wheel_slot = WHEEL_OVERFLOW;
+}
+
+static void wheel_remove(struct nk_timer_percpu_state *w, nk_timer_t *t)
+{
+    uint32_t l = t->wheel_slot / WHEEL_SLOTS;
+    uint32_t s = t->wheel_slot % WHEEL_SLOTS;
+
+    list_del_init(&t->active_node);
+
+    if (l < WHEEL_LEVELS && list_empty(&w->slots[l][s])) {
+	w->occupied[l] &= ~(1UL << s);
+    }
+}
+
+// Find the first slot that needs attention, and the tick at which it
+// does: a level 0 slot fires, a higher level slot cascades, and the
+// overflow list (level WHEEL_LEVELS) is resorted.  Lower levels always
+// come first, as they only hold ticks before the next slot of the
+// level above.  Returns null if the wheel is empty.
+static struct list_head *wheel_next_slot(struct nk_timer_percpu_state *w,
+					 uint64_t *tick, int *level)
+{
+    int l;
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+	uint64_t pending = w->occupied[l] & (~0UL << SLOT_OF(w->clk,l));
+	if (pending) {
+	    uint64_t s = __builtin_ctzl(pending);
+	    uint64_t base = (w->clk >> LEVEL_SHIFT(l+1)) << LEVEL_SHIFT(l+1);
+	    *tick = base + (s << LEVEL_SHIFT(l));
+	    if (*tick < w->clk) {
+		// the clock's own slot at this level was not cascaded yet
+		*tick = w->clk;
+	    }
+	    *level = l;
+	    return &w->slots[l][s];
+	}
+    }
+
+    if (!list_empty(&w->overflow)) {
+	*tick = ((w->clk >> LEVEL_SHIFT(WHEEL_LEVELS)) + 1) << LEVEL_SHIFT(WHEEL_LEVELS);
+	*level = WHEEL_LEVELS;
+	return &w->overflow;
+    }
+
+    return 0;
+}
+
+// Move the clock up to now, moving the timers that have expired by now
+// to the expired list.  The clock jumps directly between the slots that
+// need attention, so a cpu that has not handled its timers for a long
+// time does not walk every tick in between.
+static void wheel_advance(struct nk_timer_percpu_state *w, uint64_t now,
+			  struct list_head *expired)
+{
+    uint64_t now_tick = now >> WHEEL_SHIFT;
+    uint64_t tick;
+    struct list_head *slot;
+    nk_timer_t *cur, *temp;
+    int level;
+
+    while ((slot = wheel_next_slot(w, &tick, &level)) && tick <= now_tick) {
+
+	w->clk = tick;
+
+	if (level > 0) {
+	    // cascade - these will all land in lower levels
+	    struct list_head moving;
+	    INIT_LIST_HEAD(&moving);
+	    list_splice_init(slot, &moving);
+	    if (level < WHEEL_LEVELS) {
+		w->occupied[level] &= ~(1UL << SLOT_OF(tick,level));
+	    }
+	    list_for_each_entry_safe(cur, temp, &moving, active_node) {
+		list_del_init(&cur->active_node);
+		wheel_insert(w, cur);
+		w->num_cascaded++;
+	    }
+	    continue;
+	}
+
+	// a slot before the current tick has wholly expired, while
+	// the current tick's slot may hold timers yet to expire
+	list_for_each_entry_safe(cur, temp, slot, active_node) {
+	    if (tick < now_tick || cur->time_ns <= now) {
+		cur->state = NK_TIMER_SIGNALLED;
+		list_del_init(&cur->active_node);
+		list_add_tail(&cur->active_node, expired);
+		w->num_active--;
+		w->num_fired++;
+	    }
+	}
+
+	if (list_empty(slot)) {
+	    w->occupied[0] &= ~(1UL << SLOT_OF(tick,0));
+	}
+
+	if (tick == now_tick) {
+	    return;
+	}
+    }
+
+    if (now_tick > w->clk) {
+	// nothing needs attention before now
+	w->clk = now_tick;
+    }
+}
+
+// expiry of the earliest timer in the wheel, or -1
+// only the first slot that needs attention has to be scanned
+static uint64_t wheel_earliest(struct nk_timer_percpu_state *w)
+{
+    struct list_head *slot;
+    nk_timer_t *cur;
+    uint64_t tick, earliest = -1;
+    int level;
+
+    if (!(slot = wheel_next_slot(w, &tick, &level))) {
+	return -1;
+    }
+
+    list_for_each_entry(cur, slot, active_node) {
+	if (cur->time_ns < earliest) {
+	    earliest = cur->time_ns;
+	}
+    }
+
+    return earliest;
+}
+
+// The time by which this cpu's handler must next run, which is
+// the earliest expiry plus the slack.  Timers that expire between
+// these times are then fired by the same interrupt.
+// this can be stale in the early direction, which only costs
+// a timer interrupt that finds nothing to do
+uint64_t nk_timer_next_expiry(void)
+{
+    struct nk_timer_percpu_state *w = per_cpu_get(timer_state);
+
+    if (!w || w->next_expiry == -1) {
+	return -1;
+    }
+
+    return w->next_expiry + TIMER_SLACK_NS;
+}
+
+#ifdef NAUT_CONFIG_TICKLESS
+// This cpu may have stopped its timer.  A kick makes it run its
+// scheduler, which will then set its timer to the new earliest expiry.
+static void kick_timer_cpu(void)
+{
+    apic_self_ipi(per_cpu_get(apic), APIC_NULL_KICK_VEC);
+}
+#endif
+
 
 nk_timer_t *nk_timer_create(char *name)
 {
@@ -199,24 +419,49 @@ int nk_timer_reset(nk_timer_t *t,
 
 int nk_timer_start(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    struct nk_timer_percpu_state *w;
+    uint32_t cpu;
+    uint8_t flags;
     int was_active=0;
+    int kick=0;
     
-    ACTIVE_LOCK();
+    // we must not migrate between finding our wheel and locking it
+    flags = irq_disable_save();
+    cpu = my_cpu_id();
+    w = wheel_of(cpu);
+
+    spin_lock(&w->lock);
     if (t->state == NK_TIMER_ACTIVE) {
 	// do not add it again if it's already been started...
 	was_active = 1;
     } else {
+	t->wheel_cpu = cpu;
+	wheel_insert(w,t);
+	w->num_active++;
 	t->state = NK_TIMER_ACTIVE;
-	list_add_tail(&t->active_node, &active_timer_list);
 	was_active = 0;
+	if (t->time_ns < w->next_expiry) {
+	    w->next_expiry = t->time_ns;
+#ifdef NAUT_CONFIG_TICKLESS
+	    kick = 1;
+#endif
+	}
     }
-    ACTIVE_UNLOCK();
+    spin_unlock(&w->lock);
+
+#ifdef NAUT_CONFIG_TICKLESS
+    // still on the wheel's cpu, so the kick reaches it
+    if (kick) {
+	kick_timer_cpu();
+    }
+#endif
+
+    irq_enable_restore(flags);
 
     if (was_active) { 
 	ERROR("Weird:  started already active timer %s\n",t->name);
     } else {
-	DEBUG("start %s\n",t->name);
+	DEBUG("start %s on cpu %u\n",t->name,t->wheel_cpu);
     }
 
     return 0;
@@ -224,17 +469,32 @@ int nk_timer_start(nk_timer_t *t)
 
 int nk_timer_cancel(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    struct nk_timer_percpu_state *w;
+    WHEEL_LOCK_CONF;
+    uint32_t cpu;
     int was_active=0;
 
-    ACTIVE_LOCK();
+ again:
+    cpu = t->wheel_cpu;
+    w = wheel_of(cpu);
+
+    WHEEL_LOCK(w);
     // we may not be active - only delete if we are
     if (t->state == NK_TIMER_ACTIVE) { 
-	list_del_init(&t->active_node);
+	if (t->wheel_cpu != cpu) {
+	    // it has expired and been restarted on another cpu
+	    WHEEL_UNLOCK(w);
+	    goto again;
+	}
+	wheel_remove(w,t);
+	w->num_active--;
+	t->state = NK_TIMER_SIGNALLED;
 	was_active=1;
+    } else {
+	// another cpu could be starting it, which we leave alone
+	__sync_bool_compare_and_swap(&t->state, NK_TIMER_SIGNALLED, NK_TIMER_INACTIVE);
     }
-    t->state = was_active ? NK_TIMER_SIGNALLED : NK_TIMER_INACTIVE;
-    ACTIVE_UNLOCK();
+    WHEEL_UNLOCK(w);
     // now do handling that does not require the lock
     if (was_active) { 
 	DEBUG("canceling %s\n",t->name);
@@ -285,6 +545,12 @@ int nk_timer_wait(nk_timer_t *t)
            DEBUG("going to sleep on wait queue timer %p %s waitqueue %p %s \n", t, t->name, t->waitq, t->waitq->name);
 	    nk_wait_queue_sleep_extended(t->waitq, check, t);
 	} else {
+	    // a spinning waiter need not wait for the timer interrupt,
+	    // nor for the slack it is allowed
+	    if (nk_sched_get_realtime() >= t->time_ns) {
+		nk_timer_cancel(t);
+		return 0;
+	    }
 	    asm volatile ("pause");
 	}
 	//DEBUG("try again\n");
@@ -343,8 +609,7 @@ int nk_sleep(uint64_t ns) { return _sleep(ns,0); }
 int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 
 //
-// Currently, the timer handler only makes sense on cpu 0
-//
+// Each cpu fires the timers it started
 //
 // Note that debug output here is often a bad idea since
 // timers are used in places for efficient debug output
@@ -352,34 +617,28 @@ int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 // debug output if you know what you are doing
 uint64_t nk_timer_handler (void)
 {
+    struct nk_timer_percpu_state *w = per_cpu_get(timer_state);
     uint32_t my_cpu = my_cpu_id();
     
-    if (my_cpu!=0) {
-	//DEBUG("update: cpu %d - ignored/infinity\n",my_cpu);
+    if (!w) {
+	// timers are not up yet
 	return -1;  // infinitely far in the future
     }
 
-    ACTIVE_LOCK_CONF;
+    WHEEL_LOCK_CONF;
     nk_timer_t *cur, *temp;
     uint64_t now = nk_sched_get_realtime();
-    uint64_t earliest = -1;
+    uint64_t earliest;
     struct list_head expired_list;
     INIT_LIST_HEAD(&expired_list);
 
-    ACTIVE_LOCK();
-    
     // first, find expired timers with lock held
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("considering %s\n",cur->name);
-	if (now >= cur->time_ns) { 
-	    //DEBUG("found expired timer %s\n",cur->name);
-	    cur->state = NK_TIMER_SIGNALLED;
-	    list_del_init(&cur->active_node);
-	    list_add_tail(&cur->active_node, &expired_list);
-	}
-	    
+    WHEEL_LOCK(w);
+    wheel_advance(w, now, &expired_list);
+    if (!list_empty(&expired_list)) {
+	w->num_interrupts++;
     }
-    ACTIVE_UNLOCK();
+    WHEEL_UNLOCK(w);
 
     // now handle expired timers without holding the lock
     // so that callbacks/etc can restart the timer if desired
@@ -426,19 +685,22 @@ uint64_t nk_timer_handler (void)
 	}
     }
 
-    // Now we need to scan for the earliest given that the callbacks
+    // Now we need to find the earliest given that the callbacks
     // may have started new timers, with lock held
-    ACTIVE_LOCK();
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("check timer %s\n",cur->name);
-	if (cur->time_ns < earliest) { 
-	    earliest = cur->time_ns;
-	}
-    }
-    ACTIVE_UNLOCK();
+    WHEEL_LOCK(w);
+    earliest = wheel_earliest(w);
+    w->next_expiry = earliest;
+    WHEEL_UNLOCK(w);
 
     //DEBUG("update: earliest is %llu\n",earliest);
 
+    if (earliest == -1) {
+	return -1;
+    }
+
+    // let timers expiring within the slack share the interrupt
+    earliest += TIMER_SLACK_NS;
+
     now = nk_sched_get_realtime();
     
     return earliest > now ? earliest-now : 0;
@@ -447,12 +709,31 @@ uint64_t nk_timer_handler (void)
 
 int nk_timer_init()
 {
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_timer_percpu_state *w;
+    int i, l, s;
+
     spinlock_init(&state_lock);
-    spinlock_init(&active_lock);
     INIT_LIST_HEAD(&timer_list);
-    INIT_LIST_HEAD(&active_timer_list);
 
-    INFO("Timers inited\n");
+    for (i = 0; i < sys->num_cpus; i++) {
+	if (!(w = malloc_specific(sizeof(*w), i))) {
+	    ERROR("Cannot allocate timer wheel for cpu %d\n", i);
+	    return -1;
+	}
+	memset(w, 0, sizeof(*w));
+	spinlock_init(&w->lock);
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+	    for (s = 0; s < WHEEL_SLOTS; s++) {
+		INIT_LIST_HEAD(&w->slots[l][s]);
+	    }
+	}
+	INIT_LIST_HEAD(&w->overflow);
+	w->next_expiry = -1;
+	sys->cpus[i]->timer_state = w;
+    }
+
+    INFO("Timers inited (per-cpu wheels, %lu ns slack)\n", (uint64_t)TIMER_SLACK_NS);
     return 0;
 }
 
@@ -488,6 +769,18 @@ void nk_timer_dump_timers()
 		     t->time_ns, t->flags, t->cpu, t->callback);
     }
     STATE_UNLOCK();
+
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+	struct nk_timer_percpu_state *w = sys->cpus[i]->timer_state;
+	if (w) {
+	    nk_vc_printf("cpu %d: %lu active, next at %luns, %lu fired by %lu interrupts, %lu cascaded\n",
+			 i, w->num_active, w->next_expiry, w->num_fired,
+			 w->num_interrupts, w->num_cascaded);
+	}
+    }
 }
 
 static int
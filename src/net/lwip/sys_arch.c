@@ -62,6 +62,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/semaphore.h>
+#include <nautilus/mutex.h>
 #include <nautilus/msg_queue.h>
 #include <nautilus/timer.h>
 #include <nautilus/errno.h>
@@ -175,31 +176,51 @@ u32_t sys_now()
 err_t sys_mutex_new(sys_mutex_t *mutex)
 {
     DEBUG("Mutex new %p\n",mutex);
-    return sys_sem_new(mutex, 1);
+
+    if (mutex==NULL) {
+	return ERR_MEM;
+    }
+
+    mutex->mutex = malloc(sizeof(nk_mutex_t));
+
+    if (mutex->mutex == NULL) {
+	return ERR_MEM;
+    }
+
+    nk_mutex_init(mutex->mutex);
+
+    return ERR_OK;
 }
 
 void sys_mutex_lock(sys_mutex_t *mutex)
 {
+    LWIP_ASSERT("invalid mutex", (mutex->mutex != NULL));
     DEBUG("Mutex lock %p\n",mutex);
-    sys_arch_sem_wait(mutex, 0);
+    nk_mutex_lock(mutex->mutex);
 }
 
 void sys_mutex_unlock(sys_mutex_t *mutex)
 {
-    DEBUG("Mutex signal %p\n",mutex);
-    sys_sem_signal(mutex);
+    LWIP_ASSERT("invalid mutex", (mutex->mutex != NULL));
+    DEBUG("Mutex unlock %p\n",mutex);
+    nk_mutex_unlock(mutex->mutex);
 }
 
 void sys_mutex_free(sys_mutex_t *mutex)
 {
+    if (mutex==NULL || mutex->mutex==NULL) { return; }
+
     DEBUG("Mutex free %p\n",mutex);
-    sys_sem_free(mutex);
+
+    nk_mutex_deinit(mutex->mutex);
+    free(mutex->mutex);
+    mutex->mutex=NULL;
 }
 
 int sys_mutex_valid(sys_mutex_t *mutex)
 {
     DEBUG("Is mu %p valid\n",mutex);
-    int rc=sys_sem_valid(mutex);
+    int rc = (mutex && mutex->mutex);
     DEBUG("mu returning %d\n",rc);
     return rc;
 }
@@ -207,7 +228,7 @@ int sys_mutex_valid(sys_mutex_t *mutex)
 void sys_mutex_set_invalid(sys_mutex_t *mutex)
 {
     DEBUG("Mutex set invalid %p\n",mutex);
-    sys_sem_set_invalid(mutex);
+    sys_mutex_free(mutex);
 }
 
 
@@ -22,6 +22,7 @@
  */
 #include <nautilus/nautilus.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/mutex.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/smp.h>
 #include <rt/openmp/gomp/gomp.h>
@@ -57,9 +58,22 @@ struct omp_thread
     struct omp_thread *team_leader;
     nk_counting_barrier_t team_barrier;
     struct nk_thread  *thread;
+    omp_allocator_handle_t default_allocator;
 };
 
 
+// what an allocator handle from omp_init_allocator() points to
+struct omp_allocator
+{
+    int              use_thread_policy;  // omp_atv_environment
+    nk_kmem_policy_t policy;
+    int              domain;
+};
+
+// predefined allocators are small integers
+#define OMP_PREDEFINED_ALLOCATOR(a) ((a) <= omp_thread_mem_alloc)
+
+
 // nesting level for the active parallel blocks, 
 // which enclose the calling call
 int omp_get_active_level()
@@ -386,14 +400,14 @@ void omp_set_schedule(omp_sched_t kind, int chunk_size)
 // unlocked state.
 void omp_init_lock(omp_lock_t *lock)
 {
-    spinlock_t *s = malloc(sizeof(spinlock_t));
-    if (!s) { 
+    nk_mutex_t *m = malloc(sizeof(nk_mutex_t));
+    if (!m) { 
 	ERROR("Failed to allocate OMP lock\n");
 	*lock = 0;
     } else {
-	spinlock_init(s);
-	DEBUG("omp_init_lock()-> %p\n",s);
-	*lock = s;
+	nk_mutex_init(m);
+	DEBUG("omp_init_lock()-> %p\n",m);
+	*lock = m;
     }
 }
 
@@ -405,7 +419,7 @@ void omp_init_lock(omp_lock_t *lock)
 void omp_set_lock(omp_lock_t *lock)
 {
     DEBUG("omp_set_lock(%p)\n");
-    spin_lock(*lock);
+    nk_mutex_lock(*lock);
     DEBUG("omp_set_lock(%p) - lock acquired\n");
 }
 
@@ -417,7 +431,7 @@ void omp_set_lock(omp_lock_t *lock)
 //
 int omp_test_lock(omp_lock_t *lock)
 {
-    int rc = spin_try_lock(*lock) == 0;
+    int rc = nk_mutex_try_lock(*lock) == 0;
     
     DEBUG("omp_test_lock(%p) => %d\n", lock, rc);
     return rc;
@@ -431,7 +445,7 @@ int omp_test_lock(omp_lock_t *lock)
 void omp_unset_lock(omp_lock_t *lock)
 {
     DEBUG("omp_unset_lock(%p)\n", lock);
-    spin_unlock(*lock);
+    nk_mutex_unlock(*lock);
 }
 
 // Destroy a simple lock. In order to be destroyed, a simple lock must
@@ -439,7 +453,7 @@ void omp_unset_lock(omp_lock_t *lock)
 void omp_destroy_lock(omp_lock_t *lock)
 {
     DEBUG("omp_destroy_lock(%p)\n");
-    spinlock_deinit(*lock);
+    nk_mutex_deinit(*lock);
     free(*lock);
 }
 
@@ -512,6 +526,114 @@ double omp_get_wtime(void)
     DEBUG("omp_get_wtime() = scheduler time %lu ns (%lf s)\n", ns, (double)ns/1e9);
     return (double)ns/1e9;
 }
+
+
+// Create an allocator with the given traits.   The partition trait
+// maps to a kmem NUMA policy: nearest is local, blocked and
+// interleaved are both interleaved (per allocation), and environment
+// (the default) follows the policy of the allocating thread.  All
+// memory spaces are the same memory, and the other traits are ignored.
+omp_allocator_handle_t omp_init_allocator(omp_memspace_handle_t memspace, int ntraits, const omp_alloctrait_t traits[])
+{
+    struct omp_allocator *a = malloc(sizeof(*a));
+    int i;
+
+    if (!a) {
+	ERROR("Failed to allocate allocator\n");
+	return omp_null_allocator;
+    }
+
+    a->use_thread_policy = 1;
+    a->policy = NK_KMEM_POLICY_LOCAL;
+    a->domain = 0;
+
+    for (i=0;i<ntraits;i++) {
+	if (traits[i].key == omp_atk_partition) {
+	    switch (traits[i].value) {
+	    case omp_atv_nearest:
+		a->use_thread_policy = 0;
+		a->policy = NK_KMEM_POLICY_LOCAL;
+		break;
+	    case omp_atv_blocked:
+	    case omp_atv_interleaved:
+		a->use_thread_policy = 0;
+		a->policy = NK_KMEM_POLICY_INTERLEAVE;
+		break;
+	    default:
+		a->use_thread_policy = 1;
+		break;
+	    }
+	} else {
+	    DEBUG("omp_init_allocator() ignoring trait %d\n", traits[i].key);
+	}
+    }
+
+    DEBUG("omp_init_allocator(memspace=%lu, ntraits=%d) => %p (policy %s)\n", memspace, ntraits, a,
+	  a->use_thread_policy ? "thread" : kmem_policy_name(a->policy));
+
+    return (omp_allocator_handle_t)a;
+}
+
+void omp_destroy_allocator(omp_allocator_handle_t allocator)
+{
+    DEBUG("omp_destroy_allocator(%lx)\n", allocator);
+    if (!OMP_PREDEFINED_ALLOCATOR(allocator)) {
+	free((void*)allocator);
+    }
+}
+
+void omp_set_default_allocator(omp_allocator_handle_t allocator)
+{
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+
+    DEBUG("omp_set_default_allocator(%lx)\n", allocator);
+
+    if (o && o->cookie == OMP_COOKIE) {
+	o->default_allocator = allocator;
+    }
+}
+
+omp_allocator_handle_t omp_get_default_allocator(void)
+{
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+
+    if (o && o->cookie == OMP_COOKIE && o->default_allocator != omp_null_allocator) {
+	return o->default_allocator;
+    }
+
+    return omp_default_mem_alloc;
+}
+
+void *omp_alloc(size_t size, omp_allocator_handle_t allocator)
+{
+    struct omp_allocator *a;
+
+    if (allocator == omp_null_allocator) {
+	allocator = omp_get_default_allocator();
+    }
+
+    a = (struct omp_allocator *)allocator;
+
+    if (OMP_PREDEFINED_ALLOCATOR(allocator) || a->use_thread_policy) {
+	return kmem_malloc(size);
+    } else {
+	return kmem_malloc_policy(size, a->policy, a->domain, 0);
+    }
+}
+
+void omp_free(void *ptr, omp_allocator_handle_t allocator)
+{
+    if (ptr) {
+	kmem_free(ptr);
+    }
+}
+
+
+int nk_openmp_set_mem_policy(nk_kmem_policy_t policy, int domain)
+{
+    DEBUG("nk_openmp_set_mem_policy(%s, %d)\n", kmem_policy_name(policy), domain);
+    return kmem_set_thread_policy(policy, domain);
+}
    
 // The mess here is in the GOMP_ support routines that are called by
 // the emitted code.   These are GOMP-specific, and version-specific.  
@@ -681,19 +803,19 @@ void GOMP_barrier()
 }
 
 
-static spinlock_t gomp_global_lock=0;
+static nk_mutex_t gomp_global_lock = NK_MUTEX_INITIALIZER(gomp_global_lock);
 
 void GOMP_critical_start(void)
 {
     DEBUG("GOMP_critical_start (start)\n");
-    spin_lock(&gomp_global_lock);
+    nk_mutex_lock(&gomp_global_lock);
     DEBUG("GOMP_critical_start (end)\n");
 }
 
 void GOMP_critical_end(void)
 {
     DEBUG("GOMP_critical_end\n");
-    spin_unlock(&gomp_global_lock);
+    nk_mutex_unlock(&gomp_global_lock);
 }
 
 
@@ -46,6 +46,8 @@
 #include <nautilus/thread.h>
 #include <nautilus/condvar.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/rwlock.h>
+#include <nautilus/barrier.h>
 #include <nautilus/percpu.h>
 #include <nautilus/numa.h>
 #include <nautilus/nemo.h>
@@ -692,8 +694,11 @@ static volatile int go;
 typedef struct switch_cont {
 	BARRIER_T * b;
 	unsigned char id; /* 0 or 1 */
+	int use_fp;       /* touch the FPU between switches */
 } switch_cont_t;
 
+static volatile double fp_sink[2];
+
 
 static FUNC_TYPE
 thread_switch_func FUNC_HDR
@@ -709,6 +714,9 @@ thread_switch_func FUNC_HDR
 
 	int i;
 	for (i = 0; i < YIELD_COUNT; i++) {
+		if (t->use_fp) {
+			fp_sink[t->id] += 1.5;
+		}
 		YIELD();
 	}
 
@@ -719,9 +727,15 @@ thread_switch_func FUNC_HDR
 
 
 
-void time_ctx_switch(void);
-void
-time_ctx_switch (void)
+/* 
+ * Two threads on core 1 yield to each other, optionally using the
+ * FPU between yields.  Reports the cycles per switch of each trial,
+ * and the minimum and average over all of them if asked, as well as
+ * the lazy FPU restores core 1 took while they were yielding.
+ */
+static void
+time_ctx_switch_fp (int use_fp, int trials, int verbose, uint64_t * min_out, uint64_t * avg_out,
+		    uint64_t * restores_out)
 {
 	THREAD_T t[2];
 	BARRIER_T * b = malloc(sizeof(BARRIER_T));
@@ -729,15 +743,19 @@ time_ctx_switch (void)
 	switch_cont_t * cont2 = malloc(sizeof(switch_cont_t));
 	uint64_t start = 0;
 	uint64_t end = 0;
+	uint64_t cycles, min = -1ULL, sum = 0;
+	uint64_t restores = 0;
 	int i;
 
 	/* setup thread arguments */
 	cont1->b = b;
 	cont1->id = 0;
+	cont1->use_fp = use_fp;
 	cont2->b = b;
 	cont2->id = 1;
+	cont2->use_fp = use_fp;
 
-	for (i = 0; i < CTX_SWITCH_TRIALS; i++)  {
+	for (i = 0; i < trials; i++)  {
 
 		BARRIER_INIT(b, 3);
 
@@ -762,6 +780,10 @@ time_ctx_switch (void)
 
 		while ( !(ready[0] && ready[1]) );
 
+#ifndef __USER
+		restores -= nk_get_nautilus_info()->sys.cpus[1]->fpu_restore_count;
+#endif
+
 		go = 1;
 
 		//BARRIER_WAIT(b);
@@ -770,8 +792,19 @@ time_ctx_switch (void)
 		while ( !(done[0] && done[1]) );
 		rdtscll(end);
 
+#ifndef __USER
+		restores += nk_get_nautilus_info()->sys.cpus[1]->fpu_restore_count;
+#endif
+
 		/* is this accurate? */
-		PRINT("TRIAL %u %llu\n", i, (end-start)/(YIELD_COUNT*2));
+		cycles = (end-start)/(YIELD_COUNT*2);
+		if (verbose) {
+			PRINT("TRIAL %u %llu\n", i, cycles);
+		}
+		if (cycles < min) {
+			min = cycles;
+		}
+		sum += cycles;
 
 		JOIN_FUNC(t[0], NULL);
 		JOIN_FUNC(t[1], NULL);
@@ -785,6 +818,27 @@ time_ctx_switch (void)
 		go = 0;
 
 	}
+
+	if (min_out) {
+		*min_out = min;
+	}
+	if (avg_out) {
+		*avg_out = trials ? sum/trials : 0;
+	}
+	if (restores_out) {
+		*restores_out = restores;
+	}
+
+	free(cont1);
+	free(cont2);
+	free(b);
+}
+
+void time_ctx_switch(void);
+void
+time_ctx_switch (void)
+{
+	time_ctx_switch_fp(0, CTX_SWITCH_TRIALS, 1, NULL, NULL, NULL);
 }
 
 void time_ipi_send (void);
@@ -1154,3 +1208,399 @@ static struct shell_cmd_impl bench_impl = {
 nk_register_shell_cmd(bench_impl);
 
 #endif
+
+#ifndef __USER
+
+static int
+handle_switchbench (char * buf, void * priv)
+{
+    int trials = CTX_SWITCH_TRIALS;
+    uint64_t min, avg, restores;
+    int use_fp;
+
+    sscanf(buf, "switchbench %d", &trials);
+
+    if (nk_get_num_cpus() < 2) {
+	nk_vc_printf("switchbench needs a second cpu\n");
+	return 0;
+    }
+
+    for (use_fp = 0; use_fp < 2; use_fp++) {
+	time_ctx_switch_fp(use_fp, trials, 0, &min, &avg, &restores);
+	nk_vc_printf("%-10s threads: %lu cycles/switch min %lu avg (%d trials, %lu lazy fpu restores)\n",
+		     use_fp ? "fp-using" : "integer", min, avg, trials, restores);
+#ifdef NAUT_CONFIG_LAZY_FPU_SAVE
+	if (!use_fp && restores) {
+	    // the switch or tick path has used SSE
+	    nk_vc_printf("integer threads should take no lazy fpu restores ... FAIL\n");
+	}
+#endif
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl switchbench_impl = {
+    .cmd      = "switchbench",
+    .help_str = "switchbench [trials]",
+    .handler  = handle_switchbench,
+};
+nk_register_shell_cmd(switchbench_impl);
+
+
+/*
+ * Reader-writer lock contention
+ *
+ * Each thread, one per cpu, takes the lock read_pct% of the time
+ * for reading and otherwise for writing.  Readers check that all
+ * words of the protected data agree, and writers bump them all.
+ */
+
+#define RWBENCH_OPS   100000
+#define RWBENCH_WORDS 8
+
+// nk_rwlock as it was before it became phase-fair: a spinlock
+// around the reader count, which writers hold to exclude readers
+struct old_rwlock {
+    spinlock_t lock;
+    unsigned   readers;
+};
+
+static void old_rd_lock (struct old_rwlock * l)
+{
+    int flags = spin_lock_irq_save(&l->lock);
+    ++l->readers;
+    spin_unlock_irq_restore(&l->lock, flags);
+}
+
+static void old_rd_unlock (struct old_rwlock * l)
+{
+    int flags = spin_lock_irq_save(&l->lock);
+    --l->readers;
+    spin_unlock_irq_restore(&l->lock, flags);
+}
+
+static void old_wr_lock (struct old_rwlock * l)
+{
+    while (1) {
+        spin_lock(&l->lock);
+        if (l->readers == 0) {
+            break;
+        }
+        spin_unlock(&l->lock);
+    }
+}
+
+static void old_wr_unlock (struct old_rwlock * l)
+{
+    spin_unlock(&l->lock);
+}
+
+enum { RWB_OLD, RWB_SPIN, RWB_BLOCKING };
+static const char * rwb_names[] = { "old", "phase-fair", "blocking" };
+
+static struct {
+    int               kind;
+    int               read_pct;
+    uint64_t          ops;
+    struct old_rwlock old;
+    nk_rwlock_t       lock;
+    volatile int      ready;
+    volatile int      go;
+    volatile uint64_t data[RWBENCH_WORDS];
+} rwb;
+
+struct rwb_thread {
+    int      id;
+    uint64_t cycles;
+    uint64_t max_rd_wait;
+    uint64_t max_wr_wait;
+    uint64_t torn;
+};
+
+static void
+rwbench_thread (void * in, void ** out)
+{
+    struct rwb_thread * r = in;
+    uint64_t seed = (r->id + 1) * 0x9e3779b97f4a7c15UL;
+    uint64_t i, j, start, t0, wait;
+    int read;
+
+    __sync_fetch_and_add(&rwb.ready, 1);
+    while (!rwb.go) {
+        asm volatile ("pause");
+    }
+
+    start = rdtsc();
+
+    for (i = 0; i < rwb.ops; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        read = (seed % 100) < rwb.read_pct;
+
+        t0 = rdtsc();
+        if (rwb.kind == RWB_OLD) {
+            read ? old_rd_lock(&rwb.old) : old_wr_lock(&rwb.old);
+        } else {
+            read ? nk_rwlock_rd_lock(&rwb.lock) : nk_rwlock_wr_lock(&rwb.lock);
+        }
+        wait = rdtsc() - t0;
+
+        if (read) {
+            for (j = 1; j < RWBENCH_WORDS; j++) {
+                if (rwb.data[j] != rwb.data[0]) {
+                    r->torn++;
+                    break;
+                }
+            }
+            if (wait > r->max_rd_wait) {
+                r->max_rd_wait = wait;
+            }
+        } else {
+            for (j = 0; j < RWBENCH_WORDS; j++) {
+                rwb.data[j]++;
+            }
+            if (wait > r->max_wr_wait) {
+                r->max_wr_wait = wait;
+            }
+        }
+
+        if (rwb.kind == RWB_OLD) {
+            read ? old_rd_unlock(&rwb.old) : old_wr_unlock(&rwb.old);
+        } else {
+            read ? nk_rwlock_rd_unlock(&rwb.lock) : nk_rwlock_wr_unlock(&rwb.lock);
+        }
+    }
+
+    r->cycles = rdtsc() - start;
+}
+
+static void
+rwbench (int kind, int nthreads, int read_pct, uint64_t ops)
+{
+    struct rwb_thread r[nthreads];
+    nk_thread_id_t tids[nthreads];
+    uint64_t elapsed = 0, max_rd = 0, max_wr = 0, torn = 0;
+    int i, n;
+
+    memset(&rwb, 0, sizeof(rwb));
+    memset(r, 0, sizeof(r));
+    rwb.kind = kind;
+    rwb.read_pct = read_pct;
+    rwb.ops = ops;
+    spinlock_init(&rwb.old.lock);
+    if (kind == RWB_BLOCKING) {
+        nk_rwlock_init_blocking(&rwb.lock);
+    } else {
+        nk_rwlock_init(&rwb.lock);
+    }
+
+    for (n = 0; n < nthreads; n++) {
+        r[n].id = n;
+        if (nk_thread_start(rwbench_thread, &r[n], NULL, 0, TSTACK_DEFAULT,
+                            &tids[n], n % nk_get_num_cpus())) {
+            nk_vc_printf("rwbench: cannot start thread %d\n", n);
+            break;
+        }
+    }
+
+    while (rwb.ready < n) {
+        nk_yield();
+    }
+    rwb.go = 1;
+
+    for (i = 0; i < n; i++) {
+        nk_join(tids[i], NULL);
+        elapsed = r[i].cycles > elapsed ? r[i].cycles : elapsed;
+        max_rd = r[i].max_rd_wait > max_rd ? r[i].max_rd_wait : max_rd;
+        max_wr = r[i].max_wr_wait > max_wr ? r[i].max_wr_wait : max_wr;
+        torn += r[i].torn;
+    }
+
+    nk_rwlock_deinit(&rwb.lock);
+
+    nk_vc_printf("%-10s %2d threads %3d%% reads: %8lu cycles/kop, max wait rd %8lu wr %8lu cycles%s\n",
+                 rwb_names[kind], n, read_pct,
+                 elapsed * 1000 / (ops * (n ? n : 1)), max_rd, max_wr,
+                 torn ? " TORN READS" : "");
+}
+
+static int
+handle_rwbench (char * buf, void * priv)
+{
+    int read_pcts[] = { 100, 99, 90, 50 };
+    int nthreads = nk_get_num_cpus();
+    int read_pct = -1;
+    uint64_t ops = RWBENCH_OPS;
+    int i, k;
+
+    sscanf(buf, "rwbench %d %d %lu", &nthreads, &read_pct, &ops);
+
+    if (nthreads < 1 || read_pct > 100 || !ops) {
+        nk_vc_printf("rwbench [threads [read_pct [ops]]]\n");
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(read_pcts)/sizeof(read_pcts[0]); i++) {
+        for (k = RWB_OLD; k <= RWB_BLOCKING; k++) {
+            rwbench(k, nthreads, read_pct < 0 ? read_pcts[i] : read_pct, ops);
+        }
+        if (read_pct >= 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl rwbench_impl = {
+    .cmd      = "rwbench",
+    .help_str = "rwbench [threads [read_pct [ops]]]",
+    .handler  = handle_rwbench,
+};
+nk_register_shell_cmd(rwbench_impl);
+
+
+/*
+ * Barrier latency
+ *
+ * For each barrier type, with and without blocking, and for 1, 2,
+ * 4, ... threads, one per cpu, each thread passes the barrier ops
+ * times.  Before each pass a thread stamps its slot with the pass
+ * number, and after it checks that its neighbor's stamp has caught
+ * up, which catches early releases.
+ */
+
+#define BARBENCH_OPS 10000
+
+static const char * barb_names[] = { "central", "dissemination", "tree" };
+
+struct barb_thread {
+    int               id;
+    uint64_t          cycles;
+    uint64_t          early;
+    volatile uint64_t stamp;
+} __attribute__((aligned(64)));
+
+static struct {
+    nk_barrier_t         barrier;
+    struct barb_thread * threads;
+    int                  nthreads;
+    uint64_t             ops;
+    volatile int         ready;
+    volatile int         go;     // -1 => not all threads started
+} barb;
+
+static void
+barbench_thread (void * in, void ** out)
+{
+    struct barb_thread * r = in;
+    struct barb_thread * next = &barb.threads[(r->id + 1) % barb.nthreads];
+    uint64_t i, start;
+
+    __sync_fetch_and_add(&barb.ready, 1);
+    while (!barb.go) {
+        asm volatile ("pause");
+    }
+    if (barb.go < 0) {
+        return;
+    }
+
+    start = rdtsc();
+
+    for (i = 0; i < barb.ops; i++) {
+        r->stamp = i + 1;
+        nk_barrier_wait_id(&barb.barrier, r->id);
+        if (next->stamp < i + 1) {
+            r->early++;
+        }
+    }
+
+    r->cycles = rdtsc() - start;
+}
+
+static void
+barbench (nk_barrier_type_t type, int flags, int nthreads, uint64_t ops)
+{
+    struct barb_thread r[nthreads];
+    nk_thread_id_t tids[nthreads];
+    uint64_t elapsed = 0, early = 0;
+    int i, n;
+
+    memset(&barb, 0, sizeof(barb));
+    memset(r, 0, sizeof(r));
+    barb.threads = r;
+    barb.nthreads = nthreads;
+    barb.ops = ops;
+
+    if (nk_barrier_init_type(&barb.barrier, nthreads, type, flags)) {
+        nk_vc_printf("barbench: cannot create %s barrier\n", barb_names[type]);
+        return;
+    }
+
+    for (n = 0; n < nthreads; n++) {
+        r[n].id = n;
+        if (nk_thread_start(barbench_thread, &r[n], NULL, 0, TSTACK_DEFAULT,
+                            &tids[n], n % nk_get_num_cpus())) {
+            nk_vc_printf("barbench: cannot start thread %d\n", n);
+            break;
+        }
+    }
+
+    while (barb.ready < n) {
+        nk_yield();
+    }
+    barb.go = n == nthreads ? 1 : -1;
+
+    for (i = 0; i < n; i++) {
+        nk_join(tids[i], NULL);
+        elapsed = r[i].cycles > elapsed ? r[i].cycles : elapsed;
+        early += r[i].early;
+    }
+
+    nk_barrier_destroy(&barb.barrier);
+
+    if (n == nthreads) {
+        nk_vc_printf("%-13s %-8s %3d threads: %8lu cycles/barrier%s\n",
+                     barb_names[type], flags & NK_BARRIER_BLOCKING ? "blocking" : "spinning",
+                     n, elapsed / ops, early ? " EARLY RELEASE" : "");
+    }
+}
+
+static int
+handle_barbench (char * buf, void * priv)
+{
+    int nthreads = nk_get_num_cpus();
+    uint64_t ops = BARBENCH_OPS;
+    int n, t, flags;
+
+    sscanf(buf, "barbench %d %lu", &nthreads, &ops);
+
+    if (nthreads < 1 || !ops) {
+        nk_vc_printf("barbench [threads [ops]]\n");
+        return 0;
+    }
+
+    for (n = 1; ; n = n * 2 > nthreads && n < nthreads ? nthreads : n * 2) {
+        for (t = NK_BARRIER_CENTRAL; t <= NK_BARRIER_TREE; t++) {
+            for (flags = 0; flags <= NK_BARRIER_BLOCKING; flags += NK_BARRIER_BLOCKING) {
+                barbench(t, flags, n, ops);
+            }
+        }
+        if (n >= nthreads) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl barbench_impl = {
+    .cmd      = "barbench",
+    .help_str = "barbench [threads [ops]]",
+    .handler  = handle_barbench,
+};
+nk_register_shell_cmd(barbench_impl);
+
+#endif
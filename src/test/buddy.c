@@ -0,0 +1,176 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+#include <nautilus/mm.h>
+#include <nautilus/numa.h>
+#include <nautilus/buddy.h>
+
+/*
+ * Buddy allocator microbenchmark
+ *
+ * For each block order, and for 1, 2, 4, ... N CPUs, one thread
+ * bound to each CPU repeatedly allocates a batch of blocks from its
+ * local zone and frees them again.  We report the aggregate
+ * throughput in alloc/free pairs per millisecond.
+ */
+
+#define DEFAULT_MIN_ORDER  12   // 4 KB
+#define DEFAULT_MAX_ORDER  21   // 2 MB, the size of a thread stack
+#define DEFAULT_OPS        10000
+#define BATCH              8
+
+struct bench_state {
+    ulong_t           order;
+    uint64_t          ops;
+    volatile int      ready;
+    volatile int      go;
+    volatile uint64_t failures;
+};
+
+struct bench_thread {
+    struct bench_state *state;
+    int                 cpu;
+    uint64_t            start;
+    uint64_t            end;
+};
+
+static struct buddy_mempool *local_zone(int cpu)
+{
+    struct kmem_data *kmem = &(nk_get_nautilus_info()->sys.cpus[cpu]->kmem);
+
+    return list_first_entry(&kmem->ordered_regions, struct mem_reg_entry, mem_ent)->mem->mm_state;
+}
+
+static void bench_thread(void *in, void **out)
+{
+    struct bench_thread *t = (struct bench_thread *)in;
+    struct bench_state *s = t->state;
+    struct buddy_mempool *mp = local_zone(t->cpu);
+    void *blocks[BATCH];
+    uint64_t i;
+    int j;
+
+    __sync_fetch_and_add(&s->ready, 1);
+
+    while (!s->go) {
+	__asm__ __volatile__ ("pause");
+    }
+
+    t->start = nk_sched_get_realtime();
+
+    for (i = 0; i < s->ops; i += BATCH) {
+	for (j = 0; j < BATCH; j++) {
+	    blocks[j] = buddy_alloc(mp, s->order);
+	}
+	for (j = 0; j < BATCH; j++) {
+	    if (blocks[j]) {
+		buddy_free(mp, blocks[j], s->order);
+	    } else {
+		__sync_fetch_and_add(&s->failures, 1);
+	    }
+	}
+    }
+
+    t->end = nk_sched_get_realtime();
+}
+
+static int run_one(ulong_t order, int ncpus, uint64_t ops)
+{
+    struct bench_state s = { .order = order, .ops = ops };
+    struct bench_thread t[ncpus];
+    nk_thread_id_t tid[ncpus];
+    uint64_t start = -1ULL, end = 0;
+    int i;
+
+    for (i = 0; i < ncpus; i++) {
+	t[i].state = &s;
+	t[i].cpu = i;
+	if (nk_thread_start(bench_thread, &t[i], 0, 0, TSTACK_DEFAULT, &tid[i], i)) {
+	    nk_vc_printf("Failed to start thread on cpu %d\n", i);
+	    s.go = 1;
+	    while (--i >= 0) {
+		nk_join(tid[i], 0);
+	    }
+	    return -1;
+	}
+    }
+
+    while (s.ready != ncpus) {
+	nk_yield();
+    }
+
+    s.go = 1;
+
+    for (i = 0; i < ncpus; i++) {
+	nk_join(tid[i], 0);
+	if (t[i].start < start) {
+	    start = t[i].start;
+	}
+	if (t[i].end > end) {
+	    end = t[i].end;
+	}
+    }
+
+    nk_vc_printf("order %2lu cpus %3d: %lu ns  %lu ops/ms  %lu failed allocs\n",
+		 order, ncpus, end - start,
+		 end > start ? (ops * ncpus * 1000000ULL) / (end - start) : 0,
+		 s.failures);
+
+    return 0;
+}
+
+static int
+handle_buddybench (char * buf, void * priv)
+{
+    ulong_t min_order = DEFAULT_MIN_ORDER;
+    ulong_t max_order = DEFAULT_MAX_ORDER;
+    uint64_t ops = DEFAULT_OPS;
+    ulong_t order;
+    int num_cpus = nk_get_num_cpus();
+    int n;
+
+    sscanf(buf, "buddybench %lu %lu %lu", &min_order, &max_order, &ops);
+
+    for (order = min_order; order <= max_order; order++) {
+	for (n = 1; ; n = (n * 2 < num_cpus) ? n * 2 : num_cpus) {
+	    if (run_one(order, n, ops)) {
+		return 0;
+	    }
+	    if (n == num_cpus) {
+		break;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl buddybench_impl = {
+    .cmd      = "buddybench",
+    .help_str = "buddybench [min_order max_order [ops]]",
+    .handler  = handle_buddybench,
+};
+nk_register_shell_cmd(buddybench_impl);
@@ -32,6 +32,8 @@
 #include <nautilus/shell.h>
 #include <nautilus/vc.h>
 
+#include "samples.h"
+
 #define DO_PRINT       0
 
 #if DO_PRINT
@@ -748,6 +750,96 @@ static int handle_fibers12 (char *buf, void *priv)
   return 0;
 }
 
+
+/******************* Creation Benchmark *******************/
+
+/*
+ * Creates fibers in batches, timing each nk_fiber_start(), and waits
+ * for each batch to run to completion before creating the next, so
+ * that the next batch can reuse its stacks.  Percentiles are over all
+ * creations, in cycles, and the rate covers creating and running them.
+ */
+
+#define FBENCH_DEFAULT_COUNT 100000
+#define FBENCH_DEFAULT_BATCH 256
+
+static volatile uint64_t fbench_done;
+
+static void fbench_fiber(void *i, void **o)
+{
+  __sync_fetch_and_add(&fbench_done, 1);
+}
+
+static int fiber_create_bench(uint64_t count, uint64_t batch, nk_stack_size_t stack_size)
+{
+  nk_fiber_t *f;
+  uint64_t *samples;
+  uint64_t start, t0, t1;
+  uint64_t n = 0, j;
+  int rc = 0;
+
+  if (!(samples = malloc(sizeof(uint64_t) * count))) {
+    nk_vc_printf("Cannot allocate samples\n");
+    return -1;
+  }
+
+  fbench_done = 0;
+  t0 = nk_sched_get_realtime();
+
+  while (n < count && !rc) {
+    for (j = 0; j < batch && n < count; j++) {
+      start = rdtsc();
+      if (nk_fiber_start(fbench_fiber, 0, 0, stack_size, F_RAND_CPU, &f) < 0) {
+        nk_vc_printf("Failed to start fiber %lu\n", n);
+        rc = -1;
+        break;
+      }
+      samples[n++] = rdtsc() - start;
+    }
+    while (fbench_done < n) {
+      nk_yield();
+    }
+  }
+
+  t1 = nk_sched_get_realtime();
+
+  if (n) {
+    struct samples_summary p;
+    samples_summarize(samples, n, &p);
+    nk_vc_printf("%8lu byte stacks: %lu fibers create " SAMPLES_FMT " cycles, %lu fibers/ms\n",
+                 stack_size, n, SAMPLES_ARGS(p),
+                 (n * 1000000ULL) / (t1 > t0 ? t1 - t0 : 1));
+  }
+
+  free(samples);
+
+  return rc;
+}
+
+static int handle_fibercreate (char *buf, void *priv)
+{
+  uint64_t count = FBENCH_DEFAULT_COUNT;
+  uint64_t batch = FBENCH_DEFAULT_BATCH;
+  nk_stack_size_t stack_size = 0;
+
+  int args = sscanf(buf, "fibercreate %lu %lu %lu", &count, &batch, &stack_size);
+
+  if (count < 1 || batch < 1) {
+    nk_vc_printf("Count and batch must be positive\n");
+    return -1;
+  }
+
+  if (args < 3) {
+    // default stacks, the largest cached size, and one too big to cache
+    fiber_create_bench(count, batch, FSTACK_DEFAULT);
+    fiber_create_bench(count, batch, 64 * 1024);
+    fiber_create_bench(count, batch, 256 * 1024);
+    return 0;
+  }
+
+  return fiber_create_bench(count, batch, stack_size);
+}
+
   
 /******************* Shell Structs ********************/
 
@@ -841,6 +933,12 @@ static struct shell_cmd_impl fibers_impl_new_yield = {
   .handler  = handle_fibers12,
 };
 
+static struct shell_cmd_impl fibers_impl_create = {
+  .cmd      = "fibercreate",
+  .help_str = "fibercreate [count [batch [stack_size]]]",
+  .handler  = handle_fibercreate,
+};
+
 /******************* Shell Commands *******************/
 
 nk_register_shell_cmd(fibers_impl1);
@@ -858,3 +956,4 @@ nk_register_shell_cmd(fibers_impl_all);
 nk_register_shell_cmd(fibers_impl_all_1);
 nk_register_shell_cmd(fibers_impl_all_2);
 nk_register_shell_cmd(fibers_impl_new_yield);
+nk_register_shell_cmd(fibers_impl_create);
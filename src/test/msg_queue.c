@@ -0,0 +1,565 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/msg_queue.h>
+#include <nautilus/timer.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+#include "waiting.h"
+
+/*
+ * Message queue tests
+ *
+ * Single threaded checks of the return codes of the non-blocking
+ * operations at the full and empty boundaries, and of batches that
+ * only partly fit or are only partly available, as the ring wraps.
+ * Then producers and consumers using every kind of operation on a
+ * small queue, where we check that each message arrives exactly once
+ * and in order per producer, and threads blocked on an empty or full
+ * queue, where we check that each is woken.  The single producer and
+ * single consumer types are run with only one thread on that side,
+ * as their users promise.
+ */
+
+#define NS_PER_MS        1000000UL
+#define WAKE_TIMEOUT_NS  (1000 * NS_PER_MS)
+
+#define MSG(p,i)         ((void*)(((uint64_t)(p) << 32) | ((i) + 1)))
+#define MSG_PRODUCER(m)  ((uint64_t)(m) >> 32)
+#define MSG_INDEX(m)     (((uint64_t)(m) & 0xffffffffUL) - 1)
+#define POISON           ((void*)-1UL)
+
+#define FAIL(...) do { nk_vc_printf(__VA_ARGS__); rc = -1; goto out; } while (0)
+
+static int test_codes(void)
+{
+    struct nk_msg_queue *q;
+    void *m;
+    uint64_t i;
+    int rc = 0;
+
+    if (nk_msg_queue_create(0, 0, NK_MSG_QUEUE_DEFAULT, 0)) {
+	nk_vc_printf("Created a queue of size zero\n");
+	return -1;
+    }
+
+    if (!(q = nk_msg_queue_create(0, 4, NK_MSG_QUEUE_DEFAULT, 0))) {
+	nk_vc_printf("Failed to create queue\n");
+	return -1;
+    }
+
+    if (!nk_msg_queue_empty(q) || nk_msg_queue_full(q)) {
+	FAIL("New queue is not empty\n");
+    }
+    if (!nk_msg_queue_try_pull(q, &m)) {
+	FAIL("Pulled from an empty queue\n");
+    }
+
+    // enough rounds to wrap the ring several times
+    for (i = 0; i < 12; i++) {
+	uint64_t j;
+	for (j = 0; j < 4; j++) {
+	    if (nk_msg_queue_try_push(q, MSG(0, i * 4 + j))) {
+		FAIL("Failed to push to a queue with room (round %lu)\n", i);
+	    }
+	}
+	if (!nk_msg_queue_full(q) || nk_msg_queue_empty(q)) {
+	    FAIL("Queue with every slot used is not full (round %lu)\n", i);
+	}
+	if (!nk_msg_queue_try_push(q, MSG(0, 0))) {
+	    FAIL("Pushed to a full queue (round %lu)\n", i);
+	}
+	for (j = 0; j < 4; j++) {
+	    if (nk_msg_queue_try_pull(q, &m) || m != MSG(0, i * 4 + j)) {
+		FAIL("Pulled %p, expected %p (round %lu)\n", m, MSG(0, i * 4 + j), i);
+	    }
+	}
+	if (!nk_msg_queue_empty(q) || !nk_msg_queue_try_pull(q, &m)) {
+	    FAIL("Drained queue is not empty (round %lu)\n", i);
+	}
+    }
+
+ out:
+    nk_msg_queue_release(q);
+    nk_vc_printf("Full/empty test ... %s\n", rc ? "FAIL" : "PASS");
+    return rc;
+}
+
+#define BATCH_QUEUE_SIZE 8
+
+static int test_partial_batches(nk_msg_queue_type_t type, const char *what)
+{
+    struct nk_msg_queue *q;
+    void *msgs[2 * BATCH_QUEUE_SIZE];
+    uint64_t pushed = 0, pulled = 0;
+    uint64_t i, n, want;
+    int round;
+    int rc = 0;
+
+    if (!(q = nk_msg_queue_create(0, BATCH_QUEUE_SIZE, type, 0))) {
+	nk_vc_printf("Failed to create queue\n");
+	return -1;
+    }
+
+    // odd batch sizes, so the batches straddle the end of the ring
+    for (round = 0; round < 20; round++) {
+	uint64_t ask = 3 + round % 5;
+
+	// fill the ring with batches, the last of which only partly fits
+	while (pushed - pulled < BATCH_QUEUE_SIZE) {
+	    for (i = 0; i < ask; i++) {
+		msgs[i] = MSG(0, pushed + i);
+	    }
+	    want = BATCH_QUEUE_SIZE - (pushed - pulled);
+	    want = want < ask ? want : ask;
+	    n = nk_msg_queue_try_push_batch(q, msgs, ask);
+	    if (n != want) {
+		FAIL("Pushed %lu of a batch of %lu with room for %lu\n", n, ask, want);
+	    }
+	    pushed += n;
+	}
+	if (nk_msg_queue_try_push_batch(q, msgs, ask)) {
+	    FAIL("Pushed a batch to a full queue\n");
+	}
+
+	// then drain it with batches, the last of which is only partly available
+	while (pulled < pushed) {
+	    want = pushed - pulled < ask + 1 ? pushed - pulled : ask + 1;
+	    n = nk_msg_queue_try_pull_batch(q, msgs, ask + 1);
+	    if (n != want) {
+		FAIL("Pulled %lu of a batch of %lu with %lu available\n", n, ask + 1, want);
+	    }
+	    for (i = 0; i < n; i++) {
+		if (msgs[i] != MSG(0, pulled + i)) {
+		    FAIL("Pulled %p, expected %p\n", msgs[i], MSG(0, pulled + i));
+		}
+	    }
+	    pulled += n;
+	}
+	if (nk_msg_queue_try_pull_batch(q, msgs, ask)) {
+	    FAIL("Pulled a batch from an empty queue\n");
+	}
+
+	// leave a few behind so the next round starts elsewhere in the ring
+	for (i = 0; i < round % 3; i++) {
+	    if (nk_msg_queue_try_push(q, MSG(0, pushed))) {
+		FAIL("Failed to push to a queue with room\n");
+	    }
+	    pushed++;
+	}
+    }
+
+ out:
+    nk_msg_queue_release(q);
+    nk_vc_printf("Partial batch test (%s) ... %s\n", what, rc ? "FAIL" : "PASS");
+    return rc;
+}
+
+
+#define MPMC_QUEUE_SIZE  16
+#define MPMC_PRODUCERS   4
+#define MPMC_CONSUMERS   4
+#define MPMC_MSGS        20000   // per producer
+#define MPMC_BATCH       5
+
+struct mpmc_state {
+    struct nk_msg_queue *q;
+    uint8_t             seen[MPMC_PRODUCERS][MPMC_MSGS];
+    volatile uint64_t   received;
+    volatile uint64_t   out_of_order;
+    volatile uint64_t   finished;     // consumers that have seen their poison
+};
+
+struct mpmc_arg {
+    struct mpmc_state *s;
+    int                id;
+};
+
+static void mpmc_producer(void *in, void **out)
+{
+    struct mpmc_arg *a = (struct mpmc_arg *)in;
+    void *msgs[MPMC_BATCH];
+    uint64_t i = 0, j, n;
+
+    // cycle through the blocking and non-blocking operations
+    while (i < MPMC_MSGS) {
+	switch (i % 4) {
+	case 0:
+	    nk_msg_queue_push(a->s->q, MSG(a->id, i));
+	    i++;
+	    break;
+	case 1:
+	    if (!nk_msg_queue_try_push(a->s->q, MSG(a->id, i))) {
+		i++;
+	    } else {
+		nk_yield();
+	    }
+	    break;
+	case 2:
+	    n = MPMC_MSGS - i < MPMC_BATCH ? MPMC_MSGS - i : MPMC_BATCH;
+	    for (j = 0; j < n; j++) {
+		msgs[j] = MSG(a->id, i + j);
+	    }
+	    nk_msg_queue_push_batch(a->s->q, msgs, n);
+	    i += n;
+	    break;
+	default:
+	    n = MPMC_MSGS - i < MPMC_BATCH ? MPMC_MSGS - i : MPMC_BATCH;
+	    for (j = 0; j < n; j++) {
+		msgs[j] = MSG(a->id, i + j);
+	    }
+	    if (!(n = nk_msg_queue_try_push_batch(a->s->q, msgs, n))) {
+		nk_yield();
+	    }
+	    i += n;
+	    break;
+	}
+    }
+}
+
+static void mpmc_consumer(void *in, void **out)
+{
+    struct mpmc_arg *a = (struct mpmc_arg *)in;
+    struct mpmc_state *s = a->s;
+    uint64_t last[MPMC_PRODUCERS];
+    void *msgs[MPMC_BATCH];
+    uint64_t i, n, p, x;
+    int poisoned = 0;
+    int round = 0;
+
+    for (p = 0; p < MPMC_PRODUCERS; p++) {
+	last[p] = -1;
+    }
+
+    while (!poisoned) {
+	if (round++ % 2) {
+	    n = nk_msg_queue_pull_batch(s->q, msgs, MPMC_BATCH);
+	} else {
+	    n = nk_msg_queue_try_pull_batch(s->q, msgs, MPMC_BATCH);
+	}
+
+	for (i = 0; i < n; i++) {
+	    // there is only ever one poison queued, and nothing after it
+	    if (msgs[i] == POISON) {
+		poisoned = 1;
+		break;
+	    }
+	    p = MSG_PRODUCER(msgs[i]);
+	    x = MSG_INDEX(msgs[i]);
+	    if (p >= MPMC_PRODUCERS || x >= MPMC_MSGS) {
+		__sync_fetch_and_add(&s->out_of_order, 1);
+		continue;
+	    }
+	    // each producer's messages are pulled in the order pushed
+	    if (last[p] != -1 && x <= last[p]) {
+		__sync_fetch_and_add(&s->out_of_order, 1);
+	    }
+	    last[p] = x;
+	    __sync_fetch_and_add(&s->seen[p][x], 1);
+	    __sync_fetch_and_add(&s->received, 1);
+	}
+    }
+
+    __sync_fetch_and_add(&s->finished, 1);
+}
+
+// nprod and ncons must be 1 on the side the type says has a single user
+static int test_mpmc(nk_msg_queue_type_t type, int nprod, int ncons, const char *what)
+{
+    struct mpmc_state *s;
+    struct mpmc_arg args[MPMC_PRODUCERS + MPMC_CONSUMERS];
+    nk_thread_id_t producers[MPMC_PRODUCERS];
+    nk_thread_id_t consumers[MPMC_CONSUMERS];
+    uint64_t lost = 0, duplicated = 0;
+    int i, j, np = 0, nc = 0;
+    int rc = 0;
+
+    if (!(s = malloc(sizeof(*s)))) {
+	nk_vc_printf("Failed to allocate state\n");
+	return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    if (!(s->q = nk_msg_queue_create(0, MPMC_QUEUE_SIZE, type, 0))) {
+	nk_vc_printf("Failed to create queue\n");
+	free(s);
+	return -1;
+    }
+
+    for (nc = 0; nc < ncons; nc++) {
+	args[nc].s = s;
+	args[nc].id = nc;
+	if (nk_thread_start(mpmc_consumer, &args[nc], 0, 0, PAGE_SIZE_4KB, &consumers[nc], -1)) {
+	    nk_vc_printf("Failed to start consumer %d\n", nc);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    for (np = 0; np < nprod && !rc; np++) {
+	args[MPMC_CONSUMERS + np].s = s;
+	args[MPMC_CONSUMERS + np].id = np;
+	if (nk_thread_start(mpmc_producer, &args[MPMC_CONSUMERS + np], 0, 0, PAGE_SIZE_4KB, &producers[np], -1)) {
+	    nk_vc_printf("Failed to start producer %d\n", np);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    for (i = 0; i < np; i++) {
+	nk_join(producers[i], 0);
+    }
+
+    // everything has been pushed, so a consumer stops once it sees a
+    // poison; we are now the only producer, and hand them out one at
+    // a time so that no consumer ever sees two
+    for (i = 0; i < nc; i++) {
+	nk_msg_queue_push(s->q, POISON);
+	if (wait_for_count(&s->finished, i + 1, WAKE_TIMEOUT_NS)) {
+	    // we cannot get them out, so leave them, and the state, behind
+	    nk_vc_printf("Only %lu of %d consumers finished\n", s->finished, nc);
+	    nk_vc_printf("Producer/consumer test (%s) ... FAIL\n", what);
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < nc; i++) {
+	nk_join(consumers[i], 0);
+    }
+
+    if (!rc) {
+	for (i = 0; i < np; i++) {
+	    for (j = 0; j < MPMC_MSGS; j++) {
+		if (!s->seen[i][j]) {
+		    lost++;
+		} else if (s->seen[i][j] > 1) {
+		    duplicated += s->seen[i][j] - 1;
+		}
+	    }
+	}
+	if (lost || duplicated || s->out_of_order || !nk_msg_queue_empty(s->q)) {
+	    nk_vc_printf("Received %lu messages: %lu lost, %lu duplicated, %lu out of order\n",
+			 s->received, lost, duplicated, s->out_of_order);
+	    rc = -1;
+	}
+    }
+
+    nk_msg_queue_release(s->q);
+    free(s);
+
+    nk_sched_reap(1);
+
+    nk_vc_printf("Producer/consumer test (%s, %d producers, %d consumers, %d messages) ... %s\n",
+		 what, nprod, ncons, nprod * MPMC_MSGS, rc ? "FAIL" : "PASS");
+
+    return rc;
+}
+
+
+#define WAKE_THREADS 4
+
+struct wake_state {
+    struct nk_msg_queue *q;
+    volatile uint64_t   started;
+    volatile uint64_t   done;
+};
+
+static void wake_puller(void *in, void **out)
+{
+    struct wake_state *s = (struct wake_state *)in;
+    void *m;
+
+    __sync_fetch_and_add(&s->started, 1);
+    nk_msg_queue_pull(s->q, &m);
+    __sync_fetch_and_add(&s->done, 1);
+}
+
+static void wake_pusher(void *in, void **out)
+{
+    struct wake_state *s = (struct wake_state *)in;
+
+    __sync_fetch_and_add(&s->started, 1);
+    nk_msg_queue_push(s->q, MSG(0, 0));
+    __sync_fetch_and_add(&s->done, 1);
+}
+
+// start the threads, which will block on the queue, then use
+// unblock to make room or messages for all of them, and check
+// that all are woken
+static int wake_test(const char *what, void (*func)(void *, void **), uint64_t size,
+		     uint64_t prefill, void (*unblock)(struct nk_msg_queue *, int))
+{
+    struct wake_state *s;
+    nk_thread_id_t tids[WAKE_THREADS];
+    uint64_t i;
+    int n, rc = 0;
+
+    // not on our stack, as a failed test leaves threads behind that use it
+    if (!(s = malloc(sizeof(*s)))) {
+	nk_vc_printf("Failed to allocate state\n");
+	return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    if (!(s->q = nk_msg_queue_create(0, size, NK_MSG_QUEUE_DEFAULT, 0))) {
+	nk_vc_printf("Failed to create queue\n");
+	free(s);
+	return -1;
+    }
+
+    for (i = 0; i < prefill; i++) {
+	nk_msg_queue_push(s->q, MSG(0, i));
+    }
+
+    for (n = 0; n < WAKE_THREADS; n++) {
+	if (nk_thread_start(func, s, 0, 0, PAGE_SIZE_4KB, &tids[n], -1)) {
+	    nk_vc_printf("Failed to start thread %d\n", n);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    if (wait_until_blocked(&s->started, n, WAKE_TIMEOUT_NS)) {
+	nk_vc_printf("%s: only %lu of %d threads started\n", what, s->started, n);
+	rc = -1;
+    }
+
+    if (s->done) {
+	nk_vc_printf("%s: %lu threads did not block\n", what, s->done);
+	rc = -1;
+    }
+
+    unblock(s->q, n);
+
+    if (wait_for_count(&s->done, n, WAKE_TIMEOUT_NS)) {
+	nk_vc_printf("%s: %lu of %d threads were left asleep\n", what, n - s->done, n);
+	rc = -1;
+	// one at a time, so that we can join them
+	while (s->done < n) {
+	    uint64_t before = s->done;
+	    unblock(s->q, 1);
+	    if (wait_for_count(&s->done, before + 1, WAKE_TIMEOUT_NS)) {
+		// we cannot get them out, so leave them, the queue,
+		// and the state behind
+		nk_vc_printf("%s wakeup test ... FAIL\n", what);
+		return -1;
+	    }
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	nk_join(tids[i], 0);
+    }
+
+    nk_msg_queue_release(s->q);
+    free(s);
+
+    nk_sched_reap(1);
+
+    nk_vc_printf("%s wakeup test ... %s\n", what, rc ? "FAIL" : "PASS");
+
+    return rc;
+}
+
+static void push_one_by_one(struct nk_msg_queue *q, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	nk_msg_queue_push(q, MSG(0, i));
+    }
+}
+
+static void push_as_batch(struct nk_msg_queue *q, int n)
+{
+    void *msgs[WAKE_THREADS];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	msgs[i] = MSG(0, i);
+    }
+
+    nk_msg_queue_push_batch(q, msgs, n);
+}
+
+static void pull_one_by_one(struct nk_msg_queue *q, int n)
+{
+    void *m;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	nk_msg_queue_pull(q, &m);
+    }
+}
+
+static void pull_as_batch(struct nk_msg_queue *q, int n)
+{
+    void *msgs[WAKE_THREADS];
+
+    // the queue is full, so this gets all n at once
+    nk_msg_queue_pull_batch(q, msgs, n);
+}
+
+static int test_wakeups(void)
+{
+    int rc = 0;
+
+    rc |= wake_test("Pull/push", wake_puller, WAKE_THREADS, 0, push_one_by_one);
+    rc |= wake_test("Pull/batch push", wake_puller, WAKE_THREADS, 0, push_as_batch);
+    rc |= wake_test("Push/pull", wake_pusher, WAKE_THREADS, WAKE_THREADS, pull_one_by_one);
+    rc |= wake_test("Push/batch pull", wake_pusher, WAKE_THREADS, WAKE_THREADS, pull_as_batch);
+
+    return rc;
+}
+
+static int
+handle_mqtest (char * buf, void * priv)
+{
+    int rc = 0;
+
+    rc |= test_codes();
+    rc |= test_partial_batches(NK_MSG_QUEUE_DEFAULT, "default");
+    rc |= test_partial_batches(NK_MSG_QUEUE_SINGLE_PRODUCER, "single producer");
+    rc |= test_partial_batches(NK_MSG_QUEUE_SINGLE_CONSUMER, "single consumer");
+    rc |= test_partial_batches(NK_MSG_QUEUE_SPSC, "SPSC");
+    rc |= test_mpmc(NK_MSG_QUEUE_DEFAULT, MPMC_PRODUCERS, MPMC_CONSUMERS, "default");
+    rc |= test_mpmc(NK_MSG_QUEUE_SINGLE_PRODUCER, 1, MPMC_CONSUMERS, "single producer");
+    rc |= test_mpmc(NK_MSG_QUEUE_SINGLE_CONSUMER, MPMC_PRODUCERS, 1, "single consumer");
+    rc |= test_mpmc(NK_MSG_QUEUE_SPSC, 1, 1, "SPSC");
+    rc |= test_wakeups();
+
+    nk_vc_printf("Message queue tests ... %s\n", rc ? "FAIL" : "PASS");
+
+    return 0;
+}
+
+static struct shell_cmd_impl mqtest_impl = {
+    .cmd      = "mqtest",
+    .help_str = "mqtest",
+    .handler  = handle_mqtest,
+};
+nk_register_shell_cmd(mqtest_impl);
@@ -0,0 +1,243 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/mutex.h>
+#include <nautilus/timer.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+#include "waiting.h"
+
+/*
+ * Mutex tests
+ *
+ * Threads increment a shared counter with a non-atomic read-modify-write
+ * under the mutex, sometimes yielding while holding it so that others
+ * must spin and then sleep, and check that they are never in the
+ * critical section together and that no increment is lost.  Then
+ * threads that have gone to sleep on a held mutex must all be woken,
+ * one by one, as it is handed off between them.
+ */
+
+#define NS_PER_MS          1000000UL
+#define WAKE_TIMEOUT_NS    (1000 * NS_PER_MS)
+
+#define COUNTER_THREADS    8
+#define COUNTER_ITERS      20000
+#define COUNTER_YIELD      64   // yield holding the mutex every this many iterations
+
+struct counter_state {
+    nk_mutex_t        m;
+    volatile uint64_t inside;
+    volatile uint64_t counter;
+    volatile uint64_t overlaps;
+};
+
+static void counter_func(void *in, void **out)
+{
+    struct counter_state *s = (struct counter_state *)in;
+    uint64_t i, c;
+
+    for (i = 0; i < COUNTER_ITERS; i++) {
+	if (i % 2 || nk_mutex_try_lock(&s->m)) {
+	    nk_mutex_lock(&s->m);
+	}
+
+	if (__sync_fetch_and_add(&s->inside, 1)) {
+	    __sync_fetch_and_add(&s->overlaps, 1);
+	}
+
+	c = s->counter;
+	if (!(i % COUNTER_YIELD)) {
+	    nk_yield();
+	}
+	s->counter = c + 1;
+
+	__sync_fetch_and_sub(&s->inside, 1);
+
+	nk_mutex_unlock(&s->m);
+    }
+}
+
+static int test_counter(void)
+{
+    struct counter_state s;
+    nk_thread_id_t tids[COUNTER_THREADS];
+    int i, n, rc = 0;
+
+    memset(&s, 0, sizeof(s));
+    nk_mutex_init(&s.m);
+
+    for (n = 0; n < COUNTER_THREADS; n++) {
+	if (nk_thread_start(counter_func, &s, 0, 0, PAGE_SIZE_4KB, &tids[n], -1)) {
+	    nk_vc_printf("Failed to start thread %d\n", n);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	nk_join(tids[i], 0);
+    }
+
+    if (s.overlaps || s.counter != (uint64_t)n * COUNTER_ITERS) {
+	nk_vc_printf("Counter is %lu, expected %lu, with %lu overlapping critical sections\n",
+		     s.counter, (uint64_t)n * COUNTER_ITERS, s.overlaps);
+	rc = -1;
+    }
+
+    if (s.m.owner || s.m.num_waiters) {
+	nk_vc_printf("Mutex left with owner %p and %u waiters\n", s.m.owner, s.m.num_waiters);
+	rc = -1;
+    }
+
+    nk_mutex_deinit(&s.m);
+
+    nk_sched_reap(1);
+
+    nk_vc_printf("Contended counter test (%d threads, %d iterations) ... %s\n",
+		 COUNTER_THREADS, COUNTER_ITERS, rc ? "FAIL" : "PASS");
+
+    return rc;
+}
+
+
+#define WAKE_THREADS 8
+
+struct wake_state {
+    nk_mutex_t        m;
+    volatile uint64_t started;
+    volatile uint64_t done;
+    volatile uint64_t inside;
+    volatile uint64_t overlaps;
+};
+
+static void wake_func(void *in, void **out)
+{
+    struct wake_state *s = (struct wake_state *)in;
+
+    __sync_fetch_and_add(&s->started, 1);
+
+    nk_mutex_lock(&s->m);
+
+    if (__sync_fetch_and_add(&s->inside, 1)) {
+	__sync_fetch_and_add(&s->overlaps, 1);
+    }
+    // hold it long enough for the others to stay asleep
+    nk_sleep(NS_PER_MS);
+    __sync_fetch_and_sub(&s->inside, 1);
+
+    __sync_fetch_and_add(&s->done, 1);
+
+    nk_mutex_unlock(&s->m);
+}
+
+static int test_wakeup(void)
+{
+    struct wake_state *s;
+    nk_thread_id_t tids[WAKE_THREADS];
+    int i, n, rc = 0;
+
+    // not on our stack, as a failed test leaves threads behind that use it
+    if (!(s = malloc(sizeof(*s)))) {
+	nk_vc_printf("Failed to allocate state\n");
+	return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    nk_mutex_init(&s->m);
+
+    nk_mutex_lock(&s->m);
+
+    for (n = 0; n < WAKE_THREADS; n++) {
+	if (nk_thread_start(wake_func, s, 0, 0, PAGE_SIZE_4KB, &tids[n], -1)) {
+	    nk_vc_printf("Failed to start thread %d\n", n);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    if (wait_until_blocked(&s->started, n, WAKE_TIMEOUT_NS)) {
+	nk_vc_printf("Only %lu of %d threads started\n", s->started, n);
+	rc = -1;
+    }
+
+    if (s->done) {
+	nk_vc_printf("%lu threads acquired a held mutex\n", s->done);
+	rc = -1;
+    }
+
+    nk_mutex_unlock(&s->m);
+
+    // each holds the mutex for a millisecond
+    if (wait_for_count(&s->done, n, WAKE_TIMEOUT_NS + n * NS_PER_MS)) {
+	// we cannot get them out, so leave them, and the state, behind
+	nk_vc_printf("%lu of %d threads were left asleep\n", n - s->done, n);
+	nk_vc_printf("Handoff/wakeup test (%d threads) ... FAIL\n", WAKE_THREADS);
+	return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+	nk_join(tids[i], 0);
+    }
+
+    if (s->overlaps) {
+	nk_vc_printf("%lu overlapping critical sections\n", s->overlaps);
+	rc = -1;
+    }
+
+    if (s->m.owner || s->m.num_waiters) {
+	nk_vc_printf("Mutex left with owner %p and %u waiters\n", s->m.owner, s->m.num_waiters);
+	rc = -1;
+    }
+
+    nk_mutex_deinit(&s->m);
+    free(s);
+
+    nk_sched_reap(1);
+
+    nk_vc_printf("Handoff/wakeup test (%d threads) ... %s\n", WAKE_THREADS, rc ? "FAIL" : "PASS");
+
+    return rc;
+}
+
+static int
+handle_mutextest (char * buf, void * priv)
+{
+    int rc = 0;
+
+    rc |= test_counter();
+    rc |= test_wakeup();
+
+    nk_vc_printf("Mutex tests ... %s\n", rc ? "FAIL" : "PASS");
+
+    return 0;
+}
+
+static struct shell_cmd_impl mutextest_impl = {
+    .cmd      = "mutextest",
+    .help_str = "mutextest",
+    .handler  = handle_mutextest,
+};
+nk_register_shell_cmd(mutextest_impl);
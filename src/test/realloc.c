@@ -0,0 +1,164 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+#include <nautilus/mm.h>
+
+/*
+ * Realloc benchmark
+ *
+ * Grows a buffer by doubling from 16 bytes to a maximum size, as a
+ * vector or a network buffer would, first with kmem_realloc() and then
+ * with malloc/copy/free, which is what realloc used to do.  Each is
+ * also run with a small allocation made after every step, which
+ * tends to take the memory above the buffer and force it to move.
+ * We report the time taken and the bytes each approach copied.
+ */
+
+#define DEFAULT_MAX_SIZE  (64UL << 20)
+#define DEFAULT_ROUNDS    10
+#define MIN_SIZE          16
+#define MAX_HOLDERS       64
+
+struct result {
+    uint64_t ns;
+    uint64_t bytes_copied;
+    uint64_t in_place;
+    uint64_t steps;
+};
+
+static int grow(size_t max_size, int use_realloc, int interfere, struct result *r)
+{
+    void *holders[MAX_HOLDERS];
+    int num_holders = 0;
+    uint8_t *p, *n;
+    size_t size = MIN_SIZE;
+    uint64_t start;
+
+    if (!(p = kmem_malloc(size))) {
+	return -1;
+    }
+    p[0] = 1;
+
+    start = nk_sched_get_realtime();
+
+    while (size < max_size) {
+	size *= 2;
+	if (use_realloc) {
+	    n = kmem_realloc(p, size);
+	} else {
+	    if ((n = kmem_malloc(size))) {
+		memcpy(n, p, size / 2);
+		kmem_free(p);
+		r->bytes_copied += size / 2;
+	    }
+	}
+	if (!n) {
+	    kmem_free(p);
+	    p = 0;
+	    break;
+	}
+	p = n;
+	p[size - 1] = 1;
+	r->steps++;
+	if (interfere && num_holders < MAX_HOLDERS) {
+	    holders[num_holders++] = kmem_malloc(size / 2);
+	}
+    }
+
+    r->ns += nk_sched_get_realtime() - start;
+
+    if (p) {
+	kmem_free(p);
+    }
+
+    while (num_holders--) {
+	if (holders[num_holders]) {
+	    kmem_free(holders[num_holders]);
+	}
+    }
+
+    return p ? 0 : -1;
+}
+
+static void run(size_t max_size, int rounds, int interfere)
+{
+    struct kmem_realloc_stats before, after;
+    struct result r_realloc, r_copy;
+    int i;
+
+    memset(&r_realloc, 0, sizeof(r_realloc));
+    memset(&r_copy, 0, sizeof(r_copy));
+
+    kmem_realloc_stats(&before);
+
+    for (i = 0; i < rounds; i++) {
+	if (grow(max_size, 1, interfere, &r_realloc)) {
+	    nk_vc_printf("realloc failed to grow to %lu bytes\n", max_size);
+	    return;
+	}
+    }
+
+    kmem_realloc_stats(&after);
+
+    r_realloc.bytes_copied = after.bytes_copied - before.bytes_copied;
+    r_realloc.in_place = after.in_place - before.in_place;
+
+    for (i = 0; i < rounds; i++) {
+	if (grow(max_size, 0, interfere, &r_copy)) {
+	    nk_vc_printf("malloc failed to grow to %lu bytes\n", max_size);
+	    return;
+	}
+    }
+
+    nk_vc_printf("%-12s realloc: %lu steps %lu in place %lu bytes copied %lu ns\n",
+		 interfere ? "interfering" : "alone",
+		 r_realloc.steps, r_realloc.in_place, r_realloc.bytes_copied, r_realloc.ns);
+    nk_vc_printf("%-12s copying: %lu steps %lu bytes copied %lu ns\n",
+		 interfere ? "interfering" : "alone",
+		 r_copy.steps, r_copy.bytes_copied, r_copy.ns);
+}
+
+static int
+handle_reallocbench (char * buf, void * priv)
+{
+    size_t max_size = DEFAULT_MAX_SIZE;
+    int rounds = DEFAULT_ROUNDS;
+
+    sscanf(buf, "reallocbench %lu %d", &max_size, &rounds);
+
+    nk_vc_printf("growing %d buffers from %d to %lu bytes by doubling\n", rounds, MIN_SIZE, max_size);
+
+    run(max_size, rounds, 0);
+    run(max_size, rounds, 1);
+
+    return 0;
+}
+
+static struct shell_cmd_impl reallocbench_impl = {
+    .cmd      = "reallocbench",
+    .help_str = "reallocbench [max_size [rounds]]",
+    .handler  = handle_reallocbench,
+};
+nk_register_shell_cmd(reallocbench_impl);
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+
+#include "samples.h"
+
+// a shell sort, which needs no memory and is quick enough
+// for the hundreds of thousands of samples a benchmark takes
+static void sort(uint64_t *s, uint64_t n)
+{
+    uint64_t gap, i, j;
+    uint64_t x;
+
+    for (gap = n / 2; gap > 0; gap /= 2) {
+	for (i = gap; i < n; i++) {
+	    x = s[i];
+	    for (j = i; j >= gap && s[j - gap] > x; j -= gap) {
+		s[j] = s[j - gap];
+	    }
+	    s[j] = x;
+	}
+    }
+}
+
+void samples_summarize(uint64_t *s, uint64_t n, struct samples_summary *p)
+{
+    sort(s, n);
+
+    p->p50 = s[n / 2];
+    p->p90 = s[(n * 90) / 100];
+    p->p99 = s[(n * 99) / 100];
+    p->max = s[n - 1];
+}
@@ -0,0 +1,21 @@
+#ifndef __TEST_SAMPLES_H__
+#define __TEST_SAMPLES_H__
+
+// Percentiles of latency samples, for benchmarks to report as
+//
+//   nk_vc_printf("... " SAMPLES_FMT " cycles\n", ..., SAMPLES_ARGS(p));
+
+struct samples_summary {
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+};
+
+#define SAMPLES_FMT      "p50 %lu p90 %lu p99 %lu max %lu"
+#define SAMPLES_ARGS(p)  (p).p50, (p).p90, (p).p99, (p).max
+
+// sorts the n > 0 samples in place
+void samples_summarize(uint64_t *s, uint64_t n, struct samples_summary *p);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/shell.h>
+#include <nautilus/cpu.h>
+#include <nautilus/vc.h>
+
+/*
+ * String function benchmark
+ *
+ * Times memcpy, memset, memmove (overlapping, backward) and memcmp
+ * (equal buffers) with each implementation the processor supports,
+ * and a byte-at-a-time loop for reference, across a range of sizes.
+ * Reports average cycles per call.
+ *
+ * Before timing an implementation, we check it against the byte loops
+ * with odd sizes, misaligned pointers and overlapping memmoves in both
+ * directions, and check that its memcmp gets the sign right.  An
+ * implementation that fails is not timed.
+ */
+
+#define MAX_SIZE   (1UL << 20)
+#define MAX_ITERS  10000
+#define MIN_BYTES  (64UL << 20)   // per measurement, to keep large sizes short
+
+static const size_t sizes[] = { 8, 16, 64, 256, 1024, 4096, 65536, MAX_SIZE };
+
+#define NUM_SIZES (sizeof(sizes)/sizeof(sizes[0]))
+
+static void __noinline
+byte_copy (volatile uint8_t *d, const volatile uint8_t *s, size_t n)
+{
+    while (n--) {
+	*d++ = *s++;
+    }
+}
+
+static void __noinline
+byte_set (volatile uint8_t *d, uint8_t c, size_t n)
+{
+    while (n--) {
+	*d++ = c;
+    }
+}
+
+static void __noinline
+byte_move (volatile uint8_t *d, const volatile uint8_t *s, size_t n)
+{
+    if (d <= s) {
+	byte_copy(d, s, n);
+    } else {
+	while (n--) {
+	    d[n] = s[n];
+	}
+    }
+}
+
+static int __noinline
+byte_cmp (const volatile uint8_t *a, const volatile uint8_t *b, size_t n)
+{
+    for (; n; n--, a++, b++) {
+	if (*a != *b) {
+	    return *a < *b ? -1 : 1;
+	}
+    }
+    return 0;
+}
+
+static inline int sign (int x)
+{
+    return x < 0 ? -1 : x > 0;
+}
+
+#define CHECK_MAX    8192
+#define CHECK_GUARD  64                        // untouched bytes either side
+#define CHECK_BUF    (CHECK_MAX + 2 * CHECK_GUARD)
+
+// every size up to a few words, and odd sizes around the larger
+// sizes at which implementations change strategy
+static const size_t check_sizes[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+    23, 31, 32, 33, 47, 63, 64, 65, 127, 129, 255, 257, 511, 513,
+    1023, 1025, 2047, 2049, 4095, 4097, 8191 - 15, 8191,
+};
+
+static const size_t check_offsets[] = { 0, 1, 3, 7, 8, 9, 15 };
+
+#define NUM_CHECK_SIZES   (sizeof(check_sizes)/sizeof(check_sizes[0]))
+#define NUM_CHECK_OFFSETS (sizeof(check_offsets)/sizeof(check_offsets[0]))
+
+struct check_failure {
+    const char *op;
+    size_t      size;
+    size_t      dst_off;
+    size_t      src_off;
+};
+
+static void fill (uint8_t *b, size_t n, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	b[i] = seed + i * 7 + (i >> 8);
+    }
+}
+
+// compare the results of one call against the byte loop, with
+// the implementation under test selected; nothing here may use
+// the string functions themselves
+static int check_one (uint8_t *ref, uint8_t *tst, uint8_t *src,
+		      size_t n, size_t doff, size_t soff,
+		      struct check_failure *f)
+{
+    uint8_t *d = tst + CHECK_GUARD + doff;
+    uint8_t *r = ref + CHECK_GUARD + doff;
+    size_t at[3] = { 0, n / 2, n - 1 };
+    int i;
+
+#define FAIL(o) do { f->op = o; f->size = n; f->dst_off = doff; f->src_off = soff; return -1; } while (0)
+
+    fill(ref, CHECK_BUF, 0x11);
+    fill(tst, CHECK_BUF, 0x11);
+    byte_copy(r, src + soff, n);
+    if (memcpy(d, src + soff, n) != d || byte_cmp(ref, tst, CHECK_BUF)) {
+	FAIL("memcpy");
+    }
+
+    byte_set(r, 0xa5, n);
+    if (memset(d, 0xa5, n) != d || byte_cmp(ref, tst, CHECK_BUF)) {
+	FAIL("memset");
+    }
+
+    // overlapping, forward when the destination is below the source
+    // and backward when it is above it
+    fill(ref, CHECK_BUF, 0x33);
+    fill(tst, CHECK_BUF, 0x33);
+    byte_move(r, ref + CHECK_GUARD + soff, n);
+    if (memmove(d, tst + CHECK_GUARD + soff, n) != d || byte_cmp(ref, tst, CHECK_BUF)) {
+	FAIL("memmove");
+    }
+
+    // equal, then differing at the first, middle and last bytes, with
+    // differences that a signed comparison of bytes would get wrong
+    byte_copy(d, src + soff, n);
+    if (memcmp(d, src + soff, n)) {
+	FAIL("memcmp");
+    }
+    for (i = 0; i < 3 && n; i++) {
+	size_t pos = at[i];
+	uint8_t save = d[pos];
+	d[pos] = src[soff + pos] ^ 0x80;
+	if (sign(memcmp(d, src + soff, n)) != byte_cmp(d, src + soff, n) ||
+	    sign(memcmp(src + soff, d, n)) != byte_cmp(src + soff, d, n)) {
+	    FAIL("memcmp");
+	}
+	d[pos] = save;
+    }
+
+#undef FAIL
+
+    return 0;
+}
+
+static int check_impl (int impl, uint8_t *ref, uint8_t *tst, uint8_t *src,
+		       struct check_failure *f)
+{
+    int boot_impl = nk_string_get_impl();
+    size_t i, j, k;
+    int rc = 0;
+
+    fill(src, CHECK_BUF, 0x77);
+
+    nk_string_set_impl(impl);
+
+    for (i = 0; i < NUM_CHECK_SIZES && !rc; i++) {
+	for (j = 0; j < NUM_CHECK_OFFSETS && !rc; j++) {
+	    for (k = 0; k < NUM_CHECK_OFFSETS && !rc; k++) {
+		rc = check_one(ref, tst, src, check_sizes[i],
+			       check_offsets[j], check_offsets[k], f);
+	    }
+	}
+    }
+
+    nk_string_set_impl(boot_impl);
+
+    return rc;
+}
+
+static int impl_supported (int impl)
+{
+    int cur = nk_string_get_impl();
+
+    // the boot-time choice is the best the processor supports, and
+    // each implementation only uses features of the ones before it
+    return impl <= cur;
+}
+
+static uint64_t iters_for (size_t size)
+{
+    uint64_t iters = MIN_BYTES / size;
+
+    return iters > MAX_ITERS ? MAX_ITERS : iters ? iters : 1;
+}
+
+#define TIME(iters, stmt)                        \
+    ({ uint64_t __i, __s = rdtsc();              \
+       for (__i = 0; __i < (iters); __i++) {     \
+	   stmt;                                 \
+	   __asm__ __volatile__ ("" ::: "memory"); \
+       }                                         \
+       (rdtsc() - __s) / (iters); })
+
+static int
+handle_stringbench (char * buf, void * priv)
+{
+    int boot_impl = nk_string_get_impl();
+    uint8_t *src, *dst, *ref;
+    uint64_t i, iters;
+    int impl;
+    int failed[NK_STRING_NUM_IMPLS];
+    struct check_failure f;
+    volatile int sink = 0;
+
+    src = malloc(MAX_SIZE + 64);
+    dst = malloc(MAX_SIZE + 64);
+    ref = malloc(CHECK_BUF);
+
+    if (!src || !dst || !ref) {
+	nk_vc_printf("Failed to allocate buffers\n");
+	free(src);
+	free(dst);
+	free(ref);
+	return 0;
+    }
+
+    nk_vc_printf("boot-time implementation is %s\n", nk_string_impl_name(boot_impl));
+
+    for (impl = NK_STRING_IMPL_BASIC; impl < NK_STRING_NUM_IMPLS; impl++) {
+	if (!impl_supported(impl)) {
+	    continue;
+	}
+	failed[impl] = check_impl(impl, ref, dst, src, &f);
+	if (failed[impl]) {
+	    nk_vc_printf("%s: %s of %lu bytes (dst+%lu, src+%lu) differs from byte loop ... FAIL\n",
+			 nk_string_impl_name(impl), f.op, f.size, f.dst_off, f.src_off);
+	} else {
+	    nk_vc_printf("%s: checked against byte loop ... PASS\n", nk_string_impl_name(impl));
+	}
+    }
+
+    for (i = 0; i < MAX_SIZE + 64; i++) {
+	src[i] = dst[i] = i;
+    }
+
+    nk_vc_printf("%-6s %8s %10s %10s %10s %10s  (cycles/call)\n",
+		 "impl", "size", "memcpy", "memset", "memmove", "memcmp");
+
+    for (i = 0; i < NUM_SIZES; i++) {
+	size_t n = sizes[i];
+
+	iters = iters_for(n);
+
+	nk_vc_printf("%-6s %8lu %10lu %10s %10s %10s\n", "byte", n,
+		     TIME(iters, byte_copy(dst, src, n)), "-", "-", "-");
+
+	for (impl = NK_STRING_IMPL_BASIC; impl < NK_STRING_NUM_IMPLS; impl++) {
+	    uint64_t cpy, set, mov, cmp;
+
+	    if (!impl_supported(impl) || failed[impl]) {
+		continue;
+	    }
+
+	    nk_string_set_impl(impl);
+
+	    cpy = TIME(iters, memcpy(dst, src, n));
+	    set = TIME(iters, memset(dst, 0x5a, n));
+	    mov = TIME(iters, memmove(dst + 1, dst, n));
+	    memcpy(dst, src, n);
+	    cmp = TIME(iters, sink += memcmp(dst, src, n));
+
+	    nk_string_set_impl(boot_impl);
+
+	    nk_vc_printf("%-6s %8lu %10lu %10lu %10lu %10lu\n",
+			 nk_string_impl_name(impl), n, cpy, set, mov, cmp);
+	}
+    }
+
+    nk_string_set_impl(boot_impl);
+
+    free(src);
+    free(dst);
+    free(ref);
+
+    return 0;
+}
+
+static struct shell_cmd_impl stringbench_impl = {
+    .cmd      = "stringbench",
+    .help_str = "stringbench",
+    .handler  = handle_stringbench,
+};
+nk_register_shell_cmd(stringbench_impl);
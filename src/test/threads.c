@@ -24,9 +24,12 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/thread.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
 #include <nautilus/shell.h>
 #include <nautilus/vc.h>
 
+#include "samples.h"
+
 #define DO_PRINT       0
 
 #if DO_PRINT
@@ -263,6 +266,115 @@ static int test_recursive_fork_join()
 }
 
 
+// Some runtimes destroy a thread themselves once they have joined it.
+// The idle reapers may have already claimed it by then, in which case
+// the destroy must leave it to them.  Several drivers, spread over the
+// cpus, join and destroy their own children, sometimes giving the
+// reapers a chance to get there first, and nothing reaps explicitly
+// until the end, so it is the reapers in the idle threads (when
+// REAP_IN_IDLE is on) that race with the destroys.
+#define JOIN_DESTROY_DRIVERS 4
+#define JOIN_DESTROY_WAIT_NS 1000000000UL
+
+struct join_destroy_arg {
+    int nump;
+    int numt;
+    int rc;
+};
+
+static void join_destroy_func(void *in, void **out)
+{
+}
+
+static void join_destroy_driver(void *in, void **out)
+{
+    struct join_destroy_arg *a = (struct join_destroy_arg *)in;
+    nk_thread_id_t *tids;
+    uint64_t *tidnums;
+    uint64_t deadline;
+    int i, j, n, left;
+
+    tids = malloc(sizeof(nk_thread_id_t)*a->numt);
+    tidnums = malloc(sizeof(uint64_t)*a->numt);
+
+    if (!tids || !tidnums) {
+	PRINT("Cannot allocate thread ids\n");
+	free(tids);
+	free(tidnums);
+	a->rc = -1;
+	return;
+    }
+
+    for (i=0;i<a->nump && !a->rc;i++) {
+	for (n=0;n<a->numt;n++) {
+	    if (nk_thread_start(join_destroy_func, 0, 0, 0, PAGE_SIZE_4KB, &tids[n], -1)) {
+		PRINT("Failed to launch thread %d on pass %d\n", n, i);
+		a->rc = -1;
+		break;
+	    }
+	    tidnums[n] = ((nk_thread_t *)tids[n])->tid;
+	}
+	for (j=0;j<n;j++) {
+	    nk_join(tids[j], 0);
+	    switch (j % 3) {
+	    case 1:
+		nk_yield();
+		break;
+	    case 2:
+		nk_sleep(10000);
+		break;
+	    }
+	    nk_thread_destroy(tids[j]);
+	}
+	// a thread the reapers claimed may not be unregistered quite yet
+	deadline = nk_sched_get_realtime() + JOIN_DESTROY_WAIT_NS;
+	while (1) {
+	    for (left=0, j=0;j<n;j++) {
+		left += !!nk_find_thread_by_tid(tidnums[j]);
+	    }
+	    if (!left || nk_sched_get_realtime() >= deadline) {
+		break;
+	    }
+	    nk_sleep(1000000);
+	}
+	if (left) {
+	    PRINT("%d destroyed threads are still registered\n", left);
+	    a->rc = -1;
+	}
+    }
+
+    free(tids);
+    free(tidnums);
+}
+
+static int test_join_destroy_reap(int nump, int numt)
+{
+    struct join_destroy_arg args[JOIN_DESTROY_DRIVERS];
+    nk_thread_id_t drivers[JOIN_DESTROY_DRIVERS];
+    int i, n, rc = 0;
+
+    for (n=0;n<JOIN_DESTROY_DRIVERS;n++) {
+	args[n].nump = nump;
+	args[n].numt = numt;
+	args[n].rc = 0;
+	if (nk_thread_start(join_destroy_driver, &args[n], 0, 0, PAGE_SIZE_4KB, &drivers[n],
+			    n % nk_get_num_cpus())) {
+	    PRINT("Failed to launch driver %d\n", n);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    for (i=0;i<n;i++) {
+	nk_join(drivers[i], 0);
+	rc |= args[i].rc;
+    }
+
+    // this walked destroyed threads when they were left on dead lists
+    nk_sched_reap(1);
+
+    return rc;
+}
 
 
 int test_threads()
@@ -271,6 +383,7 @@ int test_threads()
     int fork_join;
     int recursive_create_join;
     int recursive_fork_join;
+    int join_destroy_reap;
 
     create_join = test_create_join(NUM_PASSES,NUM_THREADS);
 
@@ -293,7 +406,12 @@ int test_threads()
 		 NUM_PASSES,DEPTH, 1ULL<<(DEPTH+1),recursive_fork_join ? "FAIL" : "PASS");
 
 
-    return create_join | fork_join | recursive_create_join | recursive_fork_join;
+    join_destroy_reap = test_join_destroy_reap(NUM_PASSES,NUM_THREADS);
+
+    nk_vc_printf("Join-destroy-reap test of %lu passes with %d drivers of %lu threads each: %s\n", 
+		 NUM_PASSES,JOIN_DESTROY_DRIVERS,NUM_THREADS, join_destroy_reap ? "FAIL" : "PASS");
+
+    return create_join | fork_join | recursive_create_join | recursive_fork_join | join_destroy_reap;
 
 return fork_join;
 }
@@ -312,3 +430,94 @@ static struct shell_cmd_impl threads_impl = {
     .handler  = handle_threads,
 };
 nk_register_shell_cmd(threads_impl);
+
+
+/*
+ * Spawn latency benchmark
+ *
+ * Creates batches of threads with a given stack size, timing each
+ * nk_thread_create(), and then runs, joins, and reaps each batch
+ * before creating the next.  Reaping means that creations never
+ * reanimate a dead thread, so each needs a new stack.  Percentiles
+ * are over all creations in all batches, in cycles.
+ */
+
+#define SPAWN_MAX_BATCH       256
+#define SPAWN_DEFAULT_BATCH   16
+#define SPAWN_DEFAULT_ROUNDS  64
+
+static void spawn_func(void *in, void **out)
+{
+}
+
+static int spawn_bench(nk_stack_size_t stack_size, int batch, int rounds)
+{
+    nk_thread_id_t tids[SPAWN_MAX_BATCH];
+    uint64_t *samples;
+    uint64_t start;
+    int n = 0, i, j, rc = 0;
+
+    if (!(samples = malloc(sizeof(uint64_t) * batch * rounds))) {
+	nk_vc_printf("Cannot allocate samples\n");
+	return -1;
+    }
+
+    for (i = 0; i < rounds && !rc; i++) {
+	for (j = 0; j < batch; j++) {
+	    start = rdtsc();
+	    if (nk_thread_create(spawn_func, 0, 0, 0, stack_size, &tids[j], -1)) {
+		nk_vc_printf("Failed to create thread %d in round %d\n", j, i);
+		rc = -1;
+		break;
+	    }
+	    samples[n++] = rdtsc() - start;
+	}
+	while (j--) {
+	    nk_thread_run(tids[j]);
+	}
+	nk_join_all_children(0);
+	nk_sched_reap(1);
+    }
+
+    if (n) {
+	struct samples_summary p;
+	samples_summarize(samples, n, &p);
+	nk_vc_printf("%8lu byte stacks: %d spawns " SAMPLES_FMT " cycles\n",
+		     stack_size, n, SAMPLES_ARGS(p));
+    }
+
+    free(samples);
+
+    return rc;
+}
+
+static int
+handle_spawnbench (char * buf, void * priv)
+{
+    nk_stack_size_t stack_size;
+    int batch = SPAWN_DEFAULT_BATCH;
+    int rounds = SPAWN_DEFAULT_ROUNDS;
+
+    if (sscanf(buf, "spawnbench %lu %d %d", &stack_size, &batch, &rounds) < 1) {
+	spawn_bench(TSTACK_4KB, batch, rounds);
+	spawn_bench(64 * 1024, batch, rounds);
+	spawn_bench(TSTACK_2MB, batch, rounds);
+	return 0;
+    }
+
+    if (batch < 1 || batch > SPAWN_MAX_BATCH || rounds < 1) {
+	nk_vc_printf("Batch must be 1 to %d and rounds positive\n", SPAWN_MAX_BATCH);
+	return -1;
+    }
+
+    spawn_bench(stack_size, batch, rounds);
+
+    return 0;
+}
+
+static struct shell_cmd_impl spawnbench_impl = {
+    .cmd      = "spawnbench",
+    .help_str = "spawnbench [stack_size [batch [rounds]]]",
+    .handler  = handle_spawnbench,
+};
+nk_register_shell_cmd(spawnbench_impl);
@@ -0,0 +1,305 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/timer.h>
+#include <nautilus/vc.h>
+
+/*
+ * Timer wheel tests
+ *
+ * Callback timers record when and how often they fire.  The delays
+ * are chosen so that timers land in several levels of the wheel and
+ * must be cascaded down before they fire.  We check that every timer
+ * fires exactly once and never early, that canceled timers never fire,
+ * and that timers re-armed from their callback or after a cancel fire
+ * at their new time.
+ */
+
+#define NS_PER_US     1000UL
+#define NS_PER_MS     1000000UL
+#define MAX_TIMERS    16
+#define GRACE_NS      (500 * NS_PER_MS)  // how late a timer may be
+
+struct test_timer {
+    nk_timer_t        *t;
+    uint64_t          delay_ns;
+    uint64_t          due_ns;     // when it should next fire
+    volatile uint64_t fired;      // times it has fired
+    volatile uint64_t early;      // times it fired before it was due
+    volatile uint64_t late_ns;    // latest it has fired
+    uint64_t          rearms;     // times the callback should re-arm it
+};
+
+// a tick is about 1us, and each level of the wheel is 64 times
+// coarser than the one below, so these span levels 0 through 3
+static uint64_t cascade_delays[] = {
+    30 * NS_PER_US,
+    200 * NS_PER_US,
+    3 * NS_PER_MS,
+    20 * NS_PER_MS,
+    90 * NS_PER_MS,
+    400 * NS_PER_MS,
+};
+
+#define NUM_CASCADE (sizeof(cascade_delays)/sizeof(cascade_delays[0]))
+
+// runs in the timer handler of the cpu that started the timer
+static void callback(void *priv)
+{
+    struct test_timer *tt = (struct test_timer *)priv;
+    uint64_t now = nk_sched_get_realtime();
+
+    if (now < tt->due_ns) {
+	tt->early++;
+    } else if (now - tt->due_ns > tt->late_ns) {
+	tt->late_ns = now - tt->due_ns;
+    }
+
+    if (++tt->fired <= tt->rearms) {
+	nk_timer_reset(tt->t, tt->delay_ns);
+	tt->due_ns = tt->t->time_ns;
+	nk_timer_start(tt->t);
+    }
+}
+
+static int setup(struct test_timer *tt, int n)
+{
+    char name[NK_TIMER_NAME_LEN];
+    int i;
+
+    memset(tt, 0, sizeof(*tt) * n);
+
+    for (i = 0; i < n; i++) {
+	snprintf(name, NK_TIMER_NAME_LEN, "timertest-%d", i);
+	if (!(tt[i].t = nk_timer_create(name))) {
+	    nk_vc_printf("Failed to create timer %d\n", i);
+	    while (i--) {
+		nk_timer_destroy(tt[i].t);
+	    }
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static void teardown(struct test_timer *tt, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	nk_timer_destroy(tt[i].t);
+    }
+}
+
+static void arm(struct test_timer *tt, uint64_t delay_ns)
+{
+    tt->delay_ns = delay_ns;
+    nk_timer_set(tt->t, delay_ns,
+		 NK_TIMER_CALLBACK | NK_TIMER_CALLBACK_LOCAL_SYNC,
+		 callback, tt, NK_TIMER_CALLBACK_THIS_CPU);
+    tt->due_ns = tt->t->time_ns;
+    nk_timer_start(tt->t);
+}
+
+// wait until each timer has fired the given number of times,
+// or until the deadline
+static void await(struct test_timer *tt, int n, uint64_t *want, uint64_t deadline)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	while (tt[i].fired < want[i] && nk_sched_get_realtime() < deadline) {
+	    nk_sleep(NS_PER_MS);
+	}
+    }
+}
+
+static int check(struct test_timer *tt, int n, uint64_t *want, const char *what)
+{
+    uint64_t late = 0;
+    int i, rc = 0;
+
+    for (i = 0; i < n; i++) {
+	if (tt[i].fired != want[i]) {
+	    nk_vc_printf("%s: timer %d (%lu ns) fired %lu times, expected %lu\n",
+			 what, i, tt[i].delay_ns, tt[i].fired, want[i]);
+	    rc = -1;
+	}
+	if (tt[i].early) {
+	    nk_vc_printf("%s: timer %d (%lu ns) fired early %lu times\n",
+			 what, i, tt[i].delay_ns, tt[i].early);
+	    rc = -1;
+	}
+	if (tt[i].late_ns > late) {
+	    late = tt[i].late_ns;
+	}
+    }
+
+    nk_vc_printf("%s test (%d timers, at most %lu ns late) ... %s\n",
+		 what, n, late, rc ? "FAIL" : "PASS");
+
+    return rc;
+}
+
+static int test_cascade(void)
+{
+    struct test_timer tt[NUM_CASCADE];
+    uint64_t want[NUM_CASCADE];
+    uint64_t deadline;
+    int i, rc;
+
+    if (setup(tt, NUM_CASCADE)) {
+	return -1;
+    }
+
+    // start the longest first so the wheel's clock has the furthest to go
+    for (i = NUM_CASCADE - 1; i >= 0; i--) {
+	arm(&tt[i], cascade_delays[i]);
+	want[i] = 1;
+    }
+
+    deadline = tt[NUM_CASCADE - 1].due_ns + GRACE_NS;
+    await(tt, NUM_CASCADE, want, deadline);
+
+    // give any duplicate firing a chance to show up
+    nk_sleep(10 * NS_PER_MS);
+
+    rc = check(tt, NUM_CASCADE, want, "Cascade");
+
+    teardown(tt, NUM_CASCADE);
+
+    return rc;
+}
+
+static int test_cancel(void)
+{
+    struct test_timer tt[MAX_TIMERS];
+    uint64_t want[MAX_TIMERS];
+    uint64_t deadline = 0;
+    int i, rc = 0;
+
+    if (setup(tt, MAX_TIMERS)) {
+	return -1;
+    }
+
+    // share slots among timers, so removal must leave the rest alone
+    for (i = 0; i < MAX_TIMERS; i++) {
+	arm(&tt[i], cascade_delays[3 + i % (NUM_CASCADE - 3)]);
+	want[i] = i % 2 ? 0 : 1;
+	if (tt[i].due_ns > deadline) {
+	    deadline = tt[i].due_ns;
+	}
+    }
+
+    for (i = 1; i < MAX_TIMERS; i += 2) {
+	if (nk_timer_cancel(tt[i].t)) {
+	    nk_vc_printf("Cancel: failed to cancel active timer %d\n", i);
+	    rc = -1;
+	}
+	if (!nk_timer_cancel(tt[i].t)) {
+	    nk_vc_printf("Cancel: canceled timer %d twice\n", i);
+	    rc = -1;
+	}
+    }
+
+    await(tt, MAX_TIMERS, want, deadline + GRACE_NS);
+
+    // the canceled timers would have fired by now
+    while (nk_sched_get_realtime() < deadline + 10 * NS_PER_MS) {
+	nk_sleep(NS_PER_MS);
+    }
+
+    if (check(tt, MAX_TIMERS, want, "Cancel")) {
+	rc = -1;
+    }
+
+    teardown(tt, MAX_TIMERS);
+
+    return rc;
+}
+
+#define REARMS 20
+
+static int test_rearm(void)
+{
+    struct test_timer tt[2];
+    uint64_t want[2] = { REARMS + 1, 1 };
+    uint64_t deadline;
+    int rc = 0;
+
+    if (setup(tt, 2)) {
+	return -1;
+    }
+
+    // re-armed from its own callback, each time on a fresh slot
+    tt[0].rearms = REARMS;
+    arm(&tt[0], 100 * NS_PER_US);
+
+    // moved from a high level of the wheel to a low one, which
+    // must not leave it behind in its old slot
+    arm(&tt[1], cascade_delays[NUM_CASCADE - 1]);
+    if (nk_timer_cancel(tt[1].t)) {
+	nk_vc_printf("Re-arm: failed to cancel active timer\n");
+	rc = -1;
+    }
+    nk_timer_reset(tt[1].t, cascade_delays[0]);
+    tt[1].due_ns = tt[1].t->time_ns;
+    nk_timer_start(tt[1].t);
+
+    deadline = nk_sched_get_realtime() + REARMS * tt[0].delay_ns + GRACE_NS;
+    await(tt, 2, want, deadline);
+
+    // the original expiry of the second timer
+    nk_sleep(cascade_delays[NUM_CASCADE - 1] + 10 * NS_PER_MS);
+
+    if (check(tt, 2, want, "Re-arm")) {
+	rc = -1;
+    }
+
+    teardown(tt, 2);
+
+    return rc;
+}
+
+static int
+handle_timertest (char * buf, void * priv)
+{
+    int rc = 0;
+
+    rc |= test_cascade();
+    rc |= test_cancel();
+    rc |= test_rearm();
+
+    nk_vc_printf("Timer tests ... %s\n", rc ? "FAIL" : "PASS");
+
+    return 0;
+}
+
+static struct shell_cmd_impl timertest_impl = {
+    .cmd      = "timertest",
+    .help_str = "timertest",
+    .handler  = handle_timertest,
+};
+nk_register_shell_cmd(timertest_impl);
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2020, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+
+#include "waiting.h"
+
+#define POLL_NS    1000000UL     // 1 ms
+#define SETTLE_NS  10000000UL    // 10 ms
+
+int wait_for_count(volatile uint64_t *count, uint64_t n, uint64_t timeout_ns)
+{
+    uint64_t deadline = nk_sched_get_realtime() + timeout_ns;
+
+    while (*count < n) {
+	if (nk_sched_get_realtime() >= deadline) {
+	    return -1;
+	}
+	nk_sleep(POLL_NS);
+    }
+
+    return 0;
+}
+
+int wait_until_blocked(volatile uint64_t *started, uint64_t n, uint64_t timeout_ns)
+{
+    if (wait_for_count(started, n, timeout_ns)) {
+	return -1;
+    }
+
+    // they may still be spinning on their way to sleep
+    nk_sleep(SETTLE_NS);
+
+    return 0;
+}
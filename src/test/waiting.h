@@ -0,0 +1,16 @@
+#ifndef __TEST_WAITING_H__
+#define __TEST_WAITING_H__
+
+// For tests of blocking primitives, whose threads bump a counter as
+// they start, block, and bump another as they are done.   Both
+// return nonzero if the count was not reached in time, in which case
+// the test should leave the threads, and anything they use, behind.
+
+// sleeps until *count reaches n
+int wait_for_count(volatile uint64_t *count, uint64_t n, uint64_t timeout_ns);
+
+// waits until n threads have started, and then long enough for
+// them to have gone to sleep
+int wait_until_blocked(volatile uint64_t *started, uint64_t n, uint64_t timeout_ns);
+
+#endif